@@ -0,0 +1,208 @@
+/*
+ * alert.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Alert delivery. Alerts are rare, so the queue is a plain locked deque;
+ * a worker only takes the lock when one of its series changes state. The
+ * webhook gets one HTTP/1.0 POST per alert, on a connection of its own,
+ * and anything but a 2xx counts as failed; there are no retries, the next
+ * state change is the next alert.
+ */
+
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dnsperf.h"
+#include "alert.h"
+#include "detect.h"
+
+using namespace std;
+
+static const char *dnsperf_alert_states[] = {
+	"raised", "cleared", "adopted"
+};
+
+/* One line, for people: stdout and syslog */
+static string dnsperf_alert_text(const struct dnsperf_alert *al)
+{
+	const char *unit = al->alarm == DNSPERF_ALARM_FAILURES ? "%" : " ms";
+	char buf[512];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%s", al->domain);
+	if (al->nameserver[0])
+		len += snprintf(buf + len, sizeof(buf) - len, " %s (%s)",
+				al->nameserver, al->address);
+	snprintf(buf + len, sizeof(buf) - len, ": %s %s, %.3g%s -> %.3g%s",
+		 dnsperf_alarm_name(al->alarm),
+		 al->state == DNSPERF_ALERT_RAISED ? "up" :
+		 al->state == DNSPERF_ALERT_CLEARED ? "back to normal" :
+		 "is the new normal", al->baseline, unit, al->current, unit);
+	return buf;
+}
+
+static void dnsperf_json_string(string *out, const char *key, const char *v)
+{
+	*out += "\"";
+	*out += key;
+	*out += "\":\"";
+	for (; *v; v++) {
+		if (*v == '\\' || *v == '"')
+			*out += '\\';
+		if ((unsigned char)*v >= ' ')
+			*out += *v;
+	}
+	*out += "\"";
+}
+
+static void dnsperf_alert_json(const struct dnsperf_alert *al,
+			       const string &text, string *out)
+{
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), "{\"time\":%ld,", (long)al->tm);
+	*out = buf;
+	dnsperf_json_string(out, "domain", al->domain);
+	*out += ",";
+	dnsperf_json_string(out, "nameserver", al->nameserver);
+	*out += ",";
+	dnsperf_json_string(out, "address", al->address);
+	*out += ",";
+	dnsperf_json_string(out, "alarm", dnsperf_alarm_name(al->alarm));
+	*out += ",";
+	dnsperf_json_string(out, "state", dnsperf_alert_states[al->state]);
+	snprintf(buf, sizeof(buf), ",\"baseline\":%g,\"current\":%g,",
+		 al->baseline, al->current);
+	*out += buf;
+	dnsperf_json_string(out, "unit", al->alarm == DNSPERF_ALARM_FAILURES ?
+			    "%" : "ms");
+	*out += ",";
+	dnsperf_json_string(out, "text", text.c_str());
+	*out += "}\n";
+}
+
+/* 0 if the webhook took it */
+static int dnsperf_alert_post(struct dnsperf_alerter *a, const string &body)
+{
+	string req;
+	char buf[64];
+	struct timeval tv;
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = dnsperf_connect(a->host.c_str(), "80")) < 0)
+		return 1;
+	tv.tv_sec = DNSPERF_ALERT_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	snprintf(buf, sizeof(buf), "%lu", (unsigned long)body.size());
+	req = "POST " + a->path + " HTTP/1.0\r\nHost: " + a->host +
+	    "\r\nContent-Type: application/json\r\nContent-Length: " + buf +
+	    "\r\nConnection: close\r\n\r\n" + body;
+	while (done < req.size()) {
+		n = send(fd, req.data() + done, req.size() - done,
+			 MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	/* the status line is all we want to know */
+	n = done < req.size() ? -1 : read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n < 12)
+		return 1;
+	buf[n] = '\0';
+	return strncmp(buf, "HTTP/1.", 7) || buf[9] != '2';
+}
+
+static void dnsperf_alert_deliver(struct dnsperf_alerter *a,
+				  const struct dnsperf_alert *al)
+{
+	string text = dnsperf_alert_text(al), body;
+
+	if (a->kind == DNSPERF_ALERT_LOG || !dnsperf_quiet)
+		cout << "Alert: " << text << endl;
+	if (a->kind == DNSPERF_ALERT_SYSLOG)
+		syslog(al->state == DNSPERF_ALERT_RAISED ? LOG_WARNING :
+		       LOG_NOTICE, "%s", text.c_str());
+	if (a->kind != DNSPERF_ALERT_WEBHOOK)
+		return;
+	dnsperf_alert_json(al, text, &body);
+	if (dnsperf_alert_post(a, body)) {
+		a->failed++;
+		cerr << "Webhook http://" << a->host << a->path <<
+		    " did not take an alert" << endl;
+	}
+}
+
+static void *dnsperf_alerter_thread(void *arg)
+{
+	struct dnsperf_alerter *a = (struct dnsperf_alerter *)arg;
+
+	for (;;) {
+		struct dnsperf_alert al;
+
+		pthread_mutex_lock(&a->lock);
+		while (a->queue.empty())
+			pthread_cond_wait(&a->cond, &a->lock);
+		al = a->queue.front();
+		a->queue.pop_front();
+		pthread_mutex_unlock(&a->lock);
+		dnsperf_alert_deliver(a, &al);
+	}
+	return NULL;
+}
+
+/* "log", "syslog" or "http://host[:port]/path" */
+int dnsperf_alerter_start(struct dnsperf_alerter *a, const char *target)
+{
+	if (!strcmp(target, "log")) {
+		a->kind = DNSPERF_ALERT_LOG;
+	} else if (!strcmp(target, "syslog")) {
+		a->kind = DNSPERF_ALERT_SYSLOG;
+		openlog("dnsperf", LOG_PID, LOG_DAEMON);
+	} else if (!strncmp(target, "http://", 7) && target[7] &&
+		   target[7] != '/') {
+		string rest = target + 7;
+		size_t slash = rest.find('/');
+
+		a->kind = DNSPERF_ALERT_WEBHOOK;
+		a->host = rest.substr(0, slash);
+		a->path = slash == string::npos ? "/" : rest.substr(slash);
+	} else {
+		cout << "Unknown alert target `" << target << "`" << endl;
+		return 1;
+	}
+	a->fired = a->dropped = a->failed = 0;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	if (pthread_create(&a->thread, NULL, dnsperf_alerter_thread, a)) {
+		cerr << "Unable to start the alert thread" << endl;
+		return 1;
+	}
+	pthread_detach(a->thread);
+	return 0;
+}
+
+/* From a worker: queue it and go on */
+void dnsperf_alert_fire(struct dnsperf_alerter *a,
+			const struct dnsperf_alert *al)
+{
+	pthread_mutex_lock(&a->lock);
+	if (a->queue.size() >= DNSPERF_ALERT_QUEUE) {
+		a->dropped++;
+	} else {
+		a->queue.push_back(*al);
+		a->fired++;
+		pthread_cond_signal(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,60 @@
+/*
+ * alert.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Where the detector's (detect.h) alerts go (-K): printed, to syslog, or
+ * POSTed as JSON to a webhook. Workers queue them and go on; a thread of
+ * its own delivers them, so a slow webhook never holds up a probe.
+ */
+
+#ifndef DNSPERF_ALERT_H
+#define DNSPERF_ALERT_H
+
+#include <deque>
+#include <string>
+#include <pthread.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define DNSPERF_ALERT_LOG	0	/* stdout only */
+#define DNSPERF_ALERT_SYSLOG	1
+#define DNSPERF_ALERT_WEBHOOK	2	/* http://host[:port]/path */
+
+/* what became of an alarm */
+#define DNSPERF_ALERT_RAISED	0
+#define DNSPERF_ALERT_CLEARED	1
+#define DNSPERF_ALERT_ADOPTED	2	/* it lasted: the new baseline */
+
+/* alerts waiting for delivery, at most; more are dropped */
+#define DNSPERF_ALERT_QUEUE	1024
+/* how long a webhook may take to take one (s) */
+#define DNSPERF_ALERT_TIMEOUT	2
+
+struct dnsperf_alert {
+	time_t tm;
+	int alarm;			/* DNSPERF_ALARM_* */
+	int state;			/* DNSPERF_ALERT_* */
+	char domain[DNSPERF_DOMAIN_MAX];
+	char nameserver[DNSPERF_DOMAIN_MAX];	/* "" for the whole domain */
+	char address[DNSPERF_ADDRESS_MAX];
+	double baseline, current;	/* ms, or % for failures */
+};
+
+struct dnsperf_alerter {
+	int kind;			/* DNSPERF_ALERT_* */
+	std::string host;		/* webhook's host[:port] */
+	std::string path;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::deque<struct dnsperf_alert> queue;
+	volatile unsigned long fired;
+	volatile unsigned long dropped;	/* the queue was full */
+	volatile unsigned long failed;	/* the webhook did not take them */
+};
+
+int dnsperf_alerter_start(struct dnsperf_alerter *a, const char *target);
+void dnsperf_alert_fire(struct dnsperf_alerter *a,
+			const struct dnsperf_alert *al);
+
+#endif
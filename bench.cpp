@@ -0,0 +1,421 @@
+/*
+ * bench.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Microbenchmarks for dnsperf's own hot paths, so we know how much of a
+ * measured latency is us: label generation, query encoding, answer parsing,
+ * stats aggregation, the query log ring and batch INSERTs, and whole probes
+ * against an in-process responder on the loopback.
+ *
+ * Every benchmark reports ns/op and allocations/op. The allocations are
+ * counted by wrapping malloc() and friends, which is only done with glibc;
+ * elsewhere that column stays at 0.
+ */
+
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dnsperf.h"
+#include "calibrate.h"
+#include "db.h"
+#include "histogram.h"
+#include "probe.h"
+#include "responder.h"
+#include "rng.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "stmt.h"
+#include "writer.h"
+
+using namespace std;
+
+/* the query log table we scribble into, and drop when we are done */
+#define DNSPERF_BENCH_TABLE "dnsperf_bench"
+#define DNSPERF_BENCH_DOMAIN "example.com"
+
+static volatile unsigned long dnsperf_allocs = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__sync_fetch_and_add(&dnsperf_allocs, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&dnsperf_allocs, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&dnsperf_allocs, 1);
+	return __libc_realloc(ptr, size);
+}
+}
+#endif
+
+static unsigned long dnsperf_bench_ops = 1000000;
+static uint8_t dnsperf_bench_nodb = 0;
+
+static uint64_t dnsperf_bench_t0;
+static unsigned long dnsperf_bench_a0;
+
+static void dnsperf_bench_start(void)
+{
+	dnsperf_bench_a0 = dnsperf_allocs;
+	dnsperf_bench_t0 = dnsperf_now_ns();
+}
+
+static void dnsperf_bench_stop(const char *name, unsigned long ops)
+{
+	uint64_t ns = dnsperf_now_ns() - dnsperf_bench_t0;
+	unsigned long allocs = dnsperf_allocs - dnsperf_bench_a0;
+
+	if (!ops)
+		ops = 1;
+	printf("%-24s %10lu ops %12.1f ns/op %10.2f allocs/op\n", name, ops,
+	       (double)ns / ops, (double)allocs / ops);
+}
+
+/* keep the compiler from throwing a result away */
+static volatile uint64_t dnsperf_bench_sink;
+
+static void dnsperf_bench_label(struct dnsperf_rng *rng)
+{
+	uint8_t label[DNSPERF_LABEL_MAX];
+	unsigned long n = dnsperf_bench_ops * 10;
+
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		dnsperf_label(rng, label, dnsperf_label_len);
+		dnsperf_bench_sink += label[0];
+	}
+	dnsperf_bench_stop("label", n);
+
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		dnsperf_label_tag(label, 0, i);
+		dnsperf_label(rng, label + DNSPERF_TAG_LEN,
+			      dnsperf_label_len - DNSPERF_TAG_LEN);
+		dnsperf_bench_sink += label[0];
+	}
+	dnsperf_bench_stop("label (tagged)", n);
+}
+
+static void dnsperf_bench_encode(struct dnsperf_rng *rng,
+				 const struct dnsperf_qtemplate *t)
+{
+	struct dnsperf_qtemplate tmp;
+	struct dnsperf_probe p;
+	unsigned long n = dnsperf_bench_ops / 10;
+
+	/* what every probe used to cost, and now only the first one does */
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++)
+		dnsperf_template_init(&tmp, DNSPERF_BENCH_DOMAIN,
+				      dnsperf_label_len);
+	dnsperf_bench_stop("encode (ldns template)", n);
+
+	n = dnsperf_bench_ops * 10;
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		dnsperf_label(rng, dnsperf_probe_fill(&p, t), t->label_len);
+		dnsperf_bench_sink += p.wire[t->label];
+	}
+	dnsperf_bench_stop("encode (probe fill)", n);
+}
+
+static void dnsperf_bench_parse(const struct dnsperf_qtemplate *t)
+{
+	struct dnsperf_probe p;
+	struct dnsperf_answer a;
+	uint8_t answer[DNSPERF_QUERY_MAX];
+	unsigned long n = dnsperf_bench_ops * 10;
+
+	dnsperf_probe_fill(&p, t);
+	memcpy(answer, p.wire, p.wirelen);
+	answer[2] |= 0x80;
+
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		if (!dnsperf_answer_parse(answer, p.wirelen, &a) &&
+		    dnsperf_answer_match(&p, answer, p.wirelen))
+			dnsperf_bench_sink += a.id;
+	}
+	dnsperf_bench_stop("parse answer", n);
+}
+
+static void dnsperf_bench_stats(struct dnsperf_rng *rng)
+{
+	struct dnsperf_stat st;
+	const char *ns[] = { "a.ns.example.com", "b.ns.example.com",
+		"c.ns.example.com", "d.ns.example.com" };
+	unsigned long n = dnsperf_bench_ops * 10;
+	time_t now = time(NULL);
+	size_t nsid[4];
+	string enc;
+
+	dnsperf_stat_init(&st, DNSPERF_BENCH_DOMAIN);
+	/* looked up once per target, as the workers do */
+	for (int k = 0; k < 4; k++)
+		nsid[k] = dnsperf_stat_nsid(&st, ns[k], "192.0.2.1");
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		uint64_t latency = 100000 + (dnsperf_rng_next(rng) & 0xfffff);
+
+		dnsperf_stat_add(&st, latency / 1000.0, now);
+		dnsperf_stat_hist_add(&st, nsid[i & 3], latency);
+	}
+	dnsperf_bench_stop("stats add", n);
+
+	n = dnsperf_bench_ops / 10;
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++)
+		dnsperf_bench_sink += dnsperf_hist_percentile(&st.hist, 99.0);
+	dnsperf_bench_stop("stats percentile", n);
+
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		dnsperf_hist_encode(&st.hist, &enc);
+		dnsperf_bench_sink += enc.size();
+	}
+	dnsperf_bench_stop("stats encode", n);
+}
+
+static void dnsperf_bench_queue(void)
+{
+	static struct dnsperf_queue q;
+	struct dnsperf_sample s, out[256];
+	unsigned long n = dnsperf_bench_ops * 10;
+
+	q.head = q.tail = 0;
+	s.domain = DNSPERF_BENCH_DOMAIN;
+	s.nameserver = "a.ns.example.com";
+	s.address = "192.0.2.1";
+	s.latency = 1000000;
+	s.tm = time(NULL);
+	s.usec = 0;
+	s.outcome = DNSPERF_OUTCOME_OK;
+	s.clamped = 0;
+	s.vantage = NULL;
+
+	dnsperf_bench_start();
+	for (unsigned long i = 0; i < n; i++) {
+		dnsperf_queue_push(&q, &s);
+		if ((i & 255) == 255)
+			dnsperf_queue_pop(&q, out, 256);
+	}
+	dnsperf_bench_stop("writer ring", n);
+}
+
+/* Batches of -B rows through the prepared INSERTs, into a table of our own */
+static void dnsperf_bench_db(void)
+{
+	mysqlpp::Connection *conn;
+	struct dnsperf_stmts st;
+	vector<struct dnsperf_sample> batch(dnsperf_batch);
+	unsigned long n = 0, rows = dnsperf_bench_ops / 10;
+
+	if (dnsperf_bench_nodb || !(conn = dnsperf_db_grab())) {
+		printf("%-24s skipped\n", "db insert");
+		return;
+	}
+	conn->query("drop table if exists " DNSPERF_BENCH_TABLE).execute();
+	if (dnsperf_create_dimtables(conn, DNSPERF_BENCH_TABLE) ||
+	    dnsperf_create_valtable(conn, DNSPERF_BENCH_TABLE)) {
+		dnsperf_db_release(conn);
+		printf("%-24s skipped\n", "db insert");
+		return;
+	}
+	dnsperf_valtable = DNSPERF_BENCH_TABLE;
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		batch[i].domain = DNSPERF_BENCH_DOMAIN;
+		batch[i].nameserver = "a.ns.example.com";
+		batch[i].address = "192.0.2.1";
+		batch[i].latency = 1000000 + i;
+		batch[i].tm = time(NULL);
+		batch[i].usec = i;
+		batch[i].outcome = DNSPERF_OUTCOME_OK;
+		batch[i].clamped = 0;
+		batch[i].vantage = NULL;
+	}
+	dnsperf_stmt_init(&st);
+	/* connect and prepare outside the clock */
+	dnsperf_stmt_insert(&st, &batch[0], batch.size());
+
+	dnsperf_bench_start();
+	while (n < rows && !dnsperf_stmt_insert(&st, &batch[0], batch.size())) {
+		/* a second later, or the rows are all there already */
+		for (size_t i = 0; i < batch.size(); i++)
+			batch[i].tm++;
+		n += batch.size();
+	}
+	dnsperf_bench_stop("db insert (per row)", n);
+
+	dnsperf_stmt_close(&st);
+	conn->query("drop table " DNSPERF_BENCH_TABLE).execute();
+	for (int kind = 0; kind < DNSPERF_DIMS; kind++)
+		conn->query(("drop table " +
+			     dnsperf_dim_table(DNSPERF_BENCH_TABLE,
+					       kind)).c_str()).execute();
+	dnsperf_db_release(conn);
+}
+
+/* Whole probes, send to answer, against the loopback responder; this is
+ * the calibration pass (see calibrate.cpp) with the clock around it */
+static void dnsperf_bench_loopback(struct dnsperf_rng *rng,
+				   const struct dnsperf_responder *r,
+				   unsigned int inflight, const char *name)
+{
+	static struct dnsperf_calibration c;
+
+	dnsperf_bench_start();
+	if (dnsperf_calibrate_run(&c, r, rng, inflight,
+				  dnsperf_bench_ops / 10)) {
+		printf("%-24s skipped\n", name);
+		return;
+	}
+	dnsperf_bench_stop(name, c.probes);
+	printf("%-24s latency p50 %lu ns, p99 %lu ns, max %lu ns, "
+	       "%lu failed\n", "", (unsigned long)
+	       dnsperf_hist_percentile(&c.hist, 50.0), (unsigned long)
+	       dnsperf_hist_percentile(&c.hist, 99.0), (unsigned long)c.hist.max,
+	       c.failed);
+}
+
+static void dnsperf_bench_usage(const char *progname)
+{
+	printf("%s <options>\n", progname);
+	printf("options: [-h] | [-i <ops>] [-n <queries>] [-w <ms>] [-T <clock>] [-L <len>]\n"
+	       "         [-B <rows>] [-N] [-u <dbuser>] [-p <dbpass>] [-c <dbhostname>] [-m <dbname>]\n\n");
+
+	printf("  -h			  print this help and exit\n");
+	printf("  -i <ops>		  base number of operations per benchmark; the\n"
+	       "                            cheap ones run 10 times that, the slow ones a\n"
+	       "                            tenth (default: 1000000)\n");
+	printf("  -n <queries>		  queries in flight for the loopback run (default: 64)\n");
+	printf("  -w <time>		  time to wait for an answer (in ms, default: 5000)\n");
+	printf("  -T <clock>		  wall, mono (default) or kernel, as for dnsperf\n");
+	printf("  -L <len>		  random label length (default: 12)\n");
+	printf("  -B <rows>		  rows per INSERT batch (default: 500)\n");
+	printf("  -N			  skip the database benchmark\n");
+	printf("  -u, -p, -c, -m	  database user, password, host and name, as for\n"
+	       "                            dnsperf; the benchmark uses a table of its own\n"
+	       "                            (" DNSPERF_BENCH_TABLE ") and drops it afterwards\n\n");
+
+	exit(0);
+}
+
+static int dnsperf_bench_cmdline(int argc, char **argv)
+{
+	int c;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "hNi:n:w:T:L:B:u:p:c:m:")) != -1)
+		switch (c) {
+		case 'i':
+			dnsperf_bench_ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			dnsperf_inflight = atoi(optarg);
+			break;
+		case 'w':
+			dnsperf_timeout = atoi(optarg);
+			break;
+		case 'T':
+			if ((dnsperf_clock = dnsperf_parse_clock(optarg)) < 0) {
+				cout << "Unknown clock `" << optarg << "`" << endl;
+				return 1;
+			}
+			break;
+		case 'L':
+			dnsperf_label_len = atoi(optarg);
+			if (dnsperf_label_len < DNSPERF_TAG_LEN ||
+			    dnsperf_label_len > DNSPERF_LABEL_MAX) {
+				cout << "Label length must be between " <<
+				    DNSPERF_TAG_LEN << " and " <<
+				    DNSPERF_LABEL_MAX << endl;
+				return 1;
+			}
+			break;
+		case 'B':
+			dnsperf_batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'N':
+			dnsperf_bench_nodb = 1;
+			break;
+		case 'm':
+			dnsperf_dbname = strdup(optarg);
+			break;
+		case 'u':
+			dnsperf_dbuser = strdup(optarg);
+			break;
+		case 'p':
+			dnsperf_dbpass = strdup(optarg);
+			break;
+		case 'c':
+			dnsperf_dbhostname = strdup(optarg);
+			break;
+		case 'h':
+			dnsperf_bench_usage(argv[0]);
+			break;
+		case '?':
+			cout << "Error parsing arguments" << endl;
+			dnsperf_bench_usage(argv[0]);
+			return 1;
+		default:
+			abort();
+		}
+
+	if (!dnsperf_inflight || !dnsperf_batch || !dnsperf_bench_ops) {
+		cout << "-i, -n and -B must be positive" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct dnsperf_rng rng;
+	struct dnsperf_qtemplate t;
+	struct dnsperf_responder r;
+
+	if (dnsperf_bench_cmdline(argc, argv))
+		exit(1);
+	dnsperf_quiet = 1;
+
+	srand(time(NULL));
+	dnsperf_rng_seed(&rng, ((uint64_t)rand() << 32) ^ rand());
+	if (dnsperf_template_init(&t, DNSPERF_BENCH_DOMAIN, dnsperf_label_len)) {
+		cerr << "Unable to encode a query for " DNSPERF_BENCH_DOMAIN << endl;
+		exit(1);
+	}
+
+	dnsperf_bench_label(&rng);
+	dnsperf_bench_encode(&rng, &t);
+	dnsperf_bench_parse(&t);
+	dnsperf_bench_stats(&rng);
+	dnsperf_bench_queue();
+	dnsperf_bench_db();
+
+	if (dnsperf_responder_start(&r))
+		exit(1);
+	dnsperf_bench_loopback(&rng, &r, 1, "loopback (1 in flight)");
+	dnsperf_bench_loopback(&rng, &r, dnsperf_inflight,
+			       "loopback (-n in flight)");
+	dnsperf_responder_stop(&r);
+
+	return 0;
+}
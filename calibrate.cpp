@@ -0,0 +1,146 @@
+/*
+ * calibrate.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Loopback self-calibration. We start the responder on 127.0.0.1 and send it
+ * queries exactly the way the workers do: an ldns template, a fresh random
+ * label per probe, the probe engine with the -T clock and the -w timeout.
+ * The responder answers at once, so what we measure is the floor under every
+ * latency we report, and its spread is our own jitter.
+ *
+ * Two passes: one query in flight, which is the floor proper, and -n in
+ * flight, which is what the tool adds when it is busy. The median of the
+ * first one is the baseline -Z subtracts from every sample.
+ */
+
+#include <iostream>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dnsperf.h"
+#include "calibrate.h"
+#include "probe.h"
+
+using namespace std;
+
+#define DNSPERF_CALIBRATE_DOMAIN "calibrate.invalid"
+
+/* Send `probes' queries to the responder, `inflight' at a time */
+int dnsperf_calibrate_run(struct dnsperf_calibration *c,
+			  const struct dnsperf_responder *r,
+			  struct dnsperf_rng *rng, unsigned int inflight,
+			  unsigned long probes)
+{
+	static struct dnsperf_engine e;
+	struct dnsperf_qtemplate t;
+	vector<struct dnsperf_probe> batch(inflight);
+
+	c->inflight = inflight;
+	c->probes = c->failed = 0;
+	c->mean = c->m2 = 0;
+	dnsperf_hist_init(&c->hist);
+
+	if (dnsperf_template_init(&t, DNSPERF_CALIBRATE_DOMAIN,
+				  dnsperf_label_len)) {
+		cout << "Unable to encode the calibration query" << endl;
+		return 1;
+	}
+	if (dnsperf_engine_init(&e, inflight, dnsperf_timeout, rand(),
+				dnsperf_clock)) {
+		cout << "Unable to set up the probe engine" << endl;
+		return 1;
+	}
+	for (size_t i = 0; i < batch.size(); i++) {
+		batch[i].domain = 0;
+		batch[i].nameserver = "localhost";
+		batch[i].address = "127.0.0.1";
+		memcpy(&batch[i].addr, &r->addr, sizeof(r->addr));
+		batch[i].addrlen = sizeof(r->addr);
+	}
+
+	while (c->probes < probes) {
+		size_t n = batch.size();
+
+		if (n > probes - c->probes)
+			n = probes - c->probes;
+		for (size_t i = 0; i < n; i++)
+			dnsperf_label(rng, dnsperf_probe_fill(&batch[i], &t),
+				      t.label_len);
+		dnsperf_engine_run(&e, &batch[0], n);
+		for (size_t i = 0; i < n; i++) {
+			double delta;
+
+			c->probes++;
+			if (batch[i].status != DNSPERF_PROBE_OK) {
+				c->failed++;
+				continue;
+			}
+			dnsperf_hist_add(&c->hist, batch[i].latency);
+			/* Welford, like the per-domain stats */
+			delta = batch[i].latency - c->mean;
+			c->mean += delta / c->hist.count;
+			c->m2 += delta * (batch[i].latency - c->mean);
+		}
+	}
+	dnsperf_engine_destroy(&e);
+	return 0;
+}
+
+void dnsperf_calibrate_print(const char *name,
+			     const struct dnsperf_calibration *c)
+{
+	const struct dnsperf_hist *h = &c->hist;
+	double stddev = h->count > 1 ? sqrt(c->m2 / (h->count - 1)) : 0;
+
+	printf("%s: %lu probes, %u in flight, %lu failed\n", name, c->probes,
+	       c->inflight, c->failed);
+	if (!h->count)
+		return;
+	printf("  latency (us): min %.1f p50 %.1f p90 %.1f p99 %.1f "
+	       "p99.9 %.1f max %.1f\n", h->min / 1000.0,
+	       dnsperf_hist_percentile(h, 50.0) / 1000.0,
+	       dnsperf_hist_percentile(h, 90.0) / 1000.0,
+	       dnsperf_hist_percentile(h, 99.0) / 1000.0,
+	       dnsperf_hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+	printf("  jitter (us): mean %.1f stddev %.1f, p99 - p50 %.1f\n",
+	       c->mean / 1000.0, stddev / 1000.0,
+	       (dnsperf_hist_percentile(h, 99.0) -
+		dnsperf_hist_percentile(h, 50.0)) / 1000.0);
+}
+
+/* Run both passes and report; *baseline is the idle median (ns) */
+int dnsperf_calibrate(uint64_t *baseline)
+{
+	static struct dnsperf_calibration idle, busy;
+	struct dnsperf_responder r;
+	struct dnsperf_rng rng;
+	int ret;
+
+	if (dnsperf_responder_start(&r))
+		return 1;
+	dnsperf_rng_seed(&rng, ((uint64_t)rand() << 32) ^ rand() ^
+			 ((uint64_t)time(NULL) << 16));
+
+	cout << "Calibrating against 127.0.0.1:" << ntohs(r.addr.sin_port) <<
+	    "..." << endl;
+	ret = dnsperf_calibrate_run(&idle, &r, &rng, 1,
+				    DNSPERF_CALIBRATE_PROBES) ||
+	    dnsperf_calibrate_run(&busy, &r, &rng, dnsperf_inflight,
+				  DNSPERF_CALIBRATE_PROBES);
+	dnsperf_responder_stop(&r);
+	if (ret)
+		return 1;
+
+	dnsperf_calibrate_print("Idle", &idle);
+	dnsperf_calibrate_print("Busy", &busy);
+	if (!idle.hist.count) {
+		cout << "No answers from the responder, can't calibrate" << endl;
+		return 1;
+	}
+	*baseline = dnsperf_hist_percentile(&idle.hist, 50.0);
+	cout << "Tool latency floor: " << *baseline / 1000.0 << " us" << endl;
+	return 0;
+}
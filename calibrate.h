@@ -0,0 +1,36 @@
+/*
+ * calibrate.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Self-calibration: run the probe path against the loopback responder and
+ * see what latency the tool adds on its own.
+ */
+
+#ifndef DNSPERF_CALIBRATE_H
+#define DNSPERF_CALIBRATE_H
+
+#include <stdint.h>
+
+#include "histogram.h"
+#include "responder.h"
+#include "rng.h"
+
+/* probes per calibration pass */
+#define DNSPERF_CALIBRATE_PROBES 20000
+
+struct dnsperf_calibration {
+	unsigned int inflight;
+	unsigned long probes;
+	unsigned long failed;
+	struct dnsperf_hist hist;	/* ns */
+	double mean, m2;		/* running mean and squared deviations */
+};
+
+int dnsperf_calibrate_run(struct dnsperf_calibration *c,
+			  const struct dnsperf_responder *r,
+			  struct dnsperf_rng *rng, unsigned int inflight,
+			  unsigned long probes);
+void dnsperf_calibrate_print(const char *name,
+			     const struct dnsperf_calibration *c);
+int dnsperf_calibrate(uint64_t *baseline);
+
+#endif
@@ -0,0 +1,524 @@
+/*
+ * colfile.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Columnar sample file. Writing is a memcpy into a shared mapping of the
+ * file, which grows DNSPERF_COL_CHUNK at a time; the header's length is
+ * only moved past a record once the record is complete, so a crash leaves
+ * at most a torn tail that the next open (and any reader) ignores.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "colfile.h"
+#include "probe.h"
+
+using namespace std;
+
+#define DNSPERF_COL_ALIGN(x) (((x) + 7) & ~(size_t)7)
+/* names longer than a DNS name get cut */
+#define DNSPERF_COL_NAME_MAX 255
+/* latencies are stored in units of this many ns */
+#define DNSPERF_COL_LATENCY_UNIT 10
+
+static int dnsperf_col_map(struct dnsperf_colfile *f, size_t size)
+{
+	if (f->map)
+		munmap(f->map, f->mapped);
+	f->map = NULL;
+	/* have the blocks now: a full disk should fail here, not SIGBUS a
+	 * later memcpy into the mapping */
+	if (ftruncate(f->fd, size) || posix_fallocate(f->fd, 0, size))
+		return 1;
+	f->map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, f->fd, 0);
+	if (f->map == MAP_FAILED) {
+		f->map = NULL;
+		return 1;
+	}
+	f->mapped = size;
+	return 0;
+}
+
+/* Make room for len more bytes past the end */
+static int dnsperf_col_reserve(struct dnsperf_colfile *f, size_t len)
+{
+	size_t size = f->mapped;
+
+	if (f->length + len <= size)
+		return 0;
+	while (f->length + len > size)
+		size += DNSPERF_COL_CHUNK;
+	return dnsperf_col_map(f, size);
+}
+
+static void dnsperf_col_commit(struct dnsperf_colfile *f, size_t len)
+{
+	struct dnsperf_col_header *h = (struct dnsperf_col_header *)f->map;
+
+	f->length += DNSPERF_COL_ALIGN(len);
+	/* the record must be in place before the header points past it */
+	__sync_synchronize();
+	h->length = f->length;
+}
+
+static int dnsperf_col_put(struct dnsperf_colfile *f, uint32_t type,
+			   const void *data, size_t len)
+{
+	struct dnsperf_col_record r;
+
+	if (dnsperf_col_reserve(f, sizeof(r) + DNSPERF_COL_ALIGN(len)))
+		return 1;
+	r.type = type;
+	r.len = len;
+	memcpy(f->map + f->length, &r, sizeof(r));
+	memcpy(f->map + f->length + sizeof(r), data, len);
+	dnsperf_col_commit(f, sizeof(r) + len);
+	return 0;
+}
+
+uint32_t dnsperf_names_add(struct dnsperf_names *d, const string &name)
+{
+	uint32_t id = d->names.size();
+
+	d->names.push_back(name);
+	d->ids[name] = id;
+	return id;
+}
+
+uint32_t dnsperf_names_id(struct dnsperf_names *d, const char *name,
+			  size_t max, int *added)
+{
+	map<const char *, uint32_t>::iterator p;
+	map<string, uint32_t>::iterator it;
+	size_t len;
+	uint32_t id;
+
+	*added = 0;
+	/* names come from the topology and the domains table, and stay put */
+	p = d->ptrs.find(name);
+	if (p != d->ptrs.end() && d->names[p->second] == name)
+		return p->second;
+
+	len = strnlen(name, max);
+	it = d->ids.find(string(name, len));
+	if (it != d->ids.end()) {
+		d->ptrs[name] = it->second;
+		return it->second;
+	}
+
+	id = dnsperf_names_add(d, string(name, len));
+	d->ptrs[name] = id;
+	*added = 1;
+	return id;
+}
+
+void dnsperf_names_clear(struct dnsperf_names *d)
+{
+	d->names.clear();
+	d->ids.clear();
+	d->ptrs.clear();
+}
+
+/* Id of a name, writing out a dictionary record the first time we see it;
+ * ~0 if that fails */
+static uint32_t dnsperf_col_id(struct dnsperf_colfile *f, int kind,
+			       const char *name)
+{
+	struct dnsperf_col_dict *d;
+	uint8_t buf[sizeof(*d) + DNSPERF_COL_NAME_MAX];
+	uint32_t id;
+	int added;
+
+	id = dnsperf_names_id(&f->dict[kind], name, DNSPERF_COL_NAME_MAX,
+			      &added);
+	if (!added)
+		return id;
+	d = (struct dnsperf_col_dict *)buf;
+	d->id = id;
+	d->kind = kind;
+	d->len = f->dict[kind].names[id].size();
+	memcpy(buf + sizeof(*d), name, d->len);
+	if (dnsperf_col_put(f, DNSPERF_COL_DICT, buf, sizeof(*d) + d->len))
+		return ~0U;
+	return id;
+}
+
+/* zigzag varints; they make the timestamp deltas, and the collector's
+ * (collector.cpp) sample batches */
+size_t dnsperf_varint_put(uint8_t *p, int64_t v)
+{
+	uint64_t z = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	size_t n = 0;
+
+	while (z >= 0x80) {
+		p[n++] = (z & 0x7f) | 0x80;
+		z >>= 7;
+	}
+	p[n++] = z;
+	return n;
+}
+
+size_t dnsperf_varint_get(const uint8_t *p, const uint8_t *end, int64_t *v)
+{
+	uint64_t z = 0;
+	size_t n = 0;
+
+	for (unsigned int shift = 0; p + n < end && shift < 64; shift += 7) {
+		uint8_t b = p[n++];
+
+		z |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+			return n;
+		}
+	}
+	return 0;
+}
+
+/* Walk the records of a mapped file, up to length */
+static int dnsperf_col_next(const uint8_t *map, size_t length, size_t *off,
+			    const struct dnsperf_col_record **r)
+{
+	if (*off + sizeof(**r) > length)
+		return 0;
+	*r = (const struct dnsperf_col_record *)(map + *off);
+	if (*off + sizeof(**r) + (*r)->len > length)
+		return 0;
+	*off += DNSPERF_COL_ALIGN(sizeof(**r) + (*r)->len);
+	return 1;
+}
+
+static int dnsperf_col_check(const uint8_t *map, size_t size)
+{
+	const struct dnsperf_col_header *h =
+	    (const struct dnsperf_col_header *)map;
+
+	return size < sizeof(*h) || memcmp(h->magic, DNSPERF_COL_MAGIC, 8) ||
+	    h->version != DNSPERF_COL_VERSION ||
+	    h->length > size ||
+	    h->length < sizeof(*h);
+}
+
+/* Open a sample file for appending, creating it if needed. The
+ * dictionaries of an existing file are read back so ids keep meaning the
+ * same thing. */
+int dnsperf_col_open(struct dnsperf_colfile *f, const char *path)
+{
+	struct dnsperf_col_header *h;
+	const struct dnsperf_col_record *r;
+	struct stat st;
+	size_t off;
+
+	f->map = NULL;
+	f->mapped = 0;
+	f->precise = 0;
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (f->fd < 0 || fstat(f->fd, &st)) {
+		cerr << "Unable to open " << path << ": " << strerror(errno) <<
+		    endl;
+		return 1;
+	}
+
+	if (!st.st_size) {
+		if (dnsperf_col_map(f, DNSPERF_COL_CHUNK))
+			goto fail;
+		h = (struct dnsperf_col_header *)f->map;
+		memcpy(h->magic, DNSPERF_COL_MAGIC, 8);
+		h->version = DNSPERF_COL_VERSION;
+		h->pad = 0;
+		h->length = f->length = sizeof(*h);
+		return 0;
+	}
+
+	if (dnsperf_col_map(f, DNSPERF_COL_ALIGN(st.st_size)) ||
+	    dnsperf_col_check(f->map, f->mapped)) {
+		cerr << path << " is not a dnsperf sample file" << endl;
+		goto fail;
+	}
+	h = (struct dnsperf_col_header *)f->map;
+	f->length = h->length;
+	for (off = sizeof(*h); dnsperf_col_next(f->map, f->length, &off, &r);) {
+		const struct dnsperf_col_dict *d;
+
+		if (r->type != DNSPERF_COL_DICT)
+			continue;
+		d = (const struct dnsperf_col_dict *)(r + 1);
+		if (d->kind >= DNSPERF_COL_KINDS ||
+		    d->id != f->dict[d->kind].names.size())
+			continue;
+		dnsperf_names_add(&f->dict[d->kind],
+				  string((const char *)(d + 1), d->len));
+	}
+	return 0;
+fail:
+	if (f->map)
+		munmap(f->map, f->mapped);
+	close(f->fd);
+	f->map = NULL;
+	f->fd = -1;
+	return 1;
+}
+
+/* Write n samples out as one block */
+int dnsperf_col_append(struct dnsperf_colfile *f,
+		       const struct dnsperf_sample *samples, size_t n)
+{
+	struct dnsperf_col_block *b;
+	uint32_t *latency, *domain, *ns, *addr, *col;
+	uint32_t *usec = NULL, *vantage = NULL;
+	uint8_t *outcome;
+	size_t len;
+	int64_t prev;
+
+	if (!n)
+		return 0;
+	/* worst case for the varints is 10 bytes each */
+	f->block.resize(sizeof(*b) + n * (6 * sizeof(uint32_t) + 1 + 10));
+	b = (struct dnsperf_col_block *)&f->block[0];
+	b->count = n;
+	b->flags = 0;
+	b->base_tm = samples[0].tm;
+	latency = (uint32_t *)(b + 1);
+	domain = latency + n;
+	ns = domain + n;
+	addr = ns + n;
+	col = addr + n;
+	if (f->precise) {
+		b->flags |= DNSPERF_COL_HAS_USEC;
+		usec = col;
+		col += n;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (!samples[i].vantage)
+			continue;
+		b->flags |= DNSPERF_COL_HAS_VANTAGE;
+		vantage = col;
+		col += n;
+		break;
+	}
+	outcome = (uint8_t *)col;
+	len = (uint8_t *)col - &f->block[0];
+	for (size_t i = 0; i < n; i++) {
+		if (samples[i].outcome == DNSPERF_OUTCOME_OK &&
+		    !samples[i].clamped)
+			continue;
+		b->flags |= DNSPERF_COL_HAS_OUTCOME;
+		len += n;
+		break;
+	}
+
+	prev = b->base_tm;
+	for (size_t i = 0; i < n; i++) {
+		uint64_t l = samples[i].latency / DNSPERF_COL_LATENCY_UNIT;
+
+		latency[i] = l > 0xffffffffULL ? 0xffffffffU : l;
+		domain[i] = dnsperf_col_id(f, DNSPERF_COL_DOMAIN,
+					   samples[i].domain);
+		ns[i] = dnsperf_col_id(f, DNSPERF_COL_NS,
+				       samples[i].nameserver);
+		addr[i] = dnsperf_col_id(f, DNSPERF_COL_ADDR,
+					 samples[i].address);
+		if (domain[i] == ~0U || ns[i] == ~0U || addr[i] == ~0U)
+			return 1;
+		if (usec)
+			usec[i] = samples[i].usec;
+		if (vantage) {
+			vantage[i] = DNSPERF_COL_NONE;
+			if (samples[i].vantage &&
+			    (vantage[i] = dnsperf_col_id(f, DNSPERF_COL_VANTAGE,
+						samples[i].vantage)) == ~0U)
+				return 1;
+		}
+		if (b->flags & DNSPERF_COL_HAS_OUTCOME)
+			outcome[i] = samples[i].outcome |
+			    (samples[i].clamped ? DNSPERF_COL_CLAMPED : 0);
+		len += dnsperf_varint_put(&f->block[len],
+					  (int64_t)samples[i].tm - prev);
+		prev = samples[i].tm;
+	}
+	return dnsperf_col_put(f, DNSPERF_COL_BLOCK, &f->block[0], len);
+}
+
+/* Make sure what was appended so far is on the disk */
+int dnsperf_col_sync(struct dnsperf_colfile *f)
+{
+	if (f->fd < 0 || !f->map)
+		return 0;
+	if (msync(f->map, f->length, MS_SYNC) || fdatasync(f->fd)) {
+		cerr << "Unable to sync sample file: " << strerror(errno) <<
+		    endl;
+		return 1;
+	}
+	return 0;
+}
+
+void dnsperf_col_close(struct dnsperf_colfile *f)
+{
+	if (f->fd < 0)
+		return;
+	if (f->map) {
+		msync(f->map, f->length, MS_SYNC);
+		munmap(f->map, f->mapped);
+	}
+	/* give back the unused part of the last chunk */
+	if (ftruncate(f->fd, f->length))
+		cerr << "Unable to trim sample file: " << strerror(errno) <<
+		    endl;
+	close(f->fd);
+	f->fd = -1;
+	f->map = NULL;
+}
+
+int dnsperf_col_reader_open(struct dnsperf_col_reader *r, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	r->map = NULL;
+	for (int k = 0; k < DNSPERF_COL_KINDS; k++)
+		r->names[k].clear();
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		cerr << "Unable to open " << path << ": " << strerror(errno) <<
+		    endl;
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	r->size = st.st_size ? st.st_size : 1;
+	r->map = (uint8_t *)mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return 1;
+	}
+	if (dnsperf_col_check(r->map, st.st_size)) {
+		cerr << path << " is not a dnsperf sample file" << endl;
+		dnsperf_col_reader_close(r);
+		return 1;
+	}
+	r->length = ((const struct dnsperf_col_header *)r->map)->length;
+	r->off = sizeof(struct dnsperf_col_header);
+	return 0;
+}
+
+void dnsperf_col_reader_close(struct dnsperf_col_reader *r)
+{
+	if (r->map)
+		munmap(r->map, r->size);
+	r->map = NULL;
+}
+
+int dnsperf_col_read(struct dnsperf_col_reader *r,
+		     vector<struct dnsperf_sample> *samples)
+{
+	vector<string> *names = r->names;
+	const struct dnsperf_col_record *rec;
+
+	samples->clear();
+	while (dnsperf_col_next(r->map, r->length, &r->off, &rec)) {
+		const uint8_t *end = (const uint8_t *)(rec + 1) + rec->len;
+		const struct dnsperf_col_block *b;
+		const uint32_t *latency, *domain, *ns, *addr, *col;
+		const uint32_t *usec = NULL, *vantage = NULL;
+		const uint8_t *outcome = NULL, *tm;
+		int64_t prev;
+
+		if (rec->type == DNSPERF_COL_DICT) {
+			const struct dnsperf_col_dict *d =
+			    (const struct dnsperf_col_dict *)(rec + 1);
+
+			if (d->kind < DNSPERF_COL_KINDS &&
+			    d->id == names[d->kind].size())
+				names[d->kind].push_back(
+				    string((const char *)(d + 1), d->len));
+			continue;
+		}
+		if (rec->type != DNSPERF_COL_BLOCK)
+			continue;
+
+		b = (const struct dnsperf_col_block *)(rec + 1);
+		latency = (const uint32_t *)(b + 1);
+		domain = latency + b->count;
+		ns = domain + b->count;
+		addr = ns + b->count;
+		col = addr + b->count;
+		if (b->flags & DNSPERF_COL_HAS_USEC) {
+			usec = col;
+			col += b->count;
+		}
+		if (b->flags & DNSPERF_COL_HAS_VANTAGE) {
+			vantage = col;
+			col += b->count;
+		}
+		tm = (const uint8_t *)col;
+		if (b->flags & DNSPERF_COL_HAS_OUTCOME) {
+			outcome = tm;
+			tm += b->count;
+		}
+		if (tm > end)
+			return -1;
+		prev = b->base_tm;
+		samples->resize(b->count);
+		for (uint32_t i = 0; i < b->count; i++) {
+			struct dnsperf_sample *s = &(*samples)[i];
+			int64_t delta;
+			size_t used;
+
+			used = dnsperf_varint_get(tm, end, &delta);
+			if (!used || domain[i] >= names[0].size() ||
+			    ns[i] >= names[1].size() ||
+			    addr[i] >= names[2].size() ||
+			    (vantage && vantage[i] != DNSPERF_COL_NONE &&
+			     vantage[i] >= names[3].size())) {
+				samples->clear();
+				return -1;
+			}
+			tm += used;
+			prev += delta;
+			s->domain = names[0][domain[i]].c_str();
+			s->nameserver = names[1][ns[i]].c_str();
+			s->address = names[2][addr[i]].c_str();
+			s->latency = (uint64_t)latency[i] *
+			    DNSPERF_COL_LATENCY_UNIT;
+			s->tm = prev;
+			/* plain sample files keep seconds */
+			s->usec = usec ? usec[i] : 0;
+			s->outcome = outcome ?
+			    outcome[i] & ~DNSPERF_COL_CLAMPED :
+			    DNSPERF_OUTCOME_OK;
+			s->clamped = outcome &&
+			    (outcome[i] & DNSPERF_COL_CLAMPED);
+			s->vantage = vantage && vantage[i] != DNSPERF_COL_NONE ?
+			    names[3][vantage[i]].c_str() : NULL;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+int dnsperf_col_scan(const char *path,
+		     int (*fn)(const struct dnsperf_sample *s, void *arg),
+		     void *arg)
+{
+	struct dnsperf_col_reader r;
+	vector<struct dnsperf_sample> samples;
+	int got = 0, ret = 0;
+
+	if (dnsperf_col_reader_open(&r, path))
+		return 1;
+	while (!ret && (got = dnsperf_col_read(&r, &samples)) > 0)
+		for (size_t i = 0; i < samples.size(); i++)
+			if ((ret = fn(&samples[i], arg)))
+				break;
+	if (got < 0)
+		ret = 1;
+	dnsperf_col_reader_close(&r);
+	return ret;
+}
@@ -0,0 +1,139 @@
+/*
+ * colfile.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Append-only, memory-mapped columnar sample file. Domain and nameserver
+ * names and addresses are written once, as dictionary records, and samples
+ * refer to them by id; each batch of samples is one block holding a
+ * fixed-width latency column, the three id columns and varint-coded
+ * timestamp deltas, 17 bytes or so per sample instead of a 170-byte InnoDB
+ * row. The spill journal (journal.h) writes them with the microseconds and
+ * the vantage points too, so that nothing is lost on the way to MySQL.
+ */
+
+#ifndef DNSPERF_COLFILE_H
+#define DNSPERF_COLFILE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "writer.h"
+
+#define DNSPERF_COL_MAGIC	"dnspcol1"
+#define DNSPERF_COL_VERSION	1
+/* the mapping grows by this much at a time */
+#define DNSPERF_COL_CHUNK	(64UL << 20)
+
+/* Record types */
+#define DNSPERF_COL_DICT	1
+#define DNSPERF_COL_BLOCK	2
+
+/* Dictionary kinds */
+#define DNSPERF_COL_DOMAIN	0
+#define DNSPERF_COL_NS		1
+#define DNSPERF_COL_ADDR	2
+#define DNSPERF_COL_VANTAGE	3
+#define DNSPERF_COL_KINDS	4
+/* the vantage id of our own samples */
+#define DNSPERF_COL_NONE	0xffffffffU
+
+struct dnsperf_col_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	uint64_t length;		/* bytes written out, header included */
+};
+
+/* Every record starts with this; len is the payload, records are 8-aligned */
+struct dnsperf_col_record {
+	uint32_t type;
+	uint32_t len;
+};
+
+/* DNSPERF_COL_DICT payload, followed by len name bytes */
+struct dnsperf_col_dict {
+	uint32_t id;
+	uint16_t kind;
+	uint16_t len;
+};
+
+/* DNSPERF_COL_BLOCK payload: this, then uint32_t latency[count] (10ns
+ * units), uint32_t domain[count], uint32_t ns[count], uint32_t
+ * addr[count], with DNSPERF_COL_HAS_USEC uint32_t usec[count], with
+ * DNSPERF_COL_HAS_VANTAGE uint32_t vantage[count], with
+ * DNSPERF_COL_HAS_OUTCOME uint8_t outcome[count], and count zigzag varint
+ * deltas of the timestamps, the first one against base_tm */
+struct dnsperf_col_block {
+	uint32_t count;
+	uint32_t flags;
+	int64_t base_tm;
+};
+
+/* Block flags; a block of nothing but good, unclamped answers leaves the
+ * outcome column out, and one of nothing but our own samples the vantage
+ * column */
+#define DNSPERF_COL_HAS_OUTCOME	0x1
+#define DNSPERF_COL_HAS_USEC	0x2
+#define DNSPERF_COL_HAS_VANTAGE	0x4
+/* in the outcome column, on top of the outcome: sample.clamped */
+#define DNSPERF_COL_CLAMPED	0x80
+
+/* Names as ids 0, 1, 2 ..., in the order they were first seen, with a
+ * lookup cache by pointer: the sample file's dictionary records and the
+ * collector wire's DICT frames (collector.h) both work this way */
+struct dnsperf_names {
+	std::vector<std::string> names;
+	std::map<std::string, uint32_t> ids;
+	std::map<const char *, uint32_t> ptrs;
+};
+
+/* Id of a name, cut to max bytes; *added is set if it was not there yet */
+uint32_t dnsperf_names_id(struct dnsperf_names *d, const char *name,
+			  size_t max, int *added);
+uint32_t dnsperf_names_add(struct dnsperf_names *d, const std::string &name);
+void dnsperf_names_clear(struct dnsperf_names *d);
+
+struct dnsperf_colfile {
+	int fd;
+	uint8_t *map;
+	size_t mapped;
+	size_t length;
+	int precise;			/* keep the usec column */
+	struct dnsperf_names dict[DNSPERF_COL_KINDS];	/* by kind */
+	/* scratch space for building a block */
+	std::vector<uint8_t> block;
+};
+
+int dnsperf_col_open(struct dnsperf_colfile *f, const char *path);
+int dnsperf_col_append(struct dnsperf_colfile *f,
+		       const struct dnsperf_sample *samples, size_t n);
+int dnsperf_col_sync(struct dnsperf_colfile *f);
+void dnsperf_col_close(struct dnsperf_colfile *f);
+
+/* at most 10 bytes; get returns 0 on a truncated one */
+size_t dnsperf_varint_put(uint8_t *p, int64_t v);
+size_t dnsperf_varint_get(const uint8_t *p, const uint8_t *end, int64_t *v);
+
+/* Read a file back, block by block. The samples point into the reader's
+ * dictionaries, and stay good until the next read; read returns 1 with a
+ * block, 0 at the end and -1 on a corrupt one. */
+struct dnsperf_col_reader {
+	uint8_t *map;
+	size_t size;			/* mapped */
+	size_t length;			/* in use, as the header had it */
+	size_t off;			/* of the next record */
+	std::vector<std::string> names[DNSPERF_COL_KINDS];
+};
+
+int dnsperf_col_reader_open(struct dnsperf_col_reader *r, const char *path);
+int dnsperf_col_read(struct dnsperf_col_reader *r,
+		     std::vector<struct dnsperf_sample> *samples);
+void dnsperf_col_reader_close(struct dnsperf_col_reader *r);
+
+/* Or sample by sample; fn returning non-zero stops the scan */
+int dnsperf_col_scan(const char *path,
+		     int (*fn)(const struct dnsperf_sample *s, void *arg),
+		     void *arg);
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * collector.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Agents and the collector. Hundreds of agents each with a MySQL connection
+ * of their own, doing their own INSERTs, is what we want to avoid: an agent
+ * only has the one TCP connection, and sends it whatever its writer would
+ * have written, as one frame per batch, names going over once per
+ * connection (like the dictionaries of colfile.cpp) and samples as a dozen
+ * bytes of varints or so. The collector hands them to its own writer, so
+ * they go to MySQL in its batches, and acknowledges each batch; a batch
+ * without an ACK is sent again after reconnecting. Should the first one
+ * have made it after all, the query log's primary key (vp_id included)
+ * sees to it that the rows are not there twice.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dnsperf.h"
+#include "collector.h"
+#include "colfile.h"
+#include "probe.h"
+
+using namespace std;
+
+/* names longer than a DNS name get cut, like in the query log */
+#define DNSPERF_WIRE_NAME_MAX 255
+
+static void dnsperf_wire_put(vector<uint8_t> *out, uint32_t type,
+			     const void *data, size_t len)
+{
+	struct dnsperf_wire_frame f;
+	size_t off = out->size();
+
+	f.type = htonl(type);
+	f.len = htonl(len);
+	out->resize(off + sizeof(f) + len);
+	memcpy(&(*out)[off], &f, sizeof(f));
+	if (len)
+		memcpy(&(*out)[off + sizeof(f)], data, len);
+}
+
+static int dnsperf_wire_write(int fd, const uint8_t *p, size_t len)
+{
+	while (len) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int dnsperf_wire_read(int fd, uint8_t *p, size_t len)
+{
+	while (len) {
+		ssize_t n = recv(fd, p, len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* The next frame; 1 on EOF, errors and garbage */
+static int dnsperf_wire_get(int fd, uint32_t *type, vector<uint8_t> *in)
+{
+	struct dnsperf_wire_frame f;
+	uint32_t len;
+
+	if (dnsperf_wire_read(fd, (uint8_t *)&f, sizeof(f)))
+		return 1;
+	*type = ntohl(f.type);
+	len = ntohl(f.len);
+	if (len > DNSPERF_WIRE_MAX)
+		return 1;
+	in->resize(len);
+	return len && dnsperf_wire_read(fd, &(*in)[0], len);
+}
+
+static uint32_t dnsperf_wire_u32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static void dnsperf_agent_disconnect(struct dnsperf_agent *a)
+{
+	if (a->fd >= 0)
+		close(a->fd);
+	a->fd = -1;
+}
+
+static int dnsperf_agent_connect(struct dnsperf_agent *a)
+{
+	struct timeval tv;
+	uint32_t version = htonl(DNSPERF_WIRE_VERSION);
+	vector<uint8_t> hello((uint8_t *)&version, (uint8_t *)(&version + 1));
+
+	if ((a->fd = dnsperf_connect(a->spec, DNSPERF_COLLECTOR_PORT)) < 0)
+		return 1;
+	tv.tv_sec = DNSPERF_WIRE_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(a->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(a->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* a new connection, a new dictionary */
+	for (int kind = 0; kind < DNSPERF_COL_KINDS; kind++)
+		dnsperf_names_clear(&a->dict[kind]);
+	hello.insert(hello.end(), a->name, a->name + strlen(a->name));
+	a->out.clear();
+	dnsperf_wire_put(&a->out, DNSPERF_WIRE_HELLO, &hello[0], hello.size());
+	if (dnsperf_wire_write(a->fd, &a->out[0], a->out.size())) {
+		cerr << "Lost the collector at " << a->spec << ": " <<
+		    strerror(errno) << endl;
+		dnsperf_agent_disconnect(a);
+		return 1;
+	}
+	if (!dnsperf_quiet)
+		cout << "Sending queries to the collector at " << a->spec <<
+		    " as `" << a->name << "`" << endl;
+	return 0;
+}
+
+/* Id of a name on this connection, queueing a DICT frame the first time */
+static uint32_t dnsperf_agent_id(struct dnsperf_agent *a, int kind,
+				 const char *name)
+{
+	uint8_t buf[5 + DNSPERF_WIRE_NAME_MAX];
+	uint32_t id, wid;
+	int added;
+
+	id = dnsperf_names_id(&a->dict[kind], name, DNSPERF_WIRE_NAME_MAX,
+			      &added);
+	if (!added)
+		return id;
+	wid = htonl(id);
+	memcpy(buf, &wid, sizeof(wid));
+	buf[4] = kind;
+	memcpy(buf + 5, name, a->dict[kind].names[id].size());
+	dnsperf_wire_put(&a->out, DNSPERF_WIRE_DICT, buf,
+			 5 + a->dict[kind].names[id].size());
+	return id;
+}
+
+int dnsperf_agent_open(struct dnsperf_agent *a, const char *spec)
+{
+	static char host[256];
+
+	if (!spec || !*spec) {
+		cout << "The collector sink needs an address " <<
+		    "(collector:<host>[:port])" << endl;
+		return 1;
+	}
+	a->spec = spec;
+	a->fd = -1;
+	if (!(a->name = dnsperf_vantage)) {
+		if (gethostname(host, sizeof(host) - 1))
+			strcpy(host, "agent");
+		a->name = host;
+	}
+	/* not there yet is fine, the writer will try again */
+	dnsperf_agent_connect(a);
+	return 0;
+}
+
+/* Send n samples as one batch and wait for the ACK; 1 if the collector
+ * could not be reached, in which case they are ours to send again */
+int dnsperf_agent_send(struct dnsperf_agent *a,
+		       const struct dnsperf_sample *samples, size_t n)
+{
+	vector<uint8_t> in;
+	uint32_t type, count = htonl(n);
+	size_t len = sizeof(count);
+	int64_t prev = 0;
+
+	if (!n)
+		return 0;
+	if (a->fd < 0 && dnsperf_agent_connect(a))
+		return 1;
+
+	a->out.clear();
+	/* five varints of 10 bytes at most, and the outcome */
+	a->batch.resize(sizeof(count) + n * 51);
+	memcpy(&a->batch[0], &count, sizeof(count));
+	for (size_t i = 0; i < n; i++) {
+		const struct dnsperf_sample *s = &samples[i];
+		int64_t us = (int64_t)s->tm * 1000000 + s->usec;
+
+		len += dnsperf_varint_put(&a->batch[len],
+					  dnsperf_agent_id(a, 0, s->domain));
+		len += dnsperf_varint_put(&a->batch[len],
+					  dnsperf_agent_id(a, 1,
+							   s->nameserver));
+		len += dnsperf_varint_put(&a->batch[len],
+					  dnsperf_agent_id(a, 2, s->address));
+		len += dnsperf_varint_put(&a->batch[len], s->latency);
+		len += dnsperf_varint_put(&a->batch[len], us - prev);
+		a->batch[len++] = s->outcome |
+		    (s->clamped ? DNSPERF_COL_CLAMPED : 0);
+		prev = us;
+	}
+	dnsperf_wire_put(&a->out, DNSPERF_WIRE_BATCH, &a->batch[0], len);
+
+	if (dnsperf_wire_write(a->fd, &a->out[0], a->out.size()) ||
+	    dnsperf_wire_get(a->fd, &type, &in) || type != DNSPERF_WIRE_ACK ||
+	    in.size() < sizeof(count) || dnsperf_wire_u32(&in[0]) != n) {
+		cerr << "Lost the collector at " << a->spec << endl;
+		dnsperf_agent_disconnect(a);
+		return 1;
+	}
+	return 0;
+}
+
+void dnsperf_agent_close(struct dnsperf_agent *a)
+{
+	dnsperf_agent_disconnect(a);
+}
+
+struct dnsperf_collector_conn {
+	struct dnsperf_collector *c;
+	int fd;
+};
+
+static const char *dnsperf_collector_intern(struct dnsperf_collector *c,
+					    const uint8_t *name, size_t len)
+{
+	const char *s;
+
+	pthread_mutex_lock(&c->lock);
+	s = c->names.insert(string((const char *)name, len)).first->c_str();
+	pthread_mutex_unlock(&c->lock);
+	return s;
+}
+
+/* A BATCH back into samples; 1 if it does not make sense */
+static int dnsperf_collector_decode(const vector<uint8_t> &in,
+				    const vector<const char *> *dict,
+				    const char *vantage,
+				    vector<struct dnsperf_sample> *samples)
+{
+	const uint8_t *p, *end;
+	uint32_t count;
+	int64_t us = 0;
+
+	if (in.size() < sizeof(count))
+		return 1;
+	p = &in[0];
+	end = p + in.size();
+	count = dnsperf_wire_u32(p);
+	p += sizeof(count);
+	/* five bytes a sample at the very least */
+	if (count > (size_t)(end - p) / 5)
+		return 1;
+
+	samples->resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		struct dnsperf_sample *s = &(*samples)[i];
+		int64_t v[5];
+
+		for (int k = 0; k < 5; k++) {
+			size_t used;
+
+			if (!(used = dnsperf_varint_get(p, end, &v[k])))
+				return 1;
+			p += used;
+		}
+		if (p >= end || v[0] < 0 || (size_t)v[0] >= dict[0].size() ||
+		    v[1] < 0 || (size_t)v[1] >= dict[1].size() ||
+		    v[2] < 0 || (size_t)v[2] >= dict[2].size() || v[3] < 0 ||
+		    (*p & ~DNSPERF_COL_CLAMPED) >= DNSPERF_OUTCOMES)
+			return 1;
+		us += v[4];
+		s->domain = dict[0][v[0]];
+		s->nameserver = dict[1][v[1]];
+		s->address = dict[2][v[2]];
+		s->latency = v[3];
+		s->tm = us / 1000000;
+		s->usec = us % 1000000;
+		s->outcome = *p & ~DNSPERF_COL_CLAMPED;
+		s->clamped = (*p++ & DNSPERF_COL_CLAMPED) != 0;
+		s->vantage = vantage;
+	}
+	return 0;
+}
+
+static void *dnsperf_collector_agent(void *arg)
+{
+	struct dnsperf_collector_conn *conn =
+	    (struct dnsperf_collector_conn *)arg;
+	struct dnsperf_collector *c = conn->c;
+	int fd = conn->fd;
+	vector<const char *> dict[DNSPERF_COL_KINDS];
+	vector<struct dnsperf_sample> samples;
+	vector<uint8_t> in, out;
+	const char *name;
+	uint32_t type;
+
+	delete conn;
+	if (dnsperf_wire_get(fd, &type, &in) || type != DNSPERF_WIRE_HELLO ||
+	    in.size() < 4 || dnsperf_wire_u32(&in[0]) != DNSPERF_WIRE_VERSION) {
+		cerr << "Turning away a connection that is not one of our " <<
+		    "agents (or not of this version)" << endl;
+		close(fd);
+		return NULL;
+	}
+	name = dnsperf_collector_intern(c, &in[4], in.size() - 4);
+	__sync_fetch_and_add(&c->agents, 1);
+	if (!dnsperf_quiet)
+		cout << "Agent `" << name << "` connected" << endl;
+
+	while (!dnsperf_wire_get(fd, &type, &in)) {
+		uint32_t count;
+
+		if (type == DNSPERF_WIRE_DICT) {
+			uint32_t id;
+
+			if (in.size() < 5 || in[4] >= DNSPERF_COL_KINDS)
+				break;
+			id = dnsperf_wire_u32(&in[0]);
+			if (id != dict[in[4]].size())
+				break;
+			dict[in[4]].push_back(
+			    dnsperf_collector_intern(c, &in[5],
+						     in.size() - 5));
+			continue;
+		}
+		if (type != DNSPERF_WIRE_BATCH)
+			continue;
+		if (dnsperf_collector_decode(in, dict, name, &samples)) {
+			cerr << "Garbled batch from agent `" << name << "`" <<
+			    endl;
+			break;
+		}
+
+		pthread_mutex_lock(&c->lock);
+		for (size_t i = 0; i < samples.size(); i++)
+			dnsperf_writer_put(c->writer, c->producer, &samples[i]);
+		pthread_mutex_unlock(&c->lock);
+		__sync_fetch_and_add(&c->received, samples.size());
+
+		count = htonl(samples.size());
+		out.clear();
+		dnsperf_wire_put(&out, DNSPERF_WIRE_ACK, &count, sizeof(count));
+		if (dnsperf_wire_write(fd, &out[0], out.size()))
+			break;
+	}
+
+	__sync_fetch_and_sub(&c->agents, 1);
+	if (!dnsperf_quiet)
+		cout << "Agent `" << name << "` went away" << endl;
+	close(fd);
+	return NULL;
+}
+
+static void *dnsperf_collector_thread(void *arg)
+{
+	struct dnsperf_collector *c = (struct dnsperf_collector *)arg;
+
+	for (;;) {
+		struct dnsperf_collector_conn *conn;
+		struct pollfd pfd;
+		pthread_t thread;
+		int fd, on = 1;
+
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) <= 0)
+			continue;
+		if ((fd = accept(c->fd, NULL, NULL)) < 0)
+			continue;
+		/* BSDs pass O_NONBLOCK on from the listener */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+		conn = new struct dnsperf_collector_conn;
+		conn->c = c;
+		conn->fd = fd;
+		if (pthread_create(&thread, NULL, dnsperf_collector_agent,
+				   conn)) {
+			cerr << "Unable to start a thread for an agent" << endl;
+			close(fd);
+			delete conn;
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/* Take agents on listen; their samples go to writer, through producer */
+int dnsperf_collector_start(struct dnsperf_collector *c, const char *listen,
+			    struct dnsperf_writer *writer,
+			    unsigned int producer)
+{
+	if ((c->fd = dnsperf_listen(listen)) < 0)
+		return 1;
+	c->writer = writer;
+	c->producer = producer;
+	/* a batch is ACKed once it is with the writer, and what we drop the
+	 * agent would never send again: hold the agent up instead */
+	writer->producers[producer].policy = DNSPERF_POLICY_BLOCK;
+	c->agents = c->received = 0;
+	pthread_mutex_init(&c->lock, NULL);
+	if (pthread_create(&c->thread, NULL, dnsperf_collector_thread, c)) {
+		cerr << "Unable to start the collector thread" << endl;
+		return 1;
+	}
+	pthread_detach(c->thread);
+	if (!dnsperf_quiet)
+		cout << "Taking agents on " << listen << endl;
+	return 0;
+}
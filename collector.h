@@ -0,0 +1,82 @@
+/*
+ * collector.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Many vantage points, one database. An agent (-o collector:<host>) probes
+ * like any dnsperf but has no MySQL of its own: its query log goes, batch by
+ * batch, over one TCP connection to a collector (-a), which puts the rows in
+ * its own query log under the agent's name.
+ */
+
+#ifndef DNSPERF_COLLECTOR_H
+#define DNSPERF_COLLECTOR_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "colfile.h"
+#include "writer.h"
+
+#define DNSPERF_COLLECTOR_PORT	"5301"
+#define DNSPERF_WIRE_VERSION	1
+
+/* Frames: a header, then len bytes. HELLO is the agent's first, ids in DICT
+ * go 0, 1, 2 ... per kind and per connection, and every BATCH gets an ACK
+ * once its samples are with the collector's writer. */
+#define DNSPERF_WIRE_HELLO	1	/* uint32_t version, then our name */
+#define DNSPERF_WIRE_DICT	2	/* uint32_t id, uint8_t kind, name */
+#define DNSPERF_WIRE_BATCH	3	/* uint32_t count, then the samples */
+#define DNSPERF_WIRE_ACK	4	/* uint32_t count */
+/* larger frames are taken for garbage */
+#define DNSPERF_WIRE_MAX	(16UL << 20)
+/* how long (s) an agent waits for an ACK before it tries again */
+#define DNSPERF_WIRE_TIMEOUT	10
+
+/* everything in network byte order; samples in a batch are varints
+ * (colfile.h): domain id, ns id, address id, latency (ns), us since the
+ * previous sample (since the epoch for the first), then one byte of
+ * outcome, with DNSPERF_COL_CLAMPED on top.
+ * Dictionary kinds are those of colfile.h. */
+struct dnsperf_wire_frame {
+	uint32_t type;
+	uint32_t len;
+};
+
+/* The agent's end, used by the "collector" sink from the writer thread */
+struct dnsperf_agent {
+	const char *spec;		/* host[:port] */
+	const char *name;		/* -N, or our hostname */
+	int fd;				/* -1 until (re)connected */
+	/* what we told the collector so far, by kind, on this connection */
+	struct dnsperf_names dict[DNSPERF_COL_KINDS];
+	std::vector<uint8_t> batch;	/* scratch space for a BATCH */
+	std::vector<uint8_t> out;	/* frames being sent */
+};
+
+int dnsperf_agent_open(struct dnsperf_agent *a, const char *spec);
+int dnsperf_agent_send(struct dnsperf_agent *a,
+		       const struct dnsperf_sample *samples, size_t n);
+void dnsperf_agent_close(struct dnsperf_agent *a);
+
+/* The collector's end: a thread taking agents, and one per agent */
+struct dnsperf_collector {
+	int fd;
+	struct dnsperf_writer *writer;
+	unsigned int producer;		/* our writer slot, shared by the
+					 * agents' threads under lock */
+	pthread_mutex_t lock;
+	std::set<std::string> names;	/* every name the agents sent, for
+					 * good: the query log keeps pointers */
+	pthread_t thread;
+	volatile unsigned long agents;	/* connected right now */
+	volatile unsigned long received;	/* samples, all agents */
+};
+
+int dnsperf_collector_start(struct dnsperf_collector *c, const char *listen,
+			    struct dnsperf_writer *writer,
+			    unsigned int producer);
+
+#endif
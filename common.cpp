@@ -0,0 +1,197 @@
+/*
+ * common.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * The settings parse_cmdline() can change, with their defaults, and helpers
+ * used all over. Kept out of dnsperf.cpp so that other programs (the
+ * benchmarks) can link against the rest of the objects.
+ */
+
+#include <iostream>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "dnsperf.h"
+#include "probe.h"
+#include "transport.h"
+#include "writer.h"
+
+using namespace std;
+
+/* cmdline options */
+uint8_t dnsperf_resetdb = 0;
+uint8_t dnsperf_verbose = 0;
+uint8_t dnsperf_quiet = 0;
+unsigned long dnsperf_freq = 1;
+unsigned int dnsperf_inflight = 64;
+unsigned int dnsperf_ns_inflight = 0;
+double dnsperf_ns_rate = 0;
+double dnsperf_aimd = 0;
+unsigned int dnsperf_timeout = 5000;
+int dnsperf_policy = DNSPERF_POLICY_DROP;
+size_t dnsperf_batch = 500;
+unsigned int dnsperf_flush = 1000;
+char *dnsperf_journaldir = NULL;
+unsigned long dnsperf_journal_max = 1024;
+unsigned long dnsperf_journal_rate = 0;
+unsigned int dnsperf_workers = 1;
+int dnsperf_clock = DNSPERF_CLOCK_MONO;
+double dnsperf_rate = 0;
+const char *dnsperf_sinkspec = "mysql";
+unsigned int dnsperf_label_len = 12;
+uint8_t dnsperf_label_tagged = 0;
+uint8_t dnsperf_calibrate_only = 0;
+uint8_t dnsperf_subtract = 0;
+uint64_t dnsperf_baseline = 0;
+const char *dnsperf_metrics = NULL;
+const char *dnsperf_tracefile = NULL;
+const char *dnsperf_alert = NULL;
+unsigned int dnsperf_retention = 0;
+uint8_t dnsperf_partition = 0;
+const char *dnsperf_collect = NULL;
+const char *dnsperf_vantage = NULL;
+uint8_t dnsperf_agent = 0;
+int dnsperf_transport = DNSPERF_TRANSPORT_UDP;
+unsigned int dnsperf_transport_port = 0;
+const char *dnsperf_servers = NULL;
+const char *dnsperf_topofile = NULL;
+const char *dnsperf_exportfile = NULL;
+const char *dnsperf_replayfile = NULL;
+unsigned int dnsperf_family = 0;
+
+/* default database info */
+const char *dnsperf_dbhostname = "localhost";
+const char *dnsperf_dbname = "dnsperf_data";
+const char *dnsperf_dbuser = "root";
+const char *dnsperf_dbpass = "";
+const char *dnsperf_valtable = "dnsperf_queries";
+const char *dnsperf_domaintable = "dnsperf_domains";
+const char *dnsperf_domainfile = NULL;
+const char *dnsperf_stattable = "dnsperf_stats";
+const char *dnsperf_histtable = "dnsperf_latency";
+const char *dnsperf_rolluptable = "dnsperf_rollup";
+
+/* Various helper functions */
+
+/* build the timestamp in a MySQL format */
+void dnsperf_strdate(time_t tm, char *date)
+{
+	struct tm tm_local;
+
+	/* the workers call this too, so no localtime() */
+	localtime_r(&tm, &tm_local);
+	strftime(date, DNSPERF_DATE_LEN, "%Y-%m-%d %X", &tm_local);
+}
+
+/* and back, for timestamps we read from the database */
+int dnsperf_parse_date(const char *date, time_t *tm)
+{
+	struct tm tm_local;
+
+	memset(&tm_local, 0, sizeof(tm_local));
+	if (!strptime(date, "%Y-%m-%d %H:%M:%S", &tm_local))
+		return 1;
+	tm_local.tm_isdst = -1;
+	*tm = mktime(&tm_local);
+	return 0;
+}
+
+/* "port", "host:port" or "[v6 address]:port"; port is left alone if the
+ * spec has none */
+static void dnsperf_hostport(const char *spec, string *host, string *port)
+{
+	string s = spec;
+	size_t colon = s.rfind(':');
+
+	if (colon == string::npos || (s[0] == '[' && s[s.size() - 1] == ']')) {
+		*host = s;
+	} else {
+		*host = s.substr(0, colon);
+		*port = s.substr(colon + 1);
+	}
+	if (host->size() > 1 && (*host)[0] == '[' &&
+	    (*host)[host->size() - 1] == ']')
+		*host = host->substr(1, host->size() - 2);
+}
+
+/* A non-blocking TCP listener on "port", "host:port" or "[v6]:port"; -1 if
+ * that fails */
+int dnsperf_listen(const char *spec)
+{
+	struct addrinfo hints, *res, *ai;
+	string host, port;
+	int fd = -1, on = 1;
+
+	/* a lone port is a port, not a host */
+	if (!strchr(spec, ':'))
+		port = spec;
+	else
+		dnsperf_hostport(spec, &host, &port);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+			&hints, &res)) {
+		cout << "Can't make out an address from `" << spec << "`" << endl;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, 0)) < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16) &&
+		    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) >= 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		cout << "Unable to listen on " << spec << ": " <<
+		    strerror(errno) << endl;
+	return fd;
+}
+
+/* A (blocking) TCP connection to "host", "host:port" or "[v6]:port", port
+ * defaulting to defport; -1 if that fails */
+int dnsperf_connect(const char *spec, const char *defport)
+{
+	struct addrinfo hints, *res, *ai;
+	string host, port = defport;
+	int fd = -1, on = 1;
+
+	dnsperf_hostport(spec, &host, &port);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+		cerr << "Can't make out an address from `" << spec << "`" << endl;
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, 0)) < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		cerr << "Unable to connect to " << spec << ": " <<
+		    strerror(errno) << endl;
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	return fd;
+}
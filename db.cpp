@@ -0,0 +1,983 @@
+/*
+ * db.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Database plumbing: the shared connection pool and the schema code
+ * (creating, checking and populating the tables).
+ */
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dnsperf.h"
+#include "db.h"
+#include "probe.h"
+#include "rollup.h"
+
+using namespace std;
+
+const char *dnsperf_dim_column[DNSPERF_DIMS] = {
+	"domain", "nameserver", "vantage", "address"
+};
+const char *dnsperf_dim_id[DNSPERF_DIMS] = {
+	"domain_id", "ns_id", "vp_id", "addr_id"
+};
+static const char *dnsperf_dim_suffix[DNSPERF_DIMS] = {
+	"_domains", "_nameservers", "_vantages", "_addresses"
+};
+
+const char *default_domains[] = {
+	"google.com",
+	"facebook.com",
+	"youtube.com",
+	"yahoo.com",
+	"live.com",
+	"wikipedia.org",
+	"baidu.com",
+	"blogger.com",
+	"msn.com",
+	"qq.com"
+};
+
+/* Connections mirror the old per-call ones: no exceptions, and our
+ * database selected if it exists already (it may not, before initdb) */
+static int dnsperf_db_connect(mysqlpp::Connection *conn)
+{
+	conn->set_option(new mysqlpp::ConnectTimeoutOption(
+	    DNSPERF_DB_CONNECT_TIMEOUT));
+	if (!conn->connect(0, dnsperf_dbhostname, dnsperf_dbuser,
+			   dnsperf_dbpass))
+		return 1;
+	conn->select_db(dnsperf_dbname);
+	return 0;
+}
+
+class DnsperfPool : public mysqlpp::ConnectionPool
+{
+public:
+	~DnsperfPool()
+	{
+		clear();
+	}
+
+protected:
+	mysqlpp::Connection *create()
+	{
+		mysqlpp::Connection *conn = new mysqlpp::Connection((bool) false);
+
+		if (dnsperf_verbose)
+			cout << "Connecting to MYSQL://" << dnsperf_dbuser <<
+			    "@" << dnsperf_dbhostname << endl;
+		/* a failed connect is picked up (and retried) by grab */
+		dnsperf_db_connect(conn);
+		return conn;
+	}
+
+	void destroy(mysqlpp::Connection *conn)
+	{
+		delete conn;
+	}
+
+	unsigned int max_idle_time()
+	{
+		return DNSPERF_POOL_IDLE;
+	}
+};
+
+static DnsperfPool dnsperf_pool;
+/* no reconnects before this, after one failed */
+static volatile time_t dnsperf_db_down;
+
+/* Get a live connection out of the pool. Idle connections may have been
+ * dropped by the server (or the server restarted), so check first and
+ * reconnect in place; NULL means the DBMS is not there right now. */
+mysqlpp::Connection *dnsperf_db_grab(void)
+{
+	mysqlpp::Connection *conn = dnsperf_pool.grab();
+
+	if (conn->connected() && conn->ping())
+		return conn;
+
+	conn->disconnect();
+	if (time(NULL) >= dnsperf_db_down) {
+		if (!dnsperf_db_connect(conn))
+			return conn;
+		cerr << "DB connection failed: " << conn->error() << endl;
+		dnsperf_db_down = time(NULL) + DNSPERF_DB_BACKOFF;
+	}
+	dnsperf_pool.release(conn);
+	return NULL;
+}
+
+void dnsperf_db_release(mysqlpp::Connection *conn)
+{
+	dnsperf_pool.release(conn);
+}
+
+/* What information_schema says our database has: the columns and keys of
+ * every table, in one query each rather than one (or a scan of the table)
+ * per check. What we add ourselves goes in as we add it. */
+static map<string, set<string> > dnsperf_schema_columns;
+static map<string, set<string> > dnsperf_schema_keys;
+
+static int dnsperf_schema_read(mysqlpp::Connection *conn, const char *view,
+			       const char *column,
+			       map<string, set<string> > *schema)
+{
+	mysqlpp::Query query = conn->query();
+	mysqlpp::UseQueryResult res;
+
+	schema->clear();
+	query << "select table_name, " << column << " from " <<
+	    "information_schema." << view << " where table_schema = " <<
+	    mysqlpp::quote << dnsperf_dbname;
+	if (dnsperf_verbose)
+		cout << query << endl;
+	if (!(res = query.use())) {
+		cerr << "Failed to look at the schema of `" << dnsperf_dbname <<
+		    "` " << query.error() << endl;
+		return 1;
+	}
+	while (mysqlpp::Row row = res.fetch_row())
+		(*schema)[row[0].c_str()].insert(row[1].c_str());
+	if (conn->errnum()) {
+		cerr << "Failed to look at the schema of `" << dnsperf_dbname <<
+		    "` " << conn->error() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+static int dnsperf_schema_load(mysqlpp::Connection *conn)
+{
+	return dnsperf_schema_read(conn, "columns", "column_name",
+				   &dnsperf_schema_columns) ||
+	    dnsperf_schema_read(conn, "statistics", "index_name",
+				&dnsperf_schema_keys);
+}
+
+static int dnsperf_has_column(const char *tablename, const char *column)
+{
+	map<string, set<string> >::iterator it;
+
+	it = dnsperf_schema_columns.find(tablename);
+	return it != dnsperf_schema_columns.end() && it->second.count(column);
+}
+
+/* Tables from before a column was added get it now, with its default */
+static int dnsperf_add_column(mysqlpp::Connection *conn, const char *tablename,
+			      const char *column, const char *definition)
+{
+	mysqlpp::Query query = conn->query();
+
+	if (dnsperf_has_column(tablename, column))
+		return 0;
+
+	cout << "Adding column " << column << " to `" << tablename << "`" <<
+	    endl;
+	query << "alter table " << tablename << " add column " << column <<
+	    " " << definition;
+	if (!query.exec()) {
+		cerr << "Failed to alter table `" << tablename << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	dnsperf_schema_columns[tablename].insert(column);
+	return 0;
+}
+
+/* Same, for a key; 'PRIMARY' is the primary key */
+static int dnsperf_add_key(mysqlpp::Connection *conn, const char *tablename,
+			   const char *key, const char *definition)
+{
+	mysqlpp::Query query = conn->query();
+
+	if (dnsperf_schema_keys[tablename].count(key))
+		return 0;
+
+	cout << "Adding " << definition << " to `" << tablename << "`" << endl;
+	query << "alter table " << tablename << " add " << definition;
+	if (!query.exec()) {
+		cerr << "Failed to alter table `" << tablename << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	dnsperf_schema_keys[tablename].insert(key);
+	return 0;
+}
+
+/* name -> id, for all of a dimension table */
+static int dnsperf_load_ids(mysqlpp::Connection *conn, int kind,
+			    map<string, uint32_t> *ids)
+{
+	mysqlpp::Query query = conn->query();
+	mysqlpp::StoreQueryResult res;
+	string table = dnsperf_dim_table(dnsperf_valtable, kind);
+
+	query << "select " << dnsperf_dim_id[kind] << ", " <<
+	    dnsperf_dim_column[kind] << " from " << table;
+	if (!(res = query.store())) {
+		cerr << "Failed to read `" << table << "` " << query.error() <<
+		    endl;
+		return 1;
+	}
+	for (size_t i = 0; i < res.num_rows(); i++)
+		(*ids)[res[i][1].c_str()] = (uint32_t)res[i][0];
+	return 0;
+}
+
+/* The query log used to hold the names themselves, and no key. Copy it
+ * over to the new layout, in order of domain, nameserver and time; rows
+ * from the same second become a microsecond apart, since the key wants
+ * them apart and the second was all we knew anyway. The old table is
+ * renamed to <table>_v1 and left for the user to drop. */
+static int dnsperf_migrate_valtable(mysqlpp::Connection *conn)
+{
+	string table = dnsperf_valtable;
+	string tmp = table + "_v2", old = table + "_v1";
+	map<string, uint32_t> ids[2];
+	mysqlpp::Connection *out;
+	mysqlpp::Query query = conn->query();
+	mysqlpp::UseQueryResult res;
+	string last;
+	unsigned long long rows = 0;
+	size_t batch = 0;
+	unsigned int seq = 0;
+	int ret = 0;
+
+	cout << "Migrating `" << table << "` to the new layout, this may " <<
+	    "take a while..." << endl;
+	for (int kind = 0; kind <= DNSPERF_DIM_NS; kind++) {
+		query.reset();
+		query << "insert ignore into " <<
+		    dnsperf_dim_table(dnsperf_valtable, kind) << " (" <<
+		    dnsperf_dim_column[kind] << ") select distinct " <<
+		    dnsperf_dim_column[kind] << " from " << table;
+		if (!query.exec()) {
+			cerr << "Failed to fill in the " <<
+			    dnsperf_dim_column[kind] << " ids: " <<
+			    query.error() << endl;
+			return 1;
+		}
+		if (dnsperf_load_ids(conn, kind, &ids[kind]))
+			return 1;
+	}
+	query.reset();
+	query << "drop table if exists " << tmp;
+	query.exec();
+	if (dnsperf_create_valtable(conn, tmp.c_str()))
+		return 1;
+
+	/* one connection reads, the other one writes */
+	if (!(out = dnsperf_db_grab()))
+		return 1;
+	mysqlpp::Query insert = out->query();
+
+	query.reset();
+	query << "select domain, nameserver, timestamp, latency, outcome " <<
+	    "from " << table << " order by domain, nameserver, timestamp";
+	if (!(res = query.use())) {
+		cerr << "Failed to read `" << table << "` " << query.error() <<
+		    endl;
+		dnsperf_db_release(out);
+		return 1;
+	}
+	while (mysqlpp::Row row = res.fetch_row()) {
+		string key = string(row[0].c_str()) + '\0' + row[1].c_str() +
+		    '\0' + row[2].c_str();
+		char ts[DNSPERF_DATE_LEN + 8];
+
+		seq = key == last ? seq + 1 : 0;
+		last = key;
+		snprintf(ts, sizeof(ts), "%s.%06u", row[2].c_str(), seq);
+
+		if (!batch)
+			insert << "insert ignore into " << tmp << " (domain_id, " <<
+			    "ts, ns_id, latency, outcome) values ";
+		else
+			insert << ", ";
+		insert << "(" << ids[DNSPERF_DIM_DOMAIN][row[0].c_str()] <<
+		    ", " << mysqlpp::quote << ts << ", " <<
+		    ids[DNSPERF_DIM_NS][row[1].c_str()] << ", " <<
+		    row[3].c_str() << ", " << row[4].c_str() << ")";
+		rows++;
+		if (++batch < DNSPERF_MIGRATE_BATCH)
+			continue;
+		batch = 0;
+		if (!insert.exec()) {
+			ret = 1;
+			break;
+		}
+		insert.reset();
+	}
+	/* drain what is left, or the connection can't be used again */
+	while (ret && res.fetch_row())
+		;
+	if (!ret && batch && !insert.exec())
+		ret = 1;
+	if (ret)
+		cerr << "Failed to copy `" << table << "` " << insert.error() <<
+		    endl;
+	dnsperf_db_release(out);
+	if (ret)
+		return 1;
+
+	query.reset();
+	query << "rename table " << table << " to " << old << ", " << tmp <<
+	    " to " << table;
+	if (!query.exec()) {
+		cerr << "Failed to rename `" << table << "` " << query.error() <<
+		    endl;
+		return 1;
+	}
+	cout << "Migrated " << rows << " queries; the old table is `" << old <<
+	    "`, drop it once you are happy" << endl;
+	return 0;
+}
+
+/* Day partitions of the query log: what there is, and today's day number */
+static int dnsperf_partitions(mysqlpp::Connection *conn, const char *tablename,
+			      const char *cutoff, mysqlpp::StoreQueryResult *res)
+{
+	mysqlpp::Query query = conn->query();
+
+	query << "select partition_name, partition_description + 0 as upto, " <<
+	    "to_days(now()) as today, to_days(" << mysqlpp::quote <<
+	    (cutoff ? cutoff : "0000-00-00") << ") as cutoff " <<
+	    "from information_schema.partitions where table_schema = " <<
+	    "database() and table_name = " << mysqlpp::quote << tablename <<
+	    " and partition_name is not null";
+	if (!(*res = query.store())) {
+		cerr << "Failed to look at the partitions of `" << tablename <<
+		    "` " << query.error() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* With -P: make sure there are partitions for the next few days, and drop
+ * the ones that hold nothing newer than cutoff (if given). A table that is
+ * not partitioned is left alone. */
+int dnsperf_partitions_update(mysqlpp::Connection *conn, const char *tablename,
+			      const char *cutoff)
+{
+	mysqlpp::StoreQueryResult res;
+	unsigned long upto = 0, today;
+	string drop;
+
+	if (dnsperf_partitions(conn, tablename, cutoff, &res))
+		return 1;
+	if (!res.num_rows())
+		return 0;
+	today = (unsigned long)res[0]["today"];
+	for (size_t i = 0; i < res.num_rows(); i++) {
+		unsigned long n;
+
+		if (!strcmp(res[i]["partition_name"].c_str(), "pmax"))
+			continue;
+		n = (unsigned long)res[i]["upto"];
+		if (n > upto)
+			upto = n;
+		if (cutoff && n <= (unsigned long)res[i]["cutoff"])
+			drop += string(drop.empty() ? "" : ", ") +
+			    res[i]["partition_name"].c_str();
+	}
+
+	for (unsigned long d = upto > today ? upto : today;
+	     d <= today + DNSPERF_PARTITIONS_AHEAD; d++) {
+		mysqlpp::Query query = conn->query();
+
+		query << "alter table " << tablename << " reorganize " <<
+		    "partition pmax into (partition p" << d << " values " <<
+		    "less than (" << d + 1 << "), partition pmax values " <<
+		    "less than maxvalue)";
+		if (!query.exec()) {
+			cerr << "Failed to add a partition to `" << tablename <<
+			    "` " << query.error() << endl;
+			return 1;
+		}
+	}
+
+	if (!drop.empty()) {
+		mysqlpp::Query query = conn->query();
+
+		query << "alter table " << tablename << " drop partition " <<
+		    drop;
+		if (!query.exec()) {
+			cerr << "Failed to drop partitions of `" << tablename <<
+			    "` " << query.error() << endl;
+			return 1;
+		}
+		if (!dnsperf_quiet)
+			cout << "Dropped partitions " << drop << " of `" <<
+			    tablename << "`" << endl;
+	}
+	return 0;
+}
+
+/* -P on a table that was not partitioned so far */
+static int dnsperf_partition_valtable(mysqlpp::Connection *conn)
+{
+	mysqlpp::StoreQueryResult res;
+	mysqlpp::Query query = conn->query();
+
+	if (dnsperf_partitions(conn, dnsperf_valtable, NULL, &res))
+		return 1;
+	if (res.num_rows())
+		return 0;
+	cout << "Partitioning `" << dnsperf_valtable << "` by day..." << endl;
+	query << "alter table " << dnsperf_valtable << " " <<
+	    DNSPERF_PARTITION_BY;
+	if (!query.exec()) {
+		cerr << "Failed to partition `" << dnsperf_valtable << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* Rows from agents (collector.cpp) say where they come from, and two
+ * vantage points may well query the same nameserver in the same us */
+static int dnsperf_add_vantage(mysqlpp::Connection *conn)
+{
+	mysqlpp::Query query = conn->query();
+
+	cout << "Adding vantage points to `" << dnsperf_valtable << "`..." <<
+	    endl;
+	query << "alter table " << dnsperf_valtable << " add column vp_id " <<
+	    "INT UNSIGNED NOT NULL DEFAULT 0, drop primary key, add " <<
+	    "primary key (domain_id, ts, ns_id, vp_id)";
+	if (!query.exec()) {
+		cerr << "Failed to alter table `" << dnsperf_valtable << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	dnsperf_schema_columns[dnsperf_valtable].insert("vp_id");
+	return 0;
+}
+
+/* Samples say which address of the nameserver they went to; the rows
+ * from before are address 0, and two addresses of one nameserver may well
+ * be asked in the same us */
+static int dnsperf_add_address(mysqlpp::Connection *conn)
+{
+	mysqlpp::Query query = conn->query();
+
+	cout << "Adding addresses to `" << dnsperf_valtable << "`..." << endl;
+	query << "alter table " << dnsperf_valtable << " add column addr_id " <<
+	    "INT UNSIGNED NOT NULL DEFAULT 0 after ns_id, drop primary key, " <<
+	    "add primary key (domain_id, ts, ns_id, addr_id, vp_id)";
+	if (!query.exec()) {
+		cerr << "Failed to alter table `" << dnsperf_valtable << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	dnsperf_schema_columns[dnsperf_valtable].insert("addr_id");
+	return 0;
+}
+
+/* Same for an aggregate table, keyed by domain, nameserver and whatever
+ * comes in rest: what it holds for a nameserver so far stays on as
+ * address '', all of its addresses from before */
+static int dnsperf_add_address_key(mysqlpp::Connection *conn,
+				   const char *tablename, const char *rest)
+{
+	mysqlpp::Query query = conn->query();
+
+	if (dnsperf_has_column(tablename, "address"))
+		return 0;
+	cout << "Adding addresses to `" << tablename << "`..." << endl;
+	query << "alter table " << tablename << " add column address " <<
+	    DNSPERF_ADDRESS_COLUMN << ", drop primary key, add primary key " <<
+	    "(domain, nameserver, address" << rest << ")";
+	if (!query.exec()) {
+		cerr << "Failed to alter table `" << tablename << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	dnsperf_schema_columns[tablename].insert("address");
+	return 0;
+}
+
+/* Bring tables created by older versions up to date */
+static int dnsperf_upgrade_tables(mysqlpp::Connection *conn)
+{
+	/* the migration renames tables under us, so look again after it */
+	if (dnsperf_has_column(dnsperf_valtable, "domain") &&
+	    (dnsperf_add_column(conn, dnsperf_valtable, "outcome",
+				"TINYINT UNSIGNED NOT NULL DEFAULT 0") ||
+	     dnsperf_migrate_valtable(conn) || dnsperf_schema_load(conn)))
+		return 1;
+	if (!dnsperf_has_column(dnsperf_valtable, "vp_id") &&
+	    dnsperf_add_vantage(conn))
+		return 1;
+	if (!dnsperf_has_column(dnsperf_valtable, "addr_id") &&
+	    dnsperf_add_address(conn))
+		return 1;
+	if (dnsperf_add_column(conn, dnsperf_valtable, "clamped",
+			       "TINYINT UNSIGNED NOT NULL DEFAULT 0"))
+		return 1;
+	if (dnsperf_partition && (dnsperf_partition_valtable(conn) ||
+				  dnsperf_partitions_update(conn,
+							    dnsperf_valtable,
+							    NULL)))
+		return 1;
+	/* the stats UPDATE goes by domain */
+	if (dnsperf_add_key(conn, dnsperf_stattable, "PRIMARY",
+			    "PRIMARY KEY (domain)"))
+		return 1;
+	/* in the order dnsperf_create_histtable() has them: the stats
+	 * REPLACE goes by position */
+	for (int i = DNSPERF_OUTCOME_OK + 1; i < DNSPERF_OUTCOMES; i++)
+		if (dnsperf_add_column(conn, dnsperf_histtable,
+				       dnsperf_outcome_name(i),
+				       "BIGINT UNSIGNED NOT NULL DEFAULT 0"))
+			return 1;
+	if (dnsperf_add_column(conn, dnsperf_histtable, "failrate",
+			       "DOUBLE NOT NULL DEFAULT 0") ||
+	    dnsperf_add_address_key(conn, dnsperf_histtable, ""))
+		return 1;
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++)
+		if (dnsperf_add_address_key(conn,
+					    dnsperf_rollup_table(l).c_str(),
+					    ", ts"))
+			return 1;
+	return 0;
+}
+
+/* Make sure all database tables exist, on the connection main() goes on
+ * to use */
+int dnsperf_sanity_check(mysqlpp::Connection *conn)
+{
+	int created = 0, ret = 0;
+
+	if (dnsperf_resetdb) {
+		/* Reset DB values */
+		if (dnsperf_initdb(conn)) {
+			cout << "Database init failed, exiting" << endl;
+			exit(1);
+		}
+	} else {
+		if (!dnsperf_quiet)
+			cout << "Selecting database: `" << dnsperf_dbname << "`" << endl;
+
+		if (!conn->select_db(dnsperf_dbname)) {
+			cout << "Database " << dnsperf_dbname <<
+			    " does not exist, creating it... " << endl;
+			dnsperf_initdb(conn);
+		}
+	}
+	if (!conn->select_db(dnsperf_dbname))
+		return 0;
+	/* What happens if the table exists but the schema is different ? ;P */
+	if (dnsperf_create_dimtables(conn, dnsperf_valtable) ||
+	    dnsperf_schema_load(conn))
+		return 1;
+	if (dnsperf_check_table(conn, dnsperf_valtable)) {
+		if (dnsperf_create_valtable(conn, dnsperf_valtable)) {
+			cout << "Unable to create table `" << dnsperf_valtable << endl;
+			ret = 1;
+		}
+		created = 1;
+	}
+	if (!ret && dnsperf_check_table(conn, dnsperf_domaintable)) {
+		if (dnsperf_create_domtable(conn, dnsperf_domaintable)) {
+			cout << "Unable to create table `" << dnsperf_domaintable << endl;
+			ret = 1;
+		}
+		created = 1;
+	}
+	if (!ret && dnsperf_check_table(conn, dnsperf_stattable)) {
+		if (dnsperf_create_stattable(conn, dnsperf_stattable)) {
+			cout << "Unable to create table `" << dnsperf_stattable<< endl;
+			ret = 1;
+		}
+		created = 1;
+	}
+	if (!ret && dnsperf_check_table(conn, dnsperf_histtable)) {
+		if (dnsperf_create_histtable(conn, dnsperf_histtable)) {
+			cout << "Unable to create table `" << dnsperf_histtable << endl;
+			ret = 1;
+		}
+		created = 1;
+	}
+	for (int l = 0; !ret && l < DNSPERF_ROLLUPS; l++) {
+		string table = dnsperf_rollup_table(l);
+
+		if (!dnsperf_check_table(conn, table.c_str()))
+			continue;
+		if (dnsperf_create_rolluptable(conn, table.c_str())) {
+			cout << "Unable to create table `" << table << endl;
+			ret = 1;
+		}
+		created = 1;
+	}
+	/* the new tables are as they should be, but the upgrade looks */
+	if (!ret && created && dnsperf_schema_load(conn))
+		ret = 1;
+	if (!ret && dnsperf_upgrade_tables(conn))
+		ret = 1;
+	return ret;
+}
+
+/* Make sure a specific database table exists: 1 if it does not. This goes
+ * by the schema dnsperf_schema_load() read, and never looks at the rows
+ * (the query log may well have billions of them) */
+int dnsperf_check_table(mysqlpp::Connection *conn, const char *tablename)
+{
+	if (!dnsperf_quiet)
+		cout << "Checking table:`" << tablename <<
+		    "`" << endl;
+	if (dnsperf_schema_columns.count(tablename))
+		return 0;
+	if (!dnsperf_quiet)
+		cout << "No table `" << tablename << "` in `" <<
+		    dnsperf_dbname << "`" << endl;
+	return 1;
+}
+
+/* Database init functions */
+int dnsperf_create_stattable(mysqlpp::Connection *conn, const char *tablename)
+{
+
+	try {
+		if (!dnsperf_quiet)
+			cout << "Creating " << tablename << " table..." << endl;
+		mysqlpp::Query query = conn->query();
+		query<<
+		    "CREATE TABLE " << tablename << " (" <<
+		    "  domain CHAR(80) NOT NULL, " <<
+		    "  average DOUBLE NULL, " <<
+		    "  stddev DOUBLE NULL, " <<
+		    "  count BIGINT NULL, " <<
+		    "  first DATETIME NULL, " <<
+		    "  last DATETIME NULL, " <<
+		    "  PRIMARY KEY (domain)) " <<
+		    "ENGINE = InnoDB " <<
+		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
+		query.execute();
+
+		query<< "insert into %6:table values " <<
+		    "(%0q, %1q, %2q, %3q, %4q, %5q)";
+		query.parse();
+
+		query.template_defaults["table"] = tablename;
+
+		for (size_t i = 0; i < DNSPERF_DOMAINS; ++i)
+			query.execute(default_domains[i], 0, 0, 0, 0, 0);
+	}
+	catch(const mysqlpp::BadQuery & er) {
+		cerr << endl << "Query error: " << er.what() << endl;
+		return 1;
+	}
+	catch(const mysqlpp::BadConversion & er) {
+		cerr << endl << "Conversion error: " << er.what() << endl <<
+		    "\tretrieved data size: " << er.retrieved <<
+		    ", actual size: " << er.actual_size << endl;
+		return 1;
+	}
+	catch(const mysqlpp::Exception & er) {
+		cerr << endl << "Error: " << er.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+int dnsperf_create_domtable(mysqlpp::Connection * conn, const char *tablename)
+{
+	try {
+		mysqlpp::Query query = conn->query();
+
+		if (!dnsperf_quiet)
+			cout << "Creating " << tablename << " table..." << endl;
+		query << "CREATE TABLE " << tablename << " (" <<
+		    "  `rank` INT NOT NULL, " <<
+		    "  domain CHAR(80) NOT NULL) " <<
+		    "ENGINE = InnoDB " <<
+		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
+		query.execute();
+
+		if (dnsperf_verbose)
+			cout << "Populating the " << tablename <<
+			    " table ..." << endl;
+		query << "insert into %6:table values " <<
+		    "(%0q, %1q )";
+		query.parse();
+
+		query.template_defaults["table"] = tablename;
+
+		for (size_t i = 1; i <= DNSPERF_DOMAINS; ++i)
+			query.execute(i, default_domains[i - 1]);
+	}
+	catch(const mysqlpp::BadQuery & er) {
+		cerr << endl << "Query error: " << er.what() << endl;
+		return 1;
+	}
+	catch(const mysqlpp::BadConversion & er) {
+		cerr << endl << "Conversion error: " << er.what() << endl <<
+		    "\tretrieved data size: " << er.retrieved <<
+		    ", actual size: " << er.actual_size << endl;
+		return 1;
+	}
+	catch(const mysqlpp::Exception & er) {
+		cerr << endl << "Error: " << er.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+string dnsperf_dim_table(const char *valtable, int kind)
+{
+	return string(valtable) + dnsperf_dim_suffix[kind];
+}
+
+/* The names the query log refers to by id; ids are never reused, so rows
+ * keep their names whatever happens to the domains table */
+int dnsperf_create_dimtables(mysqlpp::Connection *conn, const char *valtable)
+{
+	try {
+		for (int kind = 0; kind < DNSPERF_DIMS; kind++) {
+			mysqlpp::Query query = conn->query();
+
+			query <<
+			    "CREATE TABLE IF NOT EXISTS " <<
+			    dnsperf_dim_table(valtable, kind) << " (" <<
+			    "  " << dnsperf_dim_id[kind] <<
+			    " INT UNSIGNED NOT NULL AUTO_INCREMENT, " <<
+			    "  " << dnsperf_dim_column[kind] <<
+			    " VARCHAR(" << DNSPERF_DIM_NAME_MAX <<
+			    ") NOT NULL, ";
+			/* 4 or 6, so that queries need not look */
+			if (kind == DNSPERF_DIM_ADDR)
+				query << "  family TINYINT UNSIGNED NOT NULL, ";
+			query <<
+			    "  PRIMARY KEY (" << dnsperf_dim_id[kind] << "), " <<
+			    "  UNIQUE KEY (" << dnsperf_dim_column[kind] << ")) " <<
+			    "ENGINE = InnoDB " <<
+			    "CHARACTER SET utf8 COLLATE utf8_general_ci";
+			query.execute();
+		}
+	}
+	catch(const mysqlpp::BadQuery & er) {
+		cerr << endl << "Query error: " << er.what() << endl;
+		return 1;
+	}
+	catch(const mysqlpp::Exception & er) {
+		cerr << endl << "Error: " << er.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* One row per query, clustered by domain and time, so that anything about
+ * one domain over a period is a range of the primary key. Latency in us;
+ * domain_id, ns_id, addr_id and vp_id point into dnsperf_dim_table(), and
+ * clamped says the probe limiter (limiter.h) was holding back. */
+int dnsperf_create_valtable(mysqlpp::Connection *conn, const char *tablename)
+{
+	try {
+		if (!dnsperf_quiet)
+			cout << "Creating " << tablename << " table..." << endl;
+		mysqlpp::Query query = conn->query();
+		query <<
+		    "CREATE TABLE " << tablename << " (" <<
+		    "  domain_id INT UNSIGNED NOT NULL, " <<
+		    "  ts DATETIME(6) NOT NULL, " <<
+		    "  ns_id INT UNSIGNED NOT NULL, " <<
+		    "  addr_id INT UNSIGNED NOT NULL DEFAULT 0, " <<
+		    "  latency DOUBLE NOT NULL, " <<
+		    "  outcome TINYINT UNSIGNED NOT NULL DEFAULT 0, " <<
+		    "  vp_id INT UNSIGNED NOT NULL DEFAULT 0, " <<
+		    "  clamped TINYINT UNSIGNED NOT NULL DEFAULT 0, " <<
+		    "  PRIMARY KEY (domain_id, ts, ns_id, addr_id, vp_id)) " <<
+		    "ENGINE = InnoDB";
+		if (dnsperf_partition)
+			query << " " << DNSPERF_PARTITION_BY;
+		query.execute();
+	}
+	catch(const mysqlpp::BadQuery & er) {
+		cerr << endl << "Query error: " << er.what() << endl;
+		return 1;
+	}
+	catch(const mysqlpp::BadConversion & er) {
+		cerr << endl << "Conversion error: " << er.what() << endl <<
+		    "\tretrieved data size: " << er.retrieved <<
+		    ", actual size: " << er.actual_size << endl;
+		return 1;
+	}
+	catch(const mysqlpp::Exception & er) {
+		cerr << endl << "Error: " << er.what() << endl;
+		return 1;
+	}
+	return 0;
+
+}
+
+/* Percentiles (in us) per domain, nameserver and address, and the
+ * histogram buckets they came from; nameserver '' is the whole domain */
+int dnsperf_create_histtable(mysqlpp::Connection *conn, const char *tablename)
+{
+	try {
+		if (!dnsperf_quiet)
+			cout << "Creating " << tablename << " table..." << endl;
+		mysqlpp::Query query = conn->query();
+		query <<
+		    "CREATE TABLE " << tablename << " (" <<
+		    "  domain CHAR(80) NOT NULL, " <<
+		    "  nameserver CHAR(80) NOT NULL, " <<
+		    "  count BIGINT NOT NULL, " <<
+		    "  p50 DOUBLE NOT NULL, " <<
+		    "  p90 DOUBLE NOT NULL, " <<
+		    "  p99 DOUBLE NOT NULL, " <<
+		    "  p999 DOUBLE NOT NULL, " <<
+		    "  max DOUBLE NOT NULL, " <<
+		    "  buckets MEDIUMTEXT NOT NULL, ";
+		/* queries that got no usable answer, by outcome */
+		for (int i = DNSPERF_OUTCOME_OK + 1; i < DNSPERF_OUTCOMES; i++)
+			query << "  " << dnsperf_outcome_name(i) <<
+			    " BIGINT UNSIGNED NOT NULL DEFAULT 0, ";
+		query <<
+		    "  failrate DOUBLE NOT NULL DEFAULT 0, " <<
+		    "  address " << DNSPERF_ADDRESS_COLUMN << ", " <<
+		    "  PRIMARY KEY (domain, nameserver, address)) " <<
+		    "ENGINE = InnoDB " <<
+		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
+		query.execute();
+	}
+	catch(const mysqlpp::BadQuery & er) {
+		cerr << endl << "Query error: " << er.what() << endl;
+		return 1;
+	}
+	catch(const mysqlpp::BadConversion & er) {
+		cerr << endl << "Conversion error: " << er.what() << endl <<
+		    "\tretrieved data size: " << er.retrieved <<
+		    ", actual size: " << er.actual_size << endl;
+		return 1;
+	}
+	catch(const mysqlpp::Exception & er) {
+		cerr << endl << "Error: " << er.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* One row per domain, nameserver and address ('' for the whole domain) and
+ * minute, hour or day; latencies in us, min and max NULL if every query
+ * failed */
+int dnsperf_create_rolluptable(mysqlpp::Connection *conn, const char *tablename)
+{
+	try {
+		if (!dnsperf_quiet)
+			cout << "Creating " << tablename << " table..." << endl;
+		mysqlpp::Query query = conn->query();
+		query <<
+		    "CREATE TABLE " << tablename << " (" <<
+		    "  domain CHAR(80) NOT NULL, " <<
+		    "  nameserver CHAR(80) NOT NULL, " <<
+		    "  ts DATETIME NOT NULL, " <<
+		    "  count BIGINT UNSIGNED NOT NULL, " <<
+		    "  failed BIGINT UNSIGNED NOT NULL, " <<
+		    "  sum DOUBLE NOT NULL, " <<
+		    "  sumsq DOUBLE NOT NULL, " <<
+		    "  min DOUBLE, " <<
+		    "  max DOUBLE, " <<
+		    "  buckets MEDIUMTEXT NOT NULL, " <<
+		    "  address " << DNSPERF_ADDRESS_COLUMN << ", " <<
+		    "  PRIMARY KEY (domain, nameserver, address, ts)) " <<
+		    "ENGINE = InnoDB " <<
+		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
+		query.execute();
+	}
+	catch(const mysqlpp::BadQuery & er) {
+		cerr << endl << "Query error: " << er.what() << endl;
+		return 1;
+	}
+	catch(const mysqlpp::BadConversion & er) {
+		cerr << endl << "Conversion error: " << er.what() << endl <<
+		    "\tretrieved data size: " << er.retrieved <<
+		    ", actual size: " << er.actual_size << endl;
+		return 1;
+	}
+	catch(const mysqlpp::Exception & er) {
+		cerr << endl << "Error: " << er.what() << endl;
+		return 1;
+	}
+	return 0;
+}
+
+int dnsperf_initdb(mysqlpp::Connection *conn)
+{
+	bool new_db = false;
+
+	mysqlpp::NoExceptions ne(*conn);
+	mysqlpp::Query query = conn->query();
+
+	if (conn->select_db(dnsperf_dbname)) {
+		cout << "Dropping existing tables..." << endl;
+		query << "drop table " << dnsperf_valtable;
+		query.exec();
+		for (int kind = 0; kind < DNSPERF_DIMS; kind++) {
+			query << "drop table " <<
+			    dnsperf_dim_table(dnsperf_valtable, kind);
+			query.exec();
+		}
+		query << "drop table " << dnsperf_domaintable;
+		query.exec();
+		query << "drop table " << dnsperf_stattable;
+		query.exec();
+		query << "drop table " << dnsperf_histtable;
+		query.exec();
+		for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+			query << "drop table " << dnsperf_rollup_table(l);
+			query.exec();
+		}
+	} else {
+		// Database doesn't exist yet, so create and select it.
+		if (conn->create_db(dnsperf_dbname) &&
+		    conn->select_db(dnsperf_dbname)) {
+			new_db = true;
+		} else {
+			cerr << "Error creating DB: " << conn->error() <<
+			    endl;
+			return 1;
+		}
+	}
+
+	cout << (new_db ? "Created" : "Reinitialized") <<
+		    " database successfully." << endl;
+
+	if (dnsperf_create_dimtables(conn, dnsperf_valtable) ||
+	    dnsperf_create_valtable(conn, dnsperf_valtable) ||
+	    (dnsperf_partition &&
+	     dnsperf_partitions_update(conn, dnsperf_valtable, NULL))) {
+		cout << "Unable to create table `" << dnsperf_valtable << endl;
+		exit(1);
+	}
+	if (dnsperf_create_domtable(conn, dnsperf_domaintable)) {
+		cout << "Unable to create table `" << dnsperf_domaintable << endl;
+		exit(1);
+	}
+	if (dnsperf_create_stattable(conn, dnsperf_stattable)) {
+		cout << "Unable to create table `" << dnsperf_stattable<< endl;
+		exit(1);
+	}
+	if (dnsperf_create_histtable(conn, dnsperf_histtable)) {
+		cout << "Unable to create table `" << dnsperf_histtable << endl;
+		exit(1);
+	}
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+		string table = dnsperf_rollup_table(l);
+
+		if (dnsperf_create_rolluptable(conn, table.c_str())) {
+			cout << "Unable to create table `" << table << endl;
+			exit(1);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * db.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Database plumbing: one connection pool shared by the prober, the query log
+ * writer and the schema code, plus the table helpers.
+ */
+
+#ifndef DNSPERF_DB_H
+#define DNSPERF_DB_H
+
+#include <string>
+
+#include <mysql++/mysql++.h>
+
+/* seconds a pooled connection may sit unused before we close it */
+#define DNSPERF_POOL_IDLE 300
+/* seconds to wait for the DBMS to answer a connect, and not to try again
+ * after it did not, so an outage does not hold up the probe workers */
+#define DNSPERF_DB_CONNECT_TIMEOUT 3
+#define DNSPERF_DB_BACKOFF 5
+
+/* The query log refers to domains, nameservers, the addresses they were
+ * asked at and the agents that sent the rows by id, from a table of each
+ * next to it: <logtable>_domains, <logtable>_nameservers,
+ * <logtable>_addresses and <logtable>_vantages. Vantage 0 is ourselves,
+ * address 0 is one we did not keep (rows from before we kept them). */
+#define DNSPERF_DIM_DOMAIN	0
+#define DNSPERF_DIM_NS		1
+#define DNSPERF_DIM_VANTAGE	2
+#define DNSPERF_DIM_ADDR	3
+#define DNSPERF_DIMS		4
+extern const char *dnsperf_dim_column[DNSPERF_DIMS];	/* the name column */
+extern const char *dnsperf_dim_id[DNSPERF_DIMS];	/* and the id column */
+#define DNSPERF_DIM_NAME_MAX	255
+/* the latency and rollup tables keep the address as is (DNSPERF_ADDRESS_MAX
+ * in stats.h); '' is the domain as a whole, or a row from before */
+#define DNSPERF_ADDRESS_COLUMN	"CHAR(46) NOT NULL DEFAULT ''"
+
+/* rows per INSERT when migrating an old query log */
+#define DNSPERF_MIGRATE_BATCH 1000
+
+/* -P: one partition per day, a few days ahead of time */
+#define DNSPERF_PARTITION_BY \
+	"PARTITION BY RANGE (TO_DAYS(ts)) " \
+	"(PARTITION pmax VALUES LESS THAN MAXVALUE)"
+#define DNSPERF_PARTITIONS_AHEAD 3
+
+#define DNSPERF_DOMAINS 10
+extern const char *default_domains[];
+
+mysqlpp::Connection *dnsperf_db_grab(void);
+void dnsperf_db_release(mysqlpp::Connection *conn);
+
+int dnsperf_sanity_check(mysqlpp::Connection *conn);
+int dnsperf_initdb(mysqlpp::Connection *conn);
+int dnsperf_create_stattable(mysqlpp::Connection *conn, const char *tablename);
+int dnsperf_create_domtable(mysqlpp::Connection *conn, const char *tablename);
+int dnsperf_create_valtable(mysqlpp::Connection *conn, const char *tablename);
+int dnsperf_create_dimtables(mysqlpp::Connection *conn, const char *valtable);
+std::string dnsperf_dim_table(const char *valtable, int kind);
+int dnsperf_partitions_update(mysqlpp::Connection *conn, const char *tablename,
+			      const char *cutoff);
+int dnsperf_create_histtable(mysqlpp::Connection *conn, const char *tablename);
+int dnsperf_create_rolluptable(mysqlpp::Connection *conn,
+			       const char *tablename);
+int dnsperf_check_table(mysqlpp::Connection *conn, const char *tablename);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * detect.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Change detection. Latency is looked at in log space, where a nameserver
+ * getting twice as slow is the same step whatever its usual latency, and
+ * where the odd retransmit does not swamp everything else; a single sample
+ * moves the CUSUM by at most DNSPERF_DETECT_ZMAX sigmas, so it takes a run
+ * of slow answers to go off, and a run of normal ones to clear. Until a
+ * series has seen DNSPERF_DETECT_WARMUP samples its EWMAs are plain means.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alert.h"
+#include "detect.h"
+
+using namespace std;
+
+static const char *dnsperf_alarm_names[DNSPERF_ALARMS] = {
+	"latency", "failures", "tail"
+};
+
+const char *dnsperf_alarm_name(int alarm)
+{
+	return alarm >= 0 && alarm < DNSPERF_ALARMS ?
+	    dnsperf_alarm_names[alarm] : "unknown";
+}
+
+void dnsperf_detect_init(struct dnsperf_detect *d,
+			 struct dnsperf_alerter *alerter)
+{
+	d->domains.clear();
+	d->alerter = alerter;
+}
+
+static void dnsperf_series_init(struct dnsperf_series *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+/* Window buckets: us below 4 as they are, then 4 per power of two */
+static unsigned int dnsperf_window_bucket(uint64_t latency)
+{
+	uint64_t us = latency / 1000;
+	unsigned int octave = 0, b;
+
+	if (us < 4)
+		return us;
+	for (uint64_t v = us; v > 1; v >>= 1)
+		octave++;
+	b = octave * 4 + ((us >> (octave - 2)) & 3);
+	return b < DNSPERF_DETECT_BUCKETS ? b : DNSPERF_DETECT_BUCKETS - 1;
+}
+
+/* and what a bucket stands for (us), the middle of it */
+static double dnsperf_window_value(unsigned int b)
+{
+	unsigned int octave = b / 4;
+
+	if (b < 4)
+		return b;
+	return (double)((4 + b % 4) << (octave - 2)) +
+	    (double)(1 << (octave - 2)) / 2;
+}
+
+static double dnsperf_window_p99(const struct dnsperf_series *s,
+				 uint64_t *count)
+{
+	uint64_t rank, seen = 0;
+
+	*count = 0;
+	for (unsigned int i = 0; i < DNSPERF_DETECT_BUCKETS; i++)
+		*count += s->win[0][i] + s->win[1][i];
+	if (!*count)
+		return 0;
+	rank = (uint64_t)ceil(*count * 0.99);
+	for (unsigned int i = 0; i < DNSPERF_DETECT_BUCKETS; i++) {
+		seen += s->win[0][i] + s->win[1][i];
+		if (seen >= rank)
+			return dnsperf_window_value(i);
+	}
+	return dnsperf_window_value(DNSPERF_DETECT_BUCKETS - 1);
+}
+
+static void dnsperf_detect_fire(struct dnsperf_detect *d,
+				const struct dnsperf_series *s,
+				const char *domain, int alarm, int state,
+				time_t tm, double baseline, double current)
+{
+	struct dnsperf_alert al;
+
+	al.tm = tm;
+	al.alarm = alarm;
+	al.state = state;
+	snprintf(al.domain, sizeof(al.domain), "%s", domain);
+	snprintf(al.nameserver, sizeof(al.nameserver), "%s", s->nameserver);
+	snprintf(al.address, sizeof(al.address), "%s", s->address);
+	al.baseline = baseline;
+	al.current = current;
+	dnsperf_alert_fire(d->alerter, &al);
+}
+
+/* What alerts report: ms for latency (the geometric mean), % for failures */
+static void dnsperf_detect_levels(const struct dnsperf_series *s, int alarm,
+				  double *baseline, double *current)
+{
+	if (alarm == DNSPERF_ALARM_LATENCY) {
+		*baseline = exp(s->mean) / 1000;
+		*current = exp(s->recent) / 1000;
+	} else {
+		*baseline = s->failrate * 100;
+		*current = s->recent_failrate * 100;
+	}
+}
+
+/* Raise, clear or adopt a CUSUM's alarm */
+static void dnsperf_detect_judge(struct dnsperf_detect *d,
+				 struct dnsperf_series *s, const char *domain,
+				 int alarm, double *cusum, double h, int warm,
+				 time_t tm)
+{
+	double baseline, current;
+	int state;
+
+	if (!s->alarmed[alarm]) {
+		if (!warm || *cusum <= h)
+			return;
+		s->alarmed[alarm] = tm;
+		dnsperf_detect_levels(s, alarm, &baseline, &current);
+		dnsperf_detect_fire(d, s, domain, alarm, DNSPERF_ALERT_RAISED,
+				    tm, baseline, current);
+		return;
+	}
+	/* no further up than it takes to go off, so it clears as soon */
+	if (*cusum > h)
+		*cusum = h;
+	if (*cusum > 0 && tm - s->alarmed[alarm] < DNSPERF_DETECT_ADOPT)
+		return;
+	dnsperf_detect_levels(s, alarm, &baseline, &current);
+	state = *cusum > 0 ? DNSPERF_ALERT_ADOPTED : DNSPERF_ALERT_CLEARED;
+	if (state == DNSPERF_ALERT_ADOPTED) {
+		if (alarm == DNSPERF_ALARM_LATENCY)
+			s->mean = s->recent;
+		else
+			s->failrate = s->recent_failrate;
+		*cusum = 0;
+	}
+	s->alarmed[alarm] = 0;
+	dnsperf_detect_fire(d, s, domain, alarm, state, tm, baseline, current);
+}
+
+/* A half-window is over: how did the minute up to here do */
+static void dnsperf_detect_tail(struct dnsperf_detect *d,
+				struct dnsperf_series *s, const char *domain,
+				time_t tm)
+{
+	uint64_t count;
+	double p99 = dnsperf_window_p99(s, &count);
+	int state;
+
+	if (count < DNSPERF_DETECT_TAIL_MIN)
+		return;
+	s->last_p99 = p99;
+	if (!s->alarmed[DNSPERF_ALARM_TAIL]) {
+		if (s->windows >= 3 &&
+		    p99 > DNSPERF_DETECT_TAIL_RATIO * s->p99) {
+			/* the baseline stays put while we make sure */
+			if (++s->over < 2)
+				return;
+			s->over = 0;
+			s->alarmed[DNSPERF_ALARM_TAIL] = tm;
+			dnsperf_detect_fire(d, s, domain, DNSPERF_ALARM_TAIL,
+					    DNSPERF_ALERT_RAISED, tm,
+					    s->p99 / 1000, p99 / 1000);
+			return;
+		}
+		s->over = 0;
+		s->p99 = s->windows ? s->p99 + DNSPERF_DETECT_TAIL_ALPHA *
+		    (p99 - s->p99) : p99;
+		s->windows++;
+		return;
+	}
+	if (p99 <= DNSPERF_DETECT_TAIL_RATIO * s->p99)
+		state = DNSPERF_ALERT_CLEARED;
+	else if (tm - s->alarmed[DNSPERF_ALARM_TAIL] >= DNSPERF_DETECT_ADOPT)
+		state = DNSPERF_ALERT_ADOPTED;
+	else
+		return;
+	s->alarmed[DNSPERF_ALARM_TAIL] = 0;
+	dnsperf_detect_fire(d, s, domain, DNSPERF_ALARM_TAIL, state, tm,
+			    s->p99 / 1000, p99 / 1000);
+	if (state == DNSPERF_ALERT_ADOPTED)
+		s->p99 = p99;
+}
+
+static void dnsperf_detect_window(struct dnsperf_detect *d,
+				  struct dnsperf_series *s, const char *domain,
+				  time_t tm)
+{
+	time_t half = tm - tm % DNSPERF_DETECT_HALF;
+
+	if (!s->half)
+		s->half = half;
+	if (half <= s->half)
+		return;
+	dnsperf_detect_tail(d, s, domain, tm);
+	/* the previous half only counts if it was just before this one */
+	if (half - s->half >= 2 * DNSPERF_DETECT_HALF)
+		memset(s->win[1], 0, sizeof(s->win[1]));
+	else
+		memcpy(s->win[1], s->win[0], sizeof(s->win[1]));
+	memset(s->win[0], 0, sizeof(s->win[0]));
+	s->half = half;
+}
+
+static void dnsperf_series_add(struct dnsperf_detect *d,
+			       struct dnsperf_series *s, const char *domain,
+			       uint64_t latency, time_t tm, int ok)
+{
+	double x = ok ? 0 : 1, a, p0;
+
+	dnsperf_detect_window(d, s, domain, tm);
+
+	s->samples++;
+	a = 1.0 / s->samples > DNSPERF_DETECT_ALPHA ? 1.0 / s->samples :
+	    DNSPERF_DETECT_ALPHA;
+	s->recent_failrate = s->samples == 1 ? x : s->recent_failrate +
+	    DNSPERF_DETECT_RECENT * (x - s->recent_failrate);
+	/* a failure the CUSUM has not made up for yet may be the start of
+	 * something, so it waits */
+	if (!s->alarmed[DNSPERF_ALARM_FAILURES] && (!x || !s->fcusum))
+		s->failrate += a * (x - s->failrate);
+	p0 = s->failrate > DNSPERF_DETECT_FAIL_MIN ? s->failrate :
+	    DNSPERF_DETECT_FAIL_MIN;
+	s->fcusum += x - 2 * p0;
+	if (s->fcusum < 0)
+		s->fcusum = 0;
+	dnsperf_detect_judge(d, s, domain, DNSPERF_ALARM_FAILURES, &s->fcusum,
+			     DNSPERF_DETECT_FAIL_H,
+			     s->samples >= DNSPERF_DETECT_WARMUP, tm);
+	if (!ok)
+		return;
+
+	s->win[0][dnsperf_window_bucket(latency)]++;
+	x = log(latency > 1000 ? latency / 1000.0 : 1.0);
+	if (!s->answered++) {
+		s->mean = s->recent = x;
+		return;
+	}
+	{
+		double sigma = sqrt(s->var), z, delta = x - s->mean;
+
+		if (sigma < DNSPERF_DETECT_SIGMA)
+			sigma = DNSPERF_DETECT_SIGMA;
+		z = delta / sigma;
+		if (z > DNSPERF_DETECT_ZMAX)
+			z = DNSPERF_DETECT_ZMAX;
+		else if (z < -DNSPERF_DETECT_ZMAX)
+			z = -DNSPERF_DETECT_ZMAX;
+		s->cusum += z - DNSPERF_DETECT_CUSUM_K;
+		if (s->cusum < 0)
+			s->cusum = 0;
+		s->recent += DNSPERF_DETECT_RECENT * (x - s->recent);
+		if (!s->alarmed[DNSPERF_ALARM_LATENCY]) {
+			a = 1.0 / s->answered > DNSPERF_DETECT_ALPHA ?
+			    1.0 / s->answered : DNSPERF_DETECT_ALPHA;
+			s->mean += a * delta;
+			s->var = (1 - a) * (s->var + a * delta * delta);
+		}
+	}
+	dnsperf_detect_judge(d, s, domain, DNSPERF_ALARM_LATENCY, &s->cusum,
+			     DNSPERF_DETECT_CUSUM_H,
+			     s->answered >= DNSPERF_DETECT_WARMUP, tm);
+}
+
+/* One probe of the worker's shard: the whole domain's series and the
+ * address's; latency in ns, ok unless it got no usable answer */
+void dnsperf_detect_add(struct dnsperf_detect *d, size_t domain, size_t nsid,
+			const char *name, const char *nameserver,
+			const char *address, uint64_t latency, time_t tm,
+			int ok)
+{
+	vector<struct dnsperf_series> *v;
+	struct dnsperf_series *s[2];
+
+	if (domain >= d->domains.size())
+		d->domains.resize(domain + 1);
+	v = &d->domains[domain];
+	s[1] = dnsperf_nsid_entry(v, nsid, dnsperf_series_init);
+	s[0] = &(*v)[0];
+	if (!s[1]->nameserver[0]) {
+		snprintf(s[1]->nameserver, sizeof(s[1]->nameserver), "%s",
+			 nameserver);
+		snprintf(s[1]->address, sizeof(s[1]->address), "%s", address);
+	}
+	for (int i = 0; i < 2; i++)
+		dnsperf_series_add(d, s[i], name, latency, tm, ok);
+}
@@ -0,0 +1,100 @@
+/*
+ * detect.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Change detection on the samples as they come in (-K), per domain and per
+ * nameserver address of the domain, so regressions get noticed without
+ * anyone reading the stats lines or querying the database. Three things are
+ * watched, with alerts (alert.h) when they change and when they are over:
+ *
+ *  - latency: a CUSUM on log(latency), standardized by an EWMA of its mean
+ *    and variance, goes off on a sustained shift up;
+ *  - failures: a CUSUM on the failure rate, against an EWMA of it, goes off
+ *    when queries start failing at more than twice the usual rate;
+ *  - the tail: p99 of a sliding minute (two half-minute histograms of our
+ *    own, coarser than histogram.h's) against an EWMA of earlier minutes,
+ *    twice in a row, as one minute's p99 is only a handful of samples.
+ *
+ * A sample costs a few floating point operations and an increment; the
+ * tail is looked at once per half-minute. While a series is in alarm its
+ * baselines stay put, and after DNSPERF_DETECT_ADOPT seconds of it the new
+ * level becomes the baseline. Each worker watches its own shard.
+ */
+
+#ifndef DNSPERF_DETECT_H
+#define DNSPERF_DETECT_H
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct dnsperf_alerter;
+
+#define DNSPERF_ALARM_LATENCY	0
+#define DNSPERF_ALARM_FAILURES	1
+#define DNSPERF_ALARM_TAIL	2
+#define DNSPERF_ALARMS		3
+
+/* samples before a series may go off */
+#define DNSPERF_DETECT_WARMUP	100
+/* baseline EWMA weight, and that of the level alerts report */
+#define DNSPERF_DETECT_ALPHA	0.01
+#define DNSPERF_DETECT_RECENT	0.1
+/* latency CUSUM: slack and threshold (in sigmas), a single sample's say
+ * and the least sigma there is (5%, in log space) */
+#define DNSPERF_DETECT_CUSUM_K	0.5
+#define DNSPERF_DETECT_CUSUM_H	8.0
+#define DNSPERF_DETECT_ZMAX	3.0
+#define DNSPERF_DETECT_SIGMA	0.05
+/* failure CUSUM: failures beyond twice the usual rate (at least 1%) */
+#define DNSPERF_DETECT_FAIL_MIN	0.01
+#define DNSPERF_DETECT_FAIL_H	5.0
+/* tail: half a window (s), samples a window needs, how far above the
+ * baseline p99 is too far, and that baseline's EWMA weight */
+#define DNSPERF_DETECT_HALF	30
+#define DNSPERF_DETECT_TAIL_MIN	50
+#define DNSPERF_DETECT_TAIL_RATIO 2.0
+#define DNSPERF_DETECT_TAIL_ALPHA 0.2
+/* in alarm this long (s): that's how things are now */
+#define DNSPERF_DETECT_ADOPT	600
+
+/* us, 4 buckets per power of two, up to 2^25 us (~33s) */
+#define DNSPERF_DETECT_BUCKETS	100
+
+struct dnsperf_series {
+	char nameserver[DNSPERF_DOMAIN_MAX];	/* "" for the whole domain */
+	char address[DNSPERF_ADDRESS_MAX];
+	uint64_t samples;		/* answered or not */
+	uint64_t answered;
+	double mean, var;		/* log(latency in us) */
+	double recent;
+	double cusum;
+	double failrate;
+	double recent_failrate;
+	double fcusum;
+	double p99;			/* us, of the windows so far; 0: none */
+	unsigned int windows;		/* that went into it */
+	unsigned int over;		/* windows in a row above it */
+	double last_p99;		/* of the last window */
+	time_t half;			/* start of the current half-window */
+	uint32_t win[2][DNSPERF_DETECT_BUCKETS];	/* current, previous */
+	time_t alarmed[DNSPERF_ALARMS];	/* since when; 0: not */
+};
+
+/* A worker's share, indexed like the domains table, then as
+ * dnsperf_nsid_entry() has it (as in rollup.h); grows as they come */
+struct dnsperf_detect {
+	std::vector<std::vector<struct dnsperf_series> > domains;
+	struct dnsperf_alerter *alerter;
+};
+
+const char *dnsperf_alarm_name(int alarm);
+void dnsperf_detect_init(struct dnsperf_detect *d,
+			 struct dnsperf_alerter *alerter);
+void dnsperf_detect_add(struct dnsperf_detect *d, size_t domain, size_t nsid,
+			const char *name, const char *nameserver,
+			const char *address, uint64_t latency, time_t tm,
+			int ok);
+
+#endif
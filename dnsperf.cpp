@@ -38,7 +38,24 @@
 #include <time.h>
 #include <ldns/ldns.h>
 
-#define VERSION "0x0"
+#include "dnsperf.h"
+#include "alert.h"
+#include "calibrate.h"
+#include "collector.h"
+#include "db.h"
+#include "detect.h"
+#include "domains.h"
+#include "export.h"
+#include "exporter.h"
+#include "journal.h"
+#include "reporter.h"
+#include "rollup.h"
+#include "rng.h"
+#include "sink.h"
+#include "stats.h"
+#include "trace.h"
+#include "transport.h"
+#include "worker.h"
 
 using namespace std;
 
@@ -48,253 +65,6 @@ using namespace std;
 int parse_cmdline(int argc, char **argv);
 void dnsperf_usage(const char * progname);
 void dnsperf_version(void);
-int dnsperf_sanity_check(void);
-
-/* DNS specific */
-unsigned long resolve(const char *domaintoquery, ldns_resolver * actual_res,
-		      char *date);
-ldns_resolver *build_resolver(const char *domainname,
-			      ldns_rr_list ** query_results);
-
-/* Database specific */
-int dnsperf_stats(char *domain);
-int dnsperf_initdb(void);
-int dnsperf_create_stattable(mysqlpp::Connection *conn, const char *tablename);
-int dnsperf_create_domtable(mysqlpp::Connection *conn, const char *tablename);
-int dnsperf_create_valtable(mysqlpp::Connection *conn, const char *tablename);
-int dnsperf_update_valtable(mysqlpp::Connection * conn, const char *domain,
-			    const char *nameserver, unsigned long timevalue, const char *date);
-int dnsperf_get_domains(mysqlpp::Connection * conn,
-			mysqlpp::StoreQueryResult * res_domains);
-
-int dnsperf_check_table(mysqlpp::Connection * conn, const char *tablename,
-			mysqlpp::StoreQueryResult * res);
-
-#define RELDOMLEN 7
-#define HOSTNAME_MAX 50
-/* cmdline options */
-char dnsperf_hostname[HOSTNAME_MAX];
-uint8_t dnsperf_resetdb = 0;
-uint8_t dnsperf_randhost_idx = 0;
-uint8_t dnsperf_verbose = 0;
-uint8_t dnsperf_quiet = 0;
-unsigned long dnsperf_freq = 1;
-
-/* default database info */
-const char *dnsperf_dbhostname = "localhost";
-const char *dnsperf_dbname = "dnsperf_data";
-const char *dnsperf_dbuser = "root";
-const char *dnsperf_dbpass = "";
-const char *dnsperf_valtable = "dnsperf_queries";
-const char *dnsperf_domaintable = "dnsperf_domains";
-const char *dnsperf_stattable = "dnsperf_stats";
-
-#define DNSPERF_DOMAINS 10
-const char *default_domains[] = {
-	"google.com",
-	"facebook.com",
-	"youtube.com",
-	"yahoo.com",
-	"live.com",
-	"wikipedia.org",
-	"baidu.com",
-	"blogger.com",
-	"msn.com",
-	"qq.com"
-};
-
-/* Make sure all database tables exist */
-int dnsperf_sanity_check(void)
-{
-	mysqlpp::Connection conn((bool) false);
-	mysqlpp::StoreQueryResult res;
-	if (!dnsperf_quiet)
-		cout << "Connecting to MYSQL://" << dnsperf_dbuser << "@" <<
-		    dnsperf_dbhostname << endl;
-	if (!conn.connect(0, dnsperf_dbhostname, dnsperf_dbuser,
-			  dnsperf_dbpass)) {
-		cerr << "DB connection failed: " << conn.error() << endl;
-		return 1;
-	}
-	if (!dnsperf_quiet)
-		cout << "Connected, DBMS active." << endl;
-
-	if (dnsperf_resetdb) {
-		/* Reset DB values */
-		if (dnsperf_initdb()) {
-			cout << "Database init failed, exiting" << endl;
-			exit(1);
-		}
-	} else {
-		if (!dnsperf_quiet)
-			cout << "Selecting database: `" << dnsperf_dbname << "`" << endl;
-
-		if (!conn.select_db(dnsperf_dbname)) {
-			cout << "Database " << dnsperf_dbname <<
-			    " does not exist, creating it... " << endl;
-			dnsperf_initdb();
-		}
-	}
-	if (conn.select_db(dnsperf_dbname)) {
-		/* What happens if the table exists but the schema is different ? ;P */
-		if (dnsperf_check_table(&conn, dnsperf_valtable, &res)) {
-			if (dnsperf_create_valtable(&conn, dnsperf_valtable)) {
-				cout << "Unable to create table `" << dnsperf_valtable << endl;
-				return 1;
-			}
-		}
-		if (dnsperf_check_table(&conn, dnsperf_domaintable, &res)) {
-			if (dnsperf_create_domtable(&conn, dnsperf_domaintable)) {
-				cout << "Unable to create table `" << dnsperf_domaintable << endl;
-				return 1;
-			}
-		}
-		if (dnsperf_check_table(&conn, dnsperf_stattable, &res)) {
-			if (dnsperf_create_stattable(&conn, dnsperf_stattable)) {
-				cout << "Unable to create table `" << dnsperf_stattable<< endl;
-				return 1;
-			}
-		}
-	}
-	return 0;
-
-}
-
-/* Make sure a specific database table exists
- * FIXME: have to check the table's schema too. */
-int dnsperf_check_table(mysqlpp::Connection *conn, const char *tablename, mysqlpp::StoreQueryResult *res)
-{
-	mysqlpp::Query query = conn->query();
-
-	if (!dnsperf_quiet)
-		cout << "Checking table:`" << tablename <<
-		    "`" << endl;
-	query<< "select * from %6:table";
-	query.parse();
-	query.template_defaults["table"] = tablename;
-	if (dnsperf_verbose)
-		cout << query << endl;
-	if (!(*res = query.store())) {
-		cerr << "Failed to access table `" <<
-		    tablename << "` " << query.error() << endl;
-		return 1;
-	}
-	return 0;
-}
-
-/* Loop around all domains, query and populate the query log and the stats table */
-int dnsperf_do(mysqlpp::Connection * conn,
-	       mysqlpp::StoreQueryResult * res_domains)
-{
-
-	for (size_t i = 0; i < res_domains->num_rows(); i++) {
-		char *nameserver;
-		ldns_rdf *ns_name;
-		ldns_rr_list *iplist;
-		ldns_resolver *actual_res;
-		unsigned long timevalue;
-		ldns_rr_list *query_results;
-		const char *domain = (*res_domains)[i]["domain"].c_str();
-		unsigned long nr_nameservers;
-		char date[20];
-
-
-		actual_res = build_resolver(domain, &query_results);
-
-		nr_nameservers = ldns_rr_list_rr_count(query_results);
-
-		for (size_t j = 0; j < nr_nameservers; j++) {
-			ldns_resolver *resolver;
-			resolver = ldns_resolver_new();
-			ns_name =
-			    ldns_rr_rdf(ldns_rr_list_rr(query_results, j), 0);
-			iplist =
-			    ldns_get_rr_list_addr_by_name
-			    (actual_res, ns_name, LDNS_RR_CLASS_IN, 0);
-			(void)
-			    ldns_resolver_push_nameserver_rr_list(resolver,
-								  iplist);
-			if (!ns_name) {
-				cout << "NS name is null\n"<< endl;
-				return 1;
-			} else {
-				nameserver = ldns_rdf2str(ns_name);
-			}
-			if (dnsperf_verbose)
-				cout << "Building random domain to query." <<
-				    endl;
-
-			/* construct a random hostname (keeping the relevant domain name) */
-			snprintf(dnsperf_hostname, RELDOMLEN + 1, "foo%d", rand() % 1024);
-			dnsperf_randhost_idx = strlen(dnsperf_hostname);
-			if (dnsperf_verbose)
-				cout << "Relative domain to query is `" <<
-				    dnsperf_hostname << "`" << endl;
-
-			snprintf(dnsperf_hostname + dnsperf_randhost_idx, strlen(domain) + 2, ".%s",
-				domain);
-
-			/* do the actual query and measure time */
-			timevalue = resolve(dnsperf_hostname, resolver, date);
-			if (!timevalue)
-				/* If we fail, then too bad for the domain :-) */
-				continue;
-
-
-			ldns_rr_list_free(iplist);
-			ldns_resolver_deep_free(resolver);
-
-			/* perform the SQL query to update the table that holds query logs */
-			dnsperf_update_valtable(conn, domain, nameserver,
-						timevalue, date);
-			free(nameserver);
-		}
-
-		dnsperf_stats((char *)domain);
-		ldns_rr_list_deep_free(query_results);
-		ldns_resolver_deep_free(actual_res);
-	}
-	return 0;
-}
-
-/* Get the domains to test from the database table. Populate the MySQL result structure */
-int dnsperf_get_domains(mysqlpp::Connection * conn,
-			mysqlpp::StoreQueryResult * res_domains)
-{
-	mysqlpp::Query query_domains = conn->query();
-	if (!dnsperf_quiet)
-		cout << "Database selected." << endl;
-
-	if (!dnsperf_quiet)
-		cout << "Getting domains from table `" << dnsperf_domaintable <<
-		    "`" << endl;
-	query_domains << "select * from %6:table";
-	query_domains.parse();
-	query_domains.template_defaults["table"] = dnsperf_domaintable;
-	if (dnsperf_verbose)
-		cout << query_domains << endl;
-	*res_domains = query_domains.store();
-
-	if (!(*res_domains)) {
-		cerr << "Failed to get domains from `" <<
-		    dnsperf_domaintable << "` " << query_domains.error() <<
-		    endl;
-		return 1;
-	}
-	if (dnsperf_verbose) {
-		cout.setf(ios::left);
-		cout <<
-		    setw(10) << "Rank" << setw(10) << "Domain" << endl << endl;
-
-		for (size_t i = 0; i < res_domains->num_rows(); ++i) {
-			cout << setw(5) <<
-			    (*res_domains)[i]["rank"] << ' ' <<
-			    setw(30) << (*res_domains)[i]["domain"]
-			    << ' ' << endl;
-		}
-	}
-	return 0;
-}
 
 int main(int argc, char *argv[])
 {
@@ -305,499 +75,181 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* Connect to the database */
-	mysqlpp::Connection conn((bool) false);
-	if (!dnsperf_quiet)
-		cout << "Connecting to MYSQL://" << dnsperf_dbuser << "@" <<
-		    dnsperf_dbhostname << endl;
-	if (!conn.connect(0, dnsperf_dbhostname, dnsperf_dbuser,
-			  dnsperf_dbpass)) {
-		cerr << "DB connection failed: " << conn.error() << endl;
-		return 1;
+	if (dnsperf_calibrate_only || dnsperf_subtract) {
+		if (dnsperf_calibrate(&dnsperf_baseline))
+			return 1;
+		if (dnsperf_calibrate_only)
+			return 0;
+		cout << "Subtracting " << dnsperf_baseline / 1000.0 <<
+		    " us from every sample" << endl;
 	}
-	if (!dnsperf_quiet)
-		cout << "Connected." << endl;
 
-	if (!dnsperf_quiet)
-		cout << "Selecting database: `" << dnsperf_dbname << "`" << endl;
-	if (!conn.select_db(dnsperf_dbname)) {
-		cout << "Database " << dnsperf_dbname <<
-		    " does not exist, creating it... " << endl;
-		if (dnsperf_initdb()) {
-			cout << "Unable to initialize database" << endl;
+	/* One connection for all of the start up: the checks, the domains
+	 * and the stats. Agents have no database. */
+	mysqlpp::Connection *conn = NULL;
+	if (!dnsperf_agent) {
+		if (!dnsperf_quiet)
+			cout << "Connecting to MYSQL://" << dnsperf_dbuser <<
+			    "@" << dnsperf_dbhostname << endl;
+		if (!(conn = dnsperf_db_grab()))
 			return 1;
+		if (!dnsperf_quiet)
+			cout << "Connected, DBMS active." << endl;
+		if (dnsperf_sanity_check(conn))
+			exit(1);
+		/* export: no probing, and the log is all it needs */
+		if (dnsperf_exportfile) {
+			int ret = dnsperf_export(conn, dnsperf_exportfile);
+
+			dnsperf_db_release(conn);
+			return ret;
 		}
 	}
 
-	if (conn.select_db(dnsperf_dbname)) {
-		int iter = 0;
-		mysqlpp::StoreQueryResult res_domains;
-
-		/* Domains are stored on the mysql result structure */
-		if (dnsperf_get_domains(&conn, &res_domains)) {
+	if (!conn || conn->select_db(dnsperf_dbname)) {
+		static struct dnsperf_domains domains;
+		static struct dnsperf_topology topo;
+		static struct dnsperf_writer writer;
+		static struct dnsperf_sink sink;
+		static struct dnsperf_journal journal;
+		static struct dnsperf_exporter exporter;
+		static struct dnsperf_collector collector;
+		static struct dnsperf_alerter alerter;
+		static struct dnsperf_reporter reporter;
+		struct dnsperf_worker *workers;
+
+		/* before any thread starts, see there */
+		dnsperf_domains_init(&domains, dnsperf_domainfile);
+		dnsperf_trace_init(dnsperf_tracefile);
+		/* the domains table takes its connection from the pool, so
+		 * give ours back for it to take */
+		if (conn)
+			dnsperf_db_release(conn);
+		if (dnsperf_domains_load(&domains)) {
 			cout << "Unable to get domains" << endl;
 			return 1;
 		}
-		cout << "Starting to loop..." << endl;
-		while (1) {
-			/* We pass the result structure to the function
-			 * that does the actual work */
-			if (dnsperf_do(&conn, &res_domains)) {
-				cout << "Failed" << endl;
-				return 1;
-			}
-#if 0
-			if (dnsperf_verbose) {
-				dnsperf_dump_valtable(&conn);
-			}
-#endif
-			cout << "Iteration " << ++iter << " done, sleeping for "
-			    << dnsperf_freq << "ms. " << endl;
-			usleep(dnsperf_freq * 1000);
-		}
-	}
-
-	return 0;
-}
-
-/* Get all namservers for a domain, and populate an LDNS list */
-ldns_resolver *build_resolver(const char *domainname,
-			      ldns_rr_list ** query_results)
-{
-	ldns_resolver *res;
-	ldns_rdf *domain;
-	ldns_pkt *p;
-	ldns_status s;
-
-	p = NULL;
-	*query_results = NULL;
-	res = NULL;
-
-	domain = ldns_dname_new_frm_str(domainname);
-	if (!domain) {
-		cout << "failed to build domain to query for NS" << endl;
-		exit(EXIT_FAILURE);
-	}
-
-	/* create a new resolver from /etc/resolv.conf
-	 * to get the domain's nameservers */
-	s = ldns_resolver_new_frm_file(&res, NULL);
-
-	if (s != LDNS_STATUS_OK) {
-		cout << "failed to build resolver from file" << endl;
-		exit(EXIT_FAILURE);
-	}
-
-	p = ldns_resolver_query(res,
-				domain,
-				LDNS_RR_TYPE_NS, LDNS_RR_CLASS_IN, LDNS_RD);
-
-	ldns_rdf_deep_free(domain);
-
-	if (!p) {
-		cout << "failed to query for nameservers" << endl;
-		exit(EXIT_FAILURE);
-	} else {
-		*query_results = ldns_pkt_rr_list_by_type(p,
-							  LDNS_RR_TYPE_NS,
-							  LDNS_SECTION_ANSWER);
-		if (!(*query_results)) {
-			cout << "Cannot find ns for " << domainname << endl;
-		}
-
-	}
-	ldns_pkt_free(p);
-	return res;
-}
-
-/* Do the actual query, using a resolver */
-unsigned long resolve(const char *domaintoquery, ldns_resolver * actual_res, char *date)
-{
-	ldns_rdf *domaintoq;
-	ldns_pkt *p;
-	ldns_rr_list *query_results;
-	timeval t1, t2;
-	unsigned long us1;
-	time_t tm;
-	struct tm *tm_local;
-
-	p = NULL;
-	query_results = NULL;
-
-	domaintoq = ldns_dname_new_frm_str(domaintoquery);
-	if (!domaintoq) {
-		cout << "failed to build domain to query" << endl;
-		exit(EXIT_FAILURE);
-	}
-
-	if (dnsperf_verbose)
-		cout << "querying for `" << domaintoquery << "`" << endl;
-
-	tm = time(NULL);
-	gettimeofday(&t1, NULL);
-	p = ldns_resolver_query(actual_res,
-				domaintoq,
-				LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, LDNS_RD);
-	gettimeofday(&t2, NULL);
-
-	/* build the timestamp in a MySQL format */
-	tm_local = localtime(&tm);
-	strftime(date, 20, "%Y-%m-%d %X", tm_local);
-
-
-	ldns_rdf_deep_free(domaintoq);
-
-	if (!p) {
-		cout << "failed to query for `" << domaintoquery << "`" << endl;
-		/* No need to fail, we just got a timeout or something */
-		return 0;
-	} else {
-		query_results = ldns_pkt_rr_list_by_type(p,
-							 LDNS_RR_TYPE_A,
-							 LDNS_SECTION_ANSWER);
-#if 0
-		if (!query_results) {
-			cout << "Cannot resolve " << domaintoquery << endl;
+		if (conn && !(conn = dnsperf_db_grab()))
+			return 1;
+		/* Pick up where the last run left the stats */
+		if (conn && (dnsperf_stats_load(conn, &domains) ||
+			     dnsperf_hists_load(conn, &domains))) {
+			cout << "Unable to load stats" << endl;
+			return 1;
 		}
-#endif
-		us1 = t2.tv_sec * 1000000 + (t2.tv_usec) -
-		    (t1.tv_sec * 1000000 + (t1.tv_usec));
-
-	}
-	ldns_pkt_free(p);
-	ldns_rr_list_deep_free(query_results);
-
-	return us1;
-}
-
-/* Populate query logs to the database */
-int dnsperf_update_valtable(mysqlpp::Connection * conn, const char* domain, const char*nameserver, unsigned long timevalue, const char *date)
-{
-	try {
-		mysqlpp::Query query = conn->query();
-		if (dnsperf_verbose)
-			cout <<
-			    "Updating mysql table "
-			    << dnsperf_valtable << " ..." << endl;
-
-		query <<
-		    "insert into %6:table values "
-		    << "(%0q, %1q, %2q, %3q) ";
-		query.parse();
-
-		query.template_defaults["table"]
-		    = dnsperf_valtable;
-
-		if (dnsperf_verbose)
-			cout << "Populating " <<
-			    dnsperf_valtable << " table..." << flush;
-		query.execute(domain, timevalue, date, nameserver);
+		/* replay: the aggregates as of now, plus the file's */
+		if (dnsperf_replayfile) {
+			int ret = dnsperf_replay(conn, &domains,
+						 dnsperf_replayfile);
 
-		if (dnsperf_verbose) {
-			cout << "inserted " << 1 << " row." << endl;
-			cout << dnsperf_hostname
-			    << " " << domain <<
-			    " " << timevalue <<
-			    " " << date << " " << nameserver << endl;
+			dnsperf_db_release(conn);
+			return ret;
 		}
-	}
-	catch(const mysqlpp::BadQuery & er) {
-		cerr << endl << "Query error: " << er.what() << endl;
-		return 1;
-	}
-	catch(const mysqlpp::BadConversion & er) {
-		cerr << endl <<
-		    "Conversion error: " <<
-		    er.what() << endl <<
-		    "\tretrieved data size: " <<
-		    er.retrieved << ", actual size: " << er.actual_size << endl;
-		return 1;
-	}
-	catch(const mysqlpp::Exception & er) {
-		cerr << endl << "Error: " << er.what() << endl;
-		return 1;
-	}
-
-	return 0;
-}
-
-/* Generate stats (using MySQL macros) and populate the stats table */
-int dnsperf_stats(char *domain)
-{
-
-	/* Connect to the database */
-	mysqlpp::Connection conn((bool) false);
-	if (dnsperf_verbose)
-		cout << "Connecting to MYSQL://" << dnsperf_dbuser << "@" <<
-		    dnsperf_dbhostname << "/" << dnsperf_dbname << endl;
-	if (conn.connect(dnsperf_dbname, dnsperf_dbhostname, dnsperf_dbuser,
-			 dnsperf_dbpass)) {
-
-		/* Check that the domain has answered at least one of our queries */
-		mysqlpp::Query query_check = conn.query();
-		query_check << "select *" <<
-		    " from " << dnsperf_valtable <<
-		    " where domain='" << domain << "';";
-		mysqlpp::StoreQueryResult res_check = query_check.store();
-		if (!res_check.num_rows()){
+		if (conn)
+			dnsperf_db_release(conn);
+		if (dnsperf_topology_init(&topo, &domains) ||
+		    dnsperf_topology_start(&topo)) {
+			cout << "Unable to resolve nameservers" << endl;
 			return 1;
 		}
-
-		/* Use mysql to calculate avg and stddev */
-		mysqlpp::Query query = conn.query();
-		query << "select " <<
-		    "domain," <<
-		    "avg(latency)," <<
-		    "stddev(latency)," <<
-		    "count(latency)," <<
-		    "min(timestamp)," <<
-		    "max(timestamp) " <<
-		    " from " << dnsperf_valtable <<
-		    " where domain='" << domain << "';";
-
-		if (dnsperf_verbose)
-			cout << query << endl;
-		mysqlpp::StoreQueryResult res = query.store();
-
-		if (res) {
-			double avg;
-			double stddev;
-			uint32_t count;
-			char timestamp_first[20], timestamp_last[20];
-
-			avg = res[0]["avg(latency)"];
-			stddev = res[0]["stddev(latency)"];
-			count = res[0]["count(latency)"];
-			snprintf(timestamp_first, strlen(res[0]["min(timestamp)"]) + 1 , res[0]["min(timestamp)"]);
-			snprintf(timestamp_last, strlen(res[0]["max(timestamp)"]) + 1, res[0]["max(timestamp)"]);
-			if (!dnsperf_quiet) {
-				cout << "domain: " << domain << " "
-				    << "count: " << count << " queries, "
-				    << "Avg: " << avg / 1000.0 << " ms, "
-				    << "Stddev: " << stddev / 1000.0 << " ms, "
-				    << "first query: " << timestamp_first <<
-				    ", " << "last query: " << timestamp_last <<
-				    endl;
-			}
-
-			query = conn.query();
-			query << "update " <<
-			    dnsperf_stattable <<
-			    " set average = " << avg <<
-			    ", stddev = " << stddev <<
-			    ", count = " << count <<
-			    ", first = '" << timestamp_first <<
-			    "', last = '" << timestamp_last <<
-			    "' where domain='" << domain << "';";
-
-			if (dnsperf_verbose)
-				cout << query << endl;
-			mysqlpp::StoreQueryResult res_stats = query.store();
-			if (res_stats) {
-				cerr << "Failed to update " << dnsperf_stattable
-				    << " table: " << query.error() << endl;
-				/* FIXME: how critical is this ? Should we fail ? */
-				return 1;
-			}
-		} else {
-			cerr << "Failed to get " << dnsperf_valtable <<
-			    " table: " << query.error() << endl;
+		if (dnsperf_journaldir &&
+		    dnsperf_journal_open(&journal, dnsperf_journaldir,
+					 (uint64_t)dnsperf_journal_max << 20,
+					 dnsperf_journal_rate))
+			return 1;
+		writer.trace = dnsperf_trace_slot("writer");
+		if (dnsperf_sink_open(&sink, dnsperf_sinkspec) ||
+		    dnsperf_writer_start(&writer, &sink, dnsperf_journaldir ?
+					 &journal : NULL, dnsperf_workers +
+					 (dnsperf_collect ? 1 : 0),
+					 dnsperf_policy, dnsperf_batch,
+					 dnsperf_flush)) {
+			cout << "Unable to start the query log writer" << endl;
 			return 1;
 		}
-	}
-
-	return 0;
-}
-
-/* Database init functions */
-int dnsperf_create_stattable(mysqlpp::Connection *conn, const char *tablename)
-{
-
-	try {
-		if (!dnsperf_quiet)
-			cout << "Creating " << tablename << " table..." << endl;
-		mysqlpp::Query query = conn->query();
-		query<<
-		    "CREATE TABLE " << tablename << " (" <<
-		    "  domain CHAR(80) NOT NULL, " <<
-		    "  average DOUBLE NULL, " <<
-		    "  stddev DOUBLE NULL, " <<
-		    "  count BIGINT NULL, " <<
-		    "  first DATETIME NULL, " <<
-		    "  last DATETIME NULL ) " <<
-		    "ENGINE = InnoDB " <<
-		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
-		query.execute();
-
-		query<< "insert into %6:table values " <<
-		    "(%0q, %1q, %2q, %3q, %4q, %5q)";
-		query.parse();
-
-		query.template_defaults["table"] = tablename;
-
-		for (size_t i = 0; i < DNSPERF_DOMAINS; ++i)
-			query.execute(default_domains[i], 0, 0, 0, 0, 0);
-	}
-	catch(const mysqlpp::BadQuery & er) {
-		cerr << endl << "Query error: " << er.what() << endl;
-		return 1;
-	}
-	catch(const mysqlpp::BadConversion & er) {
-		cerr << endl << "Conversion error: " << er.what() << endl <<
-		    "\tretrieved data size: " << er.retrieved <<
-		    ", actual size: " << er.actual_size << endl;
-		return 1;
-	}
-	catch(const mysqlpp::Exception & er) {
-		cerr << endl << "Error: " << er.what() << endl;
-		return 1;
-	}
-	return 0;
-}
-
-int dnsperf_create_domtable(mysqlpp::Connection * conn, const char *tablename)
-{
-	try {
-		mysqlpp::Query query = conn->query();
-
-		if (!dnsperf_quiet)
-			cout << "Creating " << tablename << " table..." << endl;
-		query << "CREATE TABLE " << tablename << " (" <<
-		    "  rank INT NOT NULL, " <<
-		    "  domain CHAR(80) NOT NULL) " <<
-		    "ENGINE = InnoDB " <<
-		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
-		query.execute();
-
-		if (dnsperf_verbose)
-			cout << "Populating the " << tablename <<
-			    " table ..." << endl;
-		query << "insert into %6:table values " <<
-		    "(%0q, %1q )";
-		query.parse();
-
-		query.template_defaults["table"] = tablename;
-
-		for (size_t i = 1; i <= DNSPERF_DOMAINS; ++i)
-			query.execute(i, default_domains[i - 1]);
-	}
-	catch(const mysqlpp::BadQuery & er) {
-		cerr << endl << "Query error: " << er.what() << endl;
-		return 1;
-	}
-	catch(const mysqlpp::BadConversion & er) {
-		cerr << endl << "Conversion error: " << er.what() << endl <<
-		    "\tretrieved data size: " << er.retrieved <<
-		    ", actual size: " << er.actual_size << endl;
-		return 1;
-	}
-	catch(const mysqlpp::Exception & er) {
-		cerr << endl << "Error: " << er.what() << endl;
-		return 1;
-	}
-	return 0;
-}
-
-int dnsperf_create_valtable(mysqlpp::Connection *conn, const char *tablename)
-{
-	try {
-		if (!dnsperf_quiet)
-			cout << "Creating " << tablename << " table..." << endl;
-		mysqlpp::Query query = conn->query();
-		query <<
-		    "CREATE TABLE " << tablename << " (" <<
-		    "  domain CHAR(80) NOT NULL, " <<
-		    "  latency BIGINT NOT NULL, " <<
-		    "  timestamp DATETIME NOT NULL, " <<
-		    "  nameserver CHAR(80) NOT NULL) " <<
-		    "ENGINE = InnoDB " <<
-		    "CHARACTER SET utf8 COLLATE utf8_general_ci";
-		query.execute();
-
-	}
-	catch(const mysqlpp::BadQuery & er) {
-		cerr << endl << "Query error: " << er.what() << endl;
-		return 1;
-	}
-	catch(const mysqlpp::BadConversion & er) {
-		cerr << endl << "Conversion error: " << er.what() << endl <<
-		    "\tretrieved data size: " << er.retrieved <<
-		    ", actual size: " << er.actual_size << endl;
-		return 1;
-	}
-	catch(const mysqlpp::Exception & er) {
-		cerr << endl << "Error: " << er.what() << endl;
-		return 1;
-	}
-	return 0;
-
-}
-
-int dnsperf_initdb(void)
-{
-	mysqlpp::Connection con;
-	try {
-		con.connect(0, dnsperf_dbhostname, dnsperf_dbuser,
-			    dnsperf_dbpass);
-	}
-	catch(exception & er) {
-		cerr << "Connection failed: " << er.what() << endl;
-		return 1;
-	}
-
-	bool new_db = false;
-
-	mysqlpp::NoExceptions ne(con);
-	mysqlpp::Query query = con.query();
-
-	if (con.select_db(dnsperf_dbname)) {
-		cout << "Dropping existing tables..." << endl;
-		query << "drop table " << dnsperf_valtable;
-		query.exec();
-		query << "drop table " << dnsperf_domaintable;
-		query.exec();
-		query << "drop table " << dnsperf_stattable;
-		query.exec();
-	} else {
-		// Database doesn't exist yet, so create and select it.
-		if (con.create_db(dnsperf_dbname) &&
-		    con.select_db(dnsperf_dbname)) {
-			new_db = true;
-		} else {
-			cerr << "Error creating DB: " << con.error() <<
-			    endl;
+		/* the agents get the writer slot after the workers' */
+		if (dnsperf_collect &&
+		    dnsperf_collector_start(&collector, dnsperf_collect,
+					    &writer, dnsperf_workers))
+			return 1;
+		if (!dnsperf_agent &&
+		    (dnsperf_retention || dnsperf_partition) &&
+		    dnsperf_retention_start(dnsperf_retention))
+			return 1;
+		if (dnsperf_metrics &&
+		    dnsperf_exporter_init(&exporter, dnsperf_metrics, &domains))
+			return 1;
+		if (dnsperf_alert && dnsperf_alerter_start(&alerter, dnsperf_alert))
+			return 1;
+		if (!dnsperf_agent && dnsperf_reporter_start(&reporter, &domains))
 			return 1;
+		cout << "Starting to loop..." << endl;
+		workers = new struct dnsperf_worker[dnsperf_workers];
+		for (unsigned int i = 0; i < dnsperf_workers; i++) {
+			char name[DNSPERF_TRACE_NAME];
+
+			workers[i].id = i;
+			workers[i].nr_workers = dnsperf_workers;
+			workers[i].seed = rand();
+			dnsperf_rng_seed(&workers[i].rng, ((uint64_t)rand() << 32) ^
+					 rand() ^ ((uint64_t)time(NULL) << 16));
+			workers[i].probes_sent = 0;
+			for (int k = 0; k < DNSPERF_OUTCOMES; k++)
+				workers[i].outcomes[k] = 0;
+			workers[i].iter = 0;
+			workers[i].domains = &domains;
+			workers[i].topo = &topo;
+			workers[i].writer = &writer;
+			workers[i].exporter = dnsperf_metrics ? &exporter : NULL;
+			workers[i].reporter = dnsperf_agent ? NULL : &reporter;
+			snprintf(name, sizeof(name), "worker %u", i);
+			workers[i].trace = dnsperf_trace_slot(name);
+			dnsperf_rollup_init(&workers[i].rollup);
+			dnsperf_detect_init(&workers[i].detect, dnsperf_alert ?
+					    &alerter : NULL);
+			if (dnsperf_worker_start(&workers[i]))
+				return 1;
 		}
-	}
-
-	cout << (new_db ? "Created" : "Reinitialized") <<
-		    " database successfully." << endl;
-
-	if (dnsperf_create_valtable(&con, dnsperf_valtable)) {
-		cout << "Unable to create table `" << dnsperf_valtable << endl;
-		exit(1);
-	}
-	if (dnsperf_create_domtable(&con, dnsperf_domaintable)) {
-		cout << "Unable to create table `" << dnsperf_domaintable << endl;
-		exit(1);
-	}
-	if (dnsperf_create_stattable(&con, dnsperf_stattable)) {
-		cout << "Unable to create table `" << dnsperf_stattable<< endl;
-		exit(1);
+		if (dnsperf_metrics &&
+		    dnsperf_exporter_start(&exporter, workers, dnsperf_workers,
+					   &writer))
+			return 1;
+		if (dnsperf_domains_start(&domains) || dnsperf_trace_start())
+			return 1;
+		/* the workers run forever, or exit() on failure */
+		for (unsigned int i = 0; i < dnsperf_workers; i++)
+			pthread_join(workers[i].thread, NULL);
 	}
 
 	return 0;
 }
 
-/* Various helper functions */
 int parse_cmdline(int argc, char **argv)
 {
+	static const struct option longopts[] = {
+		{ "calibrate", no_argument, NULL, 'C' },
+		{ "subtract-baseline", no_argument, NULL, 'Z' },
+		{ "export", required_argument, NULL, 'E' },
+		{ "replay", required_argument, NULL, 'W' },
+		{ "alert", required_argument, NULL, 'K' },
+		{ NULL, 0, NULL, 0 }
+	};
 	int c;
 
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "qVhvru:p:m:c:t:d:s:f:")) != -1)
+	while ((c = getopt_long(argc, argv, "qVhvru:p:m:c:t:d:D:s:f:n:w:b:B:F:j:T:l:R:o:L:gCZx:X:K:U:k:Pa:N:e:S:H:46J:E:W:G:Y:I:M:A:",
+				longopts, NULL)) != -1)
 		switch (c) {
+		case 'C':
+			dnsperf_calibrate_only = 1;
+			break;
+		case 'Z':
+			dnsperf_subtract = 1;
+			break;
+		case 'x':
+			dnsperf_metrics = strdup(optarg);
+			break;
 		case 'q':
 			dnsperf_quiet = 1;
 			break;
@@ -810,6 +262,113 @@ int parse_cmdline(int argc, char **argv)
 		case 'v':
 			dnsperf_verbose = 1;
 			break;
+		case 'n':
+			dnsperf_inflight = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			dnsperf_ns_inflight = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			dnsperf_ns_rate = strtod(optarg, NULL);
+			break;
+		case 'A':
+			dnsperf_aimd = strtod(optarg, NULL);
+			if (dnsperf_aimd < 0 || dnsperf_aimd >= 100) {
+				cout << "-A takes a percentage, 0 to 100" <<
+				    endl;
+				dnsperf_usage(argv[0]);
+			}
+			break;
+		case 'w':
+			dnsperf_timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			dnsperf_policy = dnsperf_parse_policy(optarg);
+			if (dnsperf_policy < 0) {
+				cout << "Unknown policy `" << optarg << "`" << endl;
+				dnsperf_usage(argv[0]);
+			}
+			break;
+		case 'o':
+			dnsperf_sinkspec = strdup(optarg);
+			break;
+		case 'J':
+			dnsperf_journaldir = strdup(optarg);
+			break;
+		case 'G':
+			dnsperf_journal_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'Y':
+			dnsperf_journal_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			dnsperf_batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			dnsperf_flush = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			dnsperf_label_len = strtoul(optarg, NULL, 0);
+			if (dnsperf_label_len < 1 ||
+			    dnsperf_label_len > DNSPERF_LABEL_MAX) {
+				cout << "Labels are 1 to " << DNSPERF_LABEL_MAX <<
+				    " characters long" << endl;
+				dnsperf_usage(argv[0]);
+			}
+			break;
+		case 'g':
+			dnsperf_label_tagged = 1;
+			break;
+		case 'R':
+			dnsperf_rate = strtod(optarg, NULL);
+			if (dnsperf_rate < 0)
+				dnsperf_rate = 0;
+			break;
+		case 'T':
+			dnsperf_clock = dnsperf_parse_clock(optarg);
+			if (dnsperf_clock < 0) {
+				cout << "Unknown clock `" << optarg << "`" << endl;
+				dnsperf_usage(argv[0]);
+			}
+			break;
+		case 'e':
+			dnsperf_transport = dnsperf_parse_transport(optarg,
+						&dnsperf_transport_port);
+			if (dnsperf_transport < 0) {
+				cout << "Unknown transport `" << optarg << "`" <<
+				    endl;
+				dnsperf_usage(argv[0]);
+			}
+			break;
+		case 'S':
+			dnsperf_servers = strdup(optarg);
+			break;
+		case 'H':
+			dnsperf_topofile = strdup(optarg);
+			break;
+		case 'X':
+			dnsperf_tracefile = strdup(optarg);
+			break;
+		case 'K':
+			dnsperf_alert = strdup(optarg);
+			break;
+		case 'E':
+			dnsperf_exportfile = strdup(optarg);
+			break;
+		case 'W':
+			dnsperf_replayfile = strdup(optarg);
+			break;
+		case '4':
+			dnsperf_family = 4;
+			break;
+		case '6':
+			dnsperf_family = 6;
+			break;
+		case 'j':
+			dnsperf_workers = strtoul(optarg, NULL, 0);
+			if (!dnsperf_workers)
+				dnsperf_workers = 1;
+			break;
 		case 'r':
 			dnsperf_resetdb = 1;
 			break;
@@ -822,6 +381,27 @@ int parse_cmdline(int argc, char **argv)
 		case 's':
 			dnsperf_stattable = strdup(optarg);
 			break;
+		case 'l':
+			dnsperf_histtable = strdup(optarg);
+			break;
+		case 'U':
+			dnsperf_rolluptable = strdup(optarg);
+			break;
+		case 'k':
+			dnsperf_retention = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			dnsperf_partition = 1;
+			break;
+		case 'D':
+			dnsperf_domainfile = strdup(optarg);
+			break;
+		case 'a':
+			dnsperf_collect = strdup(optarg);
+			break;
+		case 'N':
+			dnsperf_vantage = strdup(optarg);
+			break;
 		case 'm':
 			dnsperf_dbname = strdup(optarg);
 			break;
@@ -845,7 +425,26 @@ int parse_cmdline(int argc, char **argv)
 			abort();
 		}
 
-	return dnsperf_sanity_check();
+	/* the loopback responder only speaks UDP, and a UDP floor is not the
+	 * floor under a stream */
+	if ((dnsperf_calibrate_only || dnsperf_subtract) &&
+	    dnsperf_transport != DNSPERF_TRANSPORT_UDP) {
+		cout << "Calibrating (-C, -Z) only works with -e udp" << endl;
+		return 1;
+	}
+	/* calibrating needs nothing but the loopback */
+	if (dnsperf_calibrate_only)
+		return 0;
+	/* and agents nothing but their collector; main() sees to the
+	 * database of the rest */
+	dnsperf_agent = !strncmp(dnsperf_sinkspec, "collector", 9);
+	if (dnsperf_agent && (!dnsperf_domainfile || dnsperf_collect ||
+			      dnsperf_exportfile || dnsperf_replayfile)) {
+		cout << "Agents take their domains from -D <file>, " <<
+		    "and can't be collectors (or export and replay)" << endl;
+		return 1;
+	}
+	return 0;
 }
 
 void dnsperf_version(void)
@@ -856,18 +455,77 @@ void dnsperf_version(void)
 void dnsperf_usage(const char * progname)
 {
 	printf("%s <options> \n", progname);
-	printf("options: [-h] | [-V] | [-v] [-f <ms>] [-r] [-u <dbuser>] [-p <dbpass] \n"
-	       "         [-c <dbhostname>] [-m <dbname>] [-t <logtable>] [-d <domaintable>] [-s <stattable>]\n\n");
+	printf("options: [-h] | [-V] | [-v] [-f <ms> | -R <qps>] [-n <queries>] [-I <queries>] [-M <qps>] [-A <percent>] [-w <ms>] [-T <clock>] [-e <transport>] [-S <servers>] [-H <file>] [-4 | -6] [-L <len>] [-g] [-C] [-Z] [-x <[addr:]port>] [-X <file>] [-K <alerts>] [-j <threads>] [-r] [-u <dbuser>] [-p <dbpass] \n"
+	       "         [-o <sink>] [-B <rows>] [-F <ms>] [-b <policy>] [-J <dir>] [-G <MB>] [-Y <rows/s>] [-c <dbhostname>] [-m <dbname>] [-t <logtable>] [-d <domaintable> | -D <file>] [-s <stattable>] [-l <latencytable>]\n"
+	       "         [-U <rollupprefix>] [-k <days>] [-P] [-a <[addr:]port>] [-N <name>]\n"
+	       "         [-E <file> | -W <file>]\n\n");
 
 	printf("  -h			  print this help and exit\n");
 	printf("  -V			  print version and exit\n\n");
 
 	printf("  -q			  supress stat output\n");
 	printf("  -v			  verbose output\n");
-	printf("  -f <time>		  time to wait after each loop (in ms)\n\n");
+	printf("  -f <time>		  time to wait after each loop (in ms)\n");
+	printf("  -R <qps>		  open loop: query every nameserver this many times per\n"
+	       "                            second, whatever the answers take (-f is ignored)\n");
+	printf("  -n <queries>		  max queries in flight (default: 64)\n");
+	printf("  -I <queries>		  max queries in flight to one nameserver address\n"
+	       "                            (default: 0, only -n)\n");
+	printf("  -M <qps>		  max queries a second to one nameserver address\n"
+	       "                            (default: 0, no limit)\n");
+	printf("  -A <percent>		  adapt: halve the queries in flight (to an address,\n"
+	       "                            and in all) when more than this many time out\n"
+	       "                            (default: 0, off)\n");
+	printf("  -w <time>		  time to wait for an answer (in ms, default: 5000)\n");
+	printf("  -T <clock>		  how to time queries: wall (gettimeofday), mono\n"
+	       "                            (CLOCK_MONOTONIC, default) or kernel (socket\n"
+	       "                            receive timestamps)\n");
+	printf("  -e <transport>[:port]	  what queries go over: udp (default), tcp, tls\n"
+	       "                            (port 853) or https (HTTP/2, port 443, %s);\n"
+	       "                            one connection per server, kept open\n",
+	       DNSPERF_DOH_PATH);
+	printf("  -S <server>[,...]	  query these (names or addresses, say resolvers)\n"
+	       "                            for every domain, not the domains' nameservers\n");
+	printf("  -H <file>		  keep the nameservers and addresses found in this file,\n"
+	       "                            and start probing from it (default: off)\n");
+	printf("  -4, -6		  only look up (and query) the IPv4 or the IPv6\n"
+	       "                            addresses of nameservers (default: both)\n");
+	printf("  -L <len>		  length of the random label put in front of every\n"
+	       "                            domain (base32, 1-63, default: 12)\n");
+	printf("  -g			  tag labels: the first %d characters say which worker\n"
+	       "                            sent the query, and its number (needs -L %d or more)\n",
+	       DNSPERF_TAG_LEN, DNSPERF_TAG_LEN);
+	printf("  -C, --calibrate	  measure our own latency floor and jitter against a\n"
+	       "                            responder on 127.0.0.1, print them and exit\n");
+	printf("  -Z, --subtract-baseline calibrate first, then take the floor off every\n"
+	       "                            sample before it is stored (-e udp only)\n");
+	printf("  -x <[addr:]port>	  serve Prometheus metrics over HTTP at /metrics,\n"
+	       "                            from memory (default: off)\n");
+	printf("  -X <file>		  time every stage of the probe path, per thread, and\n"
+	       "                            dump it to this file on SIGUSR1 (default: off)\n");
+	printf("  -K, --alert <target>	  watch latency, its tail and failures for changes and\n"
+	       "                            alert: log, syslog or http://host[:port]/path\n"
+	       "                            (a JSON POST; default: off)\n");
+	printf("  -j <threads>		  probe worker threads, each one taking a share of\n"
+	       "                            the domains (default: 1)\n\n");
 
 	printf("  Database Specific (MySQL)\n");
 	printf("  -r			  re-initialize database (WARNING: all existing data will be lost)\n");
+	printf("  -o <sink>		  where the query log goes: mysql (the log table, default),\n"
+	       "                            file:<path> (local columnar sample file) or\n"
+	       "                            collector:<host>[:port] (be an agent of a collector\n"
+	       "                            -a, with no database; needs -D)\n");
+	printf("  -B <rows>		  rows per query log batch (default: 500)\n");
+	printf("  -F <time>		  max time a sample waits to be written (in ms, default: 1000)\n");
+	printf("  -b <policy>		  what to do when the DB can't keep up: drop, block or spill\n"
+	       "                            (spill keeps up to 1M samples a worker in memory,\n"
+	       "                            then drops; default: drop)\n");
+	printf("  -J <dir>		  spill journal: keep what the sink can't take in files\n"
+	       "                            here, and replay them when it can (default: off)\n");
+	printf("  -G <MB>		  max size of the spill journal, after which -b\n"
+	       "                            applies (default: 1024)\n");
+	printf("  -Y <rows/s>		  max rate at which the journal is replayed\n"
+	       "                            (default: 0, as fast as the sink takes them)\n");
 	printf("  -u <user>		  user to connect to database (default: root)\n");
 	printf("  -p <pass>		  pass to connect to database (default: <empty>)\n");
 	printf("  -c <hostname>		  hostname that MySQL is running (default: localhost)\n");
@@ -875,42 +533,26 @@ void dnsperf_usage(const char * progname)
 	       "                            if it doesn't exist, we create it, implies -r\n");
 	printf("  -t <table>		  table name for logging queries (default: dnsperf_queries)\n");
 	printf("  -d <table>		  table name for top level domains (default: dnsperf_domains)\n");
-	printf("  -s <table>		  table name for stats (default: dnsperf_stattable)\n\n");
+	printf("  -D <file>		  read the domains from this file instead, one per line\n"
+	       "                            or rank,domain (reloaded on SIGHUP or when it changes)\n");
+	printf("  -s <table>		  table name for stats (default: dnsperf_stattable)\n");
+	printf("  -l <table>		  table name for latency percentiles (default: dnsperf_latency)\n");
+	printf("  -U <prefix>		  prefix of the per-minute, hour and day rollup tables\n"
+	       "                            (default: dnsperf_rollup, as in dnsperf_rollup_1m)\n");
+	printf("  -k <days>		  prune queries older than this from the query log\n"
+	       "                            (default: 0, keep everything)\n");
+	printf("  -P			  partition the query log by day; with -k, old days\n"
+	       "                            are dropped whole\n");
+	printf("  -a <[addr:]port>	  be a collector: take agents' queries on this port\n"
+	       "                            (%s is the usual one) into the log table\n",
+	       DNSPERF_COLLECTOR_PORT);
+	printf("  -N <name>		  our vantage point, as an agent (default: hostname)\n");
+	printf("  -E, --export <file>	  write the query log to this columnar sample file\n"
+	       "                            (appended to if it exists) and exit\n");
+	printf("  -W, --replay <file>	  add the samples of this file (--export, file: or\n"
+	       "                            -J) to the stats, latency and rollup tables and\n"
+	       "                            exit\n\n");
 
 	exit(0);
 }
 
-int dnsperf_dump_valtable(mysqlpp::Connection *conn)
-{
-
-	mysqlpp::Query query_queries = conn->query();
-	query_queries << "select * from %6:table";
-	query_queries.parse();
-	query_queries.template_defaults["table"] =
-	    dnsperf_valtable;
-	if (dnsperf_verbose)
-		cout << query_queries << endl;
-	mysqlpp::StoreQueryResult res_queries =
-	    query_queries.store();
-	if (!res_queries) {
-		cerr << "Failed to get `" << dnsperf_valtable <<
-		    "`: " << query_queries.error() << endl;
-		return 1;
-	}
-	cout.setf(ios::left);
-	cout << setw(10) << "Domain"
-	    << setw(10) << "Latency (us) "
-	    << setw(18) << "Date"
-	    << setw(18) << "Nameserver" << endl << endl;
-
-	for (size_t i = 0; i < res_queries.num_rows(); ++i) {
-		cout << setw(30) <<
-		    res_queries[i]["domain"] << ' ' <<
-		    setw(9) << res_queries[i]["latency"]
-		    << ' ' << setw(18) <<
-		    res_queries[i]["timestamp"] <<
-		    setw(18) << " " <<
-		    res_queries[i]["nameserver"] << endl;
-	}
-	return 0;
-}
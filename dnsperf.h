@@ -0,0 +1,87 @@
+/*
+ * dnsperf.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Global options and prototypes shared between the dnsperf modules.
+ */
+
+#ifndef DNSPERF_H
+#define DNSPERF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define VERSION "0x0"
+
+#define DNSPERF_PORT 53
+
+/* MySQL DATETIME: "YYYY-MM-DD HH:MM:SS" plus the trailing NUL */
+#define DNSPERF_DATE_LEN 20
+
+/* a peer hanging up on us (a scraper, an agent, a webhook, a nameserver's
+ * stream) must not take the whole process with it */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* cmdline options */
+extern uint8_t dnsperf_resetdb;
+extern uint8_t dnsperf_verbose;
+extern uint8_t dnsperf_quiet;
+extern unsigned long dnsperf_freq;
+extern unsigned int dnsperf_inflight;
+extern unsigned int dnsperf_ns_inflight;	/* per address */
+extern double dnsperf_ns_rate;		/* per address, qps */
+extern double dnsperf_aimd;		/* timeout %, 0: off */
+extern unsigned int dnsperf_timeout;
+extern int dnsperf_policy;
+extern size_t dnsperf_batch;
+extern unsigned int dnsperf_flush;
+extern char *dnsperf_journaldir;
+extern unsigned long dnsperf_journal_max;	/* MB */
+extern unsigned long dnsperf_journal_rate;	/* rows/s */
+extern unsigned int dnsperf_workers;
+extern int dnsperf_clock;
+extern double dnsperf_rate;
+extern const char *dnsperf_sinkspec;
+extern unsigned int dnsperf_label_len;
+extern uint8_t dnsperf_label_tagged;
+extern uint8_t dnsperf_calibrate_only;
+extern uint8_t dnsperf_subtract;
+extern uint64_t dnsperf_baseline;	/* ns, taken off every sample with -Z */
+extern const char *dnsperf_metrics;	/* where to serve /metrics, or NULL */
+extern const char *dnsperf_tracefile;	/* -X: SIGUSR1 dumps traces here */
+extern const char *dnsperf_alert;	/* where -K alerts go, or NULL */
+extern unsigned int dnsperf_retention;	/* days of raw log to keep, 0: all */
+extern uint8_t dnsperf_partition;	/* partition the raw log by day */
+extern const char *dnsperf_collect;	/* where to take agents, or NULL */
+extern const char *dnsperf_vantage;	/* our name, as an agent */
+extern uint8_t dnsperf_agent;		/* query log to a collector, no DB */
+extern int dnsperf_transport;		/* DNSPERF_TRANSPORT_* */
+extern unsigned int dnsperf_transport_port;	/* 0: the usual one */
+extern const char *dnsperf_servers;	/* query these, not the domains' NS */
+extern const char *dnsperf_topofile;	/* topology snapshot, or NULL */
+extern const char *dnsperf_exportfile;	/* --export the log here and exit */
+extern const char *dnsperf_replayfile;	/* --replay this and exit */
+extern unsigned int dnsperf_family;	/* 4 or 6: only that one; 0: both */
+
+/* database info */
+extern const char *dnsperf_dbhostname;
+extern const char *dnsperf_dbname;
+extern const char *dnsperf_dbuser;
+extern const char *dnsperf_dbpass;
+extern const char *dnsperf_valtable;
+extern const char *dnsperf_domaintable;
+extern const char *dnsperf_domainfile;	/* NULL: the domains table */
+extern const char *dnsperf_stattable;
+extern const char *dnsperf_histtable;
+extern const char *dnsperf_rolluptable;	/* prefix; _1m, _1h, _1d */
+
+/* Helper functions */
+void dnsperf_strdate(time_t tm, char *date);
+int dnsperf_parse_date(const char *date, time_t *tm);
+int dnsperf_listen(const char *spec);
+int dnsperf_connect(const char *spec, const char *defport);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * domains.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * We used to store the whole domains table in a StoreQueryResult and keep
+ * it around for the names; that is a MySQL row object or so per domain,
+ * read once at startup. Now rows are streamed (UseQueryResult, or a line at
+ * a time from -D <file>) into a table of 24-byte entries, with the names
+ * interned in big blocks and found again through an open-addressing hash of
+ * indices: about 50 bytes a domain, all told.
+ *
+ * Loading again works the same way: names we know keep their index and are
+ * stamped with the new generation, new ones are appended, and those not
+ * stamped are no longer listed. Entries are written before the count that
+ * makes them visible, so readers (the workers, the topology) need no lock.
+ * A thread of its own reloads on SIGHUP, and when the file or the table
+ * changed, which it checks every DNSPERF_DOMAINS_POLL seconds. The per
+ * domain stats are only allocated once someone needs them.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dnsperf.h"
+#include "db.h"
+#include "domains.h"
+
+using namespace std;
+
+static volatile sig_atomic_t dnsperf_domains_hup;
+
+static uint32_t dnsperf_name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	for (; *name; name++)
+		h = (h ^ (uint8_t)*name) * 16777619U;
+	return h;
+}
+
+static const char *dnsperf_intern(struct dnsperf_domains *d, const char *name,
+				  size_t len)
+{
+	char *s;
+
+	if (d->block_left < len + 1) {
+		d->blocks.push_back((char *)malloc(DNSPERF_NAMES_BLOCK));
+		if (!d->blocks.back()) {
+			cerr << "Out of memory for domain names" << endl;
+			exit(1);
+		}
+		d->block_left = DNSPERF_NAMES_BLOCK;
+	}
+	s = d->blocks.back() + DNSPERF_NAMES_BLOCK - d->block_left;
+	memcpy(s, name, len);
+	s[len] = '\0';
+	d->block_left -= len + 1;
+	return s;
+}
+
+/* Slot of name in the hash: where it is, or where it would go */
+static size_t dnsperf_domains_slot(struct dnsperf_domains *d, const char *name,
+				   uint32_t h)
+{
+	size_t mask = d->hash.size() - 1, k;
+
+	for (k = h & mask; d->hash[k]; k = (k + 1) & mask)
+		if (!strcmp(dnsperf_domain(d, d->hash[k] - 1)->name, name))
+			break;
+	return k;
+}
+
+static void dnsperf_domains_rehash(struct dnsperf_domains *d)
+{
+	d->hash.assign(d->hash.empty() ? 1024 : d->hash.size() * 2, 0);
+	for (size_t i = 0; i < d->count; i++) {
+		const char *name = dnsperf_domain(d, i)->name;
+
+		d->hash[dnsperf_domains_slot(d, name,
+					     dnsperf_name_hash(name))] = i + 1;
+	}
+}
+
+/* Index of name, or -1; for the loaders (main() before the threads start,
+ * then the reload thread) only */
+long dnsperf_domains_find(struct dnsperf_domains *d, const char *name)
+{
+	size_t k;
+
+	if (d->hash.empty())
+		return -1;
+	k = dnsperf_domains_slot(d, name, dnsperf_name_hash(name));
+	return d->hash[k] ? (long)d->hash[k] - 1 : -1;
+}
+
+/* One row of the source; returns 1 if the domain is new */
+static int dnsperf_domains_add(struct dnsperf_domains *d, const char *name,
+			       uint32_t rank, uint32_t gen)
+{
+	struct dnsperf_domain *e;
+	size_t len = strlen(name), k;
+	uint32_t h;
+
+	if (!len || len >= DNSPERF_DOMAIN_MAX) {
+		if (len)
+			cerr << "Skipping `" << name << "`, too long" << endl;
+		return 0;
+	}
+	if ((d->count + 1) * 2 > d->hash.size())
+		dnsperf_domains_rehash(d);
+	h = dnsperf_name_hash(name);
+	k = dnsperf_domains_slot(d, name, h);
+	if (d->hash[k]) {
+		e = dnsperf_domain(d, d->hash[k] - 1);
+		e->rank = rank;
+		e->gen = gen;
+		return 0;
+	}
+
+	if (d->count == DNSPERF_DOMAIN_CHUNKS * DNSPERF_DOMAIN_CHUNK) {
+		cerr << "Too many domains, skipping `" << name << "`" << endl;
+		return 0;
+	}
+	if (!(d->count & (DNSPERF_DOMAIN_CHUNK - 1))) {
+		d->chunks[d->count >> DNSPERF_DOMAIN_CHUNK_BITS] =
+		    new struct dnsperf_domain[DNSPERF_DOMAIN_CHUNK];
+	}
+	e = dnsperf_domain(d, d->count);
+	e->name = dnsperf_intern(d, name, len);
+	e->rank = rank;
+	e->gen = gen;
+	e->stat = NULL;
+	d->hash[k] = d->count + 1;
+	/* the entry must be there before anyone can see it */
+	__sync_synchronize();
+	d->count++;
+	return 1;
+}
+
+/* "domain", or "rank,domain" like the usual top-N CSV files; # comments */
+static int dnsperf_domains_file(struct dnsperf_domains *d, uint32_t gen,
+				size_t *rows, size_t *added)
+{
+	char line[1024];
+	FILE *f;
+	struct stat sb;
+
+	if (!(f = fopen(d->file, "r"))) {
+		cerr << "Unable to open `" << d->file << "`: " <<
+		    strerror(errno) << endl;
+		return 1;
+	}
+	if (!fstat(fileno(f), &sb)) {
+		d->mtime = sb.st_mtime;
+		d->size = sb.st_size;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *name = line, *comma, *end;
+		uint32_t rank = *rows + 1;
+
+		end = line + strcspn(line, "\r\n#");
+		while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+			end--;
+		*end = '\0';
+		if ((comma = strchr(line, ','))) {
+			rank = strtoul(line, NULL, 10);
+			name = comma + 1;
+		}
+		while (*name == ' ' || *name == '\t')
+			name++;
+		if (!*name)
+			continue;
+		(*rows)++;
+		*added += dnsperf_domains_add(d, name, rank, gen);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Cheap enough to ask for every DNSPERF_DOMAINS_POLL seconds, and changes
+ * with any row */
+static int dnsperf_domains_fingerprint(mysqlpp::Connection *conn,
+				       string *fp)
+{
+	mysqlpp::Query query = conn->query();
+	mysqlpp::StoreQueryResult res;
+
+	query << "select count(*), bit_xor(crc32(concat(`rank`, ' ', " <<
+	    "domain))) from " << dnsperf_domaintable;
+	if (!(res = query.store()) || !res.num_rows()) {
+		cerr << "Failed to look at `" << dnsperf_domaintable << "` " <<
+		    query.error() << endl;
+		return 1;
+	}
+	*fp = string(res[0][0].c_str()) + "/" + res[0][1].c_str();
+	return 0;
+}
+
+static int dnsperf_domains_table(struct dnsperf_domains *d, uint32_t gen,
+				 size_t *rows, size_t *added)
+{
+	mysqlpp::Connection *conn;
+	mysqlpp::UseQueryResult res;
+	int ret = 0;
+
+	if (!(conn = dnsperf_db_grab()))
+		return 1;
+	mysqlpp::Query query = conn->query();
+
+	if (dnsperf_domains_fingerprint(conn, &d->fingerprint)) {
+		dnsperf_db_release(conn);
+		return 1;
+	}
+	/* rank is a reserved word as of MySQL 8 */
+	query << "select `rank`, domain from " << dnsperf_domaintable;
+	if (dnsperf_verbose)
+		cout << query << endl;
+	if (!(res = query.use())) {
+		cerr << "Failed to get domains from `" << dnsperf_domaintable <<
+		    "` " << query.error() << endl;
+		ret = 1;
+	} else {
+		while (mysqlpp::Row row = res.fetch_row()) {
+			(*rows)++;
+			*added += dnsperf_domains_add(d, row[1].c_str(),
+						      (uint32_t)row[0], gen);
+			if (dnsperf_verbose)
+				cout << row[0] << " " << row[1] << endl;
+		}
+		if (conn->errnum()) {
+			cerr << "Failed to get domains from `" <<
+			    dnsperf_domaintable << "` " << conn->error() <<
+			    endl;
+			ret = 1;
+		}
+	}
+	dnsperf_db_release(conn);
+	return ret;
+}
+
+void dnsperf_domains_init(struct dnsperf_domains *d, const char *file)
+{
+	sigset_t set;
+
+	memset(d->chunks, 0, sizeof(d->chunks));
+	d->count = 0;
+	d->gen = 0;
+	d->block_left = 0;
+	d->file = file;
+	d->mtime = 0;
+	d->size = 0;
+
+	/* SIGHUP is for the reload thread; everything started from here on
+	 * inherits the mask, so nobody else's system calls get interrupted */
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/* Index of name, listed as of now if it was not already; for replays
+ * (export.cpp) of samples of domains that are no longer listed. -1 if it
+ * can't be had. */
+long dnsperf_domains_intern(struct dnsperf_domains *d, const char *name)
+{
+	long i = dnsperf_domains_find(d, name);
+
+	if (i >= 0)
+		return i;
+	dnsperf_domains_add(d, name, 0, d->gen);
+	return dnsperf_domains_find(d, name);
+}
+
+/* (Re)load the list. On failure nothing changes but what was added, so a
+ * half-read source never drops domains. */
+int dnsperf_domains_load(struct dnsperf_domains *d)
+{
+	uint32_t gen = d->gen + 1;
+	size_t rows = 0, added = 0, dropped = 0;
+
+	if (!dnsperf_quiet)
+		cout << "Getting domains from " << (d->file ? "file `" :
+		    "table `") << (d->file ? d->file : dnsperf_domaintable) <<
+		    "`" << endl;
+	if (d->file ? dnsperf_domains_file(d, gen, &rows, &added) :
+	    dnsperf_domains_table(d, gen, &rows, &added))
+		return 1;
+
+	for (size_t i = 0; i < d->count; i++)
+		if (dnsperf_domain(d, i)->gen == d->gen)
+			dropped++;
+	__sync_synchronize();
+	d->gen = gen;
+	if (!dnsperf_quiet)
+		cout << "Got " << rows << " domains, " << added << " new, " <<
+		    dropped << " no longer listed" << endl;
+	return 0;
+}
+
+/* The stats of domain i, made the first time; only the worker that owns the
+ * domain (or main(), before the workers start) asks */
+struct dnsperf_stat *dnsperf_domain_stat(struct dnsperf_domains *d, size_t i)
+{
+	struct dnsperf_domain *e = dnsperf_domain(d, i);
+	struct dnsperf_stat *st;
+
+	if (e->stat)
+		return e->stat;
+	st = new struct dnsperf_stat;
+	dnsperf_stat_init(st, e->name);
+	if (!__sync_bool_compare_and_swap(&e->stat, NULL, st))
+		delete st;
+	return e->stat;
+}
+
+static int dnsperf_domains_changed(struct dnsperf_domains *d)
+{
+	mysqlpp::Connection *conn;
+	struct stat sb;
+	string fp;
+	int ret;
+
+	if (d->file)
+		return !stat(d->file, &sb) &&
+		    (sb.st_mtime != d->mtime || sb.st_size != d->size);
+	if (!(conn = dnsperf_db_grab()))
+		return 0;
+	ret = !dnsperf_domains_fingerprint(conn, &fp) && fp != d->fingerprint;
+	dnsperf_db_release(conn);
+	return ret;
+}
+
+static void dnsperf_domains_sighup(int sig)
+{
+	dnsperf_domains_hup = 1;
+}
+
+static void *dnsperf_domains_thread(void *arg)
+{
+	struct dnsperf_domains *d = (struct dnsperf_domains *)arg;
+	struct sigaction sa;
+	sigset_t set;
+
+	mysqlpp::Connection::thread_start();
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dnsperf_domains_sighup;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	for (unsigned long tick = 1;; tick++) {
+		sleep(1);
+		if (!dnsperf_domains_hup &&
+		    (tick % DNSPERF_DOMAINS_POLL || !dnsperf_domains_changed(d)))
+			continue;
+		dnsperf_domains_hup = 0;
+		dnsperf_domains_load(d);
+	}
+	mysqlpp::Connection::thread_end();
+	return NULL;
+}
+
+int dnsperf_domains_start(struct dnsperf_domains *d)
+{
+	if (pthread_create(&d->thread, NULL, dnsperf_domains_thread, d)) {
+		cerr << "Unable to start the domains reload thread" << endl;
+		return 1;
+	}
+	pthread_detach(d->thread);
+	return 0;
+}
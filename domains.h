@@ -0,0 +1,75 @@
+/*
+ * domains.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * The domains we probe: loaded row by row from the domains table (or a
+ * file, -D), kept as a compact, append-only table of interned names that
+ * everyone reads without locking, and loaded again on SIGHUP or when the
+ * source changes. A domain's index never changes; one that is no longer
+ * listed is only marked so, and picks up where it left off if it comes
+ * back.
+ */
+
+#ifndef DNSPERF_DOMAINS_H
+#define DNSPERF_DOMAINS_H
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "stats.h"
+
+/* domains by chunks that never move, so the table grows under readers */
+#define DNSPERF_DOMAIN_CHUNK_BITS	12
+#define DNSPERF_DOMAIN_CHUNK		(1UL << DNSPERF_DOMAIN_CHUNK_BITS)
+#define DNSPERF_DOMAIN_CHUNKS		1024	/* 4M domains */
+/* interned names are carved out of blocks this big */
+#define DNSPERF_NAMES_BLOCK		(1UL << 20)
+/* how often (s) to check whether the source changed */
+#define DNSPERF_DOMAINS_POLL		60
+
+struct dnsperf_domain {
+	const char *name;		/* interned, never moves or goes away */
+	uint32_t rank;
+	volatile uint32_t gen;		/* the last load that listed it */
+	struct dnsperf_stat *volatile stat;	/* NULL until first needed */
+};
+
+struct dnsperf_domains {
+	struct dnsperf_domain *chunks[DNSPERF_DOMAIN_CHUNKS];
+	volatile size_t count;
+	volatile uint32_t gen;		/* listed: d->gen >= gen */
+
+	/* loading only; main() or the reload thread, never both */
+	std::vector<char *> blocks;
+	size_t block_left;
+	std::vector<uint32_t> hash;	/* index + 1 of a domain, 0 if free */
+	const char *file;		/* NULL: the domains table */
+	time_t mtime;			/* of the file, */
+	off_t size;
+	std::string fingerprint;	/* or of the table, at the last load */
+	pthread_t thread;
+};
+
+static inline struct dnsperf_domain *
+dnsperf_domain(struct dnsperf_domains *d, size_t i)
+{
+	return &d->chunks[i >> DNSPERF_DOMAIN_CHUNK_BITS]
+	    [i & (DNSPERF_DOMAIN_CHUNK - 1)];
+}
+
+static inline int dnsperf_domain_listed(struct dnsperf_domains *d, size_t i)
+{
+	return dnsperf_domain(d, i)->gen >= d->gen;
+}
+
+void dnsperf_domains_init(struct dnsperf_domains *d, const char *file);
+int dnsperf_domains_load(struct dnsperf_domains *d);
+long dnsperf_domains_find(struct dnsperf_domains *d, const char *name);
+long dnsperf_domains_intern(struct dnsperf_domains *d, const char *name);
+struct dnsperf_stat *dnsperf_domain_stat(struct dnsperf_domains *d, size_t i);
+int dnsperf_domains_start(struct dnsperf_domains *d);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * export.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * The export reads the log with a UseQueryResult, so rows come off the
+ * wire as we go and only one block of samples is ever held; the names they
+ * point to are kept once each, as the dictionaries of the file are. No
+ * ORDER BY either: InnoDB hands them out in key order (domain, time), for
+ * free. Microseconds and vantage points are kept, so the file holds
+ * everything the log does but its key.
+ *
+ * The replay adds to what the tables hold (which main() loaded, as for a
+ * run): point it at empty ones (-s, -l, -U or -m) to have the aggregates
+ * recomputed from scratch. Samples from agents only ever went to the log,
+ * so they are skipped here too.
+ */
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+#include "dnsperf.h"
+#include "colfile.h"
+#include "db.h"
+#include "domains.h"
+#include "export.h"
+#include "rollup.h"
+#include "stats.h"
+#include "stmt.h"
+
+using namespace std;
+
+/* A name for the samples to point to, kept until the export is done */
+static const char *dnsperf_export_name(set<string> *names, const char *name)
+{
+	return names->insert(name).first->c_str();
+}
+
+int dnsperf_export(mysqlpp::Connection *conn, const char *path)
+{
+	struct dnsperf_colfile f;
+	set<string> names[DNSPERF_COL_KINDS];
+	vector<struct dnsperf_sample> block;
+	mysqlpp::Query query = conn->query();
+	mysqlpp::UseQueryResult res;
+	unsigned long long rows = 0;
+	int ret = 0;
+
+	if (dnsperf_col_open(&f, path))
+		return 1;
+	f.precise = 1;
+	block.reserve(DNSPERF_EXPORT_BLOCK);
+
+	query << "select domain, nameserver, coalesce(address, '') as " <<
+	    "address, floor(unix_timestamp(ts)) as tm, microsecond(ts) as " <<
+	    "usec, latency, outcome, clamped, vantage from " <<
+	    dnsperf_valtable << " join " <<
+	    dnsperf_dim_table(dnsperf_valtable, DNSPERF_DIM_DOMAIN) <<
+	    " using (domain_id) join " <<
+	    dnsperf_dim_table(dnsperf_valtable, DNSPERF_DIM_NS) <<
+	    " using (ns_id) left join " <<
+	    dnsperf_dim_table(dnsperf_valtable, DNSPERF_DIM_ADDR) <<
+	    " using (addr_id) left join " <<
+	    dnsperf_dim_table(dnsperf_valtable, DNSPERF_DIM_VANTAGE) <<
+	    " using (vp_id)";
+	if (dnsperf_verbose)
+		cout << query << endl;
+	if (!(res = query.use())) {
+		cerr << "Failed to read `" << dnsperf_valtable << "` " <<
+		    query.error() << endl;
+		dnsperf_col_close(&f);
+		return 1;
+	}
+	if (!dnsperf_quiet)
+		cout << "Exporting `" << dnsperf_valtable << "` to " << path <<
+		    endl;
+	while (mysqlpp::Row row = res.fetch_row()) {
+		struct dnsperf_sample s;
+
+		s.domain = dnsperf_export_name(&names[DNSPERF_COL_DOMAIN],
+					       row[0].c_str());
+		s.nameserver = dnsperf_export_name(&names[DNSPERF_COL_NS],
+						   row[1].c_str());
+		s.address = dnsperf_export_name(&names[DNSPERF_COL_ADDR],
+						row[2].c_str());
+		s.tm = (time_t)strtoll(row[3].c_str(), NULL, 10);
+		s.usec = (uint32_t)row[4];
+		/* us in the log, ns in a sample */
+		s.latency = (uint64_t)((double)row[5] * 1000 + 0.5);
+		s.outcome = (uint8_t)(unsigned int)row[6];
+		s.clamped = (uint8_t)(unsigned int)row[7];
+		s.vantage = row[8].is_null() ? NULL :
+		    dnsperf_export_name(&names[DNSPERF_COL_VANTAGE],
+					row[8].c_str());
+		block.push_back(s);
+		if (block.size() < DNSPERF_EXPORT_BLOCK)
+			continue;
+		if (dnsperf_col_append(&f, &block[0], block.size())) {
+			ret = 1;
+			break;
+		}
+		rows += block.size();
+		block.clear();
+		if (!dnsperf_quiet && !(rows % DNSPERF_EXPORT_REPORT))
+			cout << rows << " queries exported" << endl;
+	}
+	/* drain what is left, or the connection can't be used again */
+	while (ret && res.fetch_row())
+		;
+	if (!ret && conn->errnum()) {
+		cerr << "Failed to read `" << dnsperf_valtable << "` " <<
+		    conn->error() << endl;
+		ret = 1;
+	} else if (ret || (!block.empty() &&
+			   dnsperf_col_append(&f, &block[0], block.size()))) {
+		cerr << "Failed to write " << path << endl;
+		ret = 1;
+	} else {
+		rows += block.size();
+	}
+	dnsperf_col_close(&f);
+	if (!ret && !dnsperf_quiet)
+		cout << "Exported " << rows << " queries to " << path << endl;
+	return ret;
+}
+
+int dnsperf_replay(mysqlpp::Connection *conn, struct dnsperf_domains *domains,
+		   const char *path)
+{
+	struct dnsperf_col_reader r;
+	struct dnsperf_rollup_batch batch;
+	struct dnsperf_stmts stmts;
+	vector<struct dnsperf_sample> block;
+	unsigned long long rows = 0, agents = 0;
+	int got = 0, ret = 0;
+
+	if (dnsperf_col_reader_open(&r, path))
+		return 1;
+	if (!dnsperf_quiet)
+		cout << "Replaying " << path << endl;
+	dnsperf_rollup_batch_init(&batch);
+	while (!ret && (got = dnsperf_col_read(&r, &block)) > 0) {
+		unsigned long long before = rows;
+
+		for (size_t k = 0; k < block.size(); k++) {
+			const struct dnsperf_sample *s = &block[k];
+			int ok = s->outcome == DNSPERF_OUTCOME_OK;
+			struct dnsperf_stat *st;
+			size_t nsid;
+			long i;
+
+			if (s->vantage) {
+				agents++;
+				continue;
+			}
+			if ((i = dnsperf_domains_intern(domains,
+							s->domain)) < 0)
+				continue;
+			st = dnsperf_domain_stat(domains, i);
+			nsid = dnsperf_stat_nsid(st, s->nameserver,
+						 s->address);
+			if (ok) {
+				dnsperf_stat_add(st, s->latency / 1000.0,
+						 s->tm);
+				dnsperf_stat_hist_add(st, nsid, s->latency);
+			} else {
+				dnsperf_stat_fail(st, nsid, s->outcome);
+			}
+			dnsperf_rollup_batch_add(&batch, i, s->nameserver,
+						 s->address, s->latency, s->tm,
+						 ok);
+			rows++;
+			if (batch.cells.size() >= DNSPERF_ROLLUP_BATCH &&
+			    dnsperf_rollup_batch_flush(conn, &batch, domains,
+						       0)) {
+				ret = 1;
+				break;
+			}
+		}
+		if (!dnsperf_quiet && rows / DNSPERF_EXPORT_REPORT !=
+		    before / DNSPERF_EXPORT_REPORT)
+			cout << rows << " queries replayed" << endl;
+	}
+	dnsperf_col_reader_close(&r);
+	if (!ret && got < 0) {
+		cerr << path << " is corrupt past " << rows << " queries" <<
+		    endl;
+		ret = 1;
+	}
+	if (ret || dnsperf_rollup_batch_flush(conn, &batch, domains, 1)) {
+		cerr << "Replay of " << path << " failed" << endl;
+		return 1;
+	}
+
+	/* the stats and percentiles, of every domain the file has */
+	dnsperf_stmt_init(&stmts);
+	for (size_t i = 0; i < domains->count; i++) {
+		struct dnsperf_stat *st = dnsperf_domain(domains, i)->stat;
+
+		if (st)
+			dnsperf_stats(conn, &stmts, st);
+	}
+	dnsperf_stmt_close(&stmts);
+	if (!dnsperf_quiet)
+		cout << "Replayed " << rows << " queries from " << path <<
+		    " (" << agents << " from agents skipped)" << endl;
+	return 0;
+}
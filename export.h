@@ -0,0 +1,26 @@
+/*
+ * export.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Getting the query log out, and back into the aggregates. --export streams
+ * the log table, joined with its dimension tables, into a columnar sample
+ * file (colfile.h) a block at a time; --replay feeds such a file (or one a
+ * file: sink or the spill journal wrote) through the stats, percentiles and
+ * rollups, as if the samples had just been taken.
+ */
+
+#ifndef DNSPERF_EXPORT_H
+#define DNSPERF_EXPORT_H
+
+#include <mysql++/mysql++.h>
+
+struct dnsperf_domains;
+
+/* rows per block of the file, and how often (rows) to say how far we got */
+#define DNSPERF_EXPORT_BLOCK	65536
+#define DNSPERF_EXPORT_REPORT	(100 * DNSPERF_EXPORT_BLOCK)
+
+int dnsperf_export(mysqlpp::Connection *conn, const char *path);
+int dnsperf_replay(mysqlpp::Connection *conn, struct dnsperf_domains *domains,
+		   const char *path);
+
+#endif
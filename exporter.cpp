@@ -0,0 +1,537 @@
+/*
+ * exporter.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * /metrics over HTTP, for Prometheus. The exporter has a thread of its own
+ * and never takes anything the probe path waits for: workers hand it a copy
+ * of the stats of their shard's domains that got queries since, when they
+ * report, and only if the exporter isn't busy rendering (the stats are
+ * formatted under pthread_mutex_trylock's lock, straight from the copies),
+ * so a scrape costs a worker at most a skipped update, which the next one
+ * makes up for. Counters and gauges (probes by
+ * outcome, queries in flight, writer queues) are read as they are, without
+ * locking; they are single words, updated by one thread each.
+ *
+ * Latency goes out as one histogram per domain and nameserver address, with
+ * a fixed set of buckets summed up from our own finer ones. Clients get one
+ * request per connection, and a second to send it.
+ */
+
+#include <iostream>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dnsperf.h"
+#include "exporter.h"
+#include "journal.h"
+#include "trace.h"
+#include "transport.h"
+#include "worker.h"
+
+using namespace std;
+
+/* how long a client may take to send its request or read the answer (s) */
+#define DNSPERF_EXPORTER_TIMEOUT 1
+#define DNSPERF_EXPORTER_REQ_MAX 4096
+
+/* histogram bucket bounds (s); +Inf is implied */
+static const double dnsperf_le[] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+	0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define DNSPERF_LES (sizeof(dnsperf_le) / sizeof(dnsperf_le[0]))
+
+/* label values are domain names, but quote them properly anyway */
+static void dnsperf_label_value(string *out, const char *v)
+{
+	for (; *v; v++) {
+		if (*v == '\\' || *v == '"')
+			*out += '\\';
+		if (*v == '\n')
+			*out += "\\n";
+		else
+			*out += *v;
+	}
+}
+
+static void dnsperf_metric_head(string *out, const char *name,
+				const char *type, const char *help)
+{
+	*out += "# HELP ";
+	*out += name;
+	*out += " ";
+	*out += help;
+	*out += "\n# TYPE ";
+	*out += name;
+	*out += " ";
+	*out += type;
+	*out += "\n";
+}
+
+/* name{labels} value; labels are already formatted */
+static void dnsperf_metric(string *out, const char *name,
+			   const string &labels, double value)
+{
+	char buf[64];
+
+	*out += name;
+	if (!labels.empty()) {
+		*out += "{";
+		*out += labels;
+		*out += "}";
+	}
+	snprintf(buf, sizeof(buf), " %.15g\n", value);
+	*out += buf;
+}
+
+/* domain, nameserver, address and family="4" or "6" ("" for samples from
+ * before we kept the address) */
+static void dnsperf_ns_labels(string *l, const struct dnsperf_stat *st,
+			      const struct dnsperf_nshist *ns)
+{
+	int family = dnsperf_address_family(ns->address);
+
+	*l = "domain=\"";
+	dnsperf_label_value(l, st->domain);
+	*l += "\",nameserver=\"";
+	dnsperf_label_value(l, ns->nameserver);
+	*l += "\",address=\"";
+	dnsperf_label_value(l, ns->address);
+	*l += "\",family=\"";
+	if (family)
+		*l += family == 6 ? "6" : "4";
+	*l += "\"";
+}
+
+static void dnsperf_metric_hist(string *out, const string &labels,
+				const struct dnsperf_hist *h)
+{
+	char le[32];
+
+	for (unsigned int i = 0; i < DNSPERF_LES; i++) {
+		snprintf(le, sizeof(le), ",le=\"%g\"", dnsperf_le[i]);
+		dnsperf_metric(out, "dnsperf_latency_seconds_bucket",
+			       labels + le, dnsperf_hist_count_le(h,
+					(uint64_t)(dnsperf_le[i] * 1e9)));
+	}
+	dnsperf_metric(out, "dnsperf_latency_seconds_bucket",
+		       labels + ",le=\"+Inf\"", h->count);
+	dnsperf_metric(out, "dnsperf_latency_seconds_sum", labels,
+		       dnsperf_hist_sum(h) / 1e9);
+	dnsperf_metric(out, "dnsperf_latency_seconds_count", labels, h->count);
+}
+
+/* -X: per thread and stage, calls, what they handled and time spent */
+static void dnsperf_exporter_traces(string *out)
+{
+	const vector<struct dnsperf_trace *> &traces = dnsperf_traces();
+	static const char *names[] = {
+		"dnsperf_stage_calls_total", "dnsperf_stage_items_total",
+		"dnsperf_stage_seconds_total"
+	};
+	static const char *helps[] = {
+		"Calls of a probe path stage, per thread.",
+		"Probes, answers or samples a stage handled, per thread.",
+		"Time spent in a probe path stage, per thread."
+	};
+
+	if (traces.empty())
+		return;
+	for (int m = 0; m < 3; m++) {
+		dnsperf_metric_head(out, names[m], "counter", helps[m]);
+		for (size_t i = 0; i < traces.size(); i++)
+			for (int k = 0; k < DNSPERF_STAGES; k++) {
+				const struct dnsperf_trace_stage *s =
+				    &traces[i]->stages[k];
+				string l = "thread=\"";
+
+				if (!s->calls)
+					continue;
+				dnsperf_label_value(&l, traces[i]->name);
+				l += "\",stage=\"";
+				l += dnsperf_stage_name(k);
+				l += "\"";
+				dnsperf_metric(out, names[m], l, !m ? s->calls :
+					       m == 1 ? s->items :
+					       s->ns / 1e9);
+			}
+	}
+}
+
+/* The per-domain part, from the copies; callers hold the lock */
+static void dnsperf_exporter_render_stats(struct dnsperf_exporter *x,
+					  string *out)
+{
+	const vector<struct dnsperf_stat> &snap = x->snap;
+	string l;
+
+	dnsperf_metric_head(out, "dnsperf_latency_seconds", "histogram",
+			    "Query latency per domain, nameserver and address.");
+	for (size_t i = 0; i < snap.size(); i++)
+		for (size_t k = 0; k < snap[i].ns.size(); k++) {
+			dnsperf_ns_labels(&l, &snap[i], &snap[i].ns[k]);
+			dnsperf_metric_hist(out, l, &snap[i].ns[k].hist);
+		}
+
+	dnsperf_metric_head(out, "dnsperf_failures_total", "counter",
+			    "Queries that got no usable answer, per domain, nameserver and address, over all runs.");
+	for (size_t i = 0; i < snap.size(); i++)
+		for (size_t k = 0; k < snap[i].ns.size(); k++)
+			for (int o = DNSPERF_OUTCOME_OK + 1;
+			     o < DNSPERF_OUTCOMES; o++) {
+				dnsperf_ns_labels(&l, &snap[i], &snap[i].ns[k]);
+				l += ",outcome=\"";
+				l += dnsperf_outcome_name(o);
+				l += "\"";
+				dnsperf_metric(out, "dnsperf_failures_total", l,
+					       snap[i].ns[k].outcomes[o]);
+			}
+
+	dnsperf_metric_head(out, "dnsperf_domain_queries_total", "counter",
+			    "Answered queries per domain, over all runs.");
+	for (size_t i = 0; i < snap.size(); i++) {
+		if (!snap[i].domain[0])
+			continue;	/* nothing from that one yet */
+		l = "domain=\"";
+		dnsperf_label_value(&l, snap[i].domain);
+		l += "\"";
+		dnsperf_metric(out, "dnsperf_domain_queries_total", l,
+			       snap[i].count);
+	}
+	dnsperf_metric_head(out, "dnsperf_domain_latency_mean_seconds", "gauge",
+			    "Mean query latency per domain.");
+	for (size_t i = 0; i < snap.size(); i++) {
+		if (!snap[i].domain[0])
+			continue;	/* nothing from that one yet */
+		l = "domain=\"";
+		dnsperf_label_value(&l, snap[i].domain);
+		l += "\"";
+		dnsperf_metric(out, "dnsperf_domain_latency_mean_seconds", l,
+			       snap[i].mean / 1e6);
+	}
+	dnsperf_metric_head(out, "dnsperf_domain_latency_stddev_seconds",
+			    "gauge", "Query latency standard deviation per domain.");
+	for (size_t i = 0; i < snap.size(); i++) {
+		if (!snap[i].domain[0])
+			continue;	/* nothing from that one yet */
+		l = "domain=\"";
+		dnsperf_label_value(&l, snap[i].domain);
+		l += "\"";
+		dnsperf_metric(out, "dnsperf_domain_latency_stddev_seconds", l,
+			       snap[i].count ? sqrt(snap[i].m2 / snap[i].count) /
+			       1e6 : 0);
+	}
+}
+
+static void dnsperf_exporter_render(struct dnsperf_exporter *x, string *out)
+{
+	struct dnsperf_writer *wr = x->writer;
+	unsigned long depth = 0;
+	char id[16];
+
+	pthread_mutex_lock(&x->lock);
+	dnsperf_exporter_render_stats(x, out);
+	pthread_mutex_unlock(&x->lock);
+
+	dnsperf_metric_head(out, "dnsperf_probes_sent_total", "counter",
+			    "Queries sent per worker.");
+	for (unsigned int i = 0; i < x->nr_workers; i++) {
+		snprintf(id, sizeof(id), "worker=\"%u\"", i);
+		dnsperf_metric(out, "dnsperf_probes_sent_total", id,
+			       x->workers[i].probes_sent);
+	}
+	dnsperf_metric_head(out, "dnsperf_probes_total", "counter",
+			    "Queries done per worker, by outcome.");
+	for (unsigned int i = 0; i < x->nr_workers; i++)
+		for (int k = 0; k < DNSPERF_OUTCOMES; k++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_probes_total",
+				       string(id) + ",outcome=\"" +
+				       dnsperf_outcome_name(k) + "\"",
+				       x->workers[i].outcomes[k]);
+		}
+	dnsperf_metric_head(out, "dnsperf_inflight", "gauge",
+			    "Queries waiting for an answer, per worker.");
+	for (unsigned int i = 0; i < x->nr_workers; i++) {
+		snprintf(id, sizeof(id), "worker=\"%u\"", i);
+		dnsperf_metric(out, "dnsperf_inflight", id,
+			       x->workers[i].engine.inflight);
+	}
+	/* -e tcp, tls and https: the connections, and what they took */
+	if (x->nr_workers && x->workers[0].engine.streams) {
+		dnsperf_metric_head(out, "dnsperf_connections_total", "counter",
+				    "Connections set up, per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_connections_total", id,
+				       x->workers[i].engine.streams->connects);
+		}
+		dnsperf_metric_head(out, "dnsperf_connection_failures_total",
+				    "counter", "Connections that never got "
+				    "to take a query, per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_connection_failures_total",
+				       id, x->workers[i].engine.streams->
+				       connect_failures);
+		}
+		dnsperf_metric_head(out, "dnsperf_connection_setup_seconds_total",
+				    "counter", "Time spent connecting and "
+				    "handshaking, per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out,
+				       "dnsperf_connection_setup_seconds_total",
+				       id, x->workers[i].engine.streams->
+				       setup_ns / 1e9);
+		}
+		dnsperf_metric_head(out, "dnsperf_connection_reused_total",
+				    "counter", "Queries sent on a connection "
+				    "that had carried one already, per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_connection_reused_total",
+				       id, x->workers[i].engine.streams->reused);
+		}
+	}
+	/* -I, -M and -A */
+	if (x->nr_workers && x->workers[0].engine.limiter) {
+		dnsperf_metric_head(out, "dnsperf_limiter_held_total",
+				    "counter", "Queries the limiter held back, "
+				    "per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_limiter_held_total", id,
+				       x->workers[i].limiter.held);
+		}
+		dnsperf_metric_head(out, "dnsperf_limiter_clamped_total",
+				    "counter", "Samples taken while the limiter "
+				    "was clamping, per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_limiter_clamped_total", id,
+				       x->workers[i].limiter.clamped);
+		}
+		dnsperf_metric_head(out, "dnsperf_limiter_decreases_total",
+				    "counter", "Times AIMD halved a window, "
+				    "per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_limiter_decreases_total",
+				       id, x->workers[i].limiter.decreases);
+		}
+		dnsperf_metric_head(out, "dnsperf_limiter_window", "gauge",
+				    "Queries in flight the limiter allows, "
+				    "per worker.");
+		for (unsigned int i = 0; i < x->nr_workers; i++) {
+			snprintf(id, sizeof(id), "worker=\"%u\"", i);
+			dnsperf_metric(out, "dnsperf_limiter_window", id,
+				       (unsigned int)x->workers[i].limiter.
+				       global.window);
+		}
+	}
+
+	dnsperf_exporter_traces(out);
+
+	dnsperf_metric_head(out, "dnsperf_writer_queue_depth", "gauge",
+			    "Samples waiting for the query log writer, per worker.");
+	for (unsigned int i = 0; i < wr->nr_producers; i++) {
+		size_t d = dnsperf_queue_depth(&wr->producers[i].queue);
+
+		snprintf(id, sizeof(id), "worker=\"%u\"", i);
+		dnsperf_metric(out, "dnsperf_writer_queue_depth", id, d);
+		depth += d;
+	}
+	dnsperf_metric_head(out, "dnsperf_writer_dropped_total", "counter",
+			    "Samples dropped because the writer was behind.");
+	for (unsigned int i = 0; i < wr->nr_producers; i++) {
+		snprintf(id, sizeof(id), "worker=\"%u\"", i);
+		dnsperf_metric(out, "dnsperf_writer_dropped_total", id,
+			       wr->producers[i].dropped);
+	}
+	dnsperf_metric_head(out, "dnsperf_writer_written_total", "counter",
+			    "Samples written to the query log.");
+	dnsperf_metric(out, "dnsperf_writer_written_total", "", wr->written);
+	dnsperf_metric_head(out, "dnsperf_writer_failed_total", "counter",
+			    "Samples the query log sink rejected.");
+	dnsperf_metric(out, "dnsperf_writer_failed_total", "", wr->failed);
+	dnsperf_metric_head(out, "dnsperf_writer_lag_seconds", "gauge",
+			    "Age of the newest sample written, while samples are queued.");
+	dnsperf_metric(out, "dnsperf_writer_lag_seconds", "",
+		       depth && wr->last_tm ?
+		       difftime(time(NULL), wr->last_tm) : 0);
+	if (!wr->journal)
+		return;
+	dnsperf_metric_head(out, "dnsperf_journal_bytes", "gauge",
+			    "Size of the spill journal.");
+	dnsperf_metric(out, "dnsperf_journal_bytes", "", wr->journal->bytes);
+	dnsperf_metric_head(out, "dnsperf_journal_spilled_total", "counter",
+			    "Samples the sink could not take, kept in the journal.");
+	dnsperf_metric(out, "dnsperf_journal_spilled_total", "",
+		       wr->journal->spilled);
+	dnsperf_metric_head(out, "dnsperf_journal_replayed_total", "counter",
+			    "Samples replayed from the journal into the sink.");
+	dnsperf_metric(out, "dnsperf_journal_replayed_total", "",
+		       wr->journal->replayed);
+	dnsperf_metric_head(out, "dnsperf_journal_full_total", "counter",
+			    "Batches the journal had no room for.");
+	dnsperf_metric(out, "dnsperf_journal_full_total", "",
+		       wr->journal->full);
+}
+
+static void dnsperf_exporter_write(int fd, const string &s)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < s.size()) {
+		n = send(fd, s.data() + done, s.size() - done, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		done += n;
+	}
+}
+
+static void dnsperf_exporter_serve(struct dnsperf_exporter *x, int fd)
+{
+	char req[DNSPERF_EXPORTER_REQ_MAX + 1];
+	size_t len = 0;
+	string body, head;
+	char buf[128];
+	ssize_t n;
+
+	/* we only need the request line, but read up to the blank line so
+	 * the client doesn't get a reset */
+	while (len < DNSPERF_EXPORTER_REQ_MAX) {
+		if ((n = read(fd, req + len, DNSPERF_EXPORTER_REQ_MAX - len)) <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if (strncmp(req, "GET /metrics ", 13) &&
+	    strncmp(req, "GET /metrics?", 13)) {
+		dnsperf_exporter_write(fd, "HTTP/1.0 404 Not Found\r\n"
+				       "Content-Type: text/plain\r\n"
+				       "Connection: close\r\n\r\n"
+				       "Try /metrics\n");
+		return;
+	}
+	dnsperf_exporter_render(x, &body);
+	snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %lu\r\n"
+		 "Connection: close\r\n\r\n", (unsigned long)body.size());
+	head = buf;
+	dnsperf_exporter_write(fd, head + body);
+}
+
+static void *dnsperf_exporter_thread(void *arg)
+{
+	struct dnsperf_exporter *x = (struct dnsperf_exporter *)arg;
+
+	for (;;) {
+		struct pollfd pfd;
+		struct timeval tv;
+		int fd;
+
+		pfd.fd = x->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) <= 0)
+			continue;
+		if ((fd = accept(x->fd, NULL, NULL)) < 0)
+			continue;
+		tv.tv_sec = DNSPERF_EXPORTER_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+		{
+			int on = 1;
+
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on,
+				   sizeof(on));
+		}
+#endif
+		dnsperf_exporter_serve(x, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Copies of what stats there are of domains [from, count) that had queries
+ * since the last copy; with no stats yet, an entry without a name. Callers
+ * hold the lock. */
+static void dnsperf_exporter_copy(struct dnsperf_exporter *x,
+				  struct dnsperf_domains *domains, size_t from,
+				  size_t step)
+{
+	size_t count = domains->count;
+
+	if (x->snap.size() < count) {
+		size_t k = x->snap.size();
+
+		x->snap.resize(count);
+		for (; k < count; k++)
+			dnsperf_stat_init(&x->snap[k], "");
+	}
+	for (size_t i = from; i < count; i += step) {
+		struct dnsperf_stat *st = dnsperf_domain(domains, i)->stat;
+
+		if (st && st->count + dnsperf_failures(st->outcomes) !=
+		    x->snap[i].count + dnsperf_failures(x->snap[i].outcomes))
+			x->snap[i] = *st;
+	}
+}
+
+/* Listen, and start with the stats as loaded from the database */
+int dnsperf_exporter_init(struct dnsperf_exporter *x, const char *listen,
+			  struct dnsperf_domains *domains)
+{
+	if ((x->fd = dnsperf_listen(listen)) < 0)
+		return 1;
+	pthread_mutex_init(&x->lock, NULL);
+	dnsperf_exporter_copy(x, domains, 0, 1);
+	x->workers = NULL;
+	x->nr_workers = 0;
+	x->writer = NULL;
+	return 0;
+}
+
+/* The workers (and the writer) must be running by now */
+int dnsperf_exporter_start(struct dnsperf_exporter *x,
+			   struct dnsperf_worker *workers,
+			   unsigned int nr_workers,
+			   struct dnsperf_writer *writer)
+{
+	x->workers = workers;
+	x->nr_workers = nr_workers;
+	x->writer = writer;
+	if (pthread_create(&x->thread, NULL, dnsperf_exporter_thread, x)) {
+		cerr << "Unable to start the metrics exporter" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* Called by a worker when it reports; gives up rather than wait */
+void dnsperf_exporter_publish(struct dnsperf_exporter *x,
+			      struct dnsperf_domains *domains,
+			      unsigned int shard, unsigned int nr_shards)
+{
+	if (pthread_mutex_trylock(&x->lock))
+		return;
+	dnsperf_exporter_copy(x, domains, shard, nr_shards);
+	pthread_mutex_unlock(&x->lock);
+}
@@ -0,0 +1,42 @@
+/*
+ * exporter.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Prometheus exporter: a small HTTP endpoint serving /metrics in the text
+ * exposition format, straight from the in-memory stats, so scraping never
+ * touches the database.
+ */
+
+#ifndef DNSPERF_EXPORTER_H
+#define DNSPERF_EXPORTER_H
+
+#include <vector>
+#include <pthread.h>
+
+#include "domains.h"
+#include "stats.h"
+#include "writer.h"
+
+struct dnsperf_worker;
+
+struct dnsperf_exporter {
+	int fd;				/* listening socket */
+	pthread_t thread;
+	struct dnsperf_worker *workers;
+	unsigned int nr_workers;
+	struct dnsperf_writer *writer;
+	/* copies of the stats, as of each worker's last report, by domain */
+	pthread_mutex_t lock;
+	std::vector<struct dnsperf_stat> snap;
+};
+
+int dnsperf_exporter_init(struct dnsperf_exporter *x, const char *listen,
+			  struct dnsperf_domains *domains);
+int dnsperf_exporter_start(struct dnsperf_exporter *x,
+			   struct dnsperf_worker *workers,
+			   unsigned int nr_workers,
+			   struct dnsperf_writer *writer);
+void dnsperf_exporter_publish(struct dnsperf_exporter *x,
+			      struct dnsperf_domains *domains,
+			      unsigned int shard, unsigned int nr_shards);
+
+#endif
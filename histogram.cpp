@@ -0,0 +1,266 @@
+/*
+ * histogram.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Log-bucketed latency histograms. Values below DNSPERF_HIST_SUB ns are
+ * counted exactly; above that, a value with its top bit at position b lands
+ * in one of DNSPERF_HIST_SUB / 2 buckets of width 2^(b - SUB_BITS + 1).
+ * Average and stddev hide the tail (and bimodal answers, like a nameserver
+ * that is either 64ms or 270ms away); percentiles out of these do not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+using namespace std;
+
+static unsigned int dnsperf_hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value >= (1ULL << DNSPERF_HIST_MAX_BITS))
+		return DNSPERF_HIST_BUCKETS - 1;
+	if (value < DNSPERF_HIST_SUB)
+		return value;
+	/* value >> shift is in [SUB / 2, SUB) */
+	shift = 63 - __builtin_clzll(value) - (DNSPERF_HIST_SUB_BITS - 1);
+	return shift * (DNSPERF_HIST_SUB / 2) + (value >> shift);
+}
+
+/* largest value that lands in bucket i */
+static uint64_t dnsperf_hist_value(unsigned int i)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (i < DNSPERF_HIST_SUB)
+		return i;
+	shift = i / (DNSPERF_HIST_SUB / 2) - 1;
+	sub = i - shift * (DNSPERF_HIST_SUB / 2);
+	return ((sub + 1) << shift) - 1;
+}
+
+/* Zeroes what we have; the pages stay, for the next values */
+void dnsperf_hist_init(struct dnsperf_hist *h)
+{
+	h->count = h->min = h->max = 0;
+	for (int i = 0; i < DNSPERF_HIST_PAGES; i++)
+		if (h->pages[i])
+			memset(h->pages[i], 0, DNSPERF_HIST_PAGE *
+			       sizeof(h->pages[i][0]));
+}
+
+static uint64_t *dnsperf_hist_page(struct dnsperf_hist *h, unsigned int i)
+{
+	uint64_t *page = h->pages[i];
+
+	if (!page) {
+		page = new uint64_t[DNSPERF_HIST_PAGE]();
+		/* zeroed before a reader can see it (trace.h) */
+		__sync_synchronize();
+		h->pages[i] = page;
+	}
+	return page;
+}
+
+dnsperf_hist::dnsperf_hist()
+{
+	memset(pages, 0, sizeof(pages));
+	dnsperf_hist_init(this);
+}
+
+dnsperf_hist::dnsperf_hist(const struct dnsperf_hist &o)
+{
+	memset(pages, 0, sizeof(pages));
+	*this = o;
+}
+
+struct dnsperf_hist &dnsperf_hist::operator=(const struct dnsperf_hist &o)
+{
+	if (this == &o)
+		return *this;
+	count = o.count;
+	min = o.min;
+	max = o.max;
+	for (int i = 0; i < DNSPERF_HIST_PAGES; i++)
+		if (o.pages[i])
+			memcpy(dnsperf_hist_page(this, i), o.pages[i],
+			       DNSPERF_HIST_PAGE * sizeof(o.pages[i][0]));
+		else if (pages[i])
+			memset(pages[i], 0, DNSPERF_HIST_PAGE *
+			       sizeof(pages[i][0]));
+	return *this;
+}
+
+dnsperf_hist::~dnsperf_hist()
+{
+	for (int i = 0; i < DNSPERF_HIST_PAGES; i++)
+		delete[] pages[i];
+}
+
+/* Only allocates the first time a page is hit */
+void dnsperf_hist_add(struct dnsperf_hist *h, uint64_t value)
+{
+	unsigned int b = dnsperf_hist_index(value);
+
+	if (!h->count || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	dnsperf_hist_page(h, b >> DNSPERF_HIST_PAGE_BITS)
+	    [b & (DNSPERF_HIST_PAGE - 1)]++;
+}
+
+void dnsperf_hist_merge(struct dnsperf_hist *dst,
+			const struct dnsperf_hist *src)
+{
+	if (!src->count)
+		return;
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	for (int i = 0; i < DNSPERF_HIST_PAGES; i++) {
+		uint64_t *page;
+
+		if (!src->pages[i])
+			continue;
+		page = dnsperf_hist_page(dst, i);
+		for (int k = 0; k < DNSPERF_HIST_PAGE; k++)
+			page[k] += src->pages[i][k];
+	}
+}
+
+/* Count of bucket b, 0 if its page was never hit */
+static uint64_t dnsperf_hist_bucket(const struct dnsperf_hist *h,
+				    unsigned int b)
+{
+	const uint64_t *page = h->pages[b >> DNSPERF_HIST_PAGE_BITS];
+
+	return page ? page[b & (DNSPERF_HIST_PAGE - 1)] : 0;
+}
+
+/* Smallest value that at least pct% of the samples do not exceed, rounded
+ * up to the end of its bucket (but never past what we actually saw) */
+uint64_t dnsperf_hist_percentile(const struct dnsperf_hist *h, double pct)
+{
+	uint64_t rank, seen = 0;
+	uint64_t value;
+
+	if (!h->count)
+		return 0;
+	rank = (uint64_t)(pct / 100.0 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->count)
+		rank = h->count;
+
+	for (unsigned int b = 0; b < DNSPERF_HIST_BUCKETS; b++) {
+		seen += dnsperf_hist_bucket(h, b);
+		if (seen < rank)
+			continue;
+		value = dnsperf_hist_value(b);
+		if (value > h->max)
+			value = h->max;
+		if (value < h->min)
+			value = h->min;
+		return value;
+	}
+	return h->max;
+}
+
+/* Samples that are certainly <= value: a bucket that straddles it counts as
+ * above, so this errs on the slow side by at most one bucket width */
+uint64_t dnsperf_hist_count_le(const struct dnsperf_hist *h, uint64_t value)
+{
+	uint64_t n = 0;
+
+	if (value >= h->max)
+		return h->count;
+	for (unsigned int b = 0; b < DNSPERF_HIST_BUCKETS; b++) {
+		if (dnsperf_hist_value(b) > value)
+			break;
+		n += dnsperf_hist_bucket(h, b);
+	}
+	return n;
+}
+
+/* We don't keep the sum of the samples; bucket midpoints get within a
+ * bucket width (under 4%) of it */
+double dnsperf_hist_sum(const struct dnsperf_hist *h)
+{
+	double sum = 0;
+
+	for (unsigned int b = 0; b < DNSPERF_HIST_BUCKETS; b++) {
+		uint64_t lo = b ? dnsperf_hist_value(b - 1) + 1 : 0;
+
+		sum += dnsperf_hist_bucket(h, b) *
+		    ((lo + dnsperf_hist_value(b)) / 2.0);
+	}
+	return sum;
+}
+
+void dnsperf_hist_encode(const struct dnsperf_hist *h, string *out)
+{
+	char buf[64];
+
+	out->clear();
+	snprintf(buf, sizeof(buf), "%llu %llu", (unsigned long long)h->min,
+		 (unsigned long long)h->max);
+	*out += buf;
+	for (unsigned int b = 0; b < DNSPERF_HIST_BUCKETS; b++) {
+		uint64_t n = dnsperf_hist_bucket(h, b);
+
+		if (!n)
+			continue;
+		snprintf(buf, sizeof(buf), " %u:%llu", b,
+			 (unsigned long long)n);
+		*out += buf;
+	}
+}
+
+/* Inverse of the above; returns 1 (and an empty histogram) on garbage */
+int dnsperf_hist_decode(struct dnsperf_hist *h, const char *in)
+{
+	char *end;
+	long last = -1;
+
+	dnsperf_hist_init(h);
+	h->min = strtoull(in, &end, 10);
+	if (end == in)
+		goto fail;
+	in = end;
+	h->max = strtoull(in, &end, 10);
+	if (end == in)
+		goto fail;
+	in = end;
+
+	/* buckets come in order, as encode writes them */
+	while (*in == ' ') {
+		unsigned long i = strtoul(in + 1, &end, 10);
+		uint64_t n;
+
+		if (end == in + 1 || *end != ':' || i >= DNSPERF_HIST_BUCKETS ||
+		    (long)i <= last)
+			goto fail;
+		in = end + 1;
+		n = strtoull(in, &end, 10);
+		if (end == in || !n)
+			goto fail;
+		dnsperf_hist_page(h, i >> DNSPERF_HIST_PAGE_BITS)
+		    [i & (DNSPERF_HIST_PAGE - 1)] = n;
+		h->count += n;
+		last = i;
+		in = end;
+	}
+	if (*in)
+		goto fail;
+	return 0;
+fail:
+	dnsperf_hist_init(h);
+	return 1;
+}
@@ -0,0 +1,58 @@
+/*
+ * histogram.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Log-bucketed latency histograms (HDR style). Values are in ns; each
+ * power of two is split in DNSPERF_HIST_SUB / 2 linear buckets, so any
+ * value is reported within 1/32 of what was measured. The buckets come in
+ * pages of DNSPERF_HIST_PAGE, made the first time one of theirs is hit and
+ * never moved nor freed until the histogram goes: a nameserver that is
+ * always about as far away takes a page or two, well under a KB. Adding a
+ * value is an index and an increment, in place, and two histograms merge
+ * bucket by bucket.
+ */
+
+#ifndef DNSPERF_HISTOGRAM_H
+#define DNSPERF_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string>
+
+#define DNSPERF_HIST_SUB_BITS	6
+#define DNSPERF_HIST_SUB	(1 << DNSPERF_HIST_SUB_BITS)
+/* anything above 2^40 ns (~18 minutes) goes into the last bucket */
+#define DNSPERF_HIST_MAX_BITS	40
+#define DNSPERF_HIST_BUCKETS \
+	((DNSPERF_HIST_MAX_BITS - DNSPERF_HIST_SUB_BITS + 1) * \
+	 (DNSPERF_HIST_SUB / 2) + DNSPERF_HIST_SUB / 2)
+#define DNSPERF_HIST_PAGE_BITS	5
+#define DNSPERF_HIST_PAGE	(1 << DNSPERF_HIST_PAGE_BITS)
+#define DNSPERF_HIST_PAGES \
+	((DNSPERF_HIST_BUCKETS + DNSPERF_HIST_PAGE - 1) / DNSPERF_HIST_PAGE)
+
+struct dnsperf_hist {
+	uint64_t count;
+	uint64_t min;			/* ns, exact */
+	uint64_t max;			/* ns, exact */
+	/* DNSPERF_HIST_PAGE buckets each, NULL until one of them is hit */
+	uint64_t *pages[DNSPERF_HIST_PAGES];
+
+	/* the pages are ours: copies get their own */
+	dnsperf_hist();
+	dnsperf_hist(const struct dnsperf_hist &o);
+	struct dnsperf_hist &operator=(const struct dnsperf_hist &o);
+	~dnsperf_hist();
+};
+
+void dnsperf_hist_init(struct dnsperf_hist *h);
+void dnsperf_hist_add(struct dnsperf_hist *h, uint64_t value);
+void dnsperf_hist_merge(struct dnsperf_hist *dst,
+			const struct dnsperf_hist *src);
+uint64_t dnsperf_hist_percentile(const struct dnsperf_hist *h, double pct);
+uint64_t dnsperf_hist_count_le(const struct dnsperf_hist *h, uint64_t value);
+double dnsperf_hist_sum(const struct dnsperf_hist *h);
+
+/* sparse "bucket:count" text, for keeping histograms in the database */
+void dnsperf_hist_encode(const struct dnsperf_hist *h, std::string *out);
+int dnsperf_hist_decode(struct dnsperf_hist *h, const char *in);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * journal.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Spill journal. Appending is a columnar block write into the mapped active
+ * segment, with an msync() at most every DNSPERF_JOURNAL_SYNC ms; the
+ * header's length only moves past complete blocks, so a crash costs at most
+ * the samples of the last second. Replaying takes the oldest sealed segment
+ * (sealing the active one if there is nothing else) a block at a time and
+ * unlinks it once the sink has all of it. A run that stops half way through
+ * a segment replays it from the start the next time: the query log takes
+ * rows again without complaint (INSERT IGNORE).
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dnsperf.h"
+#include "journal.h"
+
+using namespace std;
+
+/* what a sample may take in a block, dictionary records aside, and a bit
+ * for those */
+#define DNSPERF_JOURNAL_ROW	48
+#define DNSPERF_JOURNAL_SLACK	4096
+
+static bool dnsperf_segment_less(const struct dnsperf_journal_segment &a,
+				 const struct dnsperf_journal_segment &b)
+{
+	return a.seq < b.seq;
+}
+
+static string dnsperf_journal_path(struct dnsperf_journal *j,
+				   unsigned long seq)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "/%010lu%s", seq, DNSPERF_JOURNAL_SUFFIX);
+	return j->dir + name;
+}
+
+static void dnsperf_journal_bytes(struct dnsperf_journal *j)
+{
+	j->bytes = j->sealed_bytes + (j->open ? j->active.length : 0);
+}
+
+/* Pick up the segments of an earlier run; they are all sealed now */
+int dnsperf_journal_open(struct dnsperf_journal *j, const char *dir,
+			 uint64_t max, unsigned long rate)
+{
+	struct dirent *de;
+	DIR *d;
+
+	j->dir = dir;
+	j->max = max;
+	j->rate = rate;
+	j->sealed.clear();
+	j->sealed_bytes = 0;
+	j->seq = 0;
+	j->open = j->dirty = j->reading = 0;
+	j->active.fd = -1;
+	j->active.map = NULL;
+	j->replay.clear();
+	j->tokens = rate;
+	j->refilled = j->synced = dnsperf_now_ms();
+	j->spilled = j->replayed = j->full = 0;
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		cerr << "Unable to create " << dir << ": " << strerror(errno) <<
+		    endl;
+		return 1;
+	}
+	if (!(d = opendir(dir))) {
+		cerr << "Unable to open " << dir << ": " << strerror(errno) <<
+		    endl;
+		return 1;
+	}
+	while ((de = readdir(d))) {
+		struct dnsperf_journal_segment seg;
+		struct stat st;
+		char *end;
+
+		seg.seq = strtoul(de->d_name, &end, 10);
+		if (end == de->d_name || strcmp(end, DNSPERF_JOURNAL_SUFFIX) ||
+		    stat(dnsperf_journal_path(j, seg.seq).c_str(), &st))
+			continue;
+		seg.size = st.st_size;
+		j->sealed.push_back(seg);
+		j->sealed_bytes += seg.size;
+		if (seg.seq > j->seq)
+			j->seq = seg.seq;
+	}
+	closedir(d);
+	sort(j->sealed.begin(), j->sealed.end(), dnsperf_segment_less);
+	dnsperf_journal_bytes(j);
+	if (!j->sealed.empty() && !dnsperf_quiet)
+		cout << "Replaying " << j->sealed.size() <<
+		    " journal segments (" << (j->sealed_bytes >> 20) <<
+		    " MB) left in " << dir << endl;
+	return 0;
+}
+
+/* Close the active segment and queue it for replay */
+static void dnsperf_journal_seal(struct dnsperf_journal *j)
+{
+	struct dnsperf_journal_segment seg;
+
+	if (!j->open)
+		return;
+	seg.seq = j->seq;
+	seg.size = j->active.length;
+	dnsperf_col_sync(&j->active);
+	dnsperf_col_close(&j->active);
+	j->open = j->dirty = 0;
+	j->sealed.push_back(seg);
+	j->sealed_bytes += seg.size;
+	dnsperf_journal_bytes(j);
+}
+
+void dnsperf_journal_sync(struct dnsperf_journal *j, int force)
+{
+	unsigned long now;
+
+	if (!j->dirty)
+		return;
+	now = dnsperf_now_ms();
+	if (!force && now - j->synced < DNSPERF_JOURNAL_SYNC)
+		return;
+	dnsperf_col_sync(&j->active);
+	j->synced = now;
+	j->dirty = 0;
+}
+
+/* Keep a batch the sink could not take; 1 if there is no room for it */
+int dnsperf_journal_append(struct dnsperf_journal *j,
+			   const struct dnsperf_sample *samples, size_t n)
+{
+	if (j->bytes + n * DNSPERF_JOURNAL_ROW + DNSPERF_JOURNAL_SLACK >
+	    j->max) {
+		j->full++;
+		return 1;
+	}
+	if (!j->open) {
+		if (dnsperf_col_open(&j->active,
+				     dnsperf_journal_path(j, ++j->seq).c_str()))
+			return 1;
+		j->active.precise = 1;
+		j->open = 1;
+	}
+	if (dnsperf_col_append(&j->active, samples, n)) {
+		cerr << "Unable to write to the journal" << endl;
+		return 1;
+	}
+	j->spilled += n;
+	j->dirty = 1;
+	dnsperf_journal_bytes(j);
+	if (j->active.length >= DNSPERF_JOURNAL_SEGMENT)
+		dnsperf_journal_seal(j);
+	else
+		dnsperf_journal_sync(j, 0);
+	return 0;
+}
+
+int dnsperf_journal_pending(struct dnsperf_journal *j)
+{
+	return !j->replay.empty() || !j->sealed.empty() ||
+	    (j->open && j->active.length > sizeof(struct dnsperf_col_header));
+}
+
+/* Done with the segment being replayed, one way or another */
+static void dnsperf_journal_drop(struct dnsperf_journal *j)
+{
+	string path = dnsperf_journal_path(j, j->sealed.front().seq);
+
+	if (j->reading)
+		dnsperf_col_reader_close(&j->reader);
+	j->reading = 0;
+	if (unlink(path.c_str()) && errno != ENOENT)
+		cerr << "Unable to remove " << path << ": " <<
+		    strerror(errno) << endl;
+	j->sealed_bytes -= j->sealed.front().size;
+	j->sealed.pop_front();
+	dnsperf_journal_bytes(j);
+}
+
+/* Hand the sink the next block, if the rate allows; returns what the sink
+ * said, with the rows it was given in rows (0 if none) and when the last
+ * of them was taken in last */
+int dnsperf_journal_replay(struct dnsperf_journal *j, struct dnsperf_sink *s,
+			   size_t *rows, time_t *last)
+{
+	int ret;
+
+	*rows = 0;
+	if (j->replay.empty()) {
+		int got;
+
+		if (!j->reading) {
+			if (j->sealed.empty()) {
+				if (!dnsperf_journal_pending(j))
+					return DNSPERF_SINK_OK;
+				dnsperf_journal_seal(j);
+			}
+			if (dnsperf_col_reader_open(&j->reader,
+				dnsperf_journal_path(j,
+				    j->sealed.front().seq).c_str())) {
+				dnsperf_journal_drop(j);
+				return DNSPERF_SINK_OK;
+			}
+			j->reading = 1;
+		}
+		got = dnsperf_col_read(&j->reader, &j->replay);
+		if (got <= 0) {
+			if (got < 0)
+				cerr << "Dropping the rest of a corrupt " <<
+				    "journal segment" << endl;
+			dnsperf_journal_drop(j);
+			return DNSPERF_SINK_OK;
+		}
+	}
+
+	/* token bucket, deep enough for a second's worth or one block */
+	if (j->rate) {
+		unsigned long now = dnsperf_now_ms();
+		double cap = max((double)j->rate, (double)j->replay.size());
+
+		j->tokens = min(cap, j->tokens +
+				(now - j->refilled) * j->rate / 1000.0);
+		j->refilled = now;
+		if (j->tokens < j->replay.size())
+			return DNSPERF_SINK_OK;
+	}
+
+	ret = s->write(s, &j->replay[0], j->replay.size());
+	if (ret == DNSPERF_SINK_RETRY)
+		return ret;
+	*rows = j->replay.size();
+	*last = j->replay.back().tm;
+	if (j->rate)
+		j->tokens -= *rows;
+	if (ret == DNSPERF_SINK_OK)
+		j->replayed += *rows;
+	j->replay.clear();
+	return ret;
+}
+
+/* What is left is replayed the next time */
+void dnsperf_journal_close(struct dnsperf_journal *j)
+{
+	if (j->reading)
+		dnsperf_col_reader_close(&j->reader);
+	j->reading = 0;
+	j->replay.clear();
+	if (j->open) {
+		dnsperf_col_sync(&j->active);
+		dnsperf_col_close(&j->active);
+	}
+	j->open = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * journal.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Spill journal for the query log (-J). While the sink's backend is away,
+ * the writer appends its batches to a directory of columnar sample files
+ * (colfile.h) instead of holding on to them, and replays the oldest of them
+ * into the sink, block by block and at a bounded rate, once it is back.
+ * Segments a previous run left behind are replayed too.
+ */
+
+#ifndef DNSPERF_JOURNAL_H
+#define DNSPERF_JOURNAL_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "colfile.h"
+#include "sink.h"
+#include "writer.h"
+
+/* a segment is sealed, and a new one started, past this size */
+#define DNSPERF_JOURNAL_SEGMENT	DNSPERF_COL_CHUNK
+/* what is appended reaches the disk at least this often (ms) */
+#define DNSPERF_JOURNAL_SYNC	1000
+/* segments are <dir>/<seq>.col */
+#define DNSPERF_JOURNAL_SUFFIX	".col"
+
+struct dnsperf_journal_segment {
+	unsigned long seq;
+	uint64_t size;
+};
+
+/* Only ever used from the writer thread; the counters are for -x */
+struct dnsperf_journal {
+	std::string dir;
+	uint64_t max;			/* bytes, all segments */
+	unsigned long rate;		/* replayed rows/s, 0: no limit */
+	/* sealed segments, oldest first; the first one is being replayed */
+	std::deque<struct dnsperf_journal_segment> sealed;
+	uint64_t sealed_bytes;
+	/* the segment being appended to */
+	struct dnsperf_colfile active;
+	unsigned long seq;
+	int open;
+	int dirty;			/* appended to since the last sync */
+	unsigned long synced;		/* ms */
+	/* replay */
+	struct dnsperf_col_reader reader;
+	int reading;
+	std::vector<struct dnsperf_sample> replay;	/* block not taken yet */
+	double tokens;
+	unsigned long refilled;		/* ms */
+	volatile uint64_t bytes;
+	volatile unsigned long spilled;
+	volatile unsigned long replayed;
+	volatile unsigned long full;	/* batches it had no room for */
+};
+
+int dnsperf_journal_open(struct dnsperf_journal *j, const char *dir,
+			 uint64_t max, unsigned long rate);
+int dnsperf_journal_append(struct dnsperf_journal *j,
+			   const struct dnsperf_sample *samples, size_t n);
+int dnsperf_journal_pending(struct dnsperf_journal *j);
+int dnsperf_journal_replay(struct dnsperf_journal *j, struct dnsperf_sink *s,
+			   size_t *rows, time_t *last);
+void dnsperf_journal_sync(struct dnsperf_journal *j, int force);
+void dnsperf_journal_close(struct dnsperf_journal *j);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * limiter.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Probe limiter. The engine asks before every send (admit) and tells us
+ * about every probe it was allowed to send once it is done, answer, timeout
+ * or error; AIMD only looks at answers and timeouts.
+ */
+
+#include "limiter.h"
+#include "probe.h"
+
+using namespace std;
+
+static void dnsperf_limit_init(struct dnsperf_limit *lim, unsigned int ceiling,
+			       double rate, uint64_t now)
+{
+	lim->window = lim->ceiling = ceiling;
+	lim->inflight = 0;
+	lim->tokens = rate * DNSPERF_LIMIT_BURST;
+	lim->refilled = now;
+	lim->answered = lim->timeouts = 0;
+	lim->held_at = 0;
+}
+
+/* inflight is the engine's (and so the global window's) ceiling; the rest
+ * are this worker's share, 0 for no limit */
+void dnsperf_limiter_init(struct dnsperf_limiter *l, unsigned int inflight,
+			  unsigned int per_address, double rate,
+			  double threshold)
+{
+	l->rate = rate;
+	l->threshold = threshold;
+	l->ceiling = per_address && per_address < inflight ? per_address :
+	    inflight;
+	dnsperf_limit_init(&l->global, inflight, 0, 0);
+	l->addrs.clear();
+	l->held = l->clamped = l->decreases = 0;
+}
+
+/* Is it holding back right now: a window AIMD has not given back in full,
+ * or a send held back a moment ago */
+static int dnsperf_limit_clamping(const struct dnsperf_limit *lim,
+				  uint64_t now)
+{
+	return lim->window < lim->ceiling ||
+	    (lim->held_at && now - lim->held_at < DNSPERF_LIMIT_MEMORY);
+}
+
+/* May p go out now ? 0 if so, and it is booked in flight */
+int dnsperf_limiter_admit(struct dnsperf_limiter *l, struct dnsperf_probe *p,
+			  uint64_t now)
+{
+	const char *address = p->address ? p->address : "";
+	map<const char *, struct dnsperf_limit>::iterator it;
+	struct dnsperf_limit *lim;
+
+	it = l->addrs.find(address);
+	if (it == l->addrs.end()) {
+		it = l->addrs.insert(make_pair(address,
+					       dnsperf_limit())).first;
+		dnsperf_limit_init(&it->second, l->ceiling, l->rate, now);
+	}
+	lim = &it->second;
+
+	if (l->global.inflight >= l->global.window) {
+		l->global.held_at = now;
+		goto held;
+	}
+	if (lim->inflight >= lim->window)
+		goto held_here;
+	if (l->rate) {
+		double burst = l->rate * DNSPERF_LIMIT_BURST;
+
+		lim->tokens += (now - lim->refilled) * l->rate / 1e9;
+		if (lim->tokens > (burst > 1 ? burst : 1))
+			lim->tokens = burst > 1 ? burst : 1;
+		lim->refilled = now;
+		if (lim->tokens < 1)
+			goto held_here;
+		lim->tokens -= 1;
+	}
+
+	lim->inflight++;
+	l->global.inflight++;
+	p->limit = lim;
+	p->clamped = dnsperf_limit_clamping(&l->global, now) ||
+	    dnsperf_limit_clamping(lim, now);
+	if (p->clamped)
+		l->clamped++;
+	return 0;
+held_here:
+	lim->held_at = now;
+held:
+	l->held++;
+	return 1;
+}
+
+/* Additive increase, multiplicative decrease, a window's worth of
+ * completions at a time */
+static void dnsperf_limit_judge(struct dnsperf_limiter *l,
+				struct dnsperf_limit *lim, int timeout)
+{
+	unsigned int total;
+
+	if (timeout)
+		lim->timeouts++;
+	else
+		lim->answered++;
+	total = lim->answered + lim->timeouts;
+	if (total < DNSPERF_LIMIT_EPOCH || total < lim->window)
+		return;
+	if (lim->timeouts > l->threshold * total) {
+		lim->window /= 2;
+		if (lim->window < 1)
+			lim->window = 1;
+		l->decreases++;
+	} else if (lim->window < lim->ceiling) {
+		lim->window += 1;
+		if (lim->window > lim->ceiling)
+			lim->window = lim->ceiling;
+	}
+	lim->answered = lim->timeouts = 0;
+}
+
+void dnsperf_limiter_done(struct dnsperf_limiter *l,
+			  const struct dnsperf_probe *p)
+{
+	struct dnsperf_limit *lim = p->limit;
+
+	if (!lim)
+		return;
+	lim->inflight--;
+	l->global.inflight--;
+	if (!l->threshold || (p->status != DNSPERF_PROBE_OK &&
+			      p->status != DNSPERF_PROBE_TIMEOUT))
+		return;
+	dnsperf_limit_judge(l, &l->global,
+			    p->status == DNSPERF_PROBE_TIMEOUT);
+	dnsperf_limit_judge(l, lim, p->status == DNSPERF_PROBE_TIMEOUT);
+}
+
+/* How many more the global window takes right now */
+unsigned int dnsperf_limiter_room(const struct dnsperf_limiter *l)
+{
+	unsigned int window = (unsigned int)l->global.window;
+
+	return window > l->global.inflight ? window - l->global.inflight : 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * limiter.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Concurrency and rate limiter of a probe engine, so that a fast run does
+ * not end up measuring queues of its own making (ours, our uplink's, or a
+ * nameserver's that is rate limiting us). Every nameserver address gets at
+ * most -I queries in flight and -M a second (a token bucket), and with -A
+ * both that window and the engine's as a whole follow AIMD on the timeout
+ * rate: halved when more than -A percent of a window's worth of queries
+ * time out, one more otherwise. Sends it holds back are not made (or made
+ * later, in the closed loop), and samples taken while it is clamping say so.
+ *
+ * Each worker has a limiter of its own and takes its share of -I and -M, so
+ * the probe path takes no locks.
+ */
+
+#ifndef DNSPERF_LIMITER_H
+#define DNSPERF_LIMITER_H
+
+#include <map>
+#include <stdint.h>
+
+struct dnsperf_probe;
+
+/* completions, at least, before a window is judged */
+#define DNSPERF_LIMIT_EPOCH	16
+/* a held back send marks samples as clamped for this long (ns) */
+#define DNSPERF_LIMIT_MEMORY	1000000000ULL
+/* the token bucket holds this much of a second's worth */
+#define DNSPERF_LIMIT_BURST	0.1
+/* how long (ms) the closed loop waits before it tries held sends again */
+#define DNSPERF_LIMIT_WAIT	1
+
+struct dnsperf_limit {
+	double window;			/* queries in flight allowed */
+	unsigned int ceiling;		/* and what it grows back to */
+	unsigned int inflight;
+	double tokens;			/* -M */
+	uint64_t refilled;		/* ns, CLOCK_MONOTONIC */
+	unsigned int answered, timeouts;	/* since it was judged */
+	uint64_t held_at;		/* ns, last send held back; 0: never */
+};
+
+struct dnsperf_limiter {
+	double rate;			/* per address and second, 0: any */
+	double threshold;		/* timeout rate, 0: no AIMD */
+	unsigned int ceiling;		/* per address */
+	struct dnsperf_limit global;
+	/* by address, as the topology has it (the pointers stay put) */
+	std::map<const char *, struct dnsperf_limit> addrs;
+	/* for -x and the reports */
+	volatile unsigned long held;	/* sends held back */
+	volatile unsigned long clamped;	/* samples taken while clamping */
+	volatile unsigned long decreases;	/* windows halved */
+};
+
+void dnsperf_limiter_init(struct dnsperf_limiter *l, unsigned int inflight,
+			  unsigned int per_address, double rate,
+			  double threshold);
+int dnsperf_limiter_admit(struct dnsperf_limiter *l, struct dnsperf_probe *p,
+			  uint64_t now);
+void dnsperf_limiter_done(struct dnsperf_limiter *l,
+			  const struct dnsperf_probe *p);
+unsigned int dnsperf_limiter_room(const struct dnsperf_limiter *l);
+
+#endif
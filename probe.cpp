@@ -0,0 +1,975 @@
+/*
+ * probe.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Asynchronous probe engine. Queries are encoded with ldns once per domain,
+ * as a template; a probe is a copy of it with a fresh label and DNS ID, sent
+ * over one non-blocking UDP socket per address family. Answers are picked up
+ * through epoll (Linux) or kqueue (BSD/Mac) into a stack buffer and matched
+ * to their probe by DNS ID and source address; only the header is parsed,
+ * so probing does no heap allocation. Up to max_inflight queries are
+ * outstanding at any time, each with its own timeout.
+ *
+ * Probes can either be run as a batch (dnsperf_engine_run) or, for open-loop
+ * scheduling, be submitted one at a time and collected as they complete
+ * (dnsperf_engine_submit + dnsperf_engine_poll).
+ *
+ * The clock is taken right before sendto() and right after the answer is
+ * read (or, with DNSPERF_CLOCK_KERNEL, when the kernel got it), so encoding
+ * and bookkeeping stay out of the measurement. CLOCK_MONOTONIC is the
+ * default: unlike gettimeofday() it does not jump under NTP.
+ *
+ * Where there are sendmmsg() and recvmmsg() (Linux), queries go out and
+ * answers come in DNSPERF_SEND_BATCH and DNSPERF_RECV_BATCH at a time, one
+ * system call each, and a batch shares its clock readings. At high rates
+ * that is most of the system calls gone, and fewer chances to be scheduled
+ * out between the clock and the packet.
+ *
+ * With -e tcp, tls or https, queries go over connections instead, one per
+ * nameserver address and kept open (transport.cpp); the engine still hands
+ * out the IDs and does the timeouts, and the transport hands back answers.
+ *
+ * With a limiter (limiter.cpp), every send is asked for first; those it
+ * holds back come back as DNSPERF_PROBE_HELD, and the batch runner tries
+ * them again once there is room.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+#include "dnsperf.h"
+#include "limiter.h"
+#include "probe.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "transport.h"
+
+using namespace std;
+
+#define DNSPERF_POLL_EVENTS 16
+/* what an answer takes of a socket's receive buffer, kernel overhead and
+ * all */
+#define DNSPERF_SOCKBUF_PER_PROBE 2048
+
+/* DNS header bits we look at (RFC 1035, 4.1.1) */
+#define DNS_HDR_LEN 12
+#define DNS_QR(wire) ((wire)[2] & 0x80)
+#define DNS_TC(wire) ((wire)[2] & 0x02)
+#define DNS_RCODE(wire) ((wire)[3] & 0x0f)
+#define DNS_ANCOUNT(wire) (((wire)[6] << 8) | (wire)[7])
+
+/* Poller helpers: epoll on Linux, kqueue everywhere else */
+static int dnsperf_poll_create(void)
+{
+#if defined(__linux__)
+	return epoll_create(DNSPERF_POLL_EVENTS);
+#else
+	return kqueue();
+#endif
+}
+
+int dnsperf_poll_add(int pollfd, int fd)
+{
+#if defined(__linux__)
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(pollfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	return kevent(pollfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+/* Also tell us when fd can be written to, or stop doing so */
+int dnsperf_poll_out(int pollfd, int fd, int on)
+{
+#if defined(__linux__)
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(pollfd, EPOLL_CTL_MOD, fd, &ev);
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_WRITE, on ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	return kevent(pollfd, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+/* Wait up to timeout ms, return the number of ready fds in fds[] */
+static int dnsperf_poll_wait(int pollfd, int *fds, int max, int timeout)
+{
+	int n;
+#if defined(__linux__)
+	struct epoll_event evs[DNSPERF_POLL_EVENTS];
+
+	if (max > DNSPERF_POLL_EVENTS)
+		max = DNSPERF_POLL_EVENTS;
+	n = epoll_wait(pollfd, evs, max, timeout);
+	for (int i = 0; i < n; i++)
+		fds[i] = evs[i].data.fd;
+#else
+	struct kevent evs[DNSPERF_POLL_EVENTS];
+	struct timespec ts;
+
+	if (max > DNSPERF_POLL_EVENTS)
+		max = DNSPERF_POLL_EVENTS;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	n = kevent(pollfd, NULL, 0, evs, max, &ts);
+	for (int i = 0; i < n; i++)
+		fds[i] = (int)evs[i].ident;
+#endif
+	if (n < 0 && errno == EINTR)
+		return 0;
+	return n;
+}
+
+/* Non-blocking, with room in the receive queue for an answer to every
+ * probe we may have in flight */
+static int dnsperf_socket(int family, unsigned int inflight)
+{
+	int fd, size, want = inflight * DNSPERF_SOCKBUF_PER_PROBE;
+	socklen_t len = sizeof(size);
+
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		close(fd);
+		return -1;
+	}
+	/* never less than the default; net.core.rmem_max has the last word */
+	if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) &&
+	    size < want &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &want, sizeof(want)) &&
+	    dnsperf_verbose)
+		cout << "Unable to grow the receive buffer: " <<
+		    strerror(errno) << endl;
+	return fd;
+}
+
+/* t2 - t1, in ns */
+static int64_t dnsperf_tsdiff(const struct timespec *t1,
+			      const struct timespec *t2)
+{
+	return (int64_t)(t2->tv_sec - t1->tv_sec) * 1000000000LL +
+	    (t2->tv_nsec - t1->tv_nsec);
+}
+
+int dnsperf_parse_clock(const char *name)
+{
+	if (!strcmp(name, "wall"))
+		return DNSPERF_CLOCK_WALL;
+	if (!strcmp(name, "mono"))
+		return DNSPERF_CLOCK_MONO;
+	if (!strcmp(name, "kernel"))
+		return DNSPERF_CLOCK_KERNEL;
+	return -1;
+}
+
+/* Timeouts and send errors are the engine's call; of the answers, only
+ * NOERROR and NXDOMAIN (which is what our random names should get) are
+ * good for a latency sample */
+int dnsperf_probe_outcome(const struct dnsperf_probe *p)
+{
+	switch (p->status) {
+	case DNSPERF_PROBE_OK:
+		break;
+	case DNSPERF_PROBE_TIMEOUT:
+		return DNSPERF_OUTCOME_TIMEOUT;
+	default:
+		return DNSPERF_OUTCOME_NETERR;
+	}
+	if (p->truncated)
+		return DNSPERF_OUTCOME_TRUNCATED;
+	switch (p->rcode) {
+	case LDNS_RCODE_NOERROR:
+	case LDNS_RCODE_NXDOMAIN:
+		return DNSPERF_OUTCOME_OK;
+	case LDNS_RCODE_SERVFAIL:
+		return DNSPERF_OUTCOME_SERVFAIL;
+	case LDNS_RCODE_REFUSED:
+		return DNSPERF_OUTCOME_REFUSED;
+	default:
+		return DNSPERF_OUTCOME_RCODE;
+	}
+}
+
+const char *dnsperf_outcome_name(int outcome)
+{
+	static const char *names[DNSPERF_OUTCOMES] = {
+		"ok", "timeout", "servfail", "refused", "truncated", "rcode",
+		"neterr"
+	};
+
+	if (outcome < 0 || outcome >= DNSPERF_OUTCOMES)
+		return "unknown";
+	return names[outcome];
+}
+
+static void dnsperf_wallclock(struct timespec *ts)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts->tv_sec = tv.tv_sec;
+	ts->tv_nsec = tv.tv_usec * 1000;
+}
+
+/* When the query went out, for the log; not what latencies come from */
+static void dnsperf_stamp(struct dnsperf_probe *p)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	p->tm = tv.tv_sec;
+	p->usec = tv.tv_usec;
+}
+
+/* Ask the kernel to stamp every datagram it receives on fd */
+static int dnsperf_rx_timestamps(int fd)
+{
+#ifdef SO_TIMESTAMPNS
+	int on = 1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#else
+	return -1;
+#endif
+}
+
+/* Does an answer come from the address we sent the probe to ? */
+static int dnsperf_same_addr(const struct sockaddr_storage *a,
+			     const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET) {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+		const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+		return a4->sin_port == b4->sin_port &&
+		    a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	}
+	if (a->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+		return a6->sin6_port == b6->sin6_port &&
+		    !memcmp(&a6->sin6_addr, &b6->sin6_addr,
+			    sizeof(a6->sin6_addr));
+	}
+	return 0;
+}
+
+int dnsperf_engine_init(struct dnsperf_engine *e, unsigned int max_inflight,
+			unsigned int timeout, unsigned int seed, int clock)
+{
+	memset(e, 0, sizeof(*e));
+	e->seed = seed;
+	e->clock = clock;
+	e->max_inflight = max_inflight;
+	if (e->max_inflight < 1)
+		e->max_inflight = 1;
+	if (e->max_inflight > DNSPERF_IDS / 2)
+		e->max_inflight = DNSPERF_IDS / 2;
+	e->timeout = timeout;
+
+	e->pollfd = dnsperf_poll_create();
+	if (e->pollfd < 0) {
+		cerr << "Unable to create poller: " << strerror(errno) << endl;
+		return 1;
+	}
+
+	e->fd4 = dnsperf_socket(AF_INET, e->max_inflight);
+	if (e->fd4 < 0 || dnsperf_poll_add(e->pollfd, e->fd4)) {
+		cerr << "Unable to set up IPv4 socket: " << strerror(errno) <<
+		    endl;
+		return 1;
+	}
+	/* Not fatal: v6 probes will just fail on a v4-only host */
+	e->fd6 = dnsperf_socket(AF_INET6, e->max_inflight);
+	if (e->fd6 >= 0 && dnsperf_poll_add(e->pollfd, e->fd6)) {
+		close(e->fd6);
+		e->fd6 = -1;
+	}
+	if (e->fd6 < 0 && dnsperf_verbose)
+		cout << "No IPv6 socket, IPv6 nameservers will fail" << endl;
+
+	if (e->clock == DNSPERF_CLOCK_KERNEL &&
+	    (dnsperf_rx_timestamps(e->fd4) ||
+	     (e->fd6 >= 0 && dnsperf_rx_timestamps(e->fd6)))) {
+		cout << "No kernel timestamps here, using the monotonic clock"
+		    << endl;
+		e->clock = DNSPERF_CLOCK_MONO;
+	}
+
+	return 0;
+}
+
+void dnsperf_engine_destroy(struct dnsperf_engine *e)
+{
+	if (e->streams)
+		dnsperf_streams_destroy(e);
+	if (e->fd4 >= 0)
+		close(e->fd4);
+	if (e->fd6 >= 0)
+		close(e->fd6);
+	if (e->pollfd >= 0)
+		close(e->pollfd);
+}
+
+/* Room for how many more probes right now */
+static size_t dnsperf_engine_room(const struct dnsperf_engine *e)
+{
+	size_t room = e->max_inflight > e->inflight ?
+	    e->max_inflight - e->inflight : 0;
+
+	if (room > DNSPERF_IDS - (e->head - e->tail))
+		room = DNSPERF_IDS - (e->head - e->tail);
+	if (e->limiter && room > dnsperf_limiter_room(e->limiter))
+		room = dnsperf_limiter_room(e->limiter);
+	return room;
+}
+
+/* A probe in flight is done (its status set): free its ID */
+static void dnsperf_engine_retire(struct dnsperf_engine *e,
+				  struct dnsperf_probe *p)
+{
+	e->ids[p->id] = NULL;
+	e->inflight--;
+	if (e->limiter)
+		dnsperf_limiter_done(e->limiter, p);
+}
+
+/* A probe that never made it out is done right away */
+static void dnsperf_engine_fail(struct dnsperf_probe *p)
+{
+	p->status = DNSPERF_PROBE_ERROR;
+	p->latency = 0;
+	dnsperf_stamp(p);
+}
+
+/* Grab a free DNS ID, stamp it on the query and book the probe in flight;
+ * dnsperf_engine_flush() sends it */
+static int dnsperf_engine_prepare(struct dnsperf_engine *e,
+				  struct dnsperf_probe *p)
+{
+	uint16_t id;
+	int fd;
+
+	/* connections have sockets of their own */
+	fd = p->addr.ss_family == AF_INET6 ? e->fd6 : e->fd4;
+	if ((fd < 0 && !e->streams) || !p->wirelen)
+		return 1;
+
+	id = rand_r(&e->seed) & 0xffff;
+	while (e->ids[id])
+		id++;
+	p->id = id;
+	p->wire[0] = id >> 8;
+	p->wire[1] = id & 0xff;
+
+	/* with nothing in flight every entry left in the ring is stale, and
+	 * its probe may be gone (the vector it was in resized): drop them
+	 * before they end up behind a live one */
+	if (!e->inflight)
+		e->tail = e->head;
+	e->ids[id] = p;
+	e->inflight++;
+	p->seq = ++e->seq;
+	e->order[e->head % DNSPERF_IDS].p = p;
+	e->order[e->head % DNSPERF_IDS].seq = p->seq;
+	e->head++;
+	return 0;
+}
+
+/* The send failed after all; its entry in order is stale from now on */
+static void dnsperf_engine_unsend(struct dnsperf_engine *e,
+				  struct dnsperf_probe *p)
+{
+	if (dnsperf_verbose)
+		cout << "sendto " << p->nameserver << " failed: " <<
+		    strerror(errno) << endl;
+	dnsperf_engine_fail(p);
+	dnsperf_engine_retire(e, p);
+}
+
+/* Send n prepared probes out of fd, sendmmsg() permitting in one system
+ * call; returns how many failed. The clocks are read once, right before,
+ * for all of them. */
+static size_t dnsperf_engine_flush(struct dnsperf_engine *e, int fd,
+				   struct dnsperf_probe **ps, size_t n)
+{
+	struct timespec sent, sent_rt = { 0, 0 };
+	size_t failed = 0;
+	uint64_t start;
+
+	if (!n)
+		return 0;
+	start = dnsperf_trace_begin(e->trace);
+	dnsperf_stamp(ps[0]);
+	for (size_t i = 1; i < n; i++) {
+		ps[i]->tm = ps[0]->tm;
+		ps[i]->usec = ps[0]->usec;
+	}
+	if (e->clock == DNSPERF_CLOCK_WALL)
+		dnsperf_wallclock(&sent_rt);
+	else if (e->clock == DNSPERF_CLOCK_KERNEL)
+		clock_gettime(CLOCK_REALTIME, &sent_rt);
+	clock_gettime(CLOCK_MONOTONIC, &sent);
+	for (size_t i = 0; i < n; i++) {
+		ps[i]->sent = sent;
+		ps[i]->sent_rt = sent_rt;
+	}
+
+#ifdef DNSPERF_MMSG
+	struct mmsghdr msgs[DNSPERF_SEND_BATCH];
+	struct iovec iov[DNSPERF_SEND_BATCH];
+	size_t done = 0;
+
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (size_t i = 0; i < n; i++) {
+		iov[i].iov_base = ps[i]->wire;
+		iov[i].iov_len = ps[i]->wirelen;
+		msgs[i].msg_hdr.msg_name = &ps[i]->addr;
+		msgs[i].msg_hdr.msg_namelen = ps[i]->addrlen;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (done < n) {
+		int sent = sendmmsg(fd, msgs + done, n - done, 0);
+
+		if (sent < 0 && errno == EINTR)
+			continue;
+		/* the first one of the rest failed; go on after it */
+		if (sent <= 0) {
+			dnsperf_engine_unsend(e, ps[done++]);
+			failed++;
+			continue;
+		}
+		done += sent;
+	}
+#else
+	for (size_t i = 0; i < n; i++)
+		if (sendto(fd, ps[i]->wire, ps[i]->wirelen, 0,
+			   (struct sockaddr *)&ps[i]->addr,
+			   ps[i]->addrlen) < 0) {
+			dnsperf_engine_unsend(e, ps[i]);
+			failed++;
+		}
+#endif
+	dnsperf_trace_end(e->trace, DNSPERF_STAGE_SEND, start, n);
+	return failed;
+}
+
+/* Only the header: is it an answer at all, to what ID, and how did it go */
+int dnsperf_answer_parse(const uint8_t *buf, size_t len,
+			 struct dnsperf_answer *a)
+{
+	if (len < DNS_HDR_LEN || !DNS_QR(buf))
+		return 1;
+	a->id = (buf[0] << 8) | buf[1];
+	a->rcode = DNS_RCODE(buf);
+	a->truncated = DNS_TC(buf) ? 1 : 0;
+	a->ancount = DNS_ANCOUNT(buf);
+	return 0;
+}
+
+/* The question is echoed back: an answer for an older probe that happened
+ * to get the same ID has a different label */
+int dnsperf_answer_match(const struct dnsperf_probe *p, const uint8_t *buf,
+			 size_t len)
+{
+	if (!p->label_len)
+		return 1;
+	return len >= p->label + p->label_len &&
+	    buf[p->label - 1] == p->label_len &&
+	    !strncasecmp((const char *)buf + p->label,
+			 (const char *)p->wire + p->label, p->label_len);
+}
+
+/* One answer, read at now (and now_rt, for the wall clock); msg has the
+ * kernel's timestamp, if any */
+static void dnsperf_engine_answer(struct dnsperf_engine *e,
+				  const uint8_t *buf, size_t len,
+				  const struct sockaddr_storage *from,
+				  struct msghdr *msg,
+				  const struct timespec *now,
+				  const struct timespec *now_rt,
+				  vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_probe *p;
+	struct timespec *kernel_ts = NULL;
+	struct dnsperf_answer a;
+	int64_t latency;
+
+	if (dnsperf_answer_parse(buf, len, &a))
+		return;
+
+	p = e->ids[a.id];
+	/* late answer to a probe that already timed out, or noise */
+	if (!p || !dnsperf_same_addr(&p->addr, from) ||
+	    !dnsperf_answer_match(p, buf, len))
+		return;
+
+#ifdef SO_TIMESTAMPNS
+	if (e->clock == DNSPERF_CLOCK_KERNEL) {
+		struct cmsghdr *cmsg;
+
+		for (cmsg = CMSG_FIRSTHDR(msg); cmsg;
+		     cmsg = CMSG_NXTHDR(msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_TIMESTAMPNS)
+				kernel_ts = (struct timespec *)CMSG_DATA(cmsg);
+	}
+#endif
+	if (e->clock == DNSPERF_CLOCK_WALL)
+		latency = dnsperf_tsdiff(&p->sent_rt, now_rt);
+	else if (kernel_ts)
+		latency = dnsperf_tsdiff(&p->sent_rt, kernel_ts);
+	else
+		latency = dnsperf_tsdiff(&p->sent, now);
+	/* kernel stamps are CLOCK_REALTIME: if that got stepped in the
+	 * meantime, the monotonic clock still knows better */
+	if (latency < 0)
+		latency = dnsperf_tsdiff(&p->sent, now);
+
+	p->latency = latency;
+	p->rcode = a.rcode;
+	p->truncated = a.truncated;
+	p->ancount = a.ancount;
+	p->status = DNSPERF_PROBE_OK;
+	dnsperf_engine_retire(e, p);
+	done->push_back(p);
+}
+
+/* An answer that came over connection c, read at now; returns 1 if it
+ * answers none of our probes. Only the monotonic clock is good here: there
+ * are no kernel stamps for what comes out of a TLS record. */
+int dnsperf_engine_answer_stream(struct dnsperf_engine *e,
+				 struct dnsperf_conn *c, const uint8_t *buf,
+				 size_t len, const struct timespec *now,
+				 vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_probe *p;
+	struct dnsperf_answer a;
+
+	if (dnsperf_answer_parse(buf, len, &a))
+		return 1;
+	p = e->ids[a.id];
+	if (!p || p->conn != c || !dnsperf_answer_match(p, buf, len))
+		return 1;
+
+	p->latency = dnsperf_tsdiff(&p->wrote, now);
+	p->rcode = a.rcode;
+	p->truncated = a.truncated;
+	p->ancount = a.ancount;
+	p->status = DNSPERF_PROBE_OK;
+	dnsperf_engine_retire(e, p);
+	done->push_back(p);
+	return 0;
+}
+
+/* A probe in flight that will get no answer after all (its connection went
+ * away): it is done, as if it never made it out */
+void dnsperf_engine_abort(struct dnsperf_engine *e, struct dnsperf_probe *p,
+			  vector<struct dnsperf_probe *> *done)
+{
+	p->status = DNSPERF_PROBE_ERROR;
+	p->latency = 0;
+	dnsperf_engine_retire(e, p);
+	done->push_back(p);
+}
+
+static void dnsperf_engine_msg(struct dnsperf_engine *e, unsigned int i,
+			       struct msghdr *msg, struct iovec *iov)
+{
+	iov->iov_base = e->rx[i];
+	iov->iov_len = DNSPERF_RECV_BUF;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = &e->rx_from[i];
+	msg->msg_namelen = sizeof(e->rx_from[i]);
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_control = e->rx_control[i];
+	msg->msg_controllen = DNSPERF_RECV_CONTROL;
+}
+
+/* Read every pending answer on a socket and complete the matching probes;
+ * recvmmsg() takes up to DNSPERF_RECV_BATCH of them per system call, and
+ * those share a reading of the clock */
+static void dnsperf_engine_recv(struct dnsperf_engine *e, int fd,
+				vector<struct dnsperf_probe *> *done)
+{
+	struct timespec now, now_rt;
+	uint64_t start;
+#ifdef DNSPERF_MMSG
+	struct mmsghdr msgs[DNSPERF_RECV_BATCH];
+	struct iovec iov[DNSPERF_RECV_BATCH];
+	int n;
+
+	do {
+		for (unsigned int i = 0; i < DNSPERF_RECV_BATCH; i++) {
+			dnsperf_engine_msg(e, i, &msgs[i].msg_hdr, &iov[i]);
+			msgs[i].msg_len = 0;
+		}
+		start = dnsperf_trace_begin(e->trace);
+		n = recvmmsg(fd, msgs, DNSPERF_RECV_BATCH, 0, NULL);
+		dnsperf_trace_end(e->trace, DNSPERF_STAGE_RECV, start,
+				  n > 0 ? n : 0);
+		if (n <= 0)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (e->clock == DNSPERF_CLOCK_WALL)
+			dnsperf_wallclock(&now_rt);
+		start = dnsperf_trace_begin(e->trace);
+		for (int i = 0; i < n; i++)
+			dnsperf_engine_answer(e, e->rx[i], msgs[i].msg_len,
+					      &e->rx_from[i], &msgs[i].msg_hdr,
+					      &now, &now_rt, done);
+		dnsperf_trace_end(e->trace, DNSPERF_STAGE_PARSE, start, n);
+		/* a short read means the socket is empty */
+	} while (n == DNSPERF_RECV_BATCH);
+#else
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+
+	for (;;) {
+		dnsperf_engine_msg(e, 0, &msg, &iov);
+		start = dnsperf_trace_begin(e->trace);
+		len = recvmsg(fd, &msg, 0);
+		dnsperf_trace_end(e->trace, DNSPERF_STAGE_RECV, start,
+				  len < 0 ? 0 : 1);
+		if (len < 0)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (e->clock == DNSPERF_CLOCK_WALL)
+			dnsperf_wallclock(&now_rt);
+		start = dnsperf_trace_begin(e->trace);
+		dnsperf_engine_answer(e, e->rx[0], len, &e->rx_from[0], &msg,
+				      &now, &now_rt, done);
+		dnsperf_trace_end(e->trace, DNSPERF_STAGE_PARSE, start, 1);
+	}
+#endif
+}
+
+/* Ask the limiter, if any; 1 if p is to be held back */
+static int dnsperf_engine_admit(struct dnsperf_engine *e,
+				struct dnsperf_probe *p, uint64_t now)
+{
+	p->limit = NULL;
+	p->clamped = 0;
+	if (!e->limiter || !dnsperf_limiter_admit(e->limiter, p, now))
+		return 0;
+	p->status = DNSPERF_PROBE_HELD;
+	return 1;
+}
+
+/* Is there room for one more probe right now ? */
+int dnsperf_engine_full(const struct dnsperf_engine *e)
+{
+	return e->inflight >= e->max_inflight ||
+	    e->head - e->tail == DNSPERF_IDS;
+}
+
+/* Same, over connections: the transport writes them out as soon as their
+ * connection is up, all the probes of a connection in one go. The clocks
+ * here are for the log and the timeouts; latencies start at the write. */
+static size_t dnsperf_engine_submit_streams(struct dnsperf_engine *e,
+					    struct dnsperf_probe **ps, size_t n)
+{
+	struct timespec sent;
+	size_t failed = 0;
+	uint64_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &sent);
+	now = (uint64_t)sent.tv_sec * 1000000000ULL + sent.tv_nsec;
+	for (size_t i = 0; i < n; i++) {
+		struct dnsperf_probe *p = ps[i];
+
+		p->status = DNSPERF_PROBE_PENDING;
+		p->conn = NULL;
+		if (dnsperf_engine_full(e) || dnsperf_engine_admit(e, p, now)) {
+			if (p->status != DNSPERF_PROBE_HELD)
+				dnsperf_engine_fail(p);
+			failed++;
+			continue;
+		}
+		if (dnsperf_engine_prepare(e, p)) {
+			dnsperf_engine_fail(p);
+			if (e->limiter)
+				dnsperf_limiter_done(e->limiter, p);
+			failed++;
+			continue;
+		}
+		dnsperf_stamp(p);
+		p->sent = sent;
+		if (dnsperf_stream_send(e, p)) {
+			dnsperf_engine_unsend(e, p);
+			failed++;
+		}
+	}
+	dnsperf_streams_flush(e);
+	return failed;
+}
+
+/* Send probes out now, with as few system calls as we can. Those that
+ * can't go (no room, or a send error) are done right away
+ * (DNSPERF_PROBE_ERROR), those the limiter holds back are not
+ * (DNSPERF_PROBE_HELD); neither will show up in poll. Returns how many. */
+size_t dnsperf_engine_submit_many(struct dnsperf_engine *e,
+				  struct dnsperf_probe **ps, size_t n)
+{
+	struct dnsperf_probe *out[2][DNSPERF_SEND_BATCH];
+	size_t nr[2], failed = 0, i = 0;
+	uint64_t now = e->limiter ? dnsperf_now_ns() : 0;
+
+	if (e->streams)
+		return dnsperf_engine_submit_streams(e, ps, n);
+	while (i < n) {
+		nr[0] = nr[1] = 0;
+		for (; i < n && nr[0] < DNSPERF_SEND_BATCH &&
+		     nr[1] < DNSPERF_SEND_BATCH; i++) {
+			struct dnsperf_probe *p = ps[i];
+			int v6 = p->addr.ss_family == AF_INET6;
+
+			p->status = DNSPERF_PROBE_PENDING;
+			if (dnsperf_engine_full(e) ||
+			    dnsperf_engine_admit(e, p, now)) {
+				if (p->status != DNSPERF_PROBE_HELD)
+					dnsperf_engine_fail(p);
+				failed++;
+				continue;
+			}
+			if (dnsperf_engine_prepare(e, p)) {
+				dnsperf_engine_fail(p);
+				if (e->limiter)
+					dnsperf_limiter_done(e->limiter, p);
+				failed++;
+				continue;
+			}
+			out[v6][nr[v6]++] = p;
+		}
+		failed += dnsperf_engine_flush(e, e->fd4, out[0], nr[0]);
+		failed += dnsperf_engine_flush(e, e->fd6, out[1], nr[1]);
+	}
+	return failed;
+}
+
+/* Send a probe out now; same thing, for one */
+int dnsperf_engine_submit(struct dnsperf_engine *e, struct dnsperf_probe *p)
+{
+	return dnsperf_engine_submit_many(e, &p, 1) ? 1 : 0;
+}
+
+/* Oldest probe still waiting for its answer, if any. With nothing in
+ * flight every entry is stale, and its probe may be long gone, so those are
+ * dropped without looking. */
+static struct dnsperf_probe *dnsperf_engine_oldest(struct dnsperf_engine *e)
+{
+	if (!e->inflight) {
+		e->tail = e->head;
+		return NULL;
+	}
+	while (e->tail != e->head) {
+		struct dnsperf_sent *s = &e->order[e->tail % DNSPERF_IDS];
+
+		if (s->p->seq == s->seq &&
+		    s->p->status == DNSPERF_PROBE_PENDING)
+			return s->p;
+		e->tail++;
+	}
+	return NULL;
+}
+
+/* Wait up to `wait' ms (less if a probe expires earlier) for answers, and
+ * add every probe that completed or timed out meanwhile to done */
+int dnsperf_engine_poll(struct dnsperf_engine *e, int wait,
+			vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_probe *p;
+	struct timespec now;
+	int fds[DNSPERF_POLL_EVENTS];
+	int n;
+
+	/* probes whose connection failed on us since the last time are done
+	 * already, no need to wait */
+	if (e->streams) {
+		size_t before = done->size();
+
+		dnsperf_streams_failed(e, done);
+		if (done->size() > before)
+			wait = 0;
+	}
+	if ((p = dnsperf_engine_oldest(e))) {
+		long left;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = e->timeout -
+		    (long)(dnsperf_tsdiff(&p->sent, &now) / 1000000);
+		if (left < 0)
+			left = 0;
+		if (left < wait)
+			wait = left;
+	}
+
+	n = dnsperf_poll_wait(e->pollfd, fds, DNSPERF_POLL_EVENTS, wait);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		cerr << "Poll failed: " << strerror(errno) << endl;
+		return 1;
+	}
+	for (int i = 0; i < n; i++)
+		if (fds[i] == e->fd4 || fds[i] == e->fd6)
+			dnsperf_engine_recv(e, fds[i], done);
+		else if (e->streams)
+			dnsperf_stream_event(e, fds[i], done);
+
+	/* expire whatever ran out of time */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while ((p = dnsperf_engine_oldest(e))) {
+		if (dnsperf_tsdiff(&p->sent, &now) / 1000000 < e->timeout)
+			break;
+		if (dnsperf_verbose)
+			cout << "query to " << p->nameserver << " timed out" <<
+			    endl;
+		p->status = DNSPERF_PROBE_TIMEOUT;
+		p->latency = dnsperf_tsdiff(&p->sent, &now);
+		dnsperf_engine_retire(e, p);
+		e->tail++;
+		done->push_back(p);
+	}
+	return 0;
+}
+
+/* Run a batch of probes to completion (answer, timeout or error); those
+ * the limiter holds back go again, before the rest, once a round */
+int dnsperf_engine_run(struct dnsperf_engine *e, struct dnsperf_probe *probes,
+		       size_t nr_probes)
+{
+	vector<struct dnsperf_probe *> done, held, retry;
+	size_t next = 0, finished = 0;
+
+	while (finished < nr_probes) {
+		size_t again = 0;
+
+		retry.swap(held);
+		held.clear();
+		/* keep the pipe full, a batch of sends at a time */
+		while ((again < retry.size() || next < nr_probes) &&
+		       dnsperf_engine_room(e)) {
+			struct dnsperf_probe *ps[DNSPERF_SEND_BATCH];
+			size_t k = 0, room = dnsperf_engine_room(e);
+
+			while (k < DNSPERF_SEND_BATCH && k < room &&
+			       again < retry.size())
+				ps[k++] = retry[again++];
+			while (k < DNSPERF_SEND_BATCH && k < room &&
+			       next < nr_probes)
+				ps[k++] = &probes[next++];
+			dnsperf_engine_submit_many(e, ps, k);
+			for (size_t i = 0; i < k; i++)
+				if (ps[i]->status == DNSPERF_PROBE_HELD)
+					held.push_back(ps[i]);
+				else if (ps[i]->status == DNSPERF_PROBE_ERROR)
+					finished++;
+		}
+		/* what we did not get to this round */
+		held.insert(held.end(), retry.begin() + again, retry.end());
+		if (finished == nr_probes)
+			break;
+
+		done.clear();
+		if (dnsperf_engine_poll(e, held.empty() ? e->timeout :
+					DNSPERF_LIMIT_WAIT, &done))
+			return 1;
+		finished += done.size();
+	}
+	return 0;
+}
+
+/* Encode an A query for <label>.<domain> once, with ldns, and remember where
+ * the label is. The label is the first name in the packet, so it sits right
+ * after the header and its length byte, uncompressed. */
+int dnsperf_template_init(struct dnsperf_qtemplate *t, const char *domain,
+			  size_t label_len)
+{
+	char name[DNSPERF_QUERY_MAX];
+	ldns_rdf *domaintoq;
+	ldns_pkt *pkt;
+	ldns_status s;
+	uint8_t *wire;
+	size_t len;
+
+	t->wirelen = 0;
+	if (label_len < 1 || label_len > 63 ||
+	    label_len + 2 + strlen(domain) > 255) {
+		cout << "Query name too long for " << domain << endl;
+		return 1;
+	}
+	memset(name, 'a', label_len);
+	snprintf(name + label_len, sizeof(name) - label_len, ".%s", domain);
+
+	domaintoq = ldns_dname_new_frm_str(name);
+	if (!domaintoq) {
+		cout << "failed to build domain to query" << endl;
+		return 1;
+	}
+
+	/* the packet owns domaintoq from here on */
+	pkt = ldns_pkt_query_new(domaintoq, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN,
+				 LDNS_RD);
+	if (!pkt) {
+		ldns_rdf_deep_free(domaintoq);
+		return 1;
+	}
+	s = ldns_pkt2wire(&wire, pkt, &len);
+	ldns_pkt_free(pkt);
+	if (s != LDNS_STATUS_OK)
+		return 1;
+	if (len > sizeof(t->wire) || len < DNS_HDR_LEN + 1 + label_len ||
+	    wire[DNS_HDR_LEN] != label_len) {
+		free(wire);
+		return 1;
+	}
+	memcpy(t->wire, wire, len);
+	free(wire);
+	t->wirelen = len;
+	t->label = DNS_HDR_LEN + 1;
+	t->label_len = label_len;
+	return 0;
+}
+
+/* Copy a template into a probe; returns where the label bytes go */
+uint8_t *dnsperf_probe_fill(struct dnsperf_probe *p,
+			    const struct dnsperf_qtemplate *t)
+{
+	memcpy(p->wire, t->wire, t->wirelen);
+	p->wirelen = t->wirelen;
+	p->label = t->label;
+	p->label_len = t->label_len;
+	p->status = DNSPERF_PROBE_PENDING;
+	return p->wire + t->label;
+}
@@ -0,0 +1,180 @@
+/*
+ * probe.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Event-driven probe engine: pre-encoded queries are sent over non-blocking
+ * UDP sockets and answers are matched back to their probe by DNS ID, so many
+ * nameservers can be queried at once and a slow one does not hold back the
+ * rest.
+ */
+
+#ifndef DNSPERF_PROBE_H
+#define DNSPERF_PROBE_H
+
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include <ldns/ldns.h>
+
+struct dnsperf_conn;
+struct dnsperf_streams;
+struct dnsperf_limit;
+struct dnsperf_limiter;
+struct dnsperf_trace;
+
+#define DNSPERF_IDS 65536
+/* header, a name of up to 255 bytes, type and class */
+#define DNSPERF_QUERY_MAX (12 + 255 + 4)
+
+/* sendmmsg() came with glibc 2.14, recvmmsg() a bit earlier */
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 14))
+#define DNSPERF_MMSG 1
+#endif
+/* queries per sendmmsg(), answers per recvmmsg() */
+#define DNSPERF_SEND_BATCH 64
+#define DNSPERF_RECV_BATCH 64
+/* we only read the header and the question of an answer; the rest of a
+ * bigger one is cut off */
+#define DNSPERF_RECV_BUF 512
+#define DNSPERF_RECV_CONTROL 64		/* room for a kernel timestamp */
+
+/* How latency is measured */
+#define DNSPERF_CLOCK_WALL	0	/* gettimeofday(), like we used to */
+#define DNSPERF_CLOCK_MONO	1	/* CLOCK_MONOTONIC around send/recv */
+#define DNSPERF_CLOCK_KERNEL	2	/* kernel receive timestamps */
+
+/* Probe outcome */
+#define DNSPERF_PROBE_PENDING	0
+#define DNSPERF_PROBE_OK	1
+#define DNSPERF_PROBE_TIMEOUT	2
+#define DNSPERF_PROBE_ERROR	3
+#define DNSPERF_PROBE_HELD	4	/* the limiter kept it back, unsent */
+
+/* What became of a probe, as far as the stats and the query log go */
+#define DNSPERF_OUTCOME_OK		0	/* NOERROR or NXDOMAIN */
+#define DNSPERF_OUTCOME_TIMEOUT		1
+#define DNSPERF_OUTCOME_SERVFAIL	2
+#define DNSPERF_OUTCOME_REFUSED		3
+#define DNSPERF_OUTCOME_TRUNCATED	4	/* TC set, no use to us */
+#define DNSPERF_OUTCOME_RCODE		5	/* any other rcode */
+#define DNSPERF_OUTCOME_NETERR		6	/* could not even send it */
+#define DNSPERF_OUTCOMES		7
+
+/* Pre-encoded query for <label>.<domain>, built once per domain; probes are a
+ * copy of it with the label bytes and the ID rewritten in place */
+struct dnsperf_qtemplate {
+	uint8_t wire[DNSPERF_QUERY_MAX];
+	size_t wirelen;
+	size_t label;			/* offset of the first label's bytes */
+	size_t label_len;
+};
+
+struct dnsperf_probe {
+	/* filled in by the caller */
+	size_t domain;			/* index of the domain we probe */
+	const char *nameserver;		/* NS name, owned by the topology */
+	struct sockaddr_storage addr;	/* the address we actually query */
+	socklen_t addrlen;
+	const char *address;		/* and as text, owned by the topology */
+	size_t nsid;			/* dnsperf_target.nsid */
+	uint8_t wire[DNSPERF_QUERY_MAX];	/* encoded query */
+	size_t wirelen;
+	size_t label, label_len;	/* where our random label is */
+
+	/* results */
+	int status;
+	uint8_t rcode;
+	uint8_t truncated;
+	uint16_t ancount;
+	uint64_t latency;		/* ns, or how long we waited */
+	time_t tm;			/* when the query was sent */
+	uint32_t usec;			/* and the microseconds */
+	uint8_t clamped;		/* the limiter was holding back */
+
+	/* engine internal */
+	uint16_t id;
+	unsigned long seq;		/* which send of this probe */
+	struct timespec sent;		/* CLOCK_MONOTONIC, for timeouts too */
+	struct timespec sent_rt;	/* CLOCK_REALTIME, for wall/kernel */
+	/* over TCP, TLS or HTTPS (transport.h): the connection it was written
+	 * on, NULL while it waits for one, and when it was */
+	struct dnsperf_conn *conn;
+	struct timespec wrote;		/* CLOCK_MONOTONIC */
+	struct dnsperf_limit *limit;	/* what the limiter booked it on */
+};
+
+/* Probes in the order they went out, which is also the order they expire in */
+struct dnsperf_sent {
+	struct dnsperf_probe *p;
+	unsigned long seq;		/* stale if the probe was reused since */
+};
+
+/* What we read out of an answer */
+struct dnsperf_answer {
+	uint16_t id;
+	uint8_t rcode;
+	uint8_t truncated;
+	uint16_t ancount;
+};
+
+struct dnsperf_engine {
+	int pollfd;			/* epoll/kqueue descriptor */
+	int fd4, fd6;			/* one socket per address family */
+	unsigned int max_inflight;
+	unsigned int timeout;		/* ms */
+	int clock;			/* DNSPERF_CLOCK_* */
+	unsigned int inflight;
+	unsigned int seed;		/* rand_r() state for DNS IDs */
+	struct dnsperf_probe *ids[DNSPERF_IDS];	/* in-flight probes by DNS ID */
+	struct dnsperf_sent order[DNSPERF_IDS];	/* ring, oldest first */
+	unsigned long head, tail;
+	unsigned long seq;
+	/* where answers are read into, a batch at a time */
+	uint8_t rx[DNSPERF_RECV_BATCH][DNSPERF_RECV_BUF];
+	struct sockaddr_storage rx_from[DNSPERF_RECV_BATCH];
+	char rx_control[DNSPERF_RECV_BATCH][DNSPERF_RECV_CONTROL];
+	struct dnsperf_streams *streams;	/* NULL: plain UDP */
+	struct dnsperf_limiter *limiter;	/* NULL: none */
+	struct dnsperf_trace *trace;	/* -X, or NULL */
+};
+
+int dnsperf_engine_init(struct dnsperf_engine *e, unsigned int max_inflight,
+			unsigned int timeout, unsigned int seed, int clock);
+void dnsperf_engine_destroy(struct dnsperf_engine *e);
+int dnsperf_engine_run(struct dnsperf_engine *e, struct dnsperf_probe *probes,
+		       size_t nr_probes);
+int dnsperf_engine_full(const struct dnsperf_engine *e);
+int dnsperf_engine_submit(struct dnsperf_engine *e, struct dnsperf_probe *p);
+size_t dnsperf_engine_submit_many(struct dnsperf_engine *e,
+				  struct dnsperf_probe **ps, size_t n);
+int dnsperf_engine_poll(struct dnsperf_engine *e, int wait,
+			std::vector<struct dnsperf_probe *> *done);
+
+/* for the stream transports (transport.cpp) */
+int dnsperf_poll_add(int pollfd, int fd);
+int dnsperf_poll_out(int pollfd, int fd, int on);
+int dnsperf_engine_answer_stream(struct dnsperf_engine *e,
+				 struct dnsperf_conn *c, const uint8_t *buf,
+				 size_t len, const struct timespec *now,
+				 std::vector<struct dnsperf_probe *> *done);
+void dnsperf_engine_abort(struct dnsperf_engine *e, struct dnsperf_probe *p,
+			  std::vector<struct dnsperf_probe *> *done);
+
+int dnsperf_answer_parse(const uint8_t *buf, size_t len,
+			 struct dnsperf_answer *a);
+int dnsperf_answer_match(const struct dnsperf_probe *p, const uint8_t *buf,
+			 size_t len);
+
+int dnsperf_probe_outcome(const struct dnsperf_probe *p);
+const char *dnsperf_outcome_name(int outcome);
+
+int dnsperf_template_init(struct dnsperf_qtemplate *t, const char *domain,
+			  size_t label_len);
+uint8_t *dnsperf_probe_fill(struct dnsperf_probe *p,
+			    const struct dnsperf_qtemplate *t);
+int dnsperf_parse_clock(const char *name);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * reporter.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * The thread that takes the workers' reports to the database. It swaps out
+ * whatever was handed over, so the workers can go on handing over while it
+ * writes, and puts back what did not make it: stats only if no newer copy
+ * came in meanwhile, buckets merged with what closed since (rollup.cpp).
+ * Retries come with the next hand-over, so a DBMS that is away costs one
+ * attempt per report, not a busy loop.
+ */
+
+#include <iostream>
+#include <map>
+
+#include "dnsperf.h"
+#include "db.h"
+#include "reporter.h"
+
+using namespace std;
+
+static void *dnsperf_reporter_thread(void *arg)
+{
+	struct dnsperf_reporter *r = (struct dnsperf_reporter *)arg;
+
+	mysqlpp::Connection::thread_start();
+	dnsperf_stmt_init(&r->stmts);
+	for (;;) {
+		map<size_t, struct dnsperf_stat> stats;
+		map<size_t, struct dnsperf_stat>::iterator it;
+		struct dnsperf_rollup_pending rollup;
+		mysqlpp::Connection *conn;
+
+		pthread_mutex_lock(&r->lock);
+		while (!r->ready)
+			pthread_cond_wait(&r->cond, &r->lock);
+		r->ready = 0;
+		stats.swap(r->stats);
+		rollup.cells.swap(r->rollup.cells);
+		pthread_mutex_unlock(&r->lock);
+
+		/* if the DBMS is away, they just catch up later */
+		if ((conn = dnsperf_db_grab())) {
+			for (it = stats.begin(); it != stats.end();)
+				if (!dnsperf_stats(conn, &r->stmts,
+						   &it->second))
+					stats.erase(it++);
+				else
+					it++;
+			dnsperf_rollup_write(conn, &rollup, r->domains);
+			dnsperf_db_release(conn);
+		}
+		if (stats.empty() && rollup.cells.empty())
+			continue;
+
+		pthread_mutex_lock(&r->lock);
+		for (it = stats.begin(); it != stats.end(); it++)
+			r->stats.insert(*it);	/* unless there is a newer one */
+		dnsperf_rollup_requeue(&r->rollup, &rollup);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return NULL;
+}
+
+int dnsperf_reporter_start(struct dnsperf_reporter *r,
+			   struct dnsperf_domains *domains)
+{
+	r->domains = domains;
+	r->ready = 0;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->thread, NULL, dnsperf_reporter_thread, r)) {
+		cerr << "Unable to start the reporter thread" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* Called by a worker when it reports: copies of the stats of its shard's
+ * domains that got queries since the last hand-over, and its closed
+ * buckets. Gives up rather than wait. */
+void dnsperf_reporter_publish(struct dnsperf_reporter *r,
+			      struct dnsperf_domains *domains,
+			      unsigned int shard, unsigned int nr_shards,
+			      struct dnsperf_rollup *rollup, time_t now)
+{
+	size_t count = domains->count;
+
+	if (pthread_mutex_trylock(&r->lock))
+		return;
+	for (size_t i = shard; i < count; i += nr_shards) {
+		struct dnsperf_stat *st = dnsperf_domain(domains, i)->stat;
+		uint64_t seen;
+
+		if (!st)
+			continue;
+		/* with a long list, most have nothing new */
+		seen = st->count + dnsperf_failures(st->outcomes);
+		if (!seen || seen == st->reported)
+			continue;
+		r->stats[i] = *st;
+		st->reported = seen;
+	}
+	if (rollup)
+		dnsperf_rollup_take(rollup, now, &r->rollup);
+	r->ready = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
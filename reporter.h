@@ -0,0 +1,44 @@
+/*
+ * reporter.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Writing the stats, the latency table and the rollups out is a thread's
+ * job of its own: when they report, the workers hand it copies of the stats
+ * of their domains that got queries since, and the rollup buckets that have
+ * closed, and go back to probing. A worker never waits on MySQL, nor on the
+ * reporter: if it is busy taking the previous hand-over, the worker keeps
+ * its changes for the next one.
+ */
+
+#ifndef DNSPERF_REPORTER_H
+#define DNSPERF_REPORTER_H
+
+#include <map>
+#include <pthread.h>
+#include <time.h>
+
+#include "domains.h"
+#include "rollup.h"
+#include "stats.h"
+#include "stmt.h"
+
+struct dnsperf_reporter {
+	pthread_t thread;
+	struct dnsperf_domains *domains;
+	struct dnsperf_stmts stmts;	/* our own prepared stats UPDATE */
+	/* what the workers handed over and we have not written yet: the
+	 * latest copy of each domain's stats, by domain, and the buckets */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int ready;			/* handed over since we last looked */
+	std::map<size_t, struct dnsperf_stat> stats;
+	struct dnsperf_rollup_pending rollup;
+};
+
+int dnsperf_reporter_start(struct dnsperf_reporter *r,
+			   struct dnsperf_domains *domains);
+void dnsperf_reporter_publish(struct dnsperf_reporter *r,
+			      struct dnsperf_domains *domains,
+			      unsigned int shard, unsigned int nr_shards,
+			      struct dnsperf_rollup *rollup, time_t now);
+
+#endif
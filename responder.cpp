@@ -0,0 +1,109 @@
+/*
+ * responder.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Loopback responder. It binds to an ephemeral port on 127.0.0.1 and hands
+ * every query back as an authoritative answer: the question is echoed as it
+ * came (so the engine's label check passes) with one A record, 127.0.0.1,
+ * pointing back at it. It does no allocation and no parsing beyond the
+ * header, so it costs about as little as a nameserver possibly can.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "probe.h"
+#include "responder.h"
+
+using namespace std;
+
+/* how often the thread looks up from recvfrom() to see if it should go (us) */
+#define DNSPERF_RESPONDER_TICK 100000
+
+/* the answer we append: a pointer to the question name, A, IN, a TTL of 0,
+ * and 127.0.0.1 */
+static const uint8_t dnsperf_responder_rr[] = {
+	0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x04, 127, 0, 0, 1
+};
+
+static void *dnsperf_responder_thread(void *arg)
+{
+	struct dnsperf_responder *r = (struct dnsperf_responder *)arg;
+	uint8_t buf[DNSPERF_QUERY_MAX + sizeof(dnsperf_responder_rr)];
+
+	while (r->running) {
+		struct sockaddr_storage from;
+		socklen_t fromlen = sizeof(from);
+		ssize_t len;
+
+		len = recvfrom(r->fd, buf, DNSPERF_QUERY_MAX, 0,
+			       (struct sockaddr *)&from, &fromlen);
+		if (len < 12)
+			continue;
+		/* QR, AA and the query's RD; RA clear, NOERROR */
+		buf[2] = (buf[2] & 0x01) | 0x84;
+		buf[3] = 0;
+		/* one answer, nothing in the other sections */
+		buf[6] = 0;
+		buf[7] = 1;
+		buf[8] = buf[9] = buf[10] = buf[11] = 0;
+		memcpy(buf + len, dnsperf_responder_rr,
+		       sizeof(dnsperf_responder_rr));
+		len += sizeof(dnsperf_responder_rr);
+		if (sendto(r->fd, buf, len, 0, (struct sockaddr *)&from,
+			   fromlen) == len)
+			r->answered++;
+	}
+	return NULL;
+}
+
+int dnsperf_responder_start(struct dnsperf_responder *r)
+{
+	struct timeval tv;
+	socklen_t len = sizeof(r->addr);
+
+	r->answered = 0;
+	if ((r->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		cerr << "Unable to set up responder socket: " <<
+		    strerror(errno) << endl;
+		return 1;
+	}
+
+	memset(&r->addr, 0, sizeof(r->addr));
+	r->addr.sin_family = AF_INET;
+	r->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	r->addr.sin_port = 0;
+	tv.tv_sec = 0;
+	tv.tv_usec = DNSPERF_RESPONDER_TICK;
+	if (bind(r->fd, (struct sockaddr *)&r->addr, sizeof(r->addr)) ||
+	    getsockname(r->fd, (struct sockaddr *)&r->addr, &len) ||
+	    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
+		cerr << "Unable to set up responder socket: " <<
+		    strerror(errno) << endl;
+		close(r->fd);
+		return 1;
+	}
+
+	r->running = 1;
+	if (pthread_create(&r->thread, NULL, dnsperf_responder_thread, r)) {
+		cerr << "Unable to start responder thread" << endl;
+		r->running = 0;
+		close(r->fd);
+		return 1;
+	}
+	return 0;
+}
+
+void dnsperf_responder_stop(struct dnsperf_responder *r)
+{
+	if (!r->running)
+		return;
+	r->running = 0;
+	pthread_join(r->thread, NULL);
+	close(r->fd);
+}
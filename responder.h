@@ -0,0 +1,26 @@
+/*
+ * responder.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * A tiny in-process DNS responder on the loopback, which answers anything it
+ * is asked at once. It gives the probe path a nameserver with next to no
+ * latency of its own, so whatever we measure against it is our overhead.
+ */
+
+#ifndef DNSPERF_RESPONDER_H
+#define DNSPERF_RESPONDER_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+struct dnsperf_responder {
+	int fd;
+	struct sockaddr_in addr;	/* 127.0.0.1 and the port we got */
+	pthread_t thread;
+	volatile int running;
+	volatile unsigned long answered;
+};
+
+int dnsperf_responder_start(struct dnsperf_responder *r);
+void dnsperf_responder_stop(struct dnsperf_responder *r);
+
+#endif
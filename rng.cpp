@@ -0,0 +1,74 @@
+/*
+ * rng.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * wyrand: one add and one 64x64->128 multiply per 64 random bits, which is
+ * plenty for cache busting and is not a shared, locked rand(). Labels are
+ * base32 (RFC 4648 alphabet, lower case), 12 characters per draw. The old
+ * "foo%d" labels only had 1024 possible values per domain; a 12 character
+ * label has 2^60.
+ *
+ * A tagged label starts with DNSPERF_TAG_LEN characters that spell out the
+ * worker and a per-worker probe counter (5 + 35 bits), and is random after
+ * that, so a query seen in a server's log can be traced to its probe.
+ */
+
+#include "rng.h"
+
+static const char dnsperf_base32[] = "abcdefghijklmnopqrstuvwxyz234567";
+
+void dnsperf_rng_seed(struct dnsperf_rng *r, uint64_t seed)
+{
+	r->state = seed;
+	/* spread a small seed over all the bits */
+	dnsperf_rng_next(r);
+}
+
+uint64_t dnsperf_rng_next(struct dnsperf_rng *r)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t t;
+
+	r->state += 0xa0761d6478bd642fULL;
+	t = (__uint128_t)r->state * (r->state ^ 0xe7037ed1a0b428dbULL);
+	return (uint64_t)(t >> 64) ^ (uint64_t)t;
+#else
+	/* no 128 bit multiply: splitmix64, nearly as cheap */
+	uint64_t z;
+
+	r->state += 0x9e3779b97f4a7c15ULL;
+	z = r->state;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+#endif
+}
+
+/* uniform in [0, 1) */
+double dnsperf_rng_double(struct dnsperf_rng *r)
+{
+	return (dnsperf_rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void dnsperf_label(struct dnsperf_rng *r, uint8_t *out, size_t len)
+{
+	while (len) {
+		uint64_t bits = dnsperf_rng_next(r);
+
+		for (int i = 0; len && i < 64 / DNSPERF_LABEL_BITS; i++, len--) {
+			*out++ = dnsperf_base32[bits & 31];
+			bits >>= DNSPERF_LABEL_BITS;
+		}
+	}
+}
+
+/* Overwrite the first DNSPERF_TAG_LEN characters of a label */
+void dnsperf_label_tag(uint8_t *out, unsigned int worker, uint64_t counter)
+{
+	uint64_t tag = ((uint64_t)(worker & 31) << 35) |
+	    (counter & ((1ULL << 35) - 1));
+
+	for (int i = DNSPERF_TAG_LEN - 1; i >= 0; i--) {
+		out[i] = dnsperf_base32[tag & 31];
+		tag >>= DNSPERF_LABEL_BITS;
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * rng.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Per-thread PRNG (wyrand) and the random labels we prepend to domains to
+ * stay clear of caches. No shared state, so every worker has its own.
+ */
+
+#ifndef DNSPERF_RNG_H
+#define DNSPERF_RNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* each base32 character carries 5 bits */
+#define DNSPERF_LABEL_BITS	5
+#define DNSPERF_LABEL_MAX	63	/* the longest DNS label */
+/* tagged labels start with this many characters of worker id and counter */
+#define DNSPERF_TAG_LEN		8
+
+struct dnsperf_rng {
+	uint64_t state;
+};
+
+void dnsperf_rng_seed(struct dnsperf_rng *r, uint64_t seed);
+uint64_t dnsperf_rng_next(struct dnsperf_rng *r);
+double dnsperf_rng_double(struct dnsperf_rng *r);
+
+void dnsperf_label(struct dnsperf_rng *r, uint8_t *out, size_t len);
+void dnsperf_label_tag(uint8_t *out, unsigned int worker, uint64_t counter);
+
+#endif
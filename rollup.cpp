@@ -0,0 +1,650 @@
+/*
+ * rollup.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Downsampled copies of the query log, so that charts over days or months
+ * don't have to go through every raw row. Each worker keeps, for every
+ * domain and nameserver address of its shard (and for the domain as a
+ * whole), the minute, the hour and the day it is currently filling: count,
+ * sum and sum of squares (for mean and stddev), the failures and a latency
+ * histogram.
+ * When a bucket's time is up it is written out, once, as one row of
+ * <prefix>_1m, _1h or _1d; all the DBMS ever sees is a few rows a minute.
+ *
+ * A bucket that closed is parked until the worker's next report hands it
+ * over to the reporter thread (reporter.h), which writes it in INSERTs of
+ * DNSPERF_ROLLUP_ROWS rows at most. While the DBMS is away the buckets that
+ * close in the meantime wait along with it, each for a row of its own. If a
+ * row is already there (we were restarted in the middle of an hour, say)
+ * the two are merged.
+ *
+ * The raw log can be cut down to the last -k days; a thread of its own
+ * deletes older rows, a few thousand at a time, once an hour. With -P the
+ * same thread keeps the day partitions of the log ahead of time, and
+ * drops whole days rather than deleting row by row.
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dnsperf.h"
+#include "db.h"
+#include "domains.h"
+#include "rollup.h"
+
+using namespace std;
+
+/* MySQL's ER_DUP_ENTRY */
+#define DNSPERF_ER_DUP_ENTRY 1062
+/* how often the retention thread wakes up (s), and rows per DELETE */
+#define DNSPERF_RETENTION_INTERVAL 3600
+#define DNSPERF_RETENTION_BATCH 10000
+
+static const char *dnsperf_rollup_suffix[DNSPERF_ROLLUPS] = {
+	"_1m", "_1h", "_1d"
+};
+
+string dnsperf_rollup_table(int level)
+{
+	return string(dnsperf_rolluptable) + dnsperf_rollup_suffix[level];
+}
+
+static void dnsperf_cell_clear(struct dnsperf_rollup_cell *c)
+{
+	c->start = c->end = 0;
+	c->failed = 0;
+	c->sum = c->sumsq = 0;
+	dnsperf_hist_init(&c->hist);
+}
+
+static int dnsperf_cell_empty(const struct dnsperf_rollup_cell *c)
+{
+	return !c->hist.count && !c->failed;
+}
+
+static void dnsperf_cell_merge(struct dnsperf_rollup_cell *dst,
+			       const struct dnsperf_rollup_cell *src)
+{
+	dst->failed += src->failed;
+	dst->sum += src->sum;
+	dst->sumsq += src->sumsq;
+	dnsperf_hist_merge(&dst->hist, &src->hist);
+}
+
+/* The minute, hour or day (local time, like the rest of the tables) that
+ * tm falls in. Only called when a bucket rolls over. */
+static void dnsperf_period(int level, time_t tm, time_t *start, time_t *end)
+{
+	struct tm t;
+
+	localtime_r(&tm, &t);
+	t.tm_sec = 0;
+	if (level >= DNSPERF_ROLLUP_HOUR)
+		t.tm_min = 0;
+	if (level >= DNSPERF_ROLLUP_DAY)
+		t.tm_hour = 0;
+	t.tm_isdst = -1;
+	*start = mktime(&t);
+	switch (level) {
+	case DNSPERF_ROLLUP_MINUTE:
+		t.tm_min++;
+		break;
+	case DNSPERF_ROLLUP_HOUR:
+		t.tm_hour++;
+		break;
+	default:
+		t.tm_mday++;
+	}
+	t.tm_isdst = -1;
+	*end = mktime(&t);
+}
+
+static void dnsperf_cell_put(struct dnsperf_rollup_cell *c, uint64_t latency,
+			     int ok)
+{
+	if (!ok) {
+		c->failed++;
+		return;
+	}
+	c->sum += latency / 1000.0;
+	c->sumsq += (latency / 1000.0) * (latency / 1000.0);
+	dnsperf_hist_add(&c->hist, latency);
+}
+
+/* Park the bucket being filled for writing, behind any that closed
+ * before it and are still parked */
+static void dnsperf_rollup_close(struct dnsperf_rollup *r,
+				 struct dnsperf_rollup_entry *e, int level)
+{
+	struct dnsperf_rollup_cell *cur = &e->cur[level];
+
+	if (!dnsperf_cell_empty(cur)) {
+		struct dnsperf_rollup_closed c;
+
+		c.entry = e;
+		c.cell = new struct dnsperf_rollup_cell(*cur);
+		r->parked[level].push_back(c);
+		e->done[level] = c.cell;
+	}
+	dnsperf_cell_clear(cur);
+}
+
+static void dnsperf_cell_add(struct dnsperf_rollup *r,
+			     struct dnsperf_rollup_entry *e, int level,
+			     uint64_t latency, time_t tm, int ok)
+{
+	struct dnsperf_rollup_cell *cur = &e->cur[level];
+	struct dnsperf_rollup_cell *done = e->done[level];
+	struct dnsperf_rollup_cell *c = cur;
+
+	if (cur->start && tm < cur->start && done &&
+	    tm >= done->start && tm < done->end) {
+		/* sent before the bucket closed, answered after */
+		c = done;
+	} else if (!cur->start || tm >= cur->end) {
+		dnsperf_rollup_close(r, e, level);
+		dnsperf_period(level, tm, &cur->start, &cur->end);
+		if (!r->next_close || cur->end < r->next_close)
+			r->next_close = cur->end;
+	}
+
+	dnsperf_cell_put(c, latency, ok);
+}
+
+static struct dnsperf_rollup_entry *
+dnsperf_rollup_entry(size_t domain, const char *nameserver,
+		     const char *address)
+{
+	struct dnsperf_rollup_entry *e = new struct dnsperf_rollup_entry;
+
+	e->domain = domain;
+	e->nameserver = nameserver;
+	e->address = address;
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+		dnsperf_cell_clear(&e->cur[l]);
+		e->done[l] = NULL;
+	}
+	return e;
+}
+
+static void dnsperf_rollup_entry_init(struct dnsperf_rollup_entry **e)
+{
+	*e = NULL;
+}
+
+void dnsperf_rollup_init(struct dnsperf_rollup *r)
+{
+	r->domains.clear();
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++)
+		r->parked[l].clear();
+	r->next_close = 0;
+}
+
+/* Account for one probe; latency in ns, ok unless it got no usable answer.
+ * The names must stay put: they come from the topology. */
+void dnsperf_rollup_add(struct dnsperf_rollup *r, size_t domain, size_t nsid,
+			const char *nameserver, const char *address,
+			uint64_t latency, time_t tm, int ok)
+{
+	vector<struct dnsperf_rollup_entry *> *v;
+	struct dnsperf_rollup_entry **e[2];
+
+	/* domains of other shards stay empty */
+	if (domain >= r->domains.size())
+		r->domains.resize(domain + 1);
+	v = &r->domains[domain];
+	e[1] = dnsperf_nsid_entry(v, nsid, dnsperf_rollup_entry_init);
+	e[0] = &(*v)[0];
+	if (!*e[0])
+		*e[0] = dnsperf_rollup_entry(domain, "", "");
+	if (!*e[1])
+		*e[1] = dnsperf_rollup_entry(domain, nameserver, address);
+	for (int i = 0; i < 2; i++)
+		for (int l = 0; l < DNSPERF_ROLLUPS; l++)
+			dnsperf_cell_add(r, *e[i], l, latency, tm, ok);
+}
+
+/* One row of VALUES; gives back about how many bytes it took */
+static size_t dnsperf_rollup_row(mysqlpp::Query & query, const char *domain,
+				 const char *nameserver, const char *address,
+				 const struct dnsperf_rollup_cell *c)
+{
+	char ts[DNSPERF_DATE_LEN];
+	string buckets;
+
+	dnsperf_strdate(c->start, ts);
+	dnsperf_hist_encode(&c->hist, &buckets);
+	query << "(" << mysqlpp::quote << domain << ", " <<
+	    mysqlpp::quote << nameserver << ", " << mysqlpp::quote << ts <<
+	    ", " << c->hist.count << ", " << c->failed << ", " << c->sum <<
+	    ", " << c->sumsq << ", ";
+	if (c->hist.count)
+		query << c->hist.min / 1000.0 << ", " << c->hist.max / 1000.0;
+	else
+		query << "NULL, NULL";
+	query << ", " << mysqlpp::quote << buckets << ", " <<
+	    mysqlpp::quote << address << ")";
+	/* the numbers, the quotes and the separators fit in this */
+	return buckets.size() + strlen(domain) + strlen(nameserver) +
+	    strlen(address) + 160;
+}
+
+/* The row is there already: add what it holds to ours and replace it */
+static int dnsperf_rollup_merge(mysqlpp::Connection *conn, int level,
+				const char *domain, const char *nameserver,
+				const char *address,
+				struct dnsperf_rollup_cell *c)
+{
+	string table = dnsperf_rollup_table(level);
+	mysqlpp::Query query = conn->query();
+	mysqlpp::StoreQueryResult res;
+	struct dnsperf_rollup_cell old;
+	char ts[DNSPERF_DATE_LEN];
+
+	dnsperf_strdate(c->start, ts);
+	query << "select failed, sum, sumsq, buckets from " << table <<
+	    " where domain = " << mysqlpp::quote << domain <<
+	    " and nameserver = " << mysqlpp::quote << nameserver <<
+	    " and address = " << mysqlpp::quote << address <<
+	    " and ts = " << mysqlpp::quote << ts;
+	if (!(res = query.store())) {
+		cerr << "Failed to read " << table << ": " << query.error() <<
+		    endl;
+		return 1;
+	}
+	if (res.num_rows()) {
+		dnsperf_cell_clear(&old);
+		old.failed = (uint64_t)res[0]["failed"];
+		old.sum = res[0]["sum"];
+		old.sumsq = res[0]["sumsq"];
+		if (dnsperf_hist_decode(&old.hist, res[0]["buckets"].c_str()))
+			cerr << "Ignoring bad histogram in " << table << endl;
+		dnsperf_cell_merge(c, &old);
+	}
+
+	query.reset();
+	query << "replace into " << table << " values ";
+	dnsperf_rollup_row(query, domain, nameserver, address, c);
+	if (!query.exec()) {
+		cerr << "Failed to update " << table << ": " << query.error() <<
+		    endl;
+		return 1;
+	}
+	return 0;
+}
+
+/* A row on its way to a rollup table */
+struct dnsperf_rollup_ref {
+	size_t domain;
+	const char *nameserver;
+	const char *address;
+	struct dnsperf_rollup_cell *cell;
+	int written;
+};
+
+/* Write rows out to the level's table, in INSERTs of DNSPERF_ROLLUP_ROWS
+ * rows and about DNSPERF_ROLLUP_BYTES at most; if a row is there already,
+ * that INSERT goes again one row at a time, merged. Those that made it are
+ * marked written. */
+static int dnsperf_rollup_insert(mysqlpp::Connection *conn, int level,
+				 struct dnsperf_domains *domains,
+				 vector<struct dnsperf_rollup_ref> *rows)
+{
+	string table = dnsperf_rollup_table(level);
+	size_t first, last;
+
+	for (first = 0; first < rows->size(); first = last) {
+		mysqlpp::Query query = conn->query();
+		size_t bytes = 0;
+
+		query << "insert into " << table << " values ";
+		for (last = first; last < rows->size() &&
+		     last - first < DNSPERF_ROLLUP_ROWS &&
+		     bytes < DNSPERF_ROLLUP_BYTES; last++) {
+			struct dnsperf_rollup_ref *row = &(*rows)[last];
+
+			if (last != first)
+				query << ", ";
+			bytes += dnsperf_rollup_row(query,
+				dnsperf_domain(domains, row->domain)->name,
+				row->nameserver, row->address, row->cell);
+		}
+		if (query.exec()) {
+			for (size_t k = first; k < last; k++)
+				(*rows)[k].written = 1;
+			continue;
+		}
+		if (query.errnum() != DNSPERF_ER_DUP_ENTRY) {
+			/* the DBMS is away: leave the rest for next time */
+			cerr << "Failed to update " << table << ": " <<
+			    query.error() << endl;
+			return 1;
+		}
+		/* one of them was there already; go one by one */
+		for (size_t k = first; k < last; k++) {
+			struct dnsperf_rollup_ref *row = &(*rows)[k];
+
+			row->written = !dnsperf_rollup_merge(conn, level,
+				dnsperf_domain(domains, row->domain)->name,
+				row->nameserver, row->address, row->cell);
+		}
+	}
+	return 0;
+}
+
+/* Close the buckets whose time is up, even without a sample since: only
+ * done when the first of them is, and that is once a minute */
+static void dnsperf_rollup_expire(struct dnsperf_rollup *r, time_t now)
+{
+	if (!r->next_close || now < r->next_close)
+		return;
+	r->next_close = 0;
+	for (size_t i = 0; i < r->domains.size(); i++)
+		for (size_t k = 0; k < r->domains[i].size(); k++) {
+			struct dnsperf_rollup_entry *e = r->domains[i][k];
+
+			if (!e)
+				continue;
+			for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+				struct dnsperf_rollup_cell *c = &e->cur[l];
+
+				if (!c->start)
+					continue;
+				if (now >= c->end)
+					dnsperf_rollup_close(r, e, l);
+				else if (!r->next_close ||
+					 c->end < r->next_close)
+					r->next_close = c->end;
+			}
+		}
+}
+
+/* Hand every bucket of ours that has closed by now over to p; only ever
+ * called by the worker that owns r, with p locked */
+void dnsperf_rollup_take(struct dnsperf_rollup *r, time_t now,
+			 struct dnsperf_rollup_pending *p)
+{
+	dnsperf_rollup_expire(r, now);
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+		for (size_t k = 0; k < r->parked[l].size(); k++) {
+			struct dnsperf_rollup_closed *c = &r->parked[l][k];
+			map<struct dnsperf_rollup_slot,
+			    struct dnsperf_rollup_cell>::iterator it;
+			struct dnsperf_rollup_slot key;
+
+			key.level = l;
+			key.entry = c->entry;
+			key.start = c->cell->start;
+			it = p->cells.find(key);
+			if (it != p->cells.end())
+				dnsperf_cell_merge(&it->second, c->cell);
+			else
+				p->cells.insert(make_pair(key, *c->cell));
+			delete c->cell;
+			c->entry->done[l] = NULL;
+		}
+		r->parked[l].clear();
+	}
+}
+
+/* Write out what was handed over; what made it leaves p */
+int dnsperf_rollup_write(mysqlpp::Connection *conn,
+			 struct dnsperf_rollup_pending *p,
+			 struct dnsperf_domains *domains)
+{
+	map<struct dnsperf_rollup_slot,
+	    struct dnsperf_rollup_cell>::iterator it;
+	int ret = 0;
+
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+		vector<map<struct dnsperf_rollup_slot,
+		    struct dnsperf_rollup_cell>::iterator> cells;
+		vector<struct dnsperf_rollup_ref> rows;
+
+		for (it = p->cells.begin(); it != p->cells.end(); it++) {
+			const struct dnsperf_rollup_entry *e = it->first.entry;
+			struct dnsperf_rollup_ref row;
+
+			if (it->first.level != l)
+				continue;
+			row.domain = e->domain;
+			row.nameserver = e->nameserver;
+			row.address = e->address;
+			row.cell = &it->second;
+			row.written = 0;
+			rows.push_back(row);
+			cells.push_back(it);
+		}
+		if (rows.empty())
+			continue;
+		if (dnsperf_rollup_insert(conn, l, domains, &rows))
+			ret = 1;
+		for (size_t k = 0; k < rows.size(); k++)
+			if (rows[k].written)
+				p->cells.erase(cells[k]);
+	}
+	return ret;
+}
+
+/* Put back what could not be written. Only the same bucket of the same
+ * entry is merged (late answers handed over after it); later ones stay
+ * rows of their own */
+void dnsperf_rollup_requeue(struct dnsperf_rollup_pending *to,
+			    struct dnsperf_rollup_pending *left)
+{
+	map<struct dnsperf_rollup_slot,
+	    struct dnsperf_rollup_cell>::iterator it, newer;
+
+	for (it = left->cells.begin(); it != left->cells.end(); it++) {
+		newer = to->cells.find(it->first);
+		if (newer == to->cells.end()) {
+			to->cells.insert(*it);
+			continue;
+		}
+		dnsperf_cell_merge(&it->second, &newer->second);
+		newer->second = it->second;
+	}
+	left->cells.clear();
+}
+
+bool dnsperf_rollup_slot::operator<(const struct dnsperf_rollup_slot &o) const
+{
+	if (level != o.level)
+		return level < o.level;
+	if (entry != o.entry)
+		return entry < o.entry;
+	return start < o.start;
+}
+
+bool dnsperf_rollup_key::operator<(const struct dnsperf_rollup_key &o) const
+{
+	if (level != o.level)
+		return level < o.level;
+	if (domain != o.domain)
+		return domain < o.domain;
+	if (start != o.start)
+		return start < o.start;
+	if (nameserver != o.nameserver)
+		return nameserver < o.nameserver;
+	return address < o.address;
+}
+
+void dnsperf_rollup_batch_init(struct dnsperf_rollup_batch *b)
+{
+	b->cells.clear();
+	b->domain = 0;
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++)
+		b->start[l] = b->end[l] = 0;
+}
+
+/* Same as dnsperf_rollup_add(), for a replay */
+void dnsperf_rollup_batch_add(struct dnsperf_rollup_batch *b, size_t domain,
+			      const char *nameserver, const char *address,
+			      uint64_t latency, time_t tm, int ok)
+{
+	struct dnsperf_rollup_key key;
+
+	b->domain = key.domain = domain;
+	for (int l = 0; l < DNSPERF_ROLLUPS; l++) {
+		/* samples of a bucket mostly come together; mktime() is not
+		 * cheap */
+		if (tm < b->start[l] || tm >= b->end[l])
+			dnsperf_period(l, tm, &b->start[l], &b->end[l]);
+		key.level = l;
+		key.start = b->start[l];
+		for (int i = 0; i < 2; i++) {
+			map<struct dnsperf_rollup_key,
+			    struct dnsperf_rollup_cell>::iterator it;
+
+			key.nameserver = i ? nameserver : "";
+			key.address = i ? address : "";
+			it = b->cells.find(key);
+			if (it == b->cells.end()) {
+				it = b->cells.insert(make_pair(key,
+				    dnsperf_rollup_cell())).first;
+				dnsperf_cell_clear(&it->second);
+				it->second.start = b->start[l];
+				it->second.end = b->end[l];
+			}
+			dnsperf_cell_put(&it->second, latency, ok);
+		}
+	}
+}
+
+/* Write out (merged with what is there) the buckets of the batch, and
+ * empty it. Unless all, those of the last sample's domain and periods stay:
+ * exports come in the order of the query log's key, domain and time, and
+ * the next samples most likely go there. */
+int dnsperf_rollup_batch_flush(mysqlpp::Connection *conn,
+			       struct dnsperf_rollup_batch *b,
+			       struct dnsperf_domains *domains, int all)
+{
+	map<struct dnsperf_rollup_key,
+	    struct dnsperf_rollup_cell>::iterator it, first, last;
+	map<struct dnsperf_rollup_key, struct dnsperf_rollup_cell> open;
+	int ret = 0;
+
+	for (it = b->cells.begin(); !all && it != b->cells.end();) {
+		if (it->first.domain != b->domain ||
+		    it->first.start != b->start[it->first.level]) {
+			it++;
+			continue;
+		}
+		open.insert(*it);
+		b->cells.erase(it++);
+	}
+
+	for (first = b->cells.begin(); first != b->cells.end(); first = last) {
+		int l = first->first.level;
+		vector<struct dnsperf_rollup_ref> rows;
+
+		for (last = first; last != b->cells.end() &&
+		     last->first.level == l; last++) {
+			struct dnsperf_rollup_ref row;
+
+			row.domain = last->first.domain;
+			row.nameserver = last->first.nameserver.c_str();
+			row.address = last->first.address.c_str();
+			row.cell = &last->second;
+			row.written = 0;
+			rows.push_back(row);
+		}
+		if (dnsperf_rollup_insert(conn, l, domains, &rows))
+			ret = 1;
+		for (size_t k = 0; k < rows.size(); k++)
+			if (!rows[k].written)
+				ret = 1;
+	}
+	b->cells.swap(open);
+	return ret;
+}
+
+/* Delete what is older than cutoff, one domain at a time so that each
+ * DELETE is a range of the primary key; what is left after dropping
+ * partitions is usually nothing */
+static unsigned long long dnsperf_prune(mysqlpp::Connection *conn,
+					const char *cutoff)
+{
+	mysqlpp::Query query = conn->query();
+	mysqlpp::StoreQueryResult res;
+	unsigned long long deleted = 0;
+
+	query << "select domain_id from " <<
+	    dnsperf_dim_table(dnsperf_valtable, DNSPERF_DIM_DOMAIN);
+	if (!(res = query.store())) {
+		cerr << "Failed to prune " << dnsperf_valtable << ": " <<
+		    query.error() << endl;
+		return 0;
+	}
+	for (size_t i = 0; i < res.num_rows(); i++) {
+		unsigned long long n;
+
+		do {
+			mysqlpp::SimpleResult r;
+
+			query.reset();
+			query << "delete from " << dnsperf_valtable <<
+			    " where domain_id = " << res[i][0] <<
+			    " and ts < " << mysqlpp::quote << cutoff <<
+			    " limit " << DNSPERF_RETENTION_BATCH;
+			if (!(r = query.execute())) {
+				cerr << "Failed to prune " <<
+				    dnsperf_valtable << ": " <<
+				    query.error() << endl;
+				return deleted;
+			}
+			n = r.rows();
+			deleted += n;
+		} while (n == DNSPERF_RETENTION_BATCH);
+	}
+	return deleted;
+}
+
+/* Hourly: day partitions (-P) and the retention of the raw log (-k) */
+static void *dnsperf_retention_thread(void *arg)
+{
+	unsigned int days = *(unsigned int *)arg;
+
+	mysqlpp::Connection::thread_start();
+	for (;;) {
+		mysqlpp::Connection *conn;
+		char cutoff[DNSPERF_DATE_LEN];
+		unsigned long long deleted = 0;
+
+		dnsperf_strdate(time(NULL) - (time_t)days * 86400, cutoff);
+		if ((conn = dnsperf_db_grab())) {
+			if (dnsperf_partition)
+				dnsperf_partitions_update(conn,
+							  dnsperf_valtable,
+							  days ? cutoff : NULL);
+			if (days)
+				deleted = dnsperf_prune(conn, cutoff);
+			dnsperf_db_release(conn);
+		}
+		if (deleted && !dnsperf_quiet)
+			cout << "Pruned " << deleted << " queries older than " <<
+			    cutoff << endl;
+		sleep(DNSPERF_RETENTION_INTERVAL);
+	}
+	mysqlpp::Connection::thread_end();
+	return NULL;
+}
+
+/* Keep the last `days' days of the raw log (0: all of it) */
+int dnsperf_retention_start(unsigned int days)
+{
+	static unsigned int keep;
+	pthread_t thread;
+
+	keep = days;
+	if (pthread_create(&thread, NULL, dnsperf_retention_thread, &keep)) {
+		cerr << "Unable to start the retention thread" << endl;
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
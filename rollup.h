@@ -0,0 +1,128 @@
+/*
+ * rollup.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Per-minute, per-hour and per-day rollups of the query log, per domain,
+ * nameserver and address, kept up to date from memory as the probes
+ * complete, plus the retention of the raw log.
+ */
+
+#ifndef DNSPERF_ROLLUP_H
+#define DNSPERF_ROLLUP_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#include <mysql++/mysql++.h>
+
+#include "histogram.h"
+#include "stats.h"
+
+struct dnsperf_domains;
+
+#define DNSPERF_ROLLUP_MINUTE	0
+#define DNSPERF_ROLLUP_HOUR	1
+#define DNSPERF_ROLLUP_DAY	2
+#define DNSPERF_ROLLUPS		3
+
+/* One time bucket of one domain/nameserver/address */
+struct dnsperf_rollup_cell {
+	time_t start, end;		/* [start, end), local time; 0 if empty */
+	uint64_t failed;		/* queries without a latency sample */
+	double sum, sumsq;		/* us */
+	struct dnsperf_hist hist;	/* count, min and max too */
+};
+
+struct dnsperf_rollup_entry {
+	size_t domain;
+	const char *nameserver;		/* owned by the topology; "" for the
+					 * whole domain */
+	const char *address;
+	struct dnsperf_rollup_cell cur[DNSPERF_ROLLUPS];	/* being filled */
+	/* the last bucket that closed, until it is handed over (late
+	 * answers still go there); only made when one does */
+	struct dnsperf_rollup_cell *done[DNSPERF_ROLLUPS];
+};
+
+/* A closed bucket, parked until it is handed over */
+struct dnsperf_rollup_closed {
+	struct dnsperf_rollup_entry *entry;
+	struct dnsperf_rollup_cell *cell;
+};
+
+/* A worker's share, indexed like the domains table, then as
+ * dnsperf_nsid_entry() has it; an entry is only made once it has a sample */
+struct dnsperf_rollup {
+	std::vector<std::vector<struct dnsperf_rollup_entry *> > domains;
+	/* every bucket that closed since the last hand-over, by level */
+	std::vector<struct dnsperf_rollup_closed> parked[DNSPERF_ROLLUPS];
+	time_t next_close;		/* when the first bucket being filled
+					 * ends; 0: none is */
+};
+
+/* Closed buckets on their way to the database, handed over by the workers
+ * (reporter.h): one per entry, level and start, each its own row */
+struct dnsperf_rollup_slot {
+	int level;
+	const struct dnsperf_rollup_entry *entry;
+	time_t start;
+	bool operator<(const struct dnsperf_rollup_slot &o) const;
+};
+
+struct dnsperf_rollup_pending {
+	std::map<struct dnsperf_rollup_slot, struct dnsperf_rollup_cell> cells;
+};
+
+/* Rows per INSERT, and roughly how big one may get: well under the
+ * smallest max_allowed_packet we could meet (1MB) */
+#define DNSPERF_ROLLUP_ROWS	1000
+#define DNSPERF_ROLLUP_BYTES	(512UL << 10)
+
+/* One bucket of a replay (export.h). A file need not be in time order, so
+ * any number of buckets of an address may be open at once; they are held
+ * until there are DNSPERF_ROLLUP_BATCH of them, then written */
+#define DNSPERF_ROLLUP_BATCH	1024
+
+struct dnsperf_rollup_key {
+	int level;
+	size_t domain;
+	time_t start;
+	std::string nameserver;		/* "" for the whole domain */
+	std::string address;
+	bool operator<(const struct dnsperf_rollup_key &o) const;
+};
+
+struct dnsperf_rollup_batch {
+	std::map<struct dnsperf_rollup_key, struct dnsperf_rollup_cell> cells;
+	/* of the last sample */
+	size_t domain;
+	time_t start[DNSPERF_ROLLUPS], end[DNSPERF_ROLLUPS];
+};
+
+std::string dnsperf_rollup_table(int level);
+
+void dnsperf_rollup_init(struct dnsperf_rollup *r);
+void dnsperf_rollup_add(struct dnsperf_rollup *r, size_t domain, size_t nsid,
+			const char *nameserver, const char *address,
+			uint64_t latency, time_t tm, int ok);
+void dnsperf_rollup_take(struct dnsperf_rollup *r, time_t now,
+			 struct dnsperf_rollup_pending *p);
+int dnsperf_rollup_write(mysqlpp::Connection *conn,
+			 struct dnsperf_rollup_pending *p,
+			 struct dnsperf_domains *domains);
+void dnsperf_rollup_requeue(struct dnsperf_rollup_pending *to,
+			    struct dnsperf_rollup_pending *left);
+
+void dnsperf_rollup_batch_init(struct dnsperf_rollup_batch *b);
+void dnsperf_rollup_batch_add(struct dnsperf_rollup_batch *b, size_t domain,
+			      const char *nameserver, const char *address,
+			      uint64_t latency, time_t tm, int ok);
+int dnsperf_rollup_batch_flush(mysqlpp::Connection *conn,
+			       struct dnsperf_rollup_batch *b,
+			       struct dnsperf_domains *domains, int all);
+
+int dnsperf_retention_start(unsigned int days);
+
+#endif
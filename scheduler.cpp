@@ -0,0 +1,121 @@
+/*
+ * scheduler.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Open-loop scheduler. The closed loop (query everything, wait for the
+ * slowest answer, sleep -f ms) samples slower exactly when a nameserver is
+ * slow, so the bad moments end up under-represented (coordinated omission).
+ * Here each target has a fixed rate and a random phase, so targets do not
+ * fire in bursts; if we fall behind by whole intervals, those sends are
+ * skipped and counted as missed rather than sent back-to-back.
+ */
+
+#include <algorithm>
+#include <map>
+#include <time.h>
+
+#include "scheduler.h"
+
+using namespace std;
+
+/* min-heap on due time */
+static bool dnsperf_slot_later(const struct dnsperf_slot &a,
+			       const struct dnsperf_slot &b)
+{
+	return a.due > b.due;
+}
+
+uint64_t dnsperf_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* rate is in queries per second, per target */
+void dnsperf_sched_init(struct dnsperf_sched *s, double rate)
+{
+	s->interval = (uint64_t)(1000000000.0 / rate);
+	if (!s->interval)
+		s->interval = 1;
+	s->heap.clear();
+	s->sent = s->late = s->missed = s->held = 0;
+}
+
+/* Switch to a new set of targets (the topology changes under us). Targets
+ * we already had keep their phase; new ones start at a random point of the
+ * interval. */
+void dnsperf_sched_update(struct dnsperf_sched *s,
+			  const vector<struct dnsperf_target> &targets,
+			  struct dnsperf_rng *rng)
+{
+	/* the topology's names and addresses stay put, so they go by
+	 * pointer */
+	map<pair<size_t, pair<const char *, const char *> >, uint64_t> due;
+	map<pair<size_t, pair<const char *, const char *> >,
+	    uint64_t>::iterator it;
+	uint64_t now = dnsperf_now_ns();
+
+	for (size_t i = 0; i < s->heap.size(); i++) {
+		const struct dnsperf_target *t = &s->heap[i].target;
+
+		due[make_pair(t->domain, make_pair(t->nameserver,
+						   t->address))] =
+		    s->heap[i].due;
+	}
+
+	s->heap.clear();
+	for (size_t i = 0; i < targets.size(); i++) {
+		struct dnsperf_slot slot;
+
+		slot.target = targets[i];
+		it = due.find(make_pair(targets[i].domain,
+					make_pair(targets[i].nameserver,
+						  targets[i].address)));
+		if (it != due.end())
+			slot.due = it->second;
+		else
+			slot.due = now + (uint64_t)(dnsperf_rng_double(rng) *
+						    s->interval);
+		s->heap.push_back(slot);
+	}
+	make_heap(s->heap.begin(), s->heap.end(), dnsperf_slot_later);
+}
+
+/* When the next send is due; ~0 if there is nothing to send */
+uint64_t dnsperf_sched_next(const struct dnsperf_sched *s)
+{
+	if (s->heap.empty())
+		return ~0ULL;
+	return s->heap.front().due;
+}
+
+/* Take the next target if it is due by `now', and book its next send. The
+ * caller accounts the send itself, as sent or (engine full) missed. */
+int dnsperf_sched_pop(struct dnsperf_sched *s, uint64_t now,
+		      struct dnsperf_target *t)
+{
+	struct dnsperf_slot *slot;
+	uint64_t lag;
+
+	if (s->heap.empty() || s->heap.front().due > now)
+		return 0;
+
+	pop_heap(s->heap.begin(), s->heap.end(), dnsperf_slot_later);
+	slot = &s->heap.back();
+	lag = now - slot->due;
+	if (lag >= s->interval) {
+		uint64_t skipped = lag / s->interval;
+
+		s->missed += skipped;
+		slot->due += skipped * s->interval;
+		lag -= skipped * s->interval;
+	}
+	if (lag > DNSPERF_SCHED_SLACK)
+		s->late++;
+
+	*t = slot->target;
+	slot->due += s->interval;
+	push_heap(s->heap.begin(), s->heap.end(), dnsperf_slot_later);
+	return 1;
+}
@@ -0,0 +1,47 @@
+/*
+ * scheduler.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Open-loop probe scheduler: every target gets a query each `interval' ns,
+ * no matter how long the previous answers took. Due times sit in a min-heap;
+ * sends we could not make in time are counted instead of silently shifting
+ * the schedule (and the samples) around.
+ */
+
+#ifndef DNSPERF_SCHEDULER_H
+#define DNSPERF_SCHEDULER_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "rng.h"
+#include "topology.h"
+
+/* a send this much (ns) after its due time counts as late; the poller only
+ * sleeps in whole ms, so anything below that is just us */
+#define DNSPERF_SCHED_SLACK 2000000ULL
+
+struct dnsperf_slot {
+	uint64_t due;			/* ns, CLOCK_MONOTONIC */
+	struct dnsperf_target target;
+};
+
+struct dnsperf_sched {
+	uint64_t interval;		/* ns between queries to one target */
+	std::vector<struct dnsperf_slot> heap;
+	unsigned long sent;
+	unsigned long late;		/* sent, but after the slack */
+	unsigned long missed;		/* not sent at all */
+	unsigned long held;		/* not sent: the limiter said no */
+};
+
+uint64_t dnsperf_now_ns(void);
+
+void dnsperf_sched_init(struct dnsperf_sched *s, double rate);
+void dnsperf_sched_update(struct dnsperf_sched *s,
+			  const std::vector<struct dnsperf_target> &targets,
+			  struct dnsperf_rng *rng);
+uint64_t dnsperf_sched_next(const struct dnsperf_sched *s);
+int dnsperf_sched_pop(struct dnsperf_sched *s, uint64_t now,
+		      struct dnsperf_target *t);
+
+#endif
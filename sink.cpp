@@ -0,0 +1,161 @@
+/*
+ * sink.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Query log sinks. "mysql" writes each batch to the log table with prepared
+ * multi-row INSERTs (stmt.cpp), in one transaction. "file:<path>" appends
+ * the batch as a block of the columnar sample file (colfile.cpp), which is
+ * what you want when probing at rates the log table can't keep up with;
+ * stats still go to MySQL either way. "collector:<host>[:port]" sends it to
+ * a collector instead (collector.cpp), and makes us an agent, without a
+ * database of our own.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dnsperf.h"
+#include "collector.h"
+#include "colfile.h"
+#include "sink.h"
+#include "stmt.h"
+
+using namespace std;
+
+/* The writer thread is the only one writing, so the sink owns its
+ * connection and prepared INSERTs */
+static int dnsperf_mysql_open(struct dnsperf_sink *s, const char *arg)
+{
+	struct dnsperf_stmts *st = new struct dnsperf_stmts;
+
+	dnsperf_stmt_init(st);
+	s->priv = st;
+	return 0;
+}
+
+static int dnsperf_mysql_write(struct dnsperf_sink *s,
+			       const struct dnsperf_sample *samples, size_t n)
+{
+	struct dnsperf_stmts *st = (struct dnsperf_stmts *)s->priv;
+
+	if (!dnsperf_stmt_insert(st, samples, n))
+		return DNSPERF_SINK_OK;
+	/* lost the connection half-way? then try again later */
+	return st->mysql ? DNSPERF_SINK_FAILED : DNSPERF_SINK_RETRY;
+}
+
+static void dnsperf_mysql_close(struct dnsperf_sink *s)
+{
+	struct dnsperf_stmts *st = (struct dnsperf_stmts *)s->priv;
+
+	dnsperf_stmt_close(st);
+	delete st;
+	s->priv = NULL;
+}
+
+static int dnsperf_file_open(struct dnsperf_sink *s, const char *arg)
+{
+	struct dnsperf_colfile *f = new struct dnsperf_colfile;
+
+	if (!arg || !*arg) {
+		cout << "The file sink needs a path (file:<path>)" << endl;
+		delete f;
+		return 1;
+	}
+	if (dnsperf_col_open(f, arg)) {
+		delete f;
+		return 1;
+	}
+	if (!dnsperf_quiet)
+		cout << "Logging queries to " << arg << endl;
+	s->priv = f;
+	return 0;
+}
+
+static int dnsperf_file_write(struct dnsperf_sink *s,
+			      const struct dnsperf_sample *samples, size_t n)
+{
+	struct dnsperf_colfile *f = (struct dnsperf_colfile *)s->priv;
+
+	if (dnsperf_col_append(f, samples, n)) {
+		cerr << "Failed to append " << n << " samples: " <<
+		    strerror(errno) << endl;
+		/* most likely a full disk, which may go away */
+		return DNSPERF_SINK_RETRY;
+	}
+	return DNSPERF_SINK_OK;
+}
+
+static void dnsperf_file_close(struct dnsperf_sink *s)
+{
+	struct dnsperf_colfile *f = (struct dnsperf_colfile *)s->priv;
+
+	dnsperf_col_close(f);
+	delete f;
+	s->priv = NULL;
+}
+
+static int dnsperf_collector_open(struct dnsperf_sink *s, const char *arg)
+{
+	struct dnsperf_agent *a = new struct dnsperf_agent;
+
+	if (dnsperf_agent_open(a, arg)) {
+		delete a;
+		return 1;
+	}
+	s->priv = a;
+	return 0;
+}
+
+static int dnsperf_collector_write(struct dnsperf_sink *s,
+				   const struct dnsperf_sample *samples,
+				   size_t n)
+{
+	struct dnsperf_agent *a = (struct dnsperf_agent *)s->priv;
+
+	/* the collector may well come back */
+	return dnsperf_agent_send(a, samples, n) ? DNSPERF_SINK_RETRY :
+	    DNSPERF_SINK_OK;
+}
+
+static void dnsperf_collector_close(struct dnsperf_sink *s)
+{
+	struct dnsperf_agent *a = (struct dnsperf_agent *)s->priv;
+
+	dnsperf_agent_close(a);
+	delete a;
+	s->priv = NULL;
+}
+
+static const struct dnsperf_sink dnsperf_sinks[] = {
+	{ "mysql", dnsperf_mysql_open, dnsperf_mysql_write,
+	  dnsperf_mysql_close, NULL },
+	{ "file", dnsperf_file_open, dnsperf_file_write,
+	  dnsperf_file_close, NULL },
+	{ "collector", dnsperf_collector_open, dnsperf_collector_write,
+	  dnsperf_collector_close, NULL },
+};
+#define DNSPERF_SINKS (sizeof(dnsperf_sinks) / sizeof(dnsperf_sinks[0]))
+
+/* spec is the sink name, optionally followed by ':' and its argument */
+int dnsperf_sink_open(struct dnsperf_sink *s, const char *spec)
+{
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+
+	for (size_t i = 0; i < DNSPERF_SINKS; i++) {
+		if (strlen(dnsperf_sinks[i].name) != len ||
+		    strncmp(dnsperf_sinks[i].name, spec, len))
+			continue;
+		*s = dnsperf_sinks[i];
+		return s->open(s, arg ? arg + 1 : NULL);
+	}
+	cout << "Unknown query log sink `" << spec << "`" << endl;
+	return 1;
+}
+
+void dnsperf_sink_close(struct dnsperf_sink *s)
+{
+	s->close(s);
+}
@@ -0,0 +1,35 @@
+/*
+ * sink.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Where the query log goes. The writer thread hands every batch of samples
+ * to one sink: the MySQL log table (the default), a local columnar file
+ * for runs that produce more samples than an InnoDB table wants to take, or
+ * a collector somewhere else.
+ */
+
+#ifndef DNSPERF_SINK_H
+#define DNSPERF_SINK_H
+
+#include <stddef.h>
+
+#include "writer.h"
+
+/* What write() tells the writer */
+#define DNSPERF_SINK_OK		0
+#define DNSPERF_SINK_FAILED	1	/* rows are bad, drop them */
+#define DNSPERF_SINK_RETRY	2	/* backend away, keep the batch */
+
+struct dnsperf_sink {
+	const char *name;
+	int (*open)(struct dnsperf_sink *s, const char *arg);
+	int (*write)(struct dnsperf_sink *s,
+		     const struct dnsperf_sample *samples, size_t n);
+	void (*close)(struct dnsperf_sink *s);
+	void *priv;
+};
+
+/* "mysql", "file:<path>" or "collector:<host>[:port]" */
+int dnsperf_sink_open(struct dnsperf_sink *s, const char *spec);
+void dnsperf_sink_close(struct dnsperf_sink *s);
+
+#endif
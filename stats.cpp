@@ -0,0 +1,324 @@
+/*
+ * stats.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Per-domain running statistics (count, mean, stddev, first/last query).
+ *
+ * Mean and variance are kept with Welford's online algorithm, so adding a
+ * sample is O(1) and numerically stable. The resulting stddev is the
+ * population standard deviation, the same thing MySQL's STDDEV() returns, so
+ * the numbers in the stats table do not change meaning.
+ *
+ * Percentiles come from the histograms and go to a table of their own (one
+ * row per nameserver and address, plus one for the whole domain with an
+ * empty nameserver). The buckets are kept there too, so they survive a
+ * restart, and so are the counts of queries that got no usable answer, by
+ * outcome: those never make it into the latency numbers, so without them a
+ * flaky nameserver would just look like a fast one that is asked less
+ * often.
+ */
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dnsperf.h"
+#include "domains.h"
+#include "stats.h"
+#include "stmt.h"
+
+using namespace std;
+
+/* percentiles we report, and the columns they go to */
+static const double dnsperf_pcts[] = { 50, 90, 99, 99.9 };
+static const char *dnsperf_pct_names[] = { "p50", "p90", "p99", "p999" };
+#define DNSPERF_PCTS (sizeof(dnsperf_pcts) / sizeof(dnsperf_pcts[0]))
+
+void dnsperf_stat_init(struct dnsperf_stat *st, const char *domain)
+{
+	snprintf(st->domain, sizeof(st->domain), "%s", domain);
+	st->count = 0;
+	st->mean = st->m2 = 0;
+	st->first = st->last = 0;
+	st->reported = 0;
+	dnsperf_hist_init(&st->hist);
+	memset(st->outcomes, 0, sizeof(st->outcomes));
+	st->ns.clear();
+}
+
+/* Which of st->ns a nameserver address is, with a linear search: done once
+ * per target, not per probe (see dnsperf_target.nsid) */
+size_t dnsperf_stat_nsid(struct dnsperf_stat *st, const char *nameserver,
+			 const char *address)
+{
+	struct dnsperf_nshist entry;
+
+	for (size_t i = 0; i < st->ns.size(); i++)
+		if (!strcmp(st->ns[i].nameserver, nameserver) &&
+		    !strcmp(st->ns[i].address, address))
+			return i;
+
+	/* first time we see this one: the only time we allocate, so an
+	 * outage costs no memory */
+	snprintf(entry.nameserver, sizeof(entry.nameserver), "%s", nameserver);
+	snprintf(entry.address, sizeof(entry.address), "%s", address);
+	dnsperf_hist_init(&entry.hist);
+	memset(entry.outcomes, 0, sizeof(entry.outcomes));
+	st->ns.push_back(entry);
+	return st->ns.size() - 1;
+}
+
+/* latency in ns, as the probe engine measured it */
+void dnsperf_stat_hist_add(struct dnsperf_stat *st, size_t nsid,
+			   uint64_t latency)
+{
+	dnsperf_hist_add(&st->hist, latency);
+	dnsperf_hist_add(&st->ns[nsid].hist, latency);
+}
+
+/* A query that got no usable answer: counted, but no latency sample */
+void dnsperf_stat_fail(struct dnsperf_stat *st, size_t nsid, int outcome)
+{
+	st->outcomes[outcome]++;
+	st->ns[nsid].outcomes[outcome]++;
+}
+
+uint64_t dnsperf_failures(const uint64_t *outcomes)
+{
+	uint64_t n = 0;
+
+	for (int i = DNSPERF_OUTCOME_OK + 1; i < DNSPERF_OUTCOMES; i++)
+		n += outcomes[i];
+	return n;
+}
+
+static double dnsperf_failrate(const struct dnsperf_hist *h,
+			       const uint64_t *outcomes)
+{
+	uint64_t failed = dnsperf_failures(outcomes);
+
+	return failed ? (double)failed / (h->count + failed) : 0;
+}
+
+void dnsperf_stat_add(struct dnsperf_stat *st, double value, time_t tm)
+{
+	double delta;
+
+	if (!st->count || tm < st->first)
+		st->first = tm;
+	if (!st->count || tm > st->last)
+		st->last = tm;
+
+	st->count++;
+	delta = value - st->mean;
+	st->mean += delta / st->count;
+	st->m2 += delta * (value - st->mean);
+}
+
+double dnsperf_stat_stddev(const struct dnsperf_stat *st)
+{
+	if (!st->count)
+		return 0;
+	return sqrt(st->m2 / st->count);
+}
+
+/* Rebuild the running state from the stats table. Only done once, at
+ * startup: from then on the stats table is written, never read. Rows are
+ * streamed, and only domains on the list get stats. */
+int dnsperf_stats_load(mysqlpp::Connection * conn,
+		       struct dnsperf_domains *domains)
+{
+	mysqlpp::Query query = conn->query();
+	mysqlpp::UseQueryResult res;
+
+	if (!dnsperf_quiet)
+		cout << "Loading stats from table `" << dnsperf_stattable <<
+		    "`" << endl;
+	query << "select domain, average, stddev, count, first, last from " <<
+	    dnsperf_stattable << " where count > 0";
+	if (dnsperf_verbose)
+		cout << query << endl;
+	if (!(res = query.use())) {
+		cerr << "Failed to get stats from `" << dnsperf_stattable <<
+		    "` " << query.error() << endl;
+		return 1;
+	}
+
+	while (mysqlpp::Row row = res.fetch_row()) {
+		struct dnsperf_stat *st;
+		double stddev;
+		long i;
+
+		if ((i = dnsperf_domains_find(domains, row[0].c_str())) < 0)
+			continue;
+		st = dnsperf_domain_stat(domains, i);
+		st->count = (uint64_t) row[3];
+		st->mean = row[1];
+		stddev = row[2];
+		st->m2 = stddev * stddev * st->count;
+		dnsperf_parse_date(row[4].c_str(), &st->first);
+		dnsperf_parse_date(row[5].c_str(), &st->last);
+		st->reported = st->count;
+		if (dnsperf_verbose)
+			cout << "Restored " << st->count << " queries for " <<
+			    st->domain << endl;
+	}
+	return 0;
+}
+
+/* Put the histograms from the latency table back in place, once at startup */
+int dnsperf_hists_load(mysqlpp::Connection * conn,
+		       struct dnsperf_domains *domains)
+{
+	mysqlpp::Query query = conn->query();
+	mysqlpp::UseQueryResult res;
+
+	query << "select domain, nameserver, buckets";
+	for (int i = DNSPERF_OUTCOME_OK + 1; i < DNSPERF_OUTCOMES; i++)
+		query << ", " << dnsperf_outcome_name(i);
+	query << ", address from " << dnsperf_histtable;
+	if (dnsperf_verbose)
+		cout << query << endl;
+	if (!(res = query.use())) {
+		cerr << "Failed to get histograms from `" << dnsperf_histtable <<
+		    "` " << query.error() << endl;
+		return 1;
+	}
+
+	while (mysqlpp::Row row = res.fetch_row()) {
+		struct dnsperf_stat *st;
+		struct dnsperf_hist *h;
+		uint64_t *outcomes;
+		long i;
+
+		if (row[2].is_null() ||
+		    (i = dnsperf_domains_find(domains, row[0].c_str())) < 0)
+			continue;
+		st = dnsperf_domain_stat(domains, i);
+		if (row[1].length()) {
+			struct dnsperf_nshist *ns;
+
+			ns = &st->ns[dnsperf_stat_nsid(st, row[1].c_str(),
+					row[DNSPERF_OUTCOMES + 2].c_str())];
+			h = &ns->hist;
+			outcomes = ns->outcomes;
+		} else {
+			h = &st->hist;
+			outcomes = st->outcomes;
+		}
+		if (dnsperf_hist_decode(h, row[2].c_str()))
+			cerr << "Ignoring bad histogram of " << st->domain <<
+			    endl;
+		for (int k = DNSPERF_OUTCOME_OK + 1; k < DNSPERF_OUTCOMES; k++)
+			outcomes[k] = (uint64_t)row[2 + k];
+		if (!row[1].length())
+			st->reported = st->count + dnsperf_failures(outcomes);
+	}
+	return 0;
+}
+
+/* One row per histogram: empty nameserver means the whole domain */
+static void dnsperf_hist_row(mysqlpp::Query & query, const char *domain,
+			     const char *nameserver, const char *address,
+			     const struct dnsperf_hist *h,
+			     const uint64_t *outcomes)
+{
+	string buckets;
+
+	dnsperf_hist_encode(h, &buckets);
+	query << "(" << mysqlpp::quote << domain << ", " <<
+	    mysqlpp::quote << nameserver << ", " << h->count;
+	for (size_t i = 0; i < DNSPERF_PCTS; i++)
+		query << ", " << dnsperf_hist_percentile(h, dnsperf_pcts[i]) /
+		    1000.0;
+	query << ", " << h->max / 1000.0 << ", " <<
+	    mysqlpp::quote << buckets;
+	for (int i = DNSPERF_OUTCOME_OK + 1; i < DNSPERF_OUTCOMES; i++)
+		query << ", " << outcomes[i];
+	query << ", " << dnsperf_failrate(h, outcomes) << ", " <<
+	    mysqlpp::quote << address << ")";
+}
+
+static void dnsperf_hist_print(const struct dnsperf_hist *h,
+			       const uint64_t *outcomes)
+{
+	uint64_t failed = dnsperf_failures(outcomes);
+
+	for (size_t i = 0; i < DNSPERF_PCTS; i++)
+		cout << ", " << dnsperf_pct_names[i] << ": " <<
+		    dnsperf_hist_percentile(h, dnsperf_pcts[i]) / 1000000.0 <<
+		    " ms";
+	cout << ", max: " << h->max / 1000000.0 << " ms";
+	if (!failed)
+		return;
+	cout << ", failed: " << failed << " (" <<
+	    dnsperf_failrate(h, outcomes) * 100 << "%:";
+	for (int i = DNSPERF_OUTCOME_OK + 1; i < DNSPERF_OUTCOMES; i++)
+		if (outcomes[i])
+			cout << " " << dnsperf_outcome_name(i) << " " <<
+			    outcomes[i];
+	cout << ")";
+}
+
+/* Report the running stats of a domain and write them to the stats table
+ * (through the prepared UPDATE) and the latency table */
+int dnsperf_stats(mysqlpp::Connection * conn, struct dnsperf_stmts *stmts,
+		  struct dnsperf_stat *st)
+{
+	double stddev;
+	char timestamp_first[DNSPERF_DATE_LEN], timestamp_last[DNSPERF_DATE_LEN];
+	uint64_t seen = st->count + dnsperf_failures(st->outcomes);
+
+	/* Check that we have asked the domain anything at all, and anything
+	 * new since the last time: with a long list, most have nothing */
+	if (!seen || seen == st->reported)
+		return 1;
+
+	stddev = dnsperf_stat_stddev(st);
+	dnsperf_strdate(st->first, timestamp_first);
+	dnsperf_strdate(st->last, timestamp_last);
+	if (!dnsperf_quiet) {
+		cout << "domain: " << st->domain << " "
+		    << "count: " << st->count << " queries, "
+		    << "Avg: " << st->mean / 1000.0 << " ms, "
+		    << "Stddev: " << stddev / 1000.0 << " ms, "
+		    << "first query: " << timestamp_first <<
+		    ", " << "last query: " << timestamp_last;
+		dnsperf_hist_print(&st->hist, st->outcomes);
+		cout << endl;
+		for (size_t i = 0; i < st->ns.size(); i++) {
+			cout << "  nameserver: " << st->ns[i].nameserver;
+			if (st->ns[i].address[0])
+				cout << " (" << st->ns[i].address << ")";
+			cout << " count: " << st->ns[i].hist.count <<
+			    " queries";
+			dnsperf_hist_print(&st->ns[i].hist,
+					   st->ns[i].outcomes);
+			cout << endl;
+		}
+	}
+
+	/* nothing but failures so far: no average to speak of */
+	if (st->count && dnsperf_stmt_update(stmts, st))
+		/* FIXME: how critical is this ? Should we fail ? */
+		return 1;
+
+	mysqlpp::Query query = conn->query();
+	query << "replace into " << dnsperf_histtable << " values ";
+	dnsperf_hist_row(query, st->domain, "", "", &st->hist, st->outcomes);
+	for (size_t i = 0; i < st->ns.size(); i++) {
+		query << ", ";
+		dnsperf_hist_row(query, st->domain, st->ns[i].nameserver,
+				 st->ns[i].address, &st->ns[i].hist,
+				 st->ns[i].outcomes);
+	}
+	if (!query.exec()) {
+		cerr << "Failed to update " << dnsperf_histtable
+		    << " table: " << query.error() << endl;
+		return 1;
+	}
+	st->reported = seen;
+	return 0;
+}
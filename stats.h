@@ -0,0 +1,87 @@
+/*
+ * stats.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Per-domain running statistics. We keep the aggregates in-process and only
+ * write them back to the stats table, instead of asking MySQL to scan the
+ * whole query log every time a domain is done. Next to them, latency
+ * histograms per domain and per nameserver address of the domain give us
+ * percentiles.
+ */
+
+#ifndef DNSPERF_STATS_H
+#define DNSPERF_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+#include <mysql++/mysql++.h>
+
+#include "histogram.h"
+#include "probe.h"
+
+/* matches the CHAR(80) domain column */
+#define DNSPERF_DOMAIN_MAX 81
+/* and the CHAR(46) address one, an IPv6 address as text */
+#define DNSPERF_ADDRESS_MAX 47
+
+/* Latency of one address of a nameserver of a domain, and what became of
+ * the queries that got none */
+struct dnsperf_nshist {
+	char nameserver[DNSPERF_DOMAIN_MAX];
+	char address[DNSPERF_ADDRESS_MAX];	/* "" from before we kept them */
+	struct dnsperf_hist hist;
+	uint64_t outcomes[DNSPERF_OUTCOMES];	/* [OK] is unused */
+};
+
+struct dnsperf_stat {
+	char domain[DNSPERF_DOMAIN_MAX];
+	uint64_t count;
+	double mean;		/* running mean (us) */
+	double m2;		/* sum of squared deviations from the mean */
+	time_t first;
+	time_t last;
+	uint64_t reported;	/* queries as of the last report */
+	struct dnsperf_hist hist;		/* whole domain */
+	uint64_t outcomes[DNSPERF_OUTCOMES];	/* failures, whole domain */
+	std::vector<struct dnsperf_nshist> ns;	/* one per nameserver address
+						 * seen */
+};
+
+void dnsperf_stat_init(struct dnsperf_stat *st, const char *domain);
+void dnsperf_stat_add(struct dnsperf_stat *st, double value, time_t tm);
+size_t dnsperf_stat_nsid(struct dnsperf_stat *st, const char *nameserver,
+			 const char *address);
+void dnsperf_stat_hist_add(struct dnsperf_stat *st, size_t nsid,
+			   uint64_t latency);
+void dnsperf_stat_fail(struct dnsperf_stat *st, size_t nsid, int outcome);
+uint64_t dnsperf_failures(const uint64_t *outcomes);
+double dnsperf_stat_stddev(const struct dnsperf_stat *st);
+
+/* The rollups and the detectors keep their per-address state in vectors
+ * laid out like st->ns, one further down: [0] is the whole domain and
+ * [nsid + 1] the address. This grows one to have room for nsid, with init
+ * run on the new entries, and gives back that of nsid. */
+template <class T>
+T *dnsperf_nsid_entry(std::vector<T> *v, size_t nsid, void (*init)(T *))
+{
+	size_t n = v->size();
+
+	if (n < nsid + 2) {
+		v->resize(nsid + 2);
+		for (; n < v->size(); n++)
+			init(&(*v)[n]);
+	}
+	return &(*v)[nsid + 1];
+}
+
+struct dnsperf_domains;
+int dnsperf_stats_load(mysqlpp::Connection * conn,
+		       struct dnsperf_domains *domains);
+int dnsperf_hists_load(mysqlpp::Connection * conn,
+		       struct dnsperf_domains *domains);
+struct dnsperf_stmts;
+int dnsperf_stats(mysqlpp::Connection * conn, struct dnsperf_stmts *stmts,
+		  struct dnsperf_stat *st);
+
+#endif
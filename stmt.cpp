@@ -0,0 +1,362 @@
+/*
+ * stmt.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Prepared statements on a raw MySQL connection. Statements are prepared the
+ * first time they are needed and kept until the connection goes; when it
+ * does (any client-side error), we close everything and the next call
+ * reconnects and prepares again, so callers only have to check st->mysql to
+ * tell a lost connection from bad rows.
+ *
+ * A batch of n rows goes out as the INSERTs of the powers of two that add
+ * up to n, in one transaction. Rows name their domain and nameserver by id;
+ * a name we have not seen before is looked up (and added if need be) in
+ * its own little transaction first.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dnsperf.h"
+#include "db.h"
+#include "stmt.h"
+#include "topology.h"
+
+using namespace std;
+
+void dnsperf_stmt_init(struct dnsperf_stmts *st)
+{
+	st->mysql = NULL;
+	for (unsigned int i = 0; i < DNSPERF_STMT_INSERTS; i++)
+		st->insert[i] = NULL;
+	st->update = NULL;
+}
+
+void dnsperf_stmt_close(struct dnsperf_stmts *st)
+{
+	for (unsigned int i = 0; i < DNSPERF_STMT_INSERTS; i++) {
+		if (st->insert[i])
+			mysql_stmt_close(st->insert[i]);
+		st->insert[i] = NULL;
+	}
+	if (st->update)
+		mysql_stmt_close(st->update);
+	st->update = NULL;
+	if (st->mysql)
+		mysql_close(st->mysql);
+	st->mysql = NULL;
+}
+
+static int dnsperf_stmt_connect(struct dnsperf_stmts *st)
+{
+	unsigned int timeout = DNSPERF_DB_CONNECT_TIMEOUT;
+
+	if (st->mysql)
+		return 0;
+	if (!(st->mysql = mysql_init(NULL)))
+		return 1;
+	mysql_options(st->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+	if (!mysql_real_connect(st->mysql, dnsperf_dbhostname, dnsperf_dbuser,
+				dnsperf_dbpass, dnsperf_dbname, 0, NULL, 0)) {
+		cerr << "DB connection failed: " << mysql_error(st->mysql) <<
+		    endl;
+		dnsperf_stmt_close(st);
+		return 1;
+	}
+	/* every batch is a transaction of its own */
+	mysql_autocommit(st->mysql, 0);
+	return 0;
+}
+
+/* Client-side errors (2xxx) mean the connection is no good any more */
+static void dnsperf_stmt_error(struct dnsperf_stmts *st, MYSQL_STMT *stmt,
+			       const char *what)
+{
+	unsigned int err = stmt ? mysql_stmt_errno(stmt) :
+	    mysql_errno(st->mysql);
+
+	cerr << "Failed to " << what << ": " <<
+	    (stmt ? mysql_stmt_error(stmt) : mysql_error(st->mysql)) << endl;
+	if (err >= CR_MIN_ERROR && err <= CR_MAX_ERROR)
+		dnsperf_stmt_close(st);
+}
+
+static MYSQL_STMT *dnsperf_stmt_prepare(struct dnsperf_stmts *st,
+					const string &sql)
+{
+	MYSQL_STMT *stmt;
+
+	if (dnsperf_verbose)
+		cout << "Preparing " << sql.substr(0, 80) << "..." << endl;
+	if (!(stmt = mysql_stmt_init(st->mysql))) {
+		dnsperf_stmt_error(st, NULL, "prepare statement");
+		return NULL;
+	}
+	if (mysql_stmt_prepare(stmt, sql.c_str(), sql.length())) {
+		dnsperf_stmt_error(st, stmt, "prepare statement");
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+	return stmt;
+}
+
+static void dnsperf_stmt_time(time_t tm, MYSQL_TIME *t)
+{
+	struct tm tm_local;
+
+	/* same as dnsperf_strdate() */
+	localtime_r(&tm, &tm_local);
+	memset(t, 0, sizeof(*t));
+	t->year = tm_local.tm_year + 1900;
+	t->month = tm_local.tm_mon + 1;
+	t->day = tm_local.tm_mday;
+	t->hour = tm_local.tm_hour;
+	t->minute = tm_local.tm_min;
+	t->second = tm_local.tm_sec;
+	t->time_type = MYSQL_TIMESTAMP_DATETIME;
+}
+
+static void dnsperf_bind(MYSQL_BIND *b, enum enum_field_types type,
+			 void *buffer, unsigned long *length)
+{
+	memset(b, 0, sizeof(*b));
+	b->buffer_type = type;
+	b->buffer = buffer;
+	b->length = length;
+}
+
+/* The id of a domain, nameserver, vantage point or address, adding it to
+ * its table the first time */
+static int dnsperf_stmt_id(struct dnsperf_stmts *st, int kind,
+			   const char *name, uint32_t *id)
+{
+	map<const char *, map<string, uint32_t>::iterator>::iterator p;
+	map<string, uint32_t>::iterator it;
+
+	/* names come from the topology and the domains table, and stay put */
+	p = st->ptrs[kind].find(name);
+	if (p != st->ptrs[kind].end() && p->second->first == name) {
+		*id = p->second->second;
+		return 0;
+	}
+
+	it = st->ids[kind].find(name);
+	if (it == st->ids[kind].end()) {
+		string table = dnsperf_dim_table(dnsperf_valtable, kind);
+		size_t len = strnlen(name, DNSPERF_DIM_NAME_MAX);
+		vector<char> esc(len * 2 + 1);
+		MYSQL_RES *res;
+		MYSQL_ROW row;
+		string sql;
+
+		mysql_real_escape_string(st->mysql, &esc[0], name, len);
+		if (kind == DNSPERF_DIM_ADDR)
+			sql = "insert ignore into " + table + " (address, " +
+			    "family) values ('" + &esc[0] + "', " +
+			    (dnsperf_address_family(name) == 6 ? "6" : "4") +
+			    ")";
+		else
+			sql = "insert ignore into " + table + " (" +
+			    dnsperf_dim_column[kind] + ") values ('" +
+			    &esc[0] + "')";
+		if (mysql_query(st->mysql, sql.c_str())) {
+			dnsperf_stmt_error(st, NULL, "add a name");
+			return 1;
+		}
+		sql = string("select ") + dnsperf_dim_id[kind] + " from " +
+		    table + " where " + dnsperf_dim_column[kind] + " = '" +
+		    &esc[0] + "'";
+		if (mysql_query(st->mysql, sql.c_str()) ||
+		    !(res = mysql_store_result(st->mysql))) {
+			dnsperf_stmt_error(st, NULL, "look up a name");
+			return 1;
+		}
+		if (!(row = mysql_fetch_row(res)) || !row[0]) {
+			cerr << "No id for `" << name << "` in " << table << endl;
+			mysql_free_result(res);
+			return 1;
+		}
+		*id = strtoul(row[0], NULL, 10);
+		mysql_free_result(res);
+		if (mysql_commit(st->mysql)) {
+			dnsperf_stmt_error(st, NULL, "commit a name");
+			return 1;
+		}
+		it = st->ids[kind].insert(make_pair(string(name), *id)).first;
+	}
+	st->ptrs[kind][name] = it;
+	*id = it->second;
+	return 0;
+}
+
+/* INSERT of 2^i rows */
+static MYSQL_STMT *dnsperf_stmt_insert_rows(struct dnsperf_stmts *st,
+					    unsigned int i)
+{
+	string sql;
+
+	if (st->insert[i])
+		return st->insert[i];
+	/* IGNORE: a row that is there already (same domain, nameserver,
+	 * address and microsecond) can only be the same query, written
+	 * again */
+	sql = string("insert ignore into ") + dnsperf_valtable +
+	    " (domain_id, ts, ns_id, latency, outcome, vp_id, addr_id, clamped)"
+	    " values (?, ?, ?, ?, ?, ?, ?, ?)";
+	for (size_t k = 1; k < (1UL << i); k++)
+		sql += ", (?, ?, ?, ?, ?, ?, ?, ?)";
+	return st->insert[i] = dnsperf_stmt_prepare(st, sql);
+}
+
+/* Write n query log rows; 0 on success. On failure, st->mysql tells
+ * whether it was the connection (NULL) or the rows. */
+int dnsperf_stmt_insert(struct dnsperf_stmts *st,
+			const struct dnsperf_sample *samples, size_t n)
+{
+	size_t done = 0;
+	time_t last = 0;
+
+	if (!n)
+		return 0;
+	if (dnsperf_stmt_connect(st))
+		return 1;
+
+	/* lay out all the parameters once, then point each INSERT at its
+	 * share of them */
+	if (st->bind.size() < n * DNSPERF_STMT_PARAMS) {
+		st->bind.resize(n * DNSPERF_STMT_PARAMS);
+		st->times.resize(n);
+		st->latency.resize(n);
+		st->dimids.resize(n * DNSPERF_DIMS);
+	}
+	for (size_t k = 0; k < n; k++) {
+		MYSQL_BIND *b = &st->bind[k * DNSPERF_STMT_PARAMS];
+		uint32_t *ids = &st->dimids[k * DNSPERF_DIMS];
+
+		ids[2] = ids[3] = 0;
+		if (dnsperf_stmt_id(st, DNSPERF_DIM_DOMAIN, samples[k].domain,
+				    &ids[0]) ||
+		    dnsperf_stmt_id(st, DNSPERF_DIM_NS, samples[k].nameserver,
+				    &ids[1]) ||
+		    (samples[k].vantage &&
+		     dnsperf_stmt_id(st, DNSPERF_DIM_VANTAGE,
+				     samples[k].vantage, &ids[2])) ||
+		    (samples[k].address[0] &&
+		     dnsperf_stmt_id(st, DNSPERF_DIM_ADDR,
+				     samples[k].address, &ids[3])))
+			goto fail;
+		/* the column is in us, keep the ns as decimals */
+		st->latency[k] = samples[k].latency / 1000.0;
+		if (!k || samples[k].tm != last)
+			dnsperf_stmt_time(samples[k].tm, &st->times[k]);
+		else
+			st->times[k] = st->times[k - 1];
+		st->times[k].second_part = samples[k].usec;
+		last = samples[k].tm;
+
+		dnsperf_bind(&b[0], MYSQL_TYPE_LONG, &ids[0], NULL);
+		b[0].is_unsigned = 1;
+		dnsperf_bind(&b[1], MYSQL_TYPE_DATETIME, &st->times[k], NULL);
+		dnsperf_bind(&b[2], MYSQL_TYPE_LONG, &ids[1], NULL);
+		b[2].is_unsigned = 1;
+		dnsperf_bind(&b[3], MYSQL_TYPE_DOUBLE, &st->latency[k], NULL);
+		dnsperf_bind(&b[4], MYSQL_TYPE_TINY,
+			     (void *)&samples[k].outcome, NULL);
+		b[4].is_unsigned = 1;
+		dnsperf_bind(&b[5], MYSQL_TYPE_LONG, &ids[2], NULL);
+		b[5].is_unsigned = 1;
+		dnsperf_bind(&b[6], MYSQL_TYPE_LONG, &ids[3], NULL);
+		b[6].is_unsigned = 1;
+		dnsperf_bind(&b[7], MYSQL_TYPE_TINY,
+			     (void *)&samples[k].clamped, NULL);
+		b[7].is_unsigned = 1;
+	}
+
+	if (dnsperf_verbose)
+		cout << "Populating " << dnsperf_valtable << " table..." << endl;
+	while (done < n) {
+		unsigned int i = DNSPERF_STMT_INSERTS - 1;
+		MYSQL_STMT *stmt;
+
+		while ((1UL << i) > n - done)
+			i--;
+		if (!(stmt = dnsperf_stmt_insert_rows(st, i)))
+			goto fail;
+		if (mysql_stmt_bind_param(stmt,
+					  &st->bind[done * DNSPERF_STMT_PARAMS]) ||
+		    mysql_stmt_execute(stmt)) {
+			dnsperf_stmt_error(st, stmt, "insert query logs");
+			goto fail;
+		}
+		done += 1UL << i;
+	}
+	if (mysql_commit(st->mysql)) {
+		dnsperf_stmt_error(st, NULL, "commit query logs");
+		goto fail;
+	}
+	if (dnsperf_verbose)
+		cout << "inserted " << n << " rows." << endl;
+	return 0;
+fail:
+	if (st->mysql)
+		mysql_rollback(st->mysql);
+	return 1;
+}
+
+/* Write the running stats of a domain to the stats table */
+int dnsperf_stmt_update(struct dnsperf_stmts *st,
+			const struct dnsperf_stat *stat)
+{
+	if (dnsperf_stmt_connect(st))
+		return 1;
+	if (!st->update) {
+		/* domains loaded later have no row yet */
+		string sql = string("insert into ") + dnsperf_stattable +
+		    " (average, stddev, count, first, last, domain)"
+		    " values (?, ?, ?, ?, ?, ?) on duplicate key update"
+		    " average = values(average), stddev = values(stddev),"
+		    " count = values(count), first = values(first),"
+		    " last = values(last)";
+
+		if (!(st->update = dnsperf_stmt_prepare(st, sql)))
+			return 1;
+		dnsperf_bind(&st->ubind[0], MYSQL_TYPE_DOUBLE, &st->average,
+			     NULL);
+		dnsperf_bind(&st->ubind[1], MYSQL_TYPE_DOUBLE, &st->stddev,
+			     NULL);
+		dnsperf_bind(&st->ubind[2], MYSQL_TYPE_LONGLONG, &st->count,
+			     NULL);
+		st->ubind[2].is_unsigned = 1;
+		dnsperf_bind(&st->ubind[3], MYSQL_TYPE_DATETIME, &st->first,
+			     NULL);
+		dnsperf_bind(&st->ubind[4], MYSQL_TYPE_DATETIME, &st->last,
+			     NULL);
+		dnsperf_bind(&st->ubind[5], MYSQL_TYPE_STRING, st->domain,
+			     &st->domain_len);
+		if (mysql_stmt_bind_param(st->update, st->ubind)) {
+			dnsperf_stmt_error(st, st->update, "bind stats update");
+			return 1;
+		}
+	}
+
+	/* the binds point here, so just fill in the values */
+	st->average = stat->mean;
+	st->stddev = dnsperf_stat_stddev(stat);
+	st->count = stat->count;
+	dnsperf_stmt_time(stat->first, &st->first);
+	dnsperf_stmt_time(stat->last, &st->last);
+	snprintf(st->domain, sizeof(st->domain), "%s", stat->domain);
+	st->domain_len = strlen(st->domain);
+
+	if (mysql_stmt_execute(st->update)) {
+		dnsperf_stmt_error(st, st->update, "update stats");
+		return 1;
+	}
+	if (mysql_commit(st->mysql)) {
+		dnsperf_stmt_error(st, NULL, "commit stats");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * stmt.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Prepared statements for the hot paths: the query log INSERT and the stats
+ * UPDATE. mysql++ only speaks SQL text, so these live on a connection of
+ * their own, opened with the MySQL C API, one per thread that needs them.
+ * Values go over bound, in binary; nothing gets formatted or escaped.
+ */
+
+#ifndef DNSPERF_STMT_H
+#define DNSPERF_STMT_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mysql.h>
+
+#include "db.h"
+#include "stats.h"
+#include "writer.h"
+
+/* we prepare INSERTs of 1, 2, 4 ... rows; 8 placeholders per row, and MySQL
+ * wants less than 65536 of those in one statement */
+#define DNSPERF_STMT_PARAMS 8
+#define DNSPERF_STMT_INSERTS 13
+#define DNSPERF_STMT_MAX_ROWS (1 << (DNSPERF_STMT_INSERTS - 1))
+
+struct dnsperf_stmts {
+	MYSQL *mysql;			/* NULL until (re)connected */
+	MYSQL_STMT *insert[DNSPERF_STMT_INSERTS];	/* 2^i rows each */
+	MYSQL_STMT *update;
+
+	/* INSERT parameters, for the largest batch we sent so far */
+	std::vector<MYSQL_BIND> bind;
+	std::vector<MYSQL_TIME> times;
+	std::vector<double> latency;
+	std::vector<uint32_t> dimids;	/* domain, ns, vantage and address
+					 * id of each row */
+
+	/* ids from the dimension tables (see db.h) by kind; these never
+	 * change, so they outlive the connection */
+	std::map<std::string, uint32_t> ids[DNSPERF_DIMS];
+	std::map<const char *, std::map<std::string, uint32_t>::iterator>
+	    ptrs[DNSPERF_DIMS];		/* lookup cache */
+
+	/* UPDATE parameters */
+	MYSQL_BIND ubind[6];
+	double average, stddev;
+	unsigned long long count;
+	MYSQL_TIME first, last;
+	char domain[DNSPERF_DOMAIN_MAX];
+	unsigned long domain_len;
+};
+
+void dnsperf_stmt_init(struct dnsperf_stmts *st);
+void dnsperf_stmt_close(struct dnsperf_stmts *st);
+int dnsperf_stmt_insert(struct dnsperf_stmts *st,
+			const struct dnsperf_sample *samples, size_t n);
+int dnsperf_stmt_update(struct dnsperf_stmts *st,
+			const struct dnsperf_stat *stat);
+
+#endif
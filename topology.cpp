@@ -0,0 +1,622 @@
+/*
+ * topology.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Domain -> NS -> address cache. We used to rebuild a resolver from
+ * /etc/resolv.conf, ask for the NS records and resolve every nameserver on
+ * each iteration; now a background thread does that only when the TTL of
+ * what it learned last time expires. Nameservers shared between domains
+ * (e.g. google.com and youtube.com) are resolved once. Domains loaded later
+ * on (see domains.cpp) are picked up by the same thread; those no longer
+ * listed are neither looked up nor probed. With -S every domain points to
+ * the servers given instead, and only their addresses are looked up.
+ *
+ * The -H snapshot is plain text, one line per domain and per nameserver:
+ *
+ *	domain <name> <expires> <nameserver> ...
+ *	ns <name> <expires> <address> ...
+ *
+ * with expires in seconds since the epoch. It is written to <file>.tmp and
+ * renamed over the old one, so a crash leaves either of them whole.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "dnsperf.h"
+#include "topology.h"
+
+using namespace std;
+
+static int dnsperf_rdf2sockaddr(const ldns_rdf *rdf,
+				struct sockaddr_storage *ss, socklen_t *len)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (ldns_rdf_get_type(rdf) == LDNS_RDF_TYPE_A) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(DNSPERF_PORT);
+		memcpy(&sin->sin_addr, ldns_rdf_data(rdf),
+		       sizeof(sin->sin_addr));
+		*len = sizeof(*sin);
+	} else if (ldns_rdf_get_type(rdf) == LDNS_RDF_TYPE_AAAA) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(DNSPERF_PORT);
+		memcpy(&sin6->sin6_addr, ldns_rdf_data(rdf),
+		       sizeof(sin6->sin6_addr));
+		*len = sizeof(*sin6);
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+/* An address as text (as -S or the snapshot have it), port and all */
+static int dnsperf_text2sockaddr(const char *text, struct sockaddr_storage *ss,
+				 socklen_t *len)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET, text,
+		      &((struct sockaddr_in *)ss)->sin_addr) == 1) {
+		ss->ss_family = AF_INET;
+		((struct sockaddr_in *)ss)->sin_port = htons(DNSPERF_PORT);
+		*len = sizeof(struct sockaddr_in);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, text,
+		      &((struct sockaddr_in6 *)ss)->sin6_addr) == 1) {
+		ss->ss_family = AF_INET6;
+		((struct sockaddr_in6 *)ss)->sin6_port = htons(DNSPERF_PORT);
+		*len = sizeof(struct sockaddr_in6);
+		return 0;
+	}
+	return 1;
+}
+
+/* Get all nameservers for a domain, along with the smallest TTL */
+static int dnsperf_lookup_ns(struct dnsperf_topology *topo,
+			     const char *domainname, vector<string> *names,
+			     uint32_t *ttl)
+{
+	ldns_rdf *domain;
+	ldns_pkt *p;
+	ldns_rr_list *query_results;
+
+	domain = ldns_dname_new_frm_str(domainname);
+	if (!domain) {
+		cout << "failed to build domain to query for NS" << endl;
+		return 1;
+	}
+
+	p = ldns_resolver_query(topo->res,
+				domain,
+				LDNS_RR_TYPE_NS, LDNS_RR_CLASS_IN, LDNS_RD);
+	ldns_rdf_deep_free(domain);
+	if (!p) {
+		cout << "failed to query for nameservers of " << domainname <<
+		    endl;
+		return 1;
+	}
+
+	query_results = ldns_pkt_rr_list_by_type(p,
+						 LDNS_RR_TYPE_NS,
+						 LDNS_SECTION_ANSWER);
+	ldns_pkt_free(p);
+	if (!query_results) {
+		cout << "Cannot find ns for " << domainname << endl;
+		return 1;
+	}
+
+	*ttl = 0;
+	for (size_t j = 0; j < ldns_rr_list_rr_count(query_results); j++) {
+		ldns_rr *rr = ldns_rr_list_rr(query_results, j);
+		ldns_rdf *ns_name = ldns_rr_rdf(rr, 0);
+		char *nameserver;
+
+		if (!ns_name)
+			continue;
+		nameserver = ldns_rdf2str(ns_name);
+		names->push_back(nameserver);
+		free(nameserver);
+		if (!*ttl || ldns_rr_ttl(rr) < *ttl)
+			*ttl = ldns_rr_ttl(rr);
+	}
+	ldns_rr_list_deep_free(query_results);
+	return names->empty();
+}
+
+/* Add the A or AAAA records of a nameserver, and lower ttl to theirs */
+static void dnsperf_lookup_type(struct dnsperf_topology *topo,
+				const ldns_rdf *ns_name, ldns_rr_type type,
+				struct dnsperf_topo_ns *ns, uint32_t *ttl)
+{
+	ldns_pkt *p;
+	ldns_rr_list *iplist;
+
+	p = ldns_resolver_query(topo->res, ns_name, type, LDNS_RR_CLASS_IN,
+				LDNS_RD);
+	if (!p)
+		return;
+	iplist = ldns_pkt_rr_list_by_type(p, type, LDNS_SECTION_ANSWER);
+	ldns_pkt_free(p);
+	if (!iplist)
+		return;
+
+	for (size_t j = 0; j < ldns_rr_list_rr_count(iplist); j++) {
+		ldns_rr *rr = ldns_rr_list_rr(iplist, j);
+		struct sockaddr_storage ss;
+		socklen_t len;
+
+		if (!ldns_rr_rdf(rr, 0) ||
+		    dnsperf_rdf2sockaddr(ldns_rr_rdf(rr, 0), &ss, &len))
+			continue;
+		ns->addrs.push_back(ss);
+		ns->addrlens.push_back(len);
+		if (!*ttl || ldns_rr_ttl(rr) < *ttl)
+			*ttl = ldns_rr_ttl(rr);
+	}
+	ldns_rr_list_deep_free(iplist);
+}
+
+/* Get the A/AAAA addresses of a nameserver, along with the smallest TTL.
+ * The two are asked for apart (ldns_get_rr_list_addr_by_name() would do
+ * both), so -4 and -6 can leave one out and a family that does not answer
+ * costs us none of the other. */
+static int dnsperf_lookup_addrs(struct dnsperf_topology *topo,
+				const char *nameserver,
+				struct dnsperf_topo_ns *ns, uint32_t *ttl)
+{
+	ldns_rdf *ns_name;
+	struct sockaddr_storage ss;
+	socklen_t len;
+
+	/* -S takes addresses too; those never change, and one of the family
+	 * -4 or -6 leaves out is left out for good */
+	if (!dnsperf_text2sockaddr(nameserver, &ss, &len)) {
+		*ttl = DNSPERF_TTL_SERVERS;
+		if (dnsperf_family && dnsperf_address_family(nameserver) !=
+		    (int)dnsperf_family) {
+			cerr << "Skipping " << nameserver << ": not an IPv" <<
+			    dnsperf_family << " address (-" << dnsperf_family <<
+			    ")" << endl;
+			return 0;
+		}
+		ns->addrs.push_back(ss);
+		ns->addrlens.push_back(len);
+		return 0;
+	}
+
+	ns_name = ldns_dname_new_frm_str(nameserver);
+	if (!ns_name)
+		return 1;
+	*ttl = 0;
+	if (dnsperf_family != 6)
+		dnsperf_lookup_type(topo, ns_name, LDNS_RR_TYPE_A, ns, ttl);
+	if (dnsperf_family != 4)
+		dnsperf_lookup_type(topo, ns_name, LDNS_RR_TYPE_AAAA, ns, ttl);
+	ldns_rdf_deep_free(ns_name);
+	return ns->addrs.empty();
+}
+
+/* 4 or 6, by the look of an address as dnsperf_topology_text() writes it;
+ * 0 for the samples that don't say */
+int dnsperf_address_family(const char *address)
+{
+	if (!address || !*address)
+		return 0;
+	return strchr(address, ':') ? 6 : 4;
+}
+
+/* An address as text, kept for good; only the refresh thread adds to the
+ * set, and what is in there never moves */
+static const char *dnsperf_topology_text(struct dnsperf_topology *topo,
+					 const struct sockaddr_storage *ss)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const void *a;
+
+	if (ss->ss_family == AF_INET6)
+		a = &((const struct sockaddr_in6 *)ss)->sin6_addr;
+	else
+		a = &((const struct sockaddr_in *)ss)->sin_addr;
+	if (!inet_ntop(ss->ss_family, a, buf, sizeof(buf)))
+		buf[0] = '\0';
+	return topo->texts.insert(buf).first->c_str();
+}
+
+static time_t dnsperf_expires(time_t now, uint32_t ttl)
+{
+	return now + (ttl < DNSPERF_TTL_MIN ? DNSPERF_TTL_MIN : ttl);
+}
+
+/* Index of a nameserver by name, a new (unresolved) one if need be; called
+ * with the lock held */
+static size_t dnsperf_topology_ns(struct dnsperf_topology *topo,
+				  const string &name)
+{
+	map<string, size_t>::iterator it;
+	struct dnsperf_topo_ns entry;
+
+	it = topo->ns_index.find(name);
+	if (it != topo->ns_index.end())
+		return it->second;
+	entry.name = strdup(name.c_str());
+	entry.expires = 0;
+	topo->ns.push_back(entry);
+	topo->ns_index.insert(make_pair(name, topo->ns.size() - 1));
+	return topo->ns.size() - 1;
+}
+
+/* Domains loaded since the last time */
+static void dnsperf_topology_grow(struct dnsperf_topology *topo)
+{
+	size_t count = topo->list->count;
+
+	if (topo->domains.size() >= count)
+		return;
+	pthread_mutex_lock(&topo->lock);
+	for (size_t i = topo->domains.size(); i < count; i++) {
+		struct dnsperf_topo_domain d;
+
+		d.name = dnsperf_domain(topo->list, i)->name;
+		d.expires = 0;
+		topo->domains.push_back(d);
+	}
+	pthread_mutex_unlock(&topo->lock);
+}
+
+/* Look up again whatever has expired. Only the refresh thread (or main(),
+ * before the thread starts) gets here, so reading the tables without the
+ * lock is fine; we only take it to change them. */
+void dnsperf_topology_refresh(struct dnsperf_topology *topo)
+{
+	time_t now = time(NULL);
+	vector<char> used;
+
+	dnsperf_topology_grow(topo);
+
+	for (size_t i = 0; i < topo->domains.size(); i++) {
+		struct dnsperf_topo_domain *d = &topo->domains[i];
+		vector<string> names;
+		vector<size_t> ns;
+		uint32_t ttl;
+
+		if (d->expires > now || !dnsperf_domain_listed(topo->list, i))
+			continue;
+		if (!topo->servers.empty()) {
+			pthread_mutex_lock(&topo->lock);
+			d->ns = topo->servers;
+			d->expires = dnsperf_expires(now, DNSPERF_TTL_SERVERS);
+			topo->changed = 1;
+			pthread_mutex_unlock(&topo->lock);
+			continue;
+		}
+		if (dnsperf_verbose)
+			cout << "Looking up nameservers of " << d->name << endl;
+		if (dnsperf_lookup_ns(topo, d->name, &names, &ttl)) {
+			/* keep what we had, try again later */
+			pthread_mutex_lock(&topo->lock);
+			d->expires = now + DNSPERF_TTL_RETRY;
+			pthread_mutex_unlock(&topo->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&topo->lock);
+		for (size_t j = 0; j < names.size(); j++)
+			ns.push_back(dnsperf_topology_ns(topo, names[j]));
+		d->ns.swap(ns);
+		d->expires = dnsperf_expires(now, ttl);
+		topo->changed = 1;
+		pthread_mutex_unlock(&topo->lock);
+	}
+
+	/* only bother with nameservers someone still points to */
+	used.resize(topo->ns.size());
+	for (size_t i = 0; i < topo->domains.size(); i++)
+		if (dnsperf_domain_listed(topo->list, i))
+			for (size_t j = 0; j < topo->domains[i].ns.size(); j++)
+				used[topo->domains[i].ns[j]] = 1;
+
+	for (size_t k = 0; k < topo->ns.size(); k++) {
+		struct dnsperf_topo_ns fresh;
+		uint32_t ttl;
+
+		if (!used[k] || topo->ns[k].expires > now)
+			continue;
+		if (dnsperf_verbose)
+			cout << "Looking up addresses of " << topo->ns[k].name <<
+			    endl;
+		if (dnsperf_lookup_addrs(topo, topo->ns[k].name, &fresh,
+					 &ttl)) {
+			pthread_mutex_lock(&topo->lock);
+			topo->ns[k].expires = now + DNSPERF_TTL_RETRY;
+			pthread_mutex_unlock(&topo->lock);
+			continue;
+		}
+		for (size_t j = 0; j < fresh.addrs.size(); j++)
+			fresh.texts.push_back(dnsperf_topology_text(topo,
+							&fresh.addrs[j]));
+		pthread_mutex_lock(&topo->lock);
+		topo->ns[k].addrs.swap(fresh.addrs);
+		topo->ns[k].addrlens.swap(fresh.addrlens);
+		topo->ns[k].texts.swap(fresh.texts);
+		topo->ns[k].expires = dnsperf_expires(now, ttl);
+		topo->changed = 1;
+		pthread_mutex_unlock(&topo->lock);
+	}
+}
+
+/* -H: what we know, for the next run to start from; called by whoever
+ * refreshes, so no lock */
+static void dnsperf_topology_save(struct dnsperf_topology *topo)
+{
+	string tmp = string(topo->snapshot) + ".tmp";
+	vector<char> used(topo->ns.size());
+	FILE *f;
+	int err;
+
+	topo->saved = time(NULL);
+	if (!(f = fopen(tmp.c_str(), "w"))) {
+		cerr << "Unable to write `" << tmp << "`: " <<
+		    strerror(errno) << endl;
+		return;
+	}
+	for (size_t i = 0; i < topo->domains.size(); i++) {
+		struct dnsperf_topo_domain *d = &topo->domains[i];
+
+		if (!dnsperf_domain_listed(topo->list, i) || d->ns.empty())
+			continue;
+		fprintf(f, "domain %s %ld", d->name, (long)d->expires);
+		for (size_t j = 0; j < d->ns.size(); j++) {
+			fprintf(f, " %s", topo->ns[d->ns[j]].name);
+			used[d->ns[j]] = 1;
+		}
+		fputc('\n', f);
+	}
+	for (size_t k = 0; k < topo->ns.size(); k++) {
+		struct dnsperf_topo_ns *ns = &topo->ns[k];
+
+		if (!used[k] || ns->texts.empty())
+			continue;
+		fprintf(f, "ns %s %ld", ns->name, (long)ns->expires);
+		for (size_t j = 0; j < ns->texts.size(); j++)
+			fprintf(f, " %s", ns->texts[j]);
+		fputc('\n', f);
+	}
+	err = ferror(f);
+	if (fclose(f) || err || rename(tmp.c_str(), topo->snapshot)) {
+		cerr << "Unable to write `" << topo->snapshot << "`: " <<
+		    strerror(errno) << endl;
+		unlink(tmp.c_str());
+		return;
+	}
+	topo->changed = 0;
+}
+
+/* -H at start up: take what the last run knew, expiry and all; returns how
+ * many domains now have nameservers (or, with -S, nameservers have
+ * addresses) to probe */
+static size_t dnsperf_topology_load(struct dnsperf_topology *topo)
+{
+	map<string, size_t> index;
+	size_t domains = 0, nameservers = 0;
+	char line[8192];
+	FILE *f;
+
+	if (!(f = fopen(topo->snapshot, "r"))) {
+		if (errno != ENOENT)
+			cerr << "Unable to open `" << topo->snapshot << "`: " <<
+			    strerror(errno) << endl;
+		return 0;
+	}
+	dnsperf_topology_grow(topo);
+	for (size_t i = 0; i < topo->domains.size(); i++)
+		index[topo->domains[i].name] = i;
+	while (fgets(line, sizeof(line), f)) {
+		char *save, *kind, *name, *expires, *word;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!(kind = strtok_r(line, " ", &save)) ||
+		    !(name = strtok_r(NULL, " ", &save)) ||
+		    !(expires = strtok_r(NULL, " ", &save)))
+			continue;
+		if (!strcmp(kind, "domain")) {
+			map<string, size_t>::iterator it = index.find(name);
+			struct dnsperf_topo_domain *d;
+
+			/* -S points every domain at its servers itself */
+			if (!topo->servers.empty() || it == index.end())
+				continue;
+			d = &topo->domains[it->second];
+			d->ns.clear();
+			while ((word = strtok_r(NULL, " ", &save)))
+				d->ns.push_back(dnsperf_topology_ns(topo, word));
+			d->expires = strtol(expires, NULL, 10);
+			domains++;
+		} else if (!strcmp(kind, "ns")) {
+			struct dnsperf_topo_ns *ns;
+
+			ns = &topo->ns[dnsperf_topology_ns(topo, name)];
+			ns->addrs.clear();
+			ns->addrlens.clear();
+			ns->texts.clear();
+			while ((word = strtok_r(NULL, " ", &save))) {
+				struct sockaddr_storage ss;
+				socklen_t len;
+
+				/* the last run may not have had -4 or -6 */
+				if (dnsperf_text2sockaddr(word, &ss, &len) ||
+				    (dnsperf_family &&
+				     dnsperf_address_family(word) !=
+				     (int)dnsperf_family))
+					continue;
+				ns->addrs.push_back(ss);
+				ns->addrlens.push_back(len);
+				ns->texts.push_back(dnsperf_topology_text(topo,
+									  &ss));
+			}
+			if (ns->addrs.empty())
+				continue;
+			ns->expires = strtol(expires, NULL, 10);
+			nameservers++;
+		}
+	}
+	fclose(f);
+	if (!dnsperf_quiet)
+		cout << "Loaded " << domains << " domains and " <<
+		    nameservers << " nameservers from `" << topo->snapshot <<
+		    "`" << endl;
+	return topo->servers.empty() ? domains : nameservers;
+}
+
+static void *dnsperf_topology_thread(void *arg)
+{
+	struct dnsperf_topology *topo = (struct dnsperf_topology *)arg;
+
+	while (topo->running) {
+		sleep(1);
+		dnsperf_topology_refresh(topo);
+		if (topo->snapshot && topo->changed &&
+		    time(NULL) - topo->saved >= DNSPERF_TOPO_SAVE)
+			dnsperf_topology_save(topo);
+	}
+	return NULL;
+}
+
+/* Build the resolver and fill the cache for the first time */
+int dnsperf_topology_init(struct dnsperf_topology *topo,
+			  struct dnsperf_domains *domains)
+{
+	ldns_status s;
+
+	topo->res = NULL;
+	topo->running = 0;
+	topo->snapshot = dnsperf_topofile;
+	topo->changed = 0;
+	topo->saved = 0;
+	pthread_mutex_init(&topo->lock, NULL);
+
+	/* create a new resolver from /etc/resolv.conf
+	 * to get the domains' nameservers */
+	s = ldns_resolver_new_frm_file(&topo->res, NULL);
+	if (s != LDNS_STATUS_OK) {
+		cout << "failed to build resolver from file" << endl;
+		return 1;
+	}
+
+	topo->list = domains;
+	if (dnsperf_servers) {
+		string list(dnsperf_servers);
+		size_t start = 0, end;
+
+		do {
+			end = list.find(',', start);
+			if (end == string::npos)
+				end = list.size();
+			if (end > start)
+				topo->servers.push_back(dnsperf_topology_ns(topo,
+				    list.substr(start, end - start)));
+			start = end + 1;
+		} while (end < list.size());
+	}
+	/* probe what the last run knew, and look again at what expired
+	 * since in the background */
+	if (topo->snapshot && dnsperf_topology_load(topo)) {
+		if (!dnsperf_quiet)
+			cout << "Resolving the rest of " << domains->count <<
+			    " domains in the background" << endl;
+		return 0;
+	}
+	if (domains->count > DNSPERF_TOPO_SYNC_MAX) {
+		if (!dnsperf_quiet)
+			cout << "Resolving nameservers of " << domains->count <<
+			    " domains in the background" << endl;
+		return 0;
+	}
+	if (!dnsperf_quiet)
+		cout << "Resolving nameservers of " << domains->count <<
+		    " domains..." << endl;
+	dnsperf_topology_refresh(topo);
+	return 0;
+}
+
+int dnsperf_topology_start(struct dnsperf_topology *topo)
+{
+	topo->running = 1;
+	if (pthread_create(&topo->thread, NULL, dnsperf_topology_thread,
+			   topo)) {
+		topo->running = 0;
+		cerr << "Unable to start topology refresh thread" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+void dnsperf_topology_destroy(struct dnsperf_topology *topo)
+{
+	if (topo->running) {
+		topo->running = 0;
+		pthread_join(topo->thread, NULL);
+	}
+	for (size_t k = 0; k < topo->ns.size(); k++)
+		free(topo->ns[k].name);
+	topo->domains.clear();
+	topo->ns.clear();
+	topo->ns_index.clear();
+	topo->servers.clear();
+	topo->texts.clear();
+	if (topo->res)
+		ldns_resolver_deep_free(topo->res);
+	pthread_mutex_destroy(&topo->lock);
+}
+
+/* Snapshot of where probes should go right now, for the domains of one
+ * shard: every address of every nameserver, so that an anycast v4 address
+ * and the v6 one of the same NS are measured (and stored) apart */
+void dnsperf_topology_targets(struct dnsperf_topology *topo,
+			      vector<struct dnsperf_target> *targets,
+			      unsigned int shard, unsigned int nr_shards)
+{
+	size_t n = 0;
+
+	pthread_mutex_lock(&topo->lock);
+	for (size_t i = shard; i < topo->domains.size(); i += nr_shards) {
+		struct dnsperf_topo_domain *d = &topo->domains[i];
+
+		if (!dnsperf_domain_listed(topo->list, i))
+			continue;
+		for (size_t j = 0; j < d->ns.size(); j++) {
+			struct dnsperf_topo_ns *ns = &topo->ns[d->ns[j]];
+
+			for (size_t k = 0; k < ns->addrs.size(); k++, n++) {
+				struct dnsperf_target *t;
+
+				if (n == targets->size())
+					targets->resize(n + 1);
+				t = &(*targets)[n];
+				/* names are interned: the same pointers are
+				 * the same target as last time */
+				if (t->domain != i ||
+				    t->nameserver != ns->name ||
+				    t->address != ns->texts[k]) {
+					t->domain = i;
+					t->nameserver = ns->name;
+					t->address = ns->texts[k];
+					t->nsid = DNSPERF_NSID_NONE;
+				}
+				t->addr = ns->addrs[k];
+				t->addrlen = ns->addrlens[k];
+			}
+		}
+	}
+	pthread_mutex_unlock(&topo->lock);
+	targets->resize(n);
+}
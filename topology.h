@@ -0,0 +1,96 @@
+/*
+ * topology.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Cached view of who serves what: each domain maps to its NS set and each
+ * nameserver to its addresses. Entries are refreshed in the background once
+ * the TTL of the records they came from runs out, so the probe loop only ever
+ * sends the timed query. Every address, v4 or v6, is a target of its own.
+ *
+ * With -H the cache is also kept in a file, so that a restart probes what
+ * the last run knew right away; what has expired since is looked up again
+ * in the background, like anything else.
+ */
+
+#ifndef DNSPERF_TOPOLOGY_H
+#define DNSPERF_TOPOLOGY_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <ldns/ldns.h>
+
+#include "domains.h"
+
+/* don't trust TTLs shorter than this, and retry failed lookups after a while */
+#define DNSPERF_TTL_MIN 30
+#define DNSPERF_TTL_RETRY 60
+/* with more domains than this, don't wait for them to be resolved */
+#define DNSPERF_TOPO_SYNC_MAX 1000
+/* how often domains are pointed at the -S servers again; we never look up
+ * their NS, so this is only for domains listed since */
+#define DNSPERF_TTL_SERVERS 86400
+/* -H: the snapshot is written at most this often (s), if anything changed */
+#define DNSPERF_TOPO_SAVE 60
+
+/* One address we can send probes to */
+struct dnsperf_target {
+	size_t domain;			/* index of the domain */
+	const char *nameserver;		/* NS name, owned by the topology */
+	const char *address;		/* addr as text, owned by the topology */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	/* which of the domain's addresses this is in its stats (stats.h);
+	 * the worker looks it up, and it is kept while the target stays */
+	size_t nsid;
+};
+#define DNSPERF_NSID_NONE	((size_t)-1)
+
+struct dnsperf_topo_ns {
+	char *name;
+	time_t expires;
+	std::vector<struct sockaddr_storage> addrs;
+	std::vector<socklen_t> addrlens;
+	std::vector<const char *> texts;	/* in dnsperf_topology.texts */
+};
+
+struct dnsperf_topo_domain {
+	const char *name;		/* owned by the domains table */
+	time_t expires;
+	std::vector<size_t> ns;		/* indices in dnsperf_topology.ns */
+};
+
+struct dnsperf_topology {
+	ldns_resolver *res;		/* built from /etc/resolv.conf, once */
+	pthread_mutex_t lock;		/* protects the two tables below */
+	pthread_t thread;
+	volatile int running;
+	struct dnsperf_domains *list;	/* what we are asked to follow */
+	std::vector<struct dnsperf_topo_domain> domains;	/* same indices */
+	std::vector<struct dnsperf_topo_ns> ns;
+	std::map<std::string, size_t> ns_index;
+	std::vector<size_t> servers;	/* -S: what every domain goes to */
+	/* every address we have seen, as text, for good: samples on their
+	 * way to the query log point here */
+	std::set<std::string> texts;
+	/* -H, only ever used by the refresh thread (or main(), before it) */
+	const char *snapshot;
+	int changed;			/* since it was last written */
+	time_t saved;
+};
+
+int dnsperf_topology_init(struct dnsperf_topology *topo,
+			  struct dnsperf_domains *domains);
+int dnsperf_topology_start(struct dnsperf_topology *topo);
+void dnsperf_topology_destroy(struct dnsperf_topology *topo);
+void dnsperf_topology_refresh(struct dnsperf_topology *topo);
+void dnsperf_topology_targets(struct dnsperf_topology *topo,
+			      std::vector<struct dnsperf_target> *targets,
+			      unsigned int shard, unsigned int nr_shards);
+int dnsperf_address_family(const char *address);
+
+#endif
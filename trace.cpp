@@ -0,0 +1,218 @@
+/*
+ * trace.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Self-profiling. Slots are handed out from the main thread, before the
+ * threads that use them start, and never freed, so the dump thread walks
+ * them without a lock. What it reads is whatever the owners wrote last: the
+ * totals and histograms may be a call apart from each other (the buckets
+ * only ever count up in place, in pages that never move), and ring events
+ * the owner overwrote while they were being copied are left out.
+ */
+
+#include <iostream>
+#include <new>
+#include <vector>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnsperf.h"
+#include "trace.h"
+#include "writer.h"
+
+using namespace std;
+
+static const char *dnsperf_stage_names[DNSPERF_STAGES] = {
+	"sched", "encode", "send", "recv", "parse", "enqueue", "commit"
+};
+
+static const char *dnsperf_trace_path;
+static vector<struct dnsperf_trace *> dnsperf_trace_all;
+static volatile sig_atomic_t dnsperf_trace_usr1;
+
+const char *dnsperf_stage_name(int stage)
+{
+	return stage >= 0 && stage < DNSPERF_STAGES ?
+	    dnsperf_stage_names[stage] : "unknown";
+}
+
+/* Before any thread starts: SIGUSR1 is the dump thread's, like SIGHUP is
+ * the domains thread's */
+int dnsperf_trace_init(const char *path)
+{
+	sigset_t set;
+
+	dnsperf_trace_path = path;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	return 0;
+}
+
+/* A slot for the thread about to be started; NULL without -X */
+struct dnsperf_trace *dnsperf_trace_slot(const char *name)
+{
+	struct dnsperf_trace *t;
+	void *mem;
+
+	if (!dnsperf_trace_path)
+		return NULL;
+	if (posix_memalign(&mem, DNSPERF_CACHELINE, sizeof(*t))) {
+		cerr << "Unable to allocate a trace slot for " << name << endl;
+		return NULL;
+	}
+	/* zeroed, histograms and all */
+	t = new (mem) struct dnsperf_trace();
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	dnsperf_trace_all.push_back(t);
+	return t;
+}
+
+const vector<struct dnsperf_trace *> &dnsperf_traces(void)
+{
+	return dnsperf_trace_all;
+}
+
+/* Only ever called by the slot's owner */
+void dnsperf_trace_add(struct dnsperf_trace *t, int stage, uint64_t start,
+		       uint64_t ns, size_t items)
+{
+	struct dnsperf_trace_stage *s = &t->stages[stage];
+	struct dnsperf_trace_event *ev;
+	uint64_t head = t->head;
+
+	s->calls++;
+	s->items += items;
+	s->ns += ns;
+	dnsperf_hist_add(&s->hist, ns);
+
+	ev = &t->ring[head & (DNSPERF_TRACE_EVENTS - 1)];
+	ev->start = start;
+	ev->ns = ns > 0xffffffffULL ? 0xffffffffU : (uint32_t)ns;
+	ev->stage = stage;
+	ev->items = items > 0xffff ? 0xffff : items;
+	/* the event must be in place before the dump thread can see it */
+	__sync_synchronize();
+	t->head = head + 1;
+}
+
+/* Totals of every stage, and the events since the last dump */
+static void dnsperf_trace_dump_slot(FILE *f, struct dnsperf_trace *t)
+{
+	vector<struct dnsperf_trace_event> evs;
+	uint64_t head, first, lost = 0;
+
+	fprintf(f, "slot %s\n", t->name);
+	for (int i = 0; i < DNSPERF_STAGES; i++) {
+		const struct dnsperf_trace_stage *s = &t->stages[i];
+		uint64_t calls = s->calls;
+
+		if (!calls)
+			continue;
+		fprintf(f, "  %-8s calls %llu items %llu mean %.0f p50 %llu "
+			"p99 %llu max %llu\n", dnsperf_stage_name(i),
+			(unsigned long long)calls,
+			(unsigned long long)s->items, (double)s->ns / calls,
+			(unsigned long long)dnsperf_hist_percentile(&s->hist,
+								    50),
+			(unsigned long long)dnsperf_hist_percentile(&s->hist,
+								    99),
+			(unsigned long long)s->hist.max);
+	}
+
+	head = t->head;
+	first = t->dumped;
+	if (head - first > DNSPERF_TRACE_EVENTS) {
+		lost = head - first - DNSPERF_TRACE_EVENTS;
+		first = head - DNSPERF_TRACE_EVENTS;
+	}
+	/* don't read events before we have seen head move past them */
+	__sync_synchronize();
+	for (uint64_t i = first; i < head; i++)
+		evs.push_back(t->ring[i & (DNSPERF_TRACE_EVENTS - 1)]);
+	__sync_synchronize();
+	/* and drop the ones the owner came round to while we copied */
+	if (t->head - first > DNSPERF_TRACE_EVENTS) {
+		uint64_t over = t->head - first - DNSPERF_TRACE_EVENTS;
+
+		if (over > evs.size())
+			over = evs.size();
+		evs.erase(evs.begin(), evs.begin() + over);
+		lost += over;
+	}
+	t->dumped = head;
+	if (lost)
+		fprintf(f, "  %llu events overwritten before they were dumped\n",
+			(unsigned long long)lost);
+	for (size_t i = 0; i < evs.size(); i++)
+		fprintf(f, "  event %llu %s %u ns %u items\n",
+			(unsigned long long)evs[i].start,
+			dnsperf_stage_name(evs[i].stage), evs[i].ns,
+			evs[i].items);
+}
+
+static void dnsperf_trace_dump(void)
+{
+	FILE *f;
+
+	if (!(f = fopen(dnsperf_trace_path, "a"))) {
+		cerr << "Unable to open " << dnsperf_trace_path << ": " <<
+		    strerror(errno) << endl;
+		return;
+	}
+	fprintf(f, "trace %ld at %llu ns\n", (long)time(NULL),
+		(unsigned long long)dnsperf_now_ns());
+	for (size_t i = 0; i < dnsperf_trace_all.size(); i++)
+		dnsperf_trace_dump_slot(f, dnsperf_trace_all[i]);
+	fclose(f);
+	if (!dnsperf_quiet)
+		cout << "Trace dumped to " << dnsperf_trace_path << endl;
+}
+
+static void dnsperf_trace_sigusr1(int sig)
+{
+	dnsperf_trace_usr1 = 1;
+}
+
+static void *dnsperf_trace_thread(void *arg)
+{
+	struct sigaction sa;
+	sigset_t set;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dnsperf_trace_sigusr1;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	for (;;) {
+		sleep(1);
+		if (!dnsperf_trace_usr1)
+			continue;
+		dnsperf_trace_usr1 = 0;
+		dnsperf_trace_dump();
+	}
+	return NULL;
+}
+
+/* Once the slots are all handed out */
+int dnsperf_trace_start(void)
+{
+	pthread_t thread;
+
+	if (!dnsperf_trace_path)
+		return 0;
+	if (pthread_create(&thread, NULL, dnsperf_trace_thread, NULL)) {
+		cerr << "Unable to start the trace thread" << endl;
+		return 1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * trace.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Self-profiling (-X). Every thread on the probe path (the workers, the
+ * query log writer) gets a slot of its own, where each stage of the
+ * pipeline adds its calls, the items they handled and how long they took,
+ * with a histogram of the latter, and where a ring keeps the last
+ * DNSPERF_TRACE_EVENTS calls for a trace. Nobody but the owner writes to a
+ * slot, so this takes no locks and no atomics; SIGUSR1 has the lot dumped
+ * to the -X file, and -x serves the totals. Without -X the slots are NULL
+ * and each stage costs a test.
+ */
+
+#ifndef DNSPERF_TRACE_H
+#define DNSPERF_TRACE_H
+
+#include <vector>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "scheduler.h"
+
+/* Stages, in the order a sample goes through them */
+#define DNSPERF_STAGE_SCHED	0	/* picking what to send */
+#define DNSPERF_STAGE_ENCODE	1	/* templates and random labels */
+#define DNSPERF_STAGE_SEND	2	/* sendto/sendmmsg */
+#define DNSPERF_STAGE_RECV	3	/* recvmsg/recvmmsg */
+#define DNSPERF_STAGE_PARSE	4	/* matching answers to probes */
+#define DNSPERF_STAGE_ENQUEUE	5	/* stats, rollups, the writer's ring */
+#define DNSPERF_STAGE_COMMIT	6	/* a batch into the query log sink */
+#define DNSPERF_STAGES		7
+
+/* calls kept per slot for the trace; a power of 2 */
+#define DNSPERF_TRACE_EVENTS	4096
+#define DNSPERF_TRACE_NAME	16
+
+struct dnsperf_trace_event {
+	uint64_t start;			/* ns, CLOCK_MONOTONIC */
+	uint32_t ns;
+	uint16_t stage;
+	uint16_t items;
+};
+
+struct dnsperf_trace_stage {
+	volatile uint64_t calls;
+	volatile uint64_t items;
+	volatile uint64_t ns;
+	struct dnsperf_hist hist;	/* ns per call */
+};
+
+/* One thread's; allocated on a cache line of its own */
+struct dnsperf_trace {
+	char name[DNSPERF_TRACE_NAME];	/* "worker 0", "writer" */
+	struct dnsperf_trace_stage stages[DNSPERF_STAGES];
+	volatile uint64_t head;		/* events ever recorded */
+	uint64_t dumped;		/* head as of the last dump */
+	struct dnsperf_trace_event ring[DNSPERF_TRACE_EVENTS];
+};
+
+int dnsperf_trace_init(const char *path);
+struct dnsperf_trace *dnsperf_trace_slot(const char *name);
+int dnsperf_trace_start(void);
+const char *dnsperf_stage_name(int stage);
+void dnsperf_trace_add(struct dnsperf_trace *t, int stage, uint64_t start,
+		       uint64_t ns, size_t items);
+const std::vector<struct dnsperf_trace *> &dnsperf_traces(void);
+
+/* start of a stage, 0 if nobody is looking */
+static inline uint64_t dnsperf_trace_begin(const struct dnsperf_trace *t)
+{
+	return t ? dnsperf_now_ns() : 0;
+}
+
+/* end of one that began at start and handled items */
+static inline void dnsperf_trace_end(struct dnsperf_trace *t, int stage,
+				     uint64_t start, size_t items)
+{
+	if (t)
+		dnsperf_trace_add(t, stage, start, dnsperf_now_ns() - start,
+				  items);
+}
+
+#endif
@@ -0,0 +1,1044 @@
+/*
+ * transport.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * DNS over TCP, TLS and HTTPS for the probe engine. Connections are
+ * non-blocking and share the engine's poller; one per nameserver address,
+ * opened when the first query for it comes and kept open for as long as the
+ * server lets us. Queries are pipelined: over TCP and TLS, each one framed
+ * with its length and answered in any order (RFC 7766), by DNS ID; over
+ * HTTPS, one HTTP/2 stream (RFC 7540) each, a GET of DNSPERF_DOH_PATH with
+ * the query in base64url (RFC 8484).
+ *
+ * Queries that come while their connection is being set up (or, for
+ * HTTP/2, while the server has as many streams open as it allows) wait for
+ * it, in the connection; their -w counts from when they were submitted, but
+ * their latency from when they were written. How long connecting and the
+ * TLS handshake took is kept apart, per engine, for -x. TLS sessions are
+ * kept to resume the next connection to the same server. We don't check
+ * certificates: we time answers, we don't trust them.
+ *
+ * HTTP/2 is only as much of it as we need: we never raise the frame size
+ * and open the windows all the way once, and of the HPACK answers we look
+ * at :status only. With SETTINGS_HEADER_TABLE_SIZE 0 the server cannot put
+ * it in a dynamic table, so it comes first, and in a handful of encodings.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/err.h>
+
+#include "dnsperf.h"
+#include "transport.h"
+
+using namespace std;
+
+#define DNSPERF_PORT_TLS	853
+#define DNSPERF_PORT_HTTPS	443
+
+/* HTTP/2 framing (RFC 7540, 4 and 6) */
+#define H2_HDR_LEN		9
+#define H2_DATA			0
+#define H2_HEADERS		1
+#define H2_RST_STREAM		3
+#define H2_SETTINGS		4
+#define H2_PING			6
+#define H2_GOAWAY		7
+#define H2_WINDOW_UPDATE	8
+#define H2_END_STREAM		0x01
+#define H2_ACK			0x01
+#define H2_END_HEADERS		0x04
+#define H2_PADDED		0x08
+#define H2_PRIORITY		0x20
+#define H2_HEADER_TABLE_SIZE	1
+#define H2_ENABLE_PUSH		2
+#define H2_MAX_STREAMS		3
+#define H2_INITIAL_WINDOW	4
+#define H2_CANCEL		8
+#define H2_FRAME_MAX		16384	/* we never ask for more */
+#define H2_WINDOW_MAX		0x7fffffffU
+#define H2_WINDOW_DEFAULT	65535
+#define H2_STREAMS_DEFAULT	100	/* until the server says (6.5.2) */
+#define H2_SID_MAX		0x7fffffffU
+
+static const char *dnsperf_transports[] = { "udp", "tcp", "tls", "https" };
+
+static const char dnsperf_h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* <udp|tcp|tls|https>[:<port>]; the port is for the stream ones only */
+int dnsperf_parse_transport(const char *spec, unsigned int *port)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+	int t;
+
+	*port = 0;
+	for (t = DNSPERF_TRANSPORT_HTTPS; t >= 0; t--)
+		if (strlen(dnsperf_transports[t]) == len &&
+		    !strncmp(spec, dnsperf_transports[t], len))
+			break;
+	if (t < 0)
+		return -1;
+#ifndef DNSPERF_TLS
+	if (t >= DNSPERF_TRANSPORT_TLS)
+		return -1;
+#endif
+	if (colon) {
+		char *end;
+		unsigned long n = strtoul(colon + 1, &end, 10);
+
+		if (t == DNSPERF_TRANSPORT_UDP || !colon[1] || *end || !n ||
+		    n > 65535)
+			return -1;
+		*port = n;
+	}
+	return t;
+}
+
+const char *dnsperf_transport_name(int transport)
+{
+	if (transport < DNSPERF_TRANSPORT_UDP ||
+	    transport > DNSPERF_TRANSPORT_HTTPS)
+		return "unknown";
+	return dnsperf_transports[transport];
+}
+
+bool dnsperf_addr_less::operator()(const struct sockaddr_storage &a,
+				   const struct sockaddr_storage &b) const
+{
+	if (a.ss_family != b.ss_family)
+		return a.ss_family < b.ss_family;
+	if (a.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)&a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)&b;
+		int k = memcmp(&a6->sin6_addr, &b6->sin6_addr,
+			       sizeof(a6->sin6_addr));
+
+		return k ? k < 0 : a6->sin6_port < b6->sin6_port;
+	}
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *)&a;
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *)&b;
+
+	if (a4->sin_addr.s_addr != b4->sin_addr.s_addr)
+		return a4->sin_addr.s_addr < b4->sin_addr.s_addr;
+	return a4->sin_port < b4->sin_port;
+}
+
+int dnsperf_engine_streams(struct dnsperf_engine *e, int transport,
+			   unsigned int port)
+{
+	struct dnsperf_streams *s;
+
+	if (transport == DNSPERF_TRANSPORT_UDP)
+		return 0;
+	s = new struct dnsperf_streams;
+	s->transport = transport;
+	if (!port)
+		port = transport == DNSPERF_TRANSPORT_TCP ? DNSPERF_PORT :
+		    transport == DNSPERF_TRANSPORT_TLS ? DNSPERF_PORT_TLS :
+		    DNSPERF_PORT_HTTPS;
+	s->port = htons(port);
+	s->ctx = NULL;
+	s->connects = 0;
+	s->connect_failures = 0;
+	s->setup_ns = 0;
+	s->reused = 0;
+#ifdef DNSPERF_TLS
+	if (transport != DNSPERF_TRANSPORT_TCP) {
+		s->ctx = SSL_CTX_new(TLS_client_method());
+		if (!s->ctx) {
+			cerr << "Unable to set up TLS" << endl;
+			delete s;
+			return 1;
+		}
+		SSL_CTX_set_verify(s->ctx, SSL_VERIFY_NONE, NULL);
+		/* the output buffer grows (and moves) while OpenSSL waits to
+		 * write the start of it */
+		SSL_CTX_set_mode(s->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+				 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		if (transport == DNSPERF_TRANSPORT_HTTPS)
+			SSL_CTX_set_alpn_protos(s->ctx,
+						(const unsigned char *)"\x02h2",
+						3);
+	}
+#endif
+	/* OpenSSL writes with write(2): a server hanging up on us must not
+	 * take the whole process with it */
+	signal(SIGPIPE, SIG_IGN);
+	e->streams = s;
+	return 0;
+}
+
+static void dnsperf_conn_reset(struct dnsperf_conn *c)
+{
+	c->state = DNSPERF_CONN_CLOSED;
+	c->queries = 0;
+	c->want_out = 0;
+	c->unstamped.clear();
+	c->in.clear();
+	c->out.clear();
+	c->out_done = 0;
+	c->next_sid = 1;
+	c->max_streams = H2_STREAMS_DEFAULT;
+	c->open_streams = 0;
+	c->consumed = 0;
+	for (size_t k = 0; k < c->streams.size(); k++)
+		c->streams[k].sid = 0;
+}
+
+/* The connection for queries to p's address, made (closed) the first time */
+static struct dnsperf_conn *dnsperf_conn_get(struct dnsperf_engine *e,
+					     const struct dnsperf_probe *p)
+{
+	struct dnsperf_streams *s = e->streams;
+	map<struct sockaddr_storage, struct dnsperf_conn *,
+	    dnsperf_addr_less>::iterator it;
+	struct dnsperf_conn *c;
+	size_t len, ring;
+
+	it = s->conns.find(p->addr);
+	if (it != s->conns.end())
+		return it->second;
+
+	c = new struct dnsperf_conn;
+	c->fd = -1;
+	c->addr = p->addr;
+	c->addrlen = p->addrlen;
+	if (c->addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&c->addr)->sin6_port = s->port;
+	else
+		((struct sockaddr_in *)&c->addr)->sin_port = s->port;
+	snprintf(c->name, sizeof(c->name), "%s", p->nameserver);
+	len = strlen(c->name);
+	if (len && c->name[len - 1] == '.')
+		c->name[len - 1] = '\0';
+	c->ssl = NULL;
+	c->session = NULL;
+	c->dirty = 0;
+	if (s->transport == DNSPERF_TRANSPORT_HTTPS) {
+		/* twice what we can have in flight, so there are always free
+		 * slots for new streams, see dnsperf_h2_query() */
+		for (ring = 64; ring < 2 * e->max_inflight; ring *= 2)
+			;
+		c->streams.resize(ring);
+	}
+	dnsperf_conn_reset(c);
+	s->conns.insert(make_pair(p->addr, c));
+	return c;
+}
+
+static int dnsperf_conn_open(struct dnsperf_engine *e, struct dnsperf_conn *c)
+{
+	struct dnsperf_streams *s = e->streams;
+	int fd, on = 1;
+
+	dnsperf_conn_reset(c);
+	fd = socket(c->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		goto fail;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+		goto fail_close;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	clock_gettime(CLOCK_MONOTONIC, &c->started);
+	if (connect(fd, (struct sockaddr *)&c->addr, c->addrlen) &&
+	    errno != EINPROGRESS)
+		goto fail_close;
+	if (dnsperf_poll_add(e->pollfd, fd) ||
+	    dnsperf_poll_out(e->pollfd, fd, 1))
+		goto fail_close;
+
+	c->fd = fd;
+	c->want_out = 1;
+	c->state = DNSPERF_CONN_CONNECTING;
+	if (s->byfd.size() <= (size_t)fd)
+		s->byfd.resize(fd + 1);
+	s->byfd[fd] = c;
+	return 0;
+
+fail_close:
+	close(fd);
+fail:
+	if (dnsperf_verbose)
+		cout << "Unable to connect to " << c->name << ": " <<
+		    strerror(errno) << endl;
+	s->connect_failures++;
+	return 1;
+}
+
+static int dnsperf_probe_ours(struct dnsperf_engine *e,
+			      const struct dnsperf_sent *w)
+{
+	return w->p->seq == w->seq && w->p->status == DNSPERF_PROBE_PENDING &&
+	    e->ids[w->p->id] == w->p;
+}
+
+/* Close c, and finish what was on it: queries written on it are lost, the
+ * ones still waiting try a new connection, if this one ever worked */
+static void dnsperf_conn_close(struct dnsperf_engine *e,
+			       struct dnsperf_conn *c,
+			       vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_streams *s = e->streams;
+	int was_ready = c->state >= DNSPERF_CONN_READY;
+	size_t k, n;
+
+	if (c->ssl) {
+		/* a session is only good for resuming if we said goodbye */
+		if (was_ready) {
+			SSL_shutdown(c->ssl);
+			if (c->session)
+				SSL_SESSION_free(c->session);
+			c->session = SSL_get1_session(c->ssl);
+		}
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+		ERR_clear_error();
+	}
+	if (c->fd >= 0) {
+		s->byfd[c->fd] = NULL;
+		close(c->fd);
+		c->fd = -1;
+	}
+	if (!was_ready)
+		s->connect_failures++;
+	dnsperf_conn_reset(c);
+
+	for (k = 0; k < DNSPERF_IDS; k++)
+		if (e->ids[k] && e->ids[k]->conn == c)
+			dnsperf_engine_abort(e, e->ids[k], done);
+
+	for (k = n = 0; k < c->waiting.size(); k++)
+		if (dnsperf_probe_ours(e, &c->waiting[k]))
+			c->waiting[n++] = c->waiting[k];
+	c->waiting.resize(n);
+	if (c->waiting.empty() || (was_ready && !dnsperf_conn_open(e, c)))
+		return;
+	for (k = 0; k < c->waiting.size(); k++)
+		dnsperf_engine_abort(e, c->waiting[k].p, done);
+	c->waiting.clear();
+}
+
+static void dnsperf_conn_dirty(struct dnsperf_streams *s,
+			       struct dnsperf_conn *c)
+{
+	if (!c->dirty) {
+		c->dirty = 1;
+		s->dirty.push_back(c);
+	}
+}
+
+static void dnsperf_h2_frame(struct dnsperf_conn *c, uint8_t type,
+			     uint8_t flags, uint32_t sid, const uint8_t *payload,
+			     size_t len)
+{
+	uint8_t h[H2_HDR_LEN] = {
+		(uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len, type,
+		flags, (uint8_t)(sid >> 24), (uint8_t)(sid >> 16),
+		(uint8_t)(sid >> 8), (uint8_t)sid
+	};
+
+	c->out.insert(c->out.end(), h, h + H2_HDR_LEN);
+	c->out.insert(c->out.end(), payload, payload + len);
+}
+
+static void dnsperf_h2_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void dnsperf_h2_setting(uint8_t *p, uint16_t id, uint32_t v)
+{
+	p[0] = id >> 8;
+	p[1] = id;
+	dnsperf_h2_u32(p + 2, v);
+}
+
+/* The preface, our SETTINGS, and all the window the server may want */
+static void dnsperf_h2_start(struct dnsperf_conn *c)
+{
+	uint8_t settings[18], inc[4];
+
+	c->out.insert(c->out.end(), dnsperf_h2_preface,
+		      dnsperf_h2_preface + sizeof(dnsperf_h2_preface) - 1);
+	dnsperf_h2_setting(settings, H2_HEADER_TABLE_SIZE, 0);
+	dnsperf_h2_setting(settings + 6, H2_ENABLE_PUSH, 0);
+	dnsperf_h2_setting(settings + 12, H2_INITIAL_WINDOW, H2_WINDOW_MAX);
+	dnsperf_h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+	dnsperf_h2_u32(inc, H2_WINDOW_MAX - H2_WINDOW_DEFAULT);
+	dnsperf_h2_frame(c, H2_WINDOW_UPDATE, 0, 0, inc, sizeof(inc));
+}
+
+static void dnsperf_h2_rst(struct dnsperf_conn *c, uint32_t sid)
+{
+	uint8_t code[4];
+
+	dnsperf_h2_u32(code, H2_CANCEL);
+	dnsperf_h2_frame(c, H2_RST_STREAM, 0, sid, code, sizeof(code));
+}
+
+/* HPACK integer with an n-bit prefix (RFC 7541, 5.1) */
+static size_t dnsperf_hpack_int(uint8_t *p, uint8_t first, int bits,
+				uint32_t v)
+{
+	uint32_t max = (1U << bits) - 1;
+	size_t n = 0;
+
+	if (v < max) {
+		p[n++] = first | v;
+		return n;
+	}
+	p[n++] = first | max;
+	for (v -= max; v >= 128; v >>= 7)
+		p[n++] = (v & 0x7f) | 0x80;
+	p[n++] = v;
+	return n;
+}
+
+/* A header field we never want indexed, named from the static table */
+static size_t dnsperf_hpack_field(uint8_t *p, uint32_t name,
+				  const char *value, size_t len)
+{
+	size_t n = dnsperf_hpack_int(p, 0x00, 4, name);
+
+	n += dnsperf_hpack_int(p + n, 0x00, 7, len);
+	memcpy(p + n, value, len);
+	return n + len;
+}
+
+static size_t dnsperf_base64url(char *out, const uint8_t *in, size_t len)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789-_";
+	size_t n = 0, i;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		out[n++] = b64[in[i] >> 2];
+		out[n++] = b64[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+		out[n++] = b64[((in[i + 1] & 15) << 2) | (in[i + 2] >> 6)];
+		out[n++] = b64[in[i + 2] & 63];
+	}
+	if (i < len) {
+		out[n++] = b64[in[i] >> 2];
+		if (i + 1 < len) {
+			out[n++] = b64[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+			out[n++] = b64[(in[i + 1] & 15) << 2];
+		} else {
+			out[n++] = b64[(in[i] & 3) << 4];
+		}
+	}
+	return n;
+}
+
+/* Room for another stream on c ? Streams whose probe timed out are still
+ * open as far as the server is concerned; when we run out, we cancel them. */
+static int dnsperf_h2_room(struct dnsperf_engine *e, struct dnsperf_conn *c)
+{
+	uint32_t max = c->max_streams;
+
+	if (max > c->streams.size() / 2)
+		max = c->streams.size() / 2;
+	/* out of stream IDs: time for a new connection */
+	if (c->next_sid > H2_SID_MAX - 2 * c->streams.size()) {
+		c->state = DNSPERF_CONN_DRAINING;
+		return 0;
+	}
+	if (c->open_streams < max)
+		return 1;
+	for (size_t k = 0; k < c->streams.size(); k++) {
+		struct dnsperf_h2_stream *st = &c->streams[k];
+		struct dnsperf_probe *p = e->ids[st->id];
+
+		if (!st->sid || (p && p->seq == st->seq && p->conn == c))
+			continue;
+		dnsperf_h2_rst(c, st->sid);
+		st->sid = 0;
+		c->open_streams--;
+	}
+	return c->open_streams < max;
+}
+
+static void dnsperf_h2_query(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			     struct dnsperf_probe *p)
+{
+	uint8_t block[1024];
+	char path[sizeof(DNSPERF_DOH_PATH) + 5 + (DNSPERF_QUERY_MAX + 2) / 3 * 4];
+	char authority[sizeof(c->name) + 8];
+	struct dnsperf_h2_stream *st;
+	size_t n = 0, len, mask = c->streams.size() - 1;
+	uint32_t sid = c->next_sid;
+
+	/* stream IDs only have to grow: we skip those whose slot is taken,
+	 * and with at most half the slots open that is never for long */
+	while (c->streams[(sid >> 1) & mask].sid)
+		sid += 2;
+	c->next_sid = sid + 2;
+	st = &c->streams[(sid >> 1) & mask];
+	st->sid = sid;
+	st->id = p->id;
+	st->seq = p->seq;
+	st->answered = 0;
+	c->open_streams++;
+
+	len = sizeof(DNSPERF_DOH_PATH) - 1;
+	memcpy(path, DNSPERF_DOH_PATH "?dns=", len + 5);
+	len += 5;
+	len += dnsperf_base64url(path + len, p->wire, p->wirelen);
+	if (strchr(c->name, ':'))
+		snprintf(authority, sizeof(authority), "[%s]", c->name);
+	else
+		snprintf(authority, sizeof(authority), "%s", c->name);
+	if (e->streams->port != htons(DNSPERF_PORT_HTTPS))
+		snprintf(authority + strlen(authority),
+			 sizeof(authority) - strlen(authority), ":%u",
+			 ntohs(e->streams->port));
+
+	block[n++] = 0x82;		/* :method GET */
+	block[n++] = 0x87;		/* :scheme https */
+	n += dnsperf_hpack_field(block + n, 4, path, len);
+	n += dnsperf_hpack_field(block + n, 1, authority, strlen(authority));
+	n += dnsperf_hpack_field(block + n, 19, "application/dns-message",
+				 23);	/* accept */
+	dnsperf_h2_frame(c, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, sid,
+			 block, n);
+}
+
+/* Queue p's query on ready connection c; dnsperf_conn_flush() writes it */
+static void dnsperf_conn_query(struct dnsperf_engine *e,
+			       struct dnsperf_conn *c, struct dnsperf_probe *p)
+{
+	struct dnsperf_streams *s = e->streams;
+
+	if (s->transport == DNSPERF_TRANSPORT_HTTPS) {
+		dnsperf_h2_query(e, c, p);
+	} else {
+		c->out.push_back(p->wirelen >> 8);
+		c->out.push_back(p->wirelen & 0xff);
+		c->out.insert(c->out.end(), p->wire, p->wire + p->wirelen);
+	}
+	p->conn = c;
+	c->unstamped.push_back(p);
+	if (c->queries++)
+		s->reused++;
+	dnsperf_conn_dirty(s, c);
+}
+
+static int dnsperf_conn_room(struct dnsperf_engine *e, struct dnsperf_conn *c)
+{
+	if (c->state != DNSPERF_CONN_READY)
+		return 0;
+	return e->streams->transport != DNSPERF_TRANSPORT_HTTPS ||
+	    dnsperf_h2_room(e, c);
+}
+
+/* Write whatever waited for c and still can go */
+static void dnsperf_conn_resume(struct dnsperf_engine *e,
+				struct dnsperf_conn *c)
+{
+	size_t k, n;
+
+	for (k = 0; k < c->waiting.size() && dnsperf_conn_room(e, c); k++)
+		if (dnsperf_probe_ours(e, &c->waiting[k]))
+			dnsperf_conn_query(e, c, c->waiting[k].p);
+	for (n = 0; k < c->waiting.size(); k++)
+		c->waiting[n++] = c->waiting[k];
+	c->waiting.resize(n);
+}
+
+int dnsperf_stream_send(struct dnsperf_engine *e, struct dnsperf_probe *p)
+{
+	struct dnsperf_conn *c = dnsperf_conn_get(e, p);
+	struct dnsperf_sent w;
+
+	if (c->state == DNSPERF_CONN_CLOSED && dnsperf_conn_open(e, c))
+		return 1;
+	if (c->waiting.empty() && dnsperf_conn_room(e, c)) {
+		dnsperf_conn_query(e, c, p);
+		return 0;
+	}
+	w.p = p;
+	w.seq = p->seq;
+	c->waiting.push_back(w);
+	return 0;
+}
+
+/* Plain TCP or TLS: a byte count, 0 if it has to wait (*out: for POLLOUT),
+ * or -1 if the connection is no good */
+static ssize_t dnsperf_conn_send(struct dnsperf_conn *c, const uint8_t *buf,
+				 size_t len, int *out)
+{
+	ssize_t n;
+
+	*out = 0;
+	if (!c->ssl) {
+		n = send(c->fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			      errno == EINTR)) {
+			*out = 1;
+			return 0;
+		}
+		return n;
+	}
+	n = SSL_write(c->ssl, buf, len);
+	if (n > 0)
+		return n;
+	switch (SSL_get_error(c->ssl, n)) {
+	case SSL_ERROR_WANT_WRITE:
+		*out = 1;
+		return 0;
+	case SSL_ERROR_WANT_READ:
+		return 0;
+	}
+	return -1;
+}
+
+/* Same, reading: returns -2 for nothing to read right now, 0 at EOF */
+static ssize_t dnsperf_conn_recv(struct dnsperf_conn *c, uint8_t *buf,
+				 size_t len)
+{
+	ssize_t n;
+
+	if (!c->ssl) {
+		n = recv(c->fd, buf, len, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			      errno == EINTR))
+			return -2;
+		return n;
+	}
+	n = SSL_read(c->ssl, buf, len);
+	if (n > 0)
+		return n;
+	switch (SSL_get_error(c->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	/* what OpenSSL wants to write goes with our next write */
+	case SSL_ERROR_WANT_WRITE:
+		return -2;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		if (!n && !ERR_peek_error())
+			return 0;
+	}
+	return -1;
+}
+
+/* Stamp what was queued on c since the last time and write out all that we
+ * can */
+static void dnsperf_conn_flush(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			       vector<struct dnsperf_probe *> *done)
+{
+	int out = 0;
+
+	if (c->fd < 0 || c->state < DNSPERF_CONN_READY)
+		return;
+	if (!c->unstamped.empty()) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (size_t k = 0; k < c->unstamped.size(); k++)
+			c->unstamped[k]->wrote = now;
+		c->unstamped.clear();
+	}
+	while (c->out_done < c->out.size()) {
+		ssize_t n = dnsperf_conn_send(c, &c->out[c->out_done],
+					      c->out.size() - c->out_done,
+					      &out);
+
+		if (n < 0) {
+			if (dnsperf_verbose)
+				cout << "Lost connection to " << c->name <<
+				    endl;
+			dnsperf_conn_close(e, c, done);
+			return;
+		}
+		if (!n)
+			break;
+		c->out_done += n;
+	}
+	if (c->out_done == c->out.size()) {
+		c->out.clear();
+		c->out_done = 0;
+	} else if (c->out_done > c->out.size() / 2) {
+		c->out.erase(c->out.begin(), c->out.begin() + c->out_done);
+		c->out_done = 0;
+	}
+	if (out != c->want_out && !dnsperf_poll_out(e->pollfd, c->fd, out))
+		c->want_out = out;
+}
+
+void dnsperf_streams_flush(struct dnsperf_engine *e)
+{
+	struct dnsperf_streams *s = e->streams;
+
+	for (size_t k = 0; k < s->dirty.size(); k++) {
+		s->dirty[k]->dirty = 0;
+		dnsperf_conn_flush(e, s->dirty[k], &s->failed);
+	}
+	s->dirty.clear();
+}
+
+/* The connection is up: from here on its queries are timed */
+static void dnsperf_conn_ready(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			       vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_streams *s = e->streams;
+	struct timespec now;
+	uint64_t setup;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	setup = (uint64_t)(now.tv_sec - c->started.tv_sec) * 1000000000ULL +
+	    now.tv_nsec - c->started.tv_nsec;
+	s->connects++;
+	s->setup_ns += setup;
+	if (dnsperf_verbose)
+		cout << "Connected to " << c->name << " over " <<
+		    dnsperf_transport_name(s->transport) << " in " <<
+		    setup / 1000000.0 << "ms" << (c->ssl &&
+		    SSL_session_reused(c->ssl) ? " (resumed)" : "") << endl;
+	c->state = DNSPERF_CONN_READY;
+	if (s->transport == DNSPERF_TRANSPORT_HTTPS)
+		dnsperf_h2_start(c);
+	dnsperf_conn_resume(e, c);
+	dnsperf_conn_flush(e, c, done);
+}
+
+static void dnsperf_conn_handshake(struct dnsperf_engine *e,
+				   struct dnsperf_conn *c,
+				   vector<struct dnsperf_probe *> *done)
+{
+	int r = SSL_connect(c->ssl), out;
+
+	if (r == 1) {
+		const unsigned char *alpn = NULL;
+		unsigned int len = 0;
+
+		if (e->streams->transport == DNSPERF_TRANSPORT_HTTPS) {
+			SSL_get0_alpn_selected(c->ssl, &alpn, &len);
+			if (len != 2 || memcmp(alpn, "h2", 2)) {
+				if (dnsperf_verbose)
+					cout << c->name << " does not speak " <<
+					    "HTTP/2" << endl;
+				dnsperf_conn_close(e, c, done);
+				return;
+			}
+		}
+		dnsperf_conn_ready(e, c, done);
+		return;
+	}
+	switch (SSL_get_error(c->ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		out = 0;
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		out = 1;
+		break;
+	default:
+		if (dnsperf_verbose)
+			cout << "TLS handshake with " << c->name <<
+			    " failed" << endl;
+		ERR_clear_error();
+		dnsperf_conn_close(e, c, done);
+		return;
+	}
+	if (out != c->want_out && !dnsperf_poll_out(e->pollfd, c->fd, out))
+		c->want_out = out;
+}
+
+static void dnsperf_conn_connected(struct dnsperf_engine *e,
+				   struct dnsperf_conn *c,
+				   vector<struct dnsperf_probe *> *done)
+{
+	struct in6_addr a;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		if (dnsperf_verbose)
+			cout << "Unable to connect to " << c->name << ": " <<
+			    strerror(err ? err : errno) << endl;
+		dnsperf_conn_close(e, c, done);
+		return;
+	}
+	if (e->streams->transport == DNSPERF_TRANSPORT_TCP) {
+		if (!dnsperf_poll_out(e->pollfd, c->fd, 0))
+			c->want_out = 0;
+		dnsperf_conn_ready(e, c, done);
+		return;
+	}
+	if (!(c->ssl = SSL_new(e->streams->ctx)) ||
+	    !SSL_set_fd(c->ssl, c->fd)) {
+		dnsperf_conn_close(e, c, done);
+		return;
+	}
+	/* SNI is for names only */
+	if (inet_pton(AF_INET, c->name, &a) != 1 &&
+	    inet_pton(AF_INET6, c->name, &a) != 1)
+		SSL_set_tlsext_host_name(c->ssl, c->name);
+	if (c->session)
+		SSL_set_session(c->ssl, c->session);
+	c->state = DNSPERF_CONN_HANDSHAKE;
+	dnsperf_conn_handshake(e, c, done);
+}
+
+static struct dnsperf_h2_stream *dnsperf_h2_stream(struct dnsperf_conn *c,
+						   uint32_t sid)
+{
+	struct dnsperf_h2_stream *st;
+
+	if (!sid || c->streams.empty())
+		return NULL;
+	st = &c->streams[(sid >> 1) & (c->streams.size() - 1)];
+	return st->sid == sid ? st : NULL;
+}
+
+/* An answer we are not going to get: the stream was reset or refused, or
+ * ended without a DNS message */
+static void dnsperf_h2_unanswered(struct dnsperf_engine *e,
+				  struct dnsperf_conn *c,
+				  struct dnsperf_h2_stream *st,
+				  vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_probe *p = e->ids[st->id];
+
+	st->answered = 1;
+	if (p && p->seq == st->seq && p->conn == c)
+		dnsperf_engine_abort(e, p, done);
+}
+
+static void dnsperf_h2_close(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			     struct dnsperf_h2_stream *st,
+			     vector<struct dnsperf_probe *> *done)
+{
+	if (!st->answered)
+		dnsperf_h2_unanswered(e, c, st, done);
+	st->sid = 0;
+	c->open_streams--;
+}
+
+/* Is :status 200 ? It has to be the first field, after any dynamic table
+ * size update (5 bit prefix), indexed or a literal with the name indexed,
+ * the value Huffman coded or not. */
+static int dnsperf_h2_ok(const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && (p[i] & 0xe0) == 0x20)
+		if ((p[i++] & 0x1f) == 0x1f)
+			while (i < len && (p[i++] & 0x80))
+				;
+	if (i >= len)
+		return 0;
+	if (p[i] == 0x88)
+		return 1;
+	if (p[i] != 0x48 && p[i] != 0x08 && p[i] != 0x18)
+		return 0;
+	p += i + 1;
+	len -= i + 1;
+	if (len >= 4 && p[0] == 0x03 && !memcmp(p + 1, "200", 3))
+		return 1;
+	return len >= 3 && p[0] == 0x82 && p[1] == 0x10 && p[2] == 0x01;
+}
+
+/* One frame from the server; returns 1 if the connection is no good */
+static int dnsperf_h2_input(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			    const uint8_t *f, const struct timespec *now,
+			    vector<struct dnsperf_probe *> *done)
+{
+	size_t len = (f[0] << 16) | (f[1] << 8) | f[2];
+	uint8_t type = f[3], flags = f[4];
+	uint32_t sid = ((f[5] & 0x7f) << 24) | (f[6] << 16) | (f[7] << 8) |
+	    f[8];
+	const uint8_t *p = f + H2_HDR_LEN;
+	struct dnsperf_h2_stream *st = dnsperf_h2_stream(c, sid);
+
+	switch (type) {
+	case H2_DATA:
+	case H2_HEADERS:
+		if (type == H2_DATA) {
+			c->consumed += len;
+			if (c->consumed >= H2_WINDOW_MAX / 2) {
+				uint8_t inc[4];
+
+				dnsperf_h2_u32(inc, c->consumed);
+				dnsperf_h2_frame(c, H2_WINDOW_UPDATE, 0, 0,
+						 inc, sizeof(inc));
+				c->consumed = 0;
+			}
+		}
+		if (flags & H2_PADDED) {
+			if (!len || p[0] >= len)
+				return 1;
+			len -= 1 + p[0];
+			p++;
+		}
+		if (type == H2_HEADERS && (flags & H2_PRIORITY)) {
+			if (len < 5)
+				return 1;
+			p += 5;
+			len -= 5;
+		}
+		if (!st)
+			break;
+		if (!st->answered && type == H2_HEADERS && !dnsperf_h2_ok(p, len))
+			dnsperf_h2_unanswered(e, c, st, done);
+		else if (!st->answered && type == H2_DATA && len) {
+			st->answered = 1;
+			dnsperf_engine_answer_stream(e, c, p, len, now, done);
+		}
+		if (flags & H2_END_STREAM)
+			dnsperf_h2_close(e, c, st, done);
+		break;
+	case H2_RST_STREAM:
+		if (st)
+			dnsperf_h2_close(e, c, st, done);
+		break;
+	case H2_SETTINGS:
+		if (flags & H2_ACK)
+			break;
+		if (len % 6)
+			return 1;
+		for (size_t k = 0; k < len; k += 6)
+			if (((p[k] << 8) | p[k + 1]) == H2_MAX_STREAMS)
+				c->max_streams = ((uint32_t)p[k + 2] << 24) |
+				    (p[k + 3] << 16) | (p[k + 4] << 8) |
+				    p[k + 5];
+		dnsperf_h2_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+		break;
+	case H2_PING:
+		if (!(flags & H2_ACK) && len == 8)
+			dnsperf_h2_frame(c, H2_PING, H2_ACK, 0, p, len);
+		break;
+	case H2_GOAWAY:
+		c->state = DNSPERF_CONN_DRAINING;
+		break;
+	}
+	return 0;
+}
+
+/* Whatever came in on c, as complete DNS messages or HTTP/2 frames; returns 1
+ * if it makes no sense */
+static int dnsperf_conn_input(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			      const struct timespec *now,
+			      vector<struct dnsperf_probe *> *done)
+{
+	int h2 = e->streams->transport == DNSPERF_TRANSPORT_HTTPS;
+	size_t off = 0, left, len;
+
+	while ((left = c->in.size() - off) >= (h2 ? H2_HDR_LEN : 2)) {
+		const uint8_t *f = &c->in[off];
+
+		if (h2) {
+			len = H2_HDR_LEN + ((f[0] << 16) | (f[1] << 8) | f[2]);
+			if (len > H2_HDR_LEN + H2_FRAME_MAX)
+				return 1;
+			if (left < len)
+				break;
+			if (dnsperf_h2_input(e, c, f, now, done))
+				return 1;
+		} else {
+			len = 2 + ((f[0] << 8) | f[1]);
+			if (left < len)
+				break;
+			dnsperf_engine_answer_stream(e, c, f + 2, len - 2, now,
+						     done);
+		}
+		off += len;
+	}
+	c->in.erase(c->in.begin(), c->in.begin() + off);
+	return 0;
+}
+
+static void dnsperf_conn_read(struct dnsperf_engine *e, struct dnsperf_conn *c,
+			      vector<struct dnsperf_probe *> *done)
+{
+	uint8_t buf[DNSPERF_STREAM_READ];
+	struct timespec now;
+	ssize_t n;
+
+	while ((n = dnsperf_conn_recv(c, buf, sizeof(buf))) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		c->in.insert(c->in.end(), buf, buf + n);
+		if (dnsperf_conn_input(e, c, &now, done)) {
+			n = -1;
+			break;
+		}
+	}
+	if (n == -2)
+		return;
+	/* servers close idle connections all the time; only a close that
+	 * takes queries with it is worth telling about */
+	if (dnsperf_verbose && (n < 0 || c->open_streams ||
+				e->inflight))
+		cout << "Lost connection to " << c->name << endl;
+	dnsperf_conn_close(e, c, done);
+}
+
+void dnsperf_stream_event(struct dnsperf_engine *e, int fd,
+			  vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_streams *s = e->streams;
+	struct dnsperf_conn *c;
+
+	if ((size_t)fd >= s->byfd.size() || !(c = s->byfd[fd]))
+		return;
+	switch (c->state) {
+	case DNSPERF_CONN_CONNECTING:
+		dnsperf_conn_connected(e, c, done);
+		return;
+	case DNSPERF_CONN_HANDSHAKE:
+		dnsperf_conn_handshake(e, c, done);
+		return;
+	}
+	dnsperf_conn_read(e, c, done);
+	if (c->fd < 0)
+		return;
+	if (c->state == DNSPERF_CONN_DRAINING && !c->open_streams) {
+		dnsperf_conn_close(e, c, done);
+		return;
+	}
+	dnsperf_conn_resume(e, c);
+	dnsperf_conn_flush(e, c, done);
+}
+
+void dnsperf_streams_failed(struct dnsperf_engine *e,
+			    vector<struct dnsperf_probe *> *done)
+{
+	struct dnsperf_streams *s = e->streams;
+
+	done->insert(done->end(), s->failed.begin(), s->failed.end());
+	s->failed.clear();
+}
+
+void dnsperf_streams_destroy(struct dnsperf_engine *e)
+{
+	struct dnsperf_streams *s = e->streams;
+	map<struct sockaddr_storage, struct dnsperf_conn *,
+	    dnsperf_addr_less>::iterator it;
+
+	for (it = s->conns.begin(); it != s->conns.end(); ++it) {
+		struct dnsperf_conn *c = it->second;
+
+		if (c->ssl)
+			SSL_free(c->ssl);
+		if (c->session)
+			SSL_SESSION_free(c->session);
+		if (c->fd >= 0)
+			close(c->fd);
+		delete c;
+	}
+	if (s->ctx)
+		SSL_CTX_free(s->ctx);
+	delete s;
+	e->streams = NULL;
+}
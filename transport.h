@@ -0,0 +1,116 @@
+/*
+ * transport.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Stream transports for the probe engine: DNS over TCP (RFC 7766), over TLS
+ * (RFC 7858) and over HTTPS, HTTP/2 only (RFC 8484). An engine keeps one
+ * connection per nameserver address, opened by the first query that needs
+ * it and kept open for as long as the server lets us, and pipelines its
+ * queries on it. Connecting and handshaking are timed on their own: a
+ * query's latency starts when it is written on a ready connection.
+ */
+
+#ifndef DNSPERF_TRANSPORT_H
+#define DNSPERF_TRANSPORT_H
+
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+
+#include "probe.h"
+
+/* ALPN and the TLS 1.3 friendly calls are 1.1.0 or later */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define DNSPERF_TLS 1
+#endif
+
+#define DNSPERF_TRANSPORT_UDP	0
+#define DNSPERF_TRANSPORT_TCP	1
+#define DNSPERF_TRANSPORT_TLS	2
+#define DNSPERF_TRANSPORT_HTTPS	3
+
+/* where the queries go, with -e https */
+#define DNSPERF_DOH_PATH "/dns-query"
+
+#define DNSPERF_CONN_CLOSED	0
+#define DNSPERF_CONN_CONNECTING	1	/* connect() in progress */
+#define DNSPERF_CONN_HANDSHAKE	2	/* TLS */
+#define DNSPERF_CONN_READY	3
+#define DNSPERF_CONN_DRAINING	4	/* HTTP/2 GOAWAY: no new streams */
+
+/* read at most this much from a connection in one go */
+#define DNSPERF_STREAM_READ 16384
+
+/* An HTTP/2 stream of ours, in a ring by stream ID */
+struct dnsperf_h2_stream {
+	uint32_t sid;			/* 0: free */
+	uint16_t id;			/* DNS ID of its probe */
+	unsigned long seq;		/* and which send of it */
+	uint8_t answered;
+};
+
+struct dnsperf_conn {
+	int fd;				/* -1 when closed */
+	int state;			/* DNSPERF_CONN_* */
+	struct sockaddr_storage addr;	/* with the transport's port */
+	socklen_t addrlen;
+	char name[256];			/* SNI and :authority, no final dot */
+	SSL *ssl;
+	SSL_SESSION *session;		/* to resume the next time */
+	struct timespec started;	/* connect(), for the setup time */
+	unsigned long queries;		/* written since connected */
+	uint8_t want_out;		/* asked the poller for POLLOUT */
+	uint8_t dirty;			/* on the engine's list to flush */
+	std::vector<struct dnsperf_sent> waiting;	/* not written yet */
+	std::vector<struct dnsperf_probe *> unstamped;	/* to be flushed */
+	std::vector<uint8_t> in;	/* read, not parsed yet */
+	std::vector<uint8_t> out;	/* to be written, from out_done on */
+	size_t out_done;
+	/* HTTP/2 */
+	uint32_t next_sid;
+	uint32_t max_streams;		/* as the server would have it */
+	uint32_t open_streams;
+	uint64_t consumed;		/* DATA since our last WINDOW_UPDATE */
+	std::vector<struct dnsperf_h2_stream> streams;
+};
+
+struct dnsperf_addr_less {
+	bool operator()(const struct sockaddr_storage &a,
+			const struct sockaddr_storage &b) const;
+};
+
+struct dnsperf_streams {
+	int transport;			/* DNSPERF_TRANSPORT_* */
+	uint16_t port;			/* network byte order */
+	SSL_CTX *ctx;
+	/* by the address probes go to, port 53 and all; never freed before
+	 * the engine is, so the TLS sessions outlive their connections */
+	std::map<struct sockaddr_storage, struct dnsperf_conn *,
+		 dnsperf_addr_less> conns;
+	std::vector<struct dnsperf_conn *> byfd;
+	std::vector<struct dnsperf_conn *> dirty;
+	std::vector<struct dnsperf_probe *> failed;	/* for the next poll */
+	/* for -x */
+	volatile unsigned long connects;	/* ready to take queries */
+	volatile unsigned long connect_failures;
+	volatile uint64_t setup_ns;		/* of those that got ready */
+	volatile unsigned long reused;		/* queries not the first of
+						 * their connection */
+};
+
+int dnsperf_parse_transport(const char *spec, unsigned int *port);
+const char *dnsperf_transport_name(int transport);
+int dnsperf_engine_streams(struct dnsperf_engine *e, int transport,
+			   unsigned int port);
+void dnsperf_streams_destroy(struct dnsperf_engine *e);
+int dnsperf_stream_send(struct dnsperf_engine *e, struct dnsperf_probe *p);
+void dnsperf_streams_flush(struct dnsperf_engine *e);
+void dnsperf_stream_event(struct dnsperf_engine *e, int fd,
+			  std::vector<struct dnsperf_probe *> *done);
+void dnsperf_streams_failed(struct dnsperf_engine *e,
+			    std::vector<struct dnsperf_probe *> *done);
+
+#endif
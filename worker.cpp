@@ -0,0 +1,406 @@
+/*
+ * worker.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Probe workers: each one loops over its shard of the domains, fires one
+ * query per nameserver address through its own probe engine and feeds the
+ * results to the stats and the query log writer.
+ */
+
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "dnsperf.h"
+#include "scheduler.h"
+#include "transport.h"
+#include "worker.h"
+
+using namespace std;
+
+/* how often (ms) the open loop writes stats out */
+#define DNSPERF_REPORT_INTERVAL 1000
+
+/* Write a fresh random label over the template's one */
+static void dnsperf_random_label(struct dnsperf_worker *w, uint8_t *label)
+{
+	dnsperf_label(&w->rng, label, dnsperf_label_len);
+	if (dnsperf_label_tagged && dnsperf_label_len >= DNSPERF_TAG_LEN)
+		dnsperf_label_tag(label, w->id, w->probes_sent);
+	w->probes_sent++;
+}
+
+/* Build a query for a random host under the target's domain */
+static int dnsperf_build_probe(struct dnsperf_worker *w,
+			       const struct dnsperf_target *t,
+			       struct dnsperf_probe *probe)
+{
+	const char *domain = dnsperf_domain(w->domains, t->domain)->name;
+	size_t k = t->domain / w->nr_workers;
+	struct dnsperf_qtemplate *tmpl;
+
+	/* first time we query this domain: encode it once and for all */
+	if (w->templates.size() <= k)
+		w->templates.resize((w->domains->count + w->nr_workers - 1) /
+				    w->nr_workers);
+	tmpl = &w->templates[k];
+	if (!tmpl->wirelen &&
+	    dnsperf_template_init(tmpl, domain, dnsperf_label_len))
+		return 1;
+
+	probe->domain = t->domain;
+	probe->nameserver = t->nameserver;
+	probe->addr = t->addr;
+	probe->addrlen = t->addrlen;
+	probe->address = t->address;
+	probe->nsid = t->nsid;
+	dnsperf_random_label(w, dnsperf_probe_fill(probe, tmpl));
+	if (dnsperf_verbose)
+		cout << "Querying `" << string((const char *)probe->wire +
+		    tmpl->label, tmpl->label_len) << "." << domain << "`" <<
+		    endl;
+	return 0;
+}
+
+/* Our shard of the topology, every target knowing which of its domain's
+ * addresses it is; only new ones are looked up */
+static void dnsperf_worker_targets(struct dnsperf_worker *w)
+{
+	vector<struct dnsperf_target> &targets = w->targets;
+
+	dnsperf_topology_targets(w->topo, &targets, w->id, w->nr_workers);
+	for (size_t k = 0; k < targets.size(); k++)
+		if (targets[k].nsid == DNSPERF_NSID_NONE)
+			targets[k].nsid = dnsperf_stat_nsid(
+			    dnsperf_domain_stat(w->domains, targets[k].domain),
+			    targets[k].nameserver, targets[k].address);
+}
+
+/* Feed the outcome of a probe to the query log and the stats */
+static void dnsperf_complete(struct dnsperf_worker *w,
+			     const struct dnsperf_probe *p)
+{
+	struct dnsperf_stat *st = dnsperf_domain_stat(w->domains, p->domain);
+	const char *domain = st->domain;
+	struct dnsperf_sample sample;
+	int outcome = dnsperf_probe_outcome(p);
+
+	sample.domain = domain;
+	sample.nameserver = p->nameserver;
+	sample.address = p->address;
+	sample.latency = p->latency;
+	sample.tm = p->tm;
+	sample.usec = p->usec;
+	sample.outcome = outcome;
+	sample.clamped = p->clamped;
+	sample.vantage = NULL;
+	w->outcomes[outcome]++;
+
+	if (outcome == DNSPERF_OUTCOME_OK) {
+		/* with -Z, what is left once our own overhead is taken off */
+		if (p->latency > dnsperf_baseline)
+			sample.latency -= dnsperf_baseline;
+		else
+			sample.latency = 0;
+		dnsperf_stat_add(st, sample.latency / 1000.0, p->tm);
+		dnsperf_stat_hist_add(st, p->nsid, sample.latency);
+	} else {
+		/* No need to fail, we just got a timeout or something; it
+		 * goes in the log and the failure counts, not the latency */
+		dnsperf_stat_fail(st, p->nsid, outcome);
+		if (!dnsperf_quiet)
+			cout << "failed to query " << p->nameserver << " (" <<
+			    p->address << ") for `" << domain << "`: " <<
+			    dnsperf_outcome_name(outcome) << endl;
+	}
+	/* agents have no rollup tables to write to */
+	if (!dnsperf_agent)
+		dnsperf_rollup_add(&w->rollup, p->domain, p->nsid,
+				   p->nameserver, p->address, sample.latency,
+				   p->tm, outcome == DNSPERF_OUTCOME_OK);
+	if (w->detect.alerter)
+		dnsperf_detect_add(&w->detect, p->domain, p->nsid, domain,
+				   p->nameserver, p->address, sample.latency,
+				   p->tm, outcome == DNSPERF_OUTCOME_OK);
+	/* queue the row for the table that holds query logs */
+	dnsperf_writer_put(w->writer, w->id, &sample);
+}
+
+/* What the limiter did since the last time */
+static void dnsperf_limiter_report(struct dnsperf_worker *w)
+{
+	unsigned long held, clamped;
+
+	if (!w->engine.limiter)
+		return;
+	held = w->limiter.held - w->reported_held;
+	clamped = w->limiter.clamped - w->reported_clamped;
+	w->reported_held = w->limiter.held;
+	w->reported_clamped = w->limiter.clamped;
+	if (!held && !clamped)
+		return;
+	cout << "Limiter";
+	if (w->nr_workers > 1)
+		cout << " of worker " << w->id;
+	cout << " held back " << held << " queries, " << clamped <<
+	    " samples taken while clamping (window " <<
+	    (unsigned int)w->limiter.global.window << ")" << endl;
+}
+
+/* Hand our shard's stats and closed rollup buckets to the thread that
+ * writes them out (reporter.h), and what the exporter serves */
+static void dnsperf_report(struct dnsperf_worker *w)
+{
+	if (w->exporter)
+		dnsperf_exporter_publish(w->exporter, w->domains, w->id,
+					 w->nr_workers);
+	/* agents keep their stats in memory (and -x) only */
+	if (w->reporter)
+		dnsperf_reporter_publish(w->reporter, w->domains, w->id,
+					 w->nr_workers, &w->rollup, time(NULL));
+}
+
+/* Loop around our domains, query and populate the query log and the stats table */
+int dnsperf_do(struct dnsperf_worker *w)
+{
+	vector<struct dnsperf_target> &targets = w->targets;
+	vector<struct dnsperf_probe> &probes = w->probes;
+	size_t n = 0;
+	uint64_t start;
+
+	/* Prepare one probe per nameserver address of every domain (these
+	 * vectors only ever grow, so once warmed up this does not
+	 * allocate)... */
+	start = dnsperf_trace_begin(w->trace);
+	dnsperf_worker_targets(w);
+	dnsperf_trace_end(w->trace, DNSPERF_STAGE_SCHED, start,
+			  targets.size());
+	if (probes.size() < targets.size())
+		probes.resize(targets.size());
+	start = dnsperf_trace_begin(w->trace);
+	for (size_t k = 0; k < targets.size(); k++)
+		if (!dnsperf_build_probe(w, &targets[k], &probes[n]))
+			n++;
+	dnsperf_trace_end(w->trace, DNSPERF_STAGE_ENCODE, start, n);
+
+	/* ...fire them all at once and measure time */
+	if (n && dnsperf_engine_run(&w->engine, &probes[0], n))
+		return 1;
+
+	start = dnsperf_trace_begin(w->trace);
+	for (size_t k = 0; k < n; k++)
+		dnsperf_complete(w, &probes[k]);
+	dnsperf_trace_end(w->trace, DNSPERF_STAGE_ENQUEUE, start, n);
+
+	dnsperf_report(w);
+	return 0;
+}
+
+/* Open loop: query every target at dnsperf_rate per second, forever. Stats
+ * are written out, and the targets picked up again from the topology, every
+ * DNSPERF_REPORT_INTERVAL ms. */
+int dnsperf_do_open(struct dnsperf_worker *w)
+{
+	vector<struct dnsperf_target> &targets = w->targets;
+	vector<struct dnsperf_probe *> done;
+	vector<struct dnsperf_probe *> idle;
+	vector<struct dnsperf_probe *> due;	/* this round's sends */
+	struct dnsperf_probe *pool;
+	struct dnsperf_sched sched;
+	uint64_t report;
+
+	/* probes must stay put while in flight, so they come from a pool */
+	pool = new struct dnsperf_probe[w->engine.max_inflight];
+	for (unsigned int i = 0; i < w->engine.max_inflight; i++)
+		idle.push_back(&pool[i]);
+	done.reserve(w->engine.max_inflight);
+	due.reserve(w->engine.max_inflight);
+
+	dnsperf_sched_init(&sched, dnsperf_rate);
+	dnsperf_worker_targets(w);
+	dnsperf_sched_update(&sched, targets, &w->rng);
+	report = dnsperf_now_ns() + DNSPERF_REPORT_INTERVAL * 1000000ULL;
+
+	for (;;) {
+		struct dnsperf_target t;
+		uint64_t now = dnsperf_now_ns();
+		uint64_t next, start, encode = 0;
+		size_t popped = 0;
+
+		/* whatever is due by now goes out in one go; popping and
+		 * encoding take turns, so encode is what is taken off */
+		due.clear();
+		start = dnsperf_trace_begin(w->trace);
+		while (dnsperf_sched_pop(&sched, now, &t)) {
+			struct dnsperf_probe *p;
+			uint64_t built;
+
+			popped++;
+			if (idle.empty() || due.size() +
+			    w->engine.inflight >= w->engine.max_inflight) {
+				sched.missed++;
+				continue;
+			}
+			p = idle.back();
+			built = dnsperf_trace_begin(w->trace);
+			if (dnsperf_build_probe(w, &t, p)) {
+				sched.missed++;
+				continue;
+			}
+			if (w->trace)
+				encode += dnsperf_now_ns() - built;
+			idle.pop_back();
+			sched.sent++;
+			due.push_back(p);
+		}
+		if (w->trace && popped) {
+			dnsperf_trace_add(w->trace, DNSPERF_STAGE_SCHED, start,
+					  dnsperf_now_ns() - start - encode,
+					  popped);
+			if (!due.empty())
+				dnsperf_trace_add(w->trace, DNSPERF_STAGE_ENCODE,
+						  start, encode, due.size());
+		}
+		/* what the limiter holds back is not sent at all, so as not
+		 * to bunch up behind it */
+		if (!due.empty() &&
+		    dnsperf_engine_submit_many(&w->engine, &due[0], due.size()))
+			for (size_t k = 0; k < due.size(); k++) {
+				if (due[k]->status == DNSPERF_PROBE_ERROR) {
+					dnsperf_complete(w, due[k]);
+					idle.push_back(due[k]);
+				} else if (due[k]->status ==
+					   DNSPERF_PROBE_HELD) {
+					sched.sent--;
+					sched.held++;
+					idle.push_back(due[k]);
+				}
+			}
+
+		/* sleep until the next send, the next report or an answer */
+		next = dnsperf_sched_next(&sched);
+		if (next > report)
+			next = report;
+		done.clear();
+		if (dnsperf_engine_poll(&w->engine, next > now ?
+					(int)((next - now + 999999) / 1000000) :
+					0, &done)) {
+			delete[] pool;
+			return 1;
+		}
+		start = dnsperf_trace_begin(w->trace);
+		for (size_t k = 0; k < done.size(); k++) {
+			dnsperf_complete(w, done[k]);
+			idle.push_back(done[k]);
+		}
+		if (!done.empty())
+			dnsperf_trace_end(w->trace, DNSPERF_STAGE_ENQUEUE, start,
+					  done.size());
+
+		if (dnsperf_now_ns() < report)
+			continue;
+		report += DNSPERF_REPORT_INTERVAL * 1000000ULL;
+		dnsperf_report(w);
+		cout << "Sent " << sched.sent << " queries";
+		if (w->nr_workers > 1)
+			cout << " from worker " << w->id;
+		cout << ", " << sched.late << " late, " << sched.missed <<
+		    " missed";
+		if (w->engine.limiter)
+			cout << ", " << sched.held << " held back";
+		cout << "." << endl;
+		sched.sent = sched.late = sched.missed = sched.held = 0;
+		dnsperf_limiter_report(w);
+		if (!w->id && dnsperf_writer_dropped(w->writer))
+			cout << "Query log writer is behind, " <<
+			    dnsperf_writer_dropped(w->writer) <<
+			    " samples dropped" << endl;
+		dnsperf_worker_targets(w);
+		dnsperf_sched_update(&sched, targets, &w->rng);
+	}
+	return 0;
+}
+
+/* Keep each worker on a core of its own, if the OS lets us */
+static void dnsperf_worker_pin(struct dnsperf_worker *w)
+{
+#if defined(__linux__)
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+
+	if (nr_cpus < 2)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(w->id % nr_cpus, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) &&
+	    dnsperf_verbose)
+		cout << "Unable to pin worker " << w->id << endl;
+#endif
+}
+
+static void *dnsperf_worker_thread(void *arg)
+{
+	struct dnsperf_worker *w = (struct dnsperf_worker *)arg;
+
+	if (w->nr_workers > 1)
+		dnsperf_worker_pin(w);
+
+	if (dnsperf_rate > 0) {
+		if (dnsperf_do_open(w)) {
+			cout << "Failed" << endl;
+			exit(1);
+		}
+		return NULL;
+	}
+
+	while (1) {
+		if (dnsperf_do(w)) {
+			cout << "Failed" << endl;
+			exit(1);
+		}
+		cout << "Iteration " << ++w->iter;
+		if (w->nr_workers > 1)
+			cout << " of worker " << w->id;
+		cout << " done, sleeping for " << dnsperf_freq << "ms. " <<
+		    endl;
+		dnsperf_limiter_report(w);
+		if (!w->id && dnsperf_writer_dropped(w->writer))
+			cout << "Query log writer is behind, " <<
+			    dnsperf_writer_dropped(w->writer) <<
+			    " samples dropped" << endl;
+		usleep(dnsperf_freq * 1000);
+	}
+	return NULL;
+}
+
+int dnsperf_worker_start(struct dnsperf_worker *w)
+{
+	if (dnsperf_engine_init(&w->engine, dnsperf_inflight, dnsperf_timeout,
+				rand_r(&w->seed), dnsperf_clock)) {
+		cout << "Unable to set up the probe engine" << endl;
+		return 1;
+	}
+	if (dnsperf_engine_streams(&w->engine, dnsperf_transport,
+				   dnsperf_transport_port)) {
+		dnsperf_engine_destroy(&w->engine);
+		return 1;
+	}
+	w->engine.trace = w->trace;
+	/* our share of the per-address limits, rounded up */
+	if (dnsperf_ns_inflight || dnsperf_ns_rate > 0 || dnsperf_aimd > 0) {
+		dnsperf_limiter_init(&w->limiter, w->engine.max_inflight,
+				     (dnsperf_ns_inflight + w->nr_workers - 1) /
+				     w->nr_workers,
+				     dnsperf_ns_rate / w->nr_workers,
+				     dnsperf_aimd / 100.0);
+		w->engine.limiter = &w->limiter;
+	}
+	w->reported_held = w->reported_clamped = 0;
+	if (pthread_create(&w->thread, NULL, dnsperf_worker_thread, w)) {
+		cerr << "Unable to start worker " << w->id << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * worker.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Probe workers. Each one owns a shard of the domains (every nr_workers-th
+ * one), its own probe engine and sockets, its own random state and its own
+ * ring towards the query log writer, so workers never contend with each
+ * other on the probe path.
+ */
+
+#ifndef DNSPERF_WORKER_H
+#define DNSPERF_WORKER_H
+
+#include <vector>
+#include <pthread.h>
+
+#include "detect.h"
+#include "domains.h"
+#include "exporter.h"
+#include "limiter.h"
+#include "probe.h"
+#include "reporter.h"
+#include "rng.h"
+#include "rollup.h"
+#include "stats.h"
+#include "topology.h"
+#include "trace.h"
+#include "writer.h"
+
+struct dnsperf_worker {
+	unsigned int id;		/* shard, writer producer slot, CPU */
+	unsigned int nr_workers;
+	pthread_t thread;
+	unsigned int seed;		/* seeds the engine's DNS IDs */
+	struct dnsperf_rng rng;		/* random labels, schedule jitter */
+	unsigned long long probes_sent;	/* for tagged labels */
+	/* how our probes went, DNSPERF_OUTCOME_OK included */
+	volatile unsigned long outcomes[DNSPERF_OUTCOMES];
+	unsigned long iter;
+	struct dnsperf_engine engine;
+	struct dnsperf_limiter limiter;	/* the engine's, with -I, -M or -A */
+	unsigned long reported_held;	/* limiter counts at the last report */
+	unsigned long reported_clamped;
+	struct dnsperf_domains *domains;	/* shared, but we only touch
+						 * our shard's stats */
+	struct dnsperf_topology *topo;
+	struct dnsperf_writer *writer;
+	struct dnsperf_exporter *exporter;	/* NULL without -x */
+	struct dnsperf_trace *trace;	/* NULL without -X */
+	struct dnsperf_reporter *reporter;	/* NULL for agents */
+	struct dnsperf_rollup rollup;	/* our shard's minutes, hours, days */
+	struct dnsperf_detect detect;	/* and their alarms, with -K */
+	/* reused from one iteration to the next */
+	/* by domain of our shard: domain / nr_workers */
+	std::vector<struct dnsperf_qtemplate> templates;
+	std::vector<struct dnsperf_target> targets;
+	std::vector<struct dnsperf_probe> probes;
+};
+
+int dnsperf_do(struct dnsperf_worker *w);
+int dnsperf_do_open(struct dnsperf_worker *w);
+int dnsperf_worker_start(struct dnsperf_worker *w);
+
+#endif
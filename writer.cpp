@@ -0,0 +1,300 @@
+/*
+ * writer.cpp -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Write-behind sink for the query log. Instead of one synchronous INSERT per
+ * sample on the prober's connection, samples go through one bounded SPSC
+ * ring per probe worker and a writer thread turns them into multi-row
+ * INSERTs. A batch goes out when it is full or when its oldest sample has
+ * waited for `flush' ms.
+ *
+ * Batches go to a sink (see sink.cpp). While the sink's backend is away the
+ * writer holds on to the batch and retries, so the ring fills up and the
+ * backpressure policy decides what happens to new samples. With -J the
+ * batches go to the spill journal instead (journal.cpp), and only once that
+ * is full does the backpressure policy come in; the journal is replayed in
+ * between batches whenever the sink takes rows again.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <mysql++/mysql++.h>
+
+#include "dnsperf.h"
+#include "journal.h"
+#include "sink.h"
+#include "trace.h"
+#include "writer.h"
+
+using namespace std;
+
+/* how long the writer naps when there is nothing to do (us) */
+#define DNSPERF_WRITER_IDLE 1000
+/* and how long it waits before trying an unreachable DBMS again (us) */
+#define DNSPERF_WRITER_RETRY 1000000
+
+int dnsperf_queue_push(struct dnsperf_queue *q, const struct dnsperf_sample *s)
+{
+	size_t head = q->head;
+
+	if (head - q->tail == DNSPERF_QUEUE_LEN)
+		return 1;
+	q->ring[head & (DNSPERF_QUEUE_LEN - 1)] = *s;
+	/* the sample must be in place before the consumer can see it */
+	__sync_synchronize();
+	q->head = head + 1;
+	return 0;
+}
+
+size_t dnsperf_queue_pop(struct dnsperf_queue *q, struct dnsperf_sample *s,
+			 size_t max)
+{
+	size_t tail = q->tail;
+	size_t n = q->head - tail;
+
+	if (n > max)
+		n = max;
+	/* don't read slots before we have seen head move past them */
+	__sync_synchronize();
+	for (size_t i = 0; i < n; i++)
+		s[i] = q->ring[(tail + i) & (DNSPERF_QUEUE_LEN - 1)];
+	/* and don't give them back before we are done reading */
+	__sync_synchronize();
+	q->tail = tail + n;
+	return n;
+}
+
+size_t dnsperf_queue_depth(struct dnsperf_queue *q)
+{
+	return q->head - q->tail;
+}
+
+int dnsperf_parse_policy(const char *name)
+{
+	if (!strcmp(name, "drop"))
+		return DNSPERF_POLICY_DROP;
+	if (!strcmp(name, "block"))
+		return DNSPERF_POLICY_BLOCK;
+	if (!strcmp(name, "spill"))
+		return DNSPERF_POLICY_SPILL;
+	return -1;
+}
+
+unsigned long dnsperf_now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+/* n rows went to the sink, the last of them taken at last */
+static void dnsperf_writer_done(struct dnsperf_writer *w, int ret, size_t n,
+				time_t last)
+{
+	if (ret == DNSPERF_SINK_FAILED) {
+		/* the rows themselves are bad, no point in retrying */
+		w->failed += n;
+	} else {
+		w->written += n;
+		if (last > w->last_tm)
+			w->last_tm = last;
+	}
+}
+
+/* Write a batch out; returns 1 if the sink is unavailable and the batch is
+ * still ours to retry */
+static int dnsperf_writer_flush(struct dnsperf_writer *w,
+				vector<struct dnsperf_sample> *batch)
+{
+	int ret = DNSPERF_SINK_RETRY;
+
+	/* no point in trying the sink again before its time */
+	if (!w->journal || dnsperf_now_ms() >= w->retry_at) {
+		uint64_t start = dnsperf_trace_begin(w->trace);
+
+		ret = w->sink->write(w->sink, &(*batch)[0], batch->size());
+		dnsperf_trace_end(w->trace, DNSPERF_STAGE_COMMIT, start,
+				  batch->size());
+	}
+	if (ret == DNSPERF_SINK_RETRY) {
+		if (dnsperf_now_ms() >= w->retry_at)
+			w->retry_at = dnsperf_now_ms() +
+			    DNSPERF_WRITER_RETRY / 1000;
+		if (!w->journal ||
+		    dnsperf_journal_append(w->journal, &(*batch)[0],
+					   batch->size()))
+			return 1;
+	} else
+		dnsperf_writer_done(w, ret, batch->size(), batch->back().tm);
+	batch->clear();
+	return 0;
+}
+
+/* Give the sink a block of the journal, if it is there to take it */
+static void dnsperf_writer_replay(struct dnsperf_writer *w)
+{
+	size_t rows;
+	time_t last;
+	int ret;
+
+	if (!w->journal || !dnsperf_journal_pending(w->journal) ||
+	    dnsperf_now_ms() < w->retry_at)
+		return;
+	ret = dnsperf_journal_replay(w->journal, w->sink, &rows, &last);
+	if (ret == DNSPERF_SINK_RETRY)
+		w->retry_at = dnsperf_now_ms() + DNSPERF_WRITER_RETRY / 1000;
+	else if (rows)
+		dnsperf_writer_done(w, ret, rows, last);
+}
+
+static void *dnsperf_writer_thread(void *arg)
+{
+	struct dnsperf_writer *w = (struct dnsperf_writer *)arg;
+	vector<struct dnsperf_sample> batch;
+	unsigned long oldest = 0;
+
+	mysqlpp::Connection::thread_start();
+	batch.reserve(w->batch);
+	for (;;) {
+		struct dnsperf_sample s[256];
+		size_t n = 0;
+
+		/* a bit from every worker, so nobody's ring starves */
+		for (unsigned int i = 0; i < w->nr_producers; i++) {
+			size_t room = w->batch - batch.size();
+			size_t got;
+
+			got = dnsperf_queue_pop(&w->producers[i].queue, s,
+						room < 256 ? room : 256);
+			if (got && batch.empty())
+				oldest = dnsperf_now_ms();
+			batch.insert(batch.end(), s, s + got);
+			n += got;
+		}
+
+		if (batch.size() >= w->batch ||
+		    (!batch.empty() &&
+		     (!w->running || dnsperf_now_ms() - oldest >= w->flush))) {
+			if (dnsperf_writer_flush(w, &batch)) {
+				if (!w->running)
+					break;
+				usleep(DNSPERF_WRITER_RETRY);
+			}
+			continue;
+		}
+		if (w->running)
+			dnsperf_writer_replay(w);
+		if (w->journal)
+			dnsperf_journal_sync(w->journal, 0);
+		if (!n) {
+			if (!w->running)
+				break;
+			usleep(DNSPERF_WRITER_IDLE);
+		}
+	}
+	if (!batch.empty())
+		cerr << "Lost " << batch.size() << " samples on exit" << endl;
+	if (w->journal)
+		dnsperf_journal_close(w->journal);
+	mysqlpp::Connection::thread_end();
+	return NULL;
+}
+
+int dnsperf_writer_start(struct dnsperf_writer *w, struct dnsperf_sink *sink,
+			 struct dnsperf_journal *journal,
+			 unsigned int nr_producers, int policy, size_t batch,
+			 unsigned int flush)
+{
+	w->sink = sink;
+	w->journal = journal;
+	w->producers = new struct dnsperf_producer[nr_producers];
+	w->nr_producers = nr_producers;
+	for (unsigned int i = 0; i < nr_producers; i++) {
+		w->producers[i].queue.head = w->producers[i].queue.tail = 0;
+		w->producers[i].policy = policy;
+		w->producers[i].dropped = 0;
+	}
+	w->policy = policy;
+	w->batch = batch ? batch : 1;
+	w->flush = flush;
+	w->written = w->failed = 0;
+	w->last_tm = 0;
+	w->retry_at = 0;
+
+	w->running = 1;
+	if (pthread_create(&w->thread, NULL, dnsperf_writer_thread, w)) {
+		cerr << "Unable to start writer thread" << endl;
+		w->running = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Hand a sample to the writer; only ever called from the probe worker
+ * that owns the producer slot */
+int dnsperf_writer_put(struct dnsperf_writer *w, unsigned int producer,
+		       const struct dnsperf_sample *s)
+{
+	struct dnsperf_producer *pr = &w->producers[producer];
+
+	/* older samples go first */
+	while (!pr->spill.empty() && !dnsperf_queue_push(&pr->queue,
+							 &pr->spill.front()))
+		pr->spill.pop_front();
+
+	if (pr->spill.empty() && !dnsperf_queue_push(&pr->queue, s))
+		return 0;
+
+	switch (pr->policy) {
+	case DNSPERF_POLICY_BLOCK:
+		while (dnsperf_queue_push(&pr->queue, s))
+			usleep(DNSPERF_WRITER_IDLE);
+		return 0;
+	case DNSPERF_POLICY_SPILL:
+		if (pr->spill.size() < DNSPERF_SPILL_MAX) {
+			pr->spill.push_back(*s);
+			return 0;
+		}
+		/* an outage longer than that is what -J is for */
+		/* fall through */
+	default:
+		pr->dropped++;
+		return 1;
+	}
+}
+
+unsigned long dnsperf_writer_dropped(struct dnsperf_writer *w)
+{
+	unsigned long dropped = 0;
+
+	for (unsigned int i = 0; i < w->nr_producers; i++)
+		dropped += w->producers[i].dropped;
+	return dropped;
+}
+
+/* Flush whatever is left and wait for the writer to go away. The workers
+ * must be gone by now. */
+void dnsperf_writer_stop(struct dnsperf_writer *w)
+{
+	if (!w->running)
+		return;
+	for (unsigned int i = 0; i < w->nr_producers; i++) {
+		struct dnsperf_producer *pr = &w->producers[i];
+
+		while (!pr->spill.empty()) {
+			if (dnsperf_queue_push(&pr->queue, &pr->spill.front()))
+				usleep(DNSPERF_WRITER_IDLE);
+			else
+				pr->spill.pop_front();
+		}
+	}
+	/* the writer drains the rings before it goes */
+	w->running = 0;
+	pthread_join(w->thread, NULL);
+	delete[] w->producers;
+	w->producers = NULL;
+}
@@ -0,0 +1,99 @@
+/*
+ * writer.h -- Copyright (c) Anastassios Nanos 2012
+ *
+ * Write-behind queue for the query log. Each probe worker pushes samples into
+ * its own bounded lock-free ring; a writer thread drains them all into
+ * batches for the query log sink, so the probe loop never waits on MySQL (or
+ * the disk). With a spill journal, what the sink can't take right now goes
+ * to the disk and comes back later.
+ */
+
+#ifndef DNSPERF_WRITER_H
+#define DNSPERF_WRITER_H
+
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/* must be a power of 2 */
+#define DNSPERF_QUEUE_LEN 65536
+#define DNSPERF_CACHELINE 64
+
+/* What to do with a sample when the ring is full */
+#define DNSPERF_POLICY_DROP	0	/* throw it away (and count it) */
+#define DNSPERF_POLICY_BLOCK	1	/* wait for the writer to catch up */
+#define DNSPERF_POLICY_SPILL	2	/* park it in memory until there is room */
+/* samples a worker parks at most, after which they are dropped */
+#define DNSPERF_SPILL_MAX	(16 * DNSPERF_QUEUE_LEN)
+
+/* One row of the query log */
+struct dnsperf_sample {
+	const char *domain;
+	const char *nameserver;
+	const char *address;		/* of the nameserver, as text; "" if
+					 * not known */
+	uint64_t latency;		/* ns */
+	time_t tm;
+	uint32_t usec;
+	uint8_t outcome;		/* DNSPERF_OUTCOME_* */
+	uint8_t clamped;		/* sent while the limiter clamped */
+	const char *vantage;		/* the agent it came from; NULL: us */
+};
+
+/* Single producer (the prober), single consumer (the writer) ring */
+struct dnsperf_queue {
+	volatile size_t head;
+	char pad0[DNSPERF_CACHELINE - sizeof(size_t)];
+	volatile size_t tail;
+	char pad1[DNSPERF_CACHELINE - sizeof(size_t)];
+	struct dnsperf_sample ring[DNSPERF_QUEUE_LEN];
+};
+
+/* Per-worker end of the writer */
+struct dnsperf_producer {
+	struct dnsperf_queue queue;
+	std::deque<struct dnsperf_sample> spill;	/* producer side only */
+	int policy;			/* the writer's, unless set after start */
+	volatile unsigned long dropped;
+};
+
+struct dnsperf_sink;
+struct dnsperf_journal;
+struct dnsperf_trace;
+
+struct dnsperf_writer {
+	struct dnsperf_sink *sink;
+	struct dnsperf_journal *journal;	/* -J, or NULL */
+	struct dnsperf_producer *producers;
+	unsigned int nr_producers;
+	int policy;
+	size_t batch;			/* rows per sink write */
+	unsigned int flush;		/* max ms a sample waits in the ring */
+	pthread_t thread;
+	volatile int running;
+	volatile unsigned long written;
+	volatile unsigned long failed;
+	volatile time_t last_tm;	/* newest sample written so far */
+	unsigned long retry_at;		/* ms; the sink is away until then */
+	struct dnsperf_trace *trace;	/* -X, or NULL; set before start */
+};
+
+int dnsperf_queue_push(struct dnsperf_queue *q,
+		       const struct dnsperf_sample *s);
+size_t dnsperf_queue_pop(struct dnsperf_queue *q, struct dnsperf_sample *s,
+			 size_t max);
+size_t dnsperf_queue_depth(struct dnsperf_queue *q);
+
+int dnsperf_writer_start(struct dnsperf_writer *w, struct dnsperf_sink *sink,
+			 struct dnsperf_journal *journal,
+			 unsigned int nr_producers, int policy, size_t batch,
+			 unsigned int flush);
+int dnsperf_writer_put(struct dnsperf_writer *w, unsigned int producer,
+		       const struct dnsperf_sample *s);
+unsigned long dnsperf_writer_dropped(struct dnsperf_writer *w);
+void dnsperf_writer_stop(struct dnsperf_writer *w);
+int dnsperf_parse_policy(const char *name);
+unsigned long dnsperf_now_ms(void);
+
+#endif